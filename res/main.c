@@ -1,3 +1,4 @@
+#define _GNU_SOURCE    // pthread_rwlockattr_setkind_np 需要
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -5,43 +6,148 @@
 #include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <time.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>    // SSE4.2 的 crc32 指令
+#endif
 
-#define COLUMN_USERNAME_SIZE 32     // 用户名的大小
-#define COLUMN_EMAIL_SIZE 255       // 邮箱的大小
+#define COLUMN_USERNAME_SIZE 32     // 默认表中用户名的大小
+#define COLUMN_EMAIL_SIZE 255       // 默认表中邮箱的大小
+#define VARCHAR_MAX_SIZE 255        // 字符串列的最大长度，长度前缀是1字节
+#define MAX_TABLE_COLUMNS 8         // 表最多的列数
+#define CATALOG_NAME_SIZE 32        // 表名和列名的大小，包括结束符
+#define MAX_SELECT_COLUMNS 8        // 查询语句最多列出的列数
+#define OUTPUT_BUFFER_SIZE 65536    // 输出缓冲区的大小
+#define INPUT_BUFFER_SIZE 65536     // 输入读缓冲区的初始大小，一条语句更长时扩大
+#define FRAME_HEADER_SIZE 4         // 长度前缀分帧时帧头的大小（大端序的32位长度）
+#define MAX_STATEMENT_LENGTH (16 * 1024 * 1024)    // 一条语句（一行或者一帧）长度的上限，读缓冲区不会为更长的语句无限扩大
+#define SERVER_MAX_EVENTS 64        // 服务器一次 epoll_wait 最多处理的事件数
+#define MAX_PARAMETERS 64           // 预处理语句中最多的占位符数
+#define PLAN_CACHE_SIZE 64          // 执行计划缓存的条目数
+
+/**
+ * 行的布局
+ * 第一列是整数键（id），在偏移量0；其他整数列各4字节，紧跟在键后面，偏移量是固定的；
+ * 字符串列按定义的顺序放在所有整数列后面，每个是长度前缀 (1字节) + 实际内容，不存结束符。
+ * 默认表 users (id int, username varchar(32), email varchar(255)) 最长的行是
+ * 4字节 + (1 + 32)字节 + (1 + 255)字节 = 293字节，所有表的行都不能比它长，每页至少能放下13个单元格
+ */
+const uint32_t ID_SIZE = sizeof(uint32_t);                          // id的大小
+const uint32_t STRING_LENGTH_SIZE = sizeof(uint8_t);                // 字符串长度前缀的大小
+const uint32_t ID_OFFSET = 0;                                       // id的偏移量
+const uint32_t INT_COLUMN_SIZE = sizeof(int32_t);                   // 整数列的大小
+#define ROW_MAX_SIZE (4 + 1 + COLUMN_USERNAME_SIZE + 1 + COLUMN_EMAIL_SIZE)    // 行的最大大小
 
 /**
  * 存储行的结构体
- * 行是数据库中的基本单元，每一行都有一个id、一个用户名和一个邮箱
+ * 语句中要插入的行在准备时就按表的布局序列化好，插入时直接复制到页里
  */
 typedef struct
 {
-    int id;
-    char username[COLUMN_USERNAME_SIZE + 1];    // 加1是为了存储字符串结束符
-    char email[COLUMN_EMAIL_SIZE + 1];          // 加1是为了存储字符串结束符
+    uint32_t id;                    // 键，和序列化的行开头的第一列相同，排序时不需要读数据
+    uint32_t length;                // 序列化后的长度
+    uint8_t data[ROW_MAX_SIZE];     // 序列化的行
 } Row;
 
+const uint32_t PAGE_SIZE = 4096;                                        // 页的大小
+#define TABLE_MAX_PAGES (UINT32_MAX - 1)                                // 最大页数，页号是32位的，UINT32_MAX保留为无效页号
+#define DEFAULT_BUFFER_POOL_PAGES 1024                                  // 缓冲池默认帧数（4MB）
+#define MIN_BUFFER_POOL_PAGES 32                                        // 缓冲池最小帧数，分裂时需要同时固定树上每一层的几个页
+#define FLUSH_BATCH_PAGES 256                                           // 一次 pwritev 最多合并的连续脏页数，不超过Linux的IOV_MAX(1024)
+#define MMAP_RESERVE_BYTES (1ULL << 40)                                 // 内存映射模式预留的地址空间（1TB），文件增长时映射不需要移动
+#define MMAP_GROW_PAGES 1024                                            // 内存映射模式每次至少扩展的页数（4MB）
+#define MAP_LATCH_CHUNK_PAGES 1024                                      // 内存映射模式下页锁按块分配，每块覆盖的页数
+
 /**
- * 行的布局
- * 序号 (4字节)，用户名 (32 + 1字节），邮箱 (255 + 1字节)
- * 4字节 + 33字节 + 256字节 = 293字节
+ * 预写日志（WAL）
+ * 日志文件在数据库文件旁边，文件名后加 -wal
+ * 日志头部：魔数、版本、页大小、盐值，共16字节
+ * 每一帧：帧头（页号、提交标记、盐值、校验和，共16字节）+ 页的完整内容
+ * 提交标记不为0的帧是一次提交的最后一帧，值为提交后数据库的页数
  */
-#define size_of_attribute(Struct, Attribute) sizeof(((Struct *)0)->Attribute)   // 获取结构体中某个属性的大小
-const uint32_t ID_SIZE = size_of_attribute(Row, id);                // id的大小
-const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);    // username的大小
-const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);          // email的大小
-const uint32_t ID_OFFSET = 0;                                       // id的偏移量
-const uint32_t USERNAME_OFFSET = ID_OFFSET + ID_SIZE;               // username的偏移量
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;      // email的偏移量
-const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;     // 行的大小
+#define WAL_MAGIC 0x57414C31                                            // 日志魔数 "WAL1"
+#define WAL_VERSION 2                                                   // 日志格式版本，版本2的帧校验和是CRC32C
+const uint32_t WAL_HEADER_SIZE = 4 * sizeof(uint32_t);                  // 日志头部的大小
+const uint32_t WAL_FRAME_HEADER_SIZE = 4 * sizeof(uint32_t);            // 帧头的大小
+#define WAL_AUTOCHECKPOINT_FRAMES 1000                                  // 日志超过这么多帧时自动检查点
+#define DEFAULT_GROUP_COMMIT 64                                         // 默认多少次提交合并成一次 fdatasync
 
-const uint32_t PAGE_SIZE = 4096;                                        // 页的大小
-#define TABLE_MAX_PAGES 100                                             // 最大页数
+/**
+ * 页压缩
+ * 用 --compress 新建的数据库文件是压缩格式：检查点把页写回文件时用LZ4块格式压缩，放进按 COMPRESS_SLOT_UNIT 对齐的变长槽，
+ * get_page 把页读进缓冲池的帧时解压；日志中的帧和内存中的页都不压缩，内存映射模式不能打开压缩文件
+ * 文件开头是一页大小的文件头：魔数、版本、页大小、页映射的块数，后面是每一块的偏移；
+ * 页映射（页号 -> 槽）分块存放，每块 COMPRESS_CHUNK_ENTRIES 项，块和槽一样从文件末尾分配
+ */
+#define COMPRESS_MAGIC 0x315A4244                                       // 压缩文件魔数 "DBZ1"，第一个字节不是合法的节点类型
+#define COMPRESS_VERSION 1                                              // 压缩文件格式版本
+const uint32_t COMPRESS_HEADER_FIELDS = 4;                              // 文件头中块偏移之前的字段数
+#define COMPRESS_SLOT_UNIT 256                                          // 槽的对齐单位，槽的偏移和容量都以它为单位
+#define COMPRESS_CHUNK_ENTRIES 4096                                     // 页映射每块的项数（32KB）
+#define COMPRESS_MAX_CHUNKS (PAGE_SIZE / sizeof(uint32_t) - COMPRESS_HEADER_FIELDS)    // 文件头放得下的块数，最多约16GB的页
+#define LZ4_HASH_BITS 12                                                // 压缩时匹配哈希表的位数
+#define LZ4_MIN_MATCH 4                                                 // 最短的匹配
+#define LZ4_LAST_LITERALS 5                                             // 数据末尾至少这么多字节是字面量
+#define LZ4_MATCH_LIMIT 12                                              // 最后一个匹配必须在数据末尾这么多字节之前开始
+
+/**
+ * 批量导入
+ * 导入的行先按键排序（内存放不下时分成多个有序段写到临时文件，再归并），
+ * 然后从叶子节点开始自底向上建树，每个节点只写一次
+ */
+#define DEFAULT_FILL_FACTOR 90                                          // 批量导入时节点默认填充到90%，给之后的插入留出空间
+#define IMPORT_RUN_BYTES (64 * 1024 * 1024)                             // 每个有序段在内存中最多占用的字节数
+#define IMPORT_COMMIT_PAGES 1024                                        // 批量导入时每新建这么多页提交一次，避免日志过大
+#define BULK_LOADER_MAX_LEVELS 16                                       // 批量建树时最多的层数
+
+/**
+ * 多版本并发控制（MVCC）
+ * 每条修改语句有一个版本号，比表的提交版本大1，提交时表的提交版本加1；查询开始时取提交版本作为快照，
+ * 只能看到版本不大于快照的行。写者插入行之前把键和版本记在内存中的版本存储里，
+ * 所有快照都能看到的版本会被回收，所以页的格式不需要改变
+ */
+#define VERSION_STORE_INITIAL_CAPACITY 1024                             // 版本存储的初始容量，不够时翻倍
+
+/**
+ * 并行扫描
+ * 大表的全表扫描和区间扫描按内部节点中的键切成许多区间，线程从共享的计数器领取下一个区间，
+ * 每个区间用自己的快照游标扫描，结果写到区间自己的缓冲区，最后按区间顺序合并，输出仍然按键排序
+ */
+#define MAX_SCAN_THREADS 64                                             // 并行扫描最多的线程数
+#define SCAN_RANGES_PER_THREAD 8                                        // 每个线程平均分到的区间数，先做完的线程可以接着领取剩下的区间
+#define PARALLEL_SCAN_MIN_PAGES 256                                     // 数据库至少有这么多页（1MB）时才并行扫描，小表分给多个线程不划算
+
+/**
+ * 完整性检查
+ * .check 从根节点开始一层一层地检查每棵树：一层的页按键的顺序分成许多段，线程领取一段，直接从日志或数据库文件
+ * 读出页（不经过缓冲池），验证校验和、父节点指针和键的顺序，把子节点按顺序放进这一段的下一层；
+ * 每个页只能被引用一次，所以损坏的指针形成的环也会在第二次引用时被发现
+ */
+#define CHECK_CHUNK_PAGES 64                                            // 一个线程一次领取的页数
+#define CHECK_MAX_PROBLEMS 100                                          // 最多打印的问题数，之后的只计数
+#define CHECK_MESSAGE_SIZE 96                                           // 一个问题的描述的最大长度
 
 /**
  * B+树节点头部
  * B+树节点头部用于表示B+树中的节点头部
- * 节点类型：1字节，是否为根节点：1字节，父节点指针：4字节，共6字节
+ * 节点类型：1字节，是否为根节点：1字节，父节点指针：4字节，校验和：4字节，共10字节
+ * 校验和是页中其余所有字节的CRC32C，页写到预写日志时计算，从日志或数据库文件读进来时验证
  */
 const uint32_t NODE_TYPE_SIZE = sizeof(uint8_t);    // 节点类型的大小
 const uint32_t NODE_TYPE_OFFSET = 0;                // 节点类型的偏移量
@@ -49,31 +155,142 @@ const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);       // 是否为根节点的大
 const uint32_t IS_ROOT_OFFSET = NODE_TYPE_OFFSET + NODE_TYPE_SIZE;    // 是否为根节点的偏移量
 const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);    // 父节点指针的大小
 const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;    // 父节点指针的偏移量
-const uint32_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;    // 通用节点头部的大小
+const uint32_t PAGE_CHECKSUM_SIZE = sizeof(uint32_t);    // 页校验和的大小
+const uint32_t PAGE_CHECKSUM_OFFSET = PARENT_POINTER_OFFSET + PARENT_POINTER_SIZE;    // 页校验和的偏移量
+const uint32_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE + PAGE_CHECKSUM_SIZE;    // 通用节点头部的大小
+#define CRC32C_POLYNOMIAL 0x82F63B78                                    // CRC32C（Castagnoli）多项式，按位反转的表示
 
 /**
  * 叶子节点格式
  * 叶子节点格式用于表示B+树中的叶子节点格式
- * 叶子节点头部：6字节，单元格数量：4字节，共10字节
+ * 叶子节点头部：10字节，单元格数量：4字节，下一个叶子节点页号：4字节，堆起始位置：2字节，共20字节
+ * 叶子节点按键的顺序串成链表，扫描时沿链表前进，不需要回到内部节点
  */
 const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);    // 叶子节点中单元格数量的大小
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;    // 叶子节点中单元格数量的偏移量
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE;    // 叶子节点头部的大小
+const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);    // 下一个叶子节点页号的大小
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;    // 下一个叶子节点页号的偏移量
+const uint32_t LEAF_NODE_HEAP_START_SIZE = sizeof(uint16_t);    // 堆起始位置的大小
+const uint32_t LEAF_NODE_HEAP_START_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;    // 堆起始位置的偏移量
+const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_HEAP_START_SIZE;    // 叶子节点头部的大小
 
 /**
  * 叶子节点体
- * 叶子节点体用于表示B+树中的叶子节点体
- * （键：4字节，值：293字节），共297字节
- * 每个页面最多存储13个单元格（页面总大小4096字节，头部大小10字节，每个单元格大小297字节）
+ * 叶子节点是槽式页：头部后面是按键排序的槽数组，每个槽（键：4字节，值偏移：2字节，值长度：2字节）共8字节；
+ * 值是序列化的行，从页尾向前存放在堆中，槽数组和堆之间是空闲空间
+ * 键的间隔固定，二分查找不需要访问堆；最长的行也能保证每页至少存储13个单元格
  */
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);    // 键的大小
 const uint32_t LEAF_NODE_KEY_OFFSET = 0;                // 键的偏移量
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;         // 值的大小
-const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;    // 值的偏移量
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;    // 单元格的大小
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;    // 页中用于存储单元格的空间
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;    // 页中最大单元格数量
+const uint32_t LEAF_NODE_VALUE_OFFSET_SIZE = sizeof(uint16_t);    // 值偏移的大小
+const uint32_t LEAF_NODE_VALUE_OFFSET_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;    // 值偏移在槽中的偏移量
+const uint32_t LEAF_NODE_VALUE_LENGTH_SIZE = sizeof(uint16_t);    // 值长度的大小
+const uint32_t LEAF_NODE_VALUE_LENGTH_OFFSET = LEAF_NODE_VALUE_OFFSET_OFFSET + LEAF_NODE_VALUE_OFFSET_SIZE;    // 值长度在槽中的偏移量
+const uint32_t LEAF_NODE_SLOT_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_OFFSET_SIZE + LEAF_NODE_VALUE_LENGTH_SIZE;    // 槽的大小
+const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;    // 页中用于存储槽和值的空间
+const uint32_t LEAF_NODE_MIN_CELLS = LEAF_NODE_SPACE_FOR_CELLS / (LEAF_NODE_SLOT_SIZE + ROW_MAX_SIZE);    // 页中至少能存储的单元格数量
+
+/**
+ * 内部节点头部
+ * 通用头部：10字节，键数量：4字节，最右子节点页号：4字节，共18字节
+ */
+const uint32_t INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(uint32_t);    // 内部节点中键数量的大小
+const uint32_t INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;    // 内部节点中键数量的偏移量
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(uint32_t);    // 最右子节点页号的大小
+const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET = INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;    // 最右子节点页号的偏移量
+const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE;    // 内部节点头部的大小
+
+/**
+ * 内部节点体
+ * （子节点页号：4字节，键：4字节），共8字节
+ * 键是对应子节点中的最大键，最右子节点单独存放在头部，没有对应的键
+ */
+const uint32_t INTERNAL_NODE_KEY_SIZE = sizeof(uint32_t);    // 键的大小
+const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);    // 子节点页号的大小
+const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;    // 单元格的大小
+const uint32_t INTERNAL_NODE_SPACE_FOR_CELLS = PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE;    // 页中用于存储单元格的空间
+const uint32_t INTERNAL_NODE_MAX_KEYS = INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;    // 页中最大键数量
+#define INVALID_PAGE_NUM UINT32_MAX                                     // 无效页号，表示空的内部节点还没有最右子节点
+
+/**
+ * 二级索引
+ * 字符串列上的索引各是一棵独立的B+树，键是（字符串，id），字符串相同时按id排序，叶子节点中只有键
+ * 索引的根节点页号记在目录页中这一列的列项里
+ */
+#define INDEX_MAX_DEPTH 32                                              // 索引树最多的层数，插入时记录下降的路径
+
+/**
+ * 索引节点格式
+ * 通用头部：10字节，单元格数量：2字节，下一个页号：4字节，公共前缀长度：2字节，共18字节
+ * 头部后面是节点中所有键共同的前缀，只存一次（前缀压缩）；之后是按键递增紧挨着存放的变长单元格：
+ * 后缀长度：1字节，后缀，id：4字节，内部节点再加子节点页号：4字节
+ * 内部节点的键是对应子节点中的最大键，最右子节点页号放在头部的下一个页号里；叶子节点的下一个页号串成链表
+ */
+const uint32_t INDEX_NODE_NUM_CELLS_SIZE = sizeof(uint16_t);    // 单元格数量的大小
+const uint32_t INDEX_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;    // 单元格数量的偏移量
+const uint32_t INDEX_NODE_NEXT_SIZE = sizeof(uint32_t);    // 下一个页号的大小
+const uint32_t INDEX_NODE_NEXT_OFFSET = INDEX_NODE_NUM_CELLS_OFFSET + INDEX_NODE_NUM_CELLS_SIZE;    // 下一个页号的偏移量
+const uint32_t INDEX_NODE_PREFIX_LENGTH_SIZE = sizeof(uint16_t);    // 公共前缀长度的大小
+const uint32_t INDEX_NODE_PREFIX_LENGTH_OFFSET = INDEX_NODE_NEXT_OFFSET + INDEX_NODE_NEXT_SIZE;    // 公共前缀长度的偏移量
+const uint32_t INDEX_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + INDEX_NODE_NUM_CELLS_SIZE + INDEX_NODE_NEXT_SIZE + INDEX_NODE_PREFIX_LENGTH_SIZE;    // 索引节点头部的大小
+const uint32_t INDEX_NODE_CHILD_SIZE = sizeof(uint32_t);    // 内部节点单元格中子节点页号的大小
+const uint32_t INDEX_NODE_MAX_ENTRIES = (PAGE_SIZE - INDEX_NODE_HEADER_SIZE) / (STRING_LENGTH_SIZE + ID_SIZE) + 2;    // 解码一个节点最多得到的项数，包括新插入的项和最右子节点
+
+/**
+ * 目录页
+ * 数据库的第0页，记录所有的表。通用头部：10字节，文件格式版本：4字节，表数量：4字节，共18字节；之后是定长的表项
+ * 表项：表名：32字节，根节点页号：4字节，列数：4字节，之后是 MAX_TABLE_COLUMNS 个列项，共344字节
+ * 列项：列名：32字节，类型：1字节，最大长度：1字节，索引的根节点页号：4字节（0表示没有索引），共38字节
+ * 表不会被删除，表项的位置不变；打开数据库时读进内存，之后只有建表和建索引时写
+ * 最后一个表项之后的4字节是待清除列表的第一页（0表示没有），旧文件这里是0，格式版本不变
+ * 目录只有这一页，不会链接更多的页：一个数据库最多 CATALOG_MAX_TABLES（11）个表，包括默认表，每个表最多 MAX_TABLE_COLUMNS（8）列，超出时建表报错
+ * 页格式变了的文件不能打开：没有校验和的旧文件（格式版本1，更早的文件没有目录页）在读任何页之前就报告不支持
+ */
+#define DB_FORMAT_VERSION 2           // 文件格式版本，版本2的每个页都有校验和
+const uint32_t CATALOG_FORMAT_VERSION_SIZE = sizeof(uint32_t);    // 文件格式版本的大小
+const uint32_t CATALOG_FORMAT_VERSION_OFFSET = COMMON_NODE_HEADER_SIZE;    // 文件格式版本的偏移量
+const uint32_t CATALOG_NUM_TABLES_SIZE = sizeof(uint32_t);    // 表数量的大小
+const uint32_t CATALOG_NUM_TABLES_OFFSET = CATALOG_FORMAT_VERSION_OFFSET + CATALOG_FORMAT_VERSION_SIZE;    // 表数量的偏移量
+const uint32_t CATALOG_HEADER_SIZE = CATALOG_NUM_TABLES_OFFSET + CATALOG_NUM_TABLES_SIZE;    // 目录页头部的大小
+const uint32_t CATALOG_TABLE_NAME_OFFSET = 0;    // 表名在表项中的偏移量
+const uint32_t CATALOG_TABLE_ROOT_SIZE = sizeof(uint32_t);    // 根节点页号的大小
+const uint32_t CATALOG_TABLE_ROOT_OFFSET = CATALOG_TABLE_NAME_OFFSET + CATALOG_NAME_SIZE;    // 根节点页号在表项中的偏移量
+const uint32_t CATALOG_TABLE_NUM_COLUMNS_SIZE = sizeof(uint32_t);    // 列数的大小
+const uint32_t CATALOG_TABLE_NUM_COLUMNS_OFFSET = CATALOG_TABLE_ROOT_OFFSET + CATALOG_TABLE_ROOT_SIZE;    // 列数在表项中的偏移量
+const uint32_t CATALOG_TABLE_COLUMNS_OFFSET = CATALOG_TABLE_NUM_COLUMNS_OFFSET + CATALOG_TABLE_NUM_COLUMNS_SIZE;    // 第一个列项在表项中的偏移量
+const uint32_t CATALOG_COLUMN_NAME_OFFSET = 0;    // 列名在列项中的偏移量
+const uint32_t CATALOG_COLUMN_TYPE_SIZE = sizeof(uint8_t);    // 类型的大小
+const uint32_t CATALOG_COLUMN_TYPE_OFFSET = CATALOG_COLUMN_NAME_OFFSET + CATALOG_NAME_SIZE;    // 类型在列项中的偏移量
+const uint32_t CATALOG_COLUMN_SIZE_SIZE = sizeof(uint8_t);    // 最大长度的大小
+const uint32_t CATALOG_COLUMN_SIZE_OFFSET = CATALOG_COLUMN_TYPE_OFFSET + CATALOG_COLUMN_TYPE_SIZE;    // 最大长度在列项中的偏移量
+const uint32_t CATALOG_COLUMN_INDEX_ROOT_SIZE = sizeof(uint32_t);    // 索引根节点页号的大小
+const uint32_t CATALOG_COLUMN_INDEX_ROOT_OFFSET = CATALOG_COLUMN_SIZE_OFFSET + CATALOG_COLUMN_SIZE_SIZE;    // 索引根节点页号在列项中的偏移量
+const uint32_t CATALOG_COLUMN_ENTRY_SIZE = CATALOG_COLUMN_INDEX_ROOT_OFFSET + CATALOG_COLUMN_INDEX_ROOT_SIZE;    // 列项的大小
+const uint32_t CATALOG_TABLE_ENTRY_SIZE = CATALOG_TABLE_COLUMNS_OFFSET + MAX_TABLE_COLUMNS * CATALOG_COLUMN_ENTRY_SIZE;    // 表项的大小
+const uint32_t CATALOG_MAX_TABLES = (PAGE_SIZE - CATALOG_HEADER_SIZE) / CATALOG_TABLE_ENTRY_SIZE;    // 目录页最多能记录的表数
+const uint32_t CATALOG_PURGE_HEAD_SIZE = sizeof(uint32_t);    // 待清除列表第一页页号的大小
+const uint32_t CATALOG_PURGE_HEAD_OFFSET = CATALOG_HEADER_SIZE + CATALOG_MAX_TABLES * CATALOG_TABLE_ENTRY_SIZE;    // 待清除列表第一页页号的偏移量
+const uint32_t CATALOG_PAGE_NUM = 0;    // 目录页的页号
+#define DEFAULT_TABLE_NAME "users"                                      // 新建数据库时自动创建的表，语句中没有写表名时使用第一个表
+
+/**
+ * 空闲页链表
+ * 删除时合并掉的节点不马上复用：可能还有查询沿着旧的指针读它，等这之前开始的快照都结束以后才加到空闲页链表。
+ * 链表头记在目录页的父节点指针里（0表示链表为空），每个空闲页的父节点指针是下一个空闲页；
+ * 分裂和建表需要新页时先从链表头取，链表为空时才追加到文件末尾。.vacuum 把所有用到的页移到文件前面，再截断文件
+ */
 
+/**
+ * 待清除列表
+ * 删除提交以后，比它旧的快照还能看到删除的行，这些行留在树中，等快照都结束以后由之后的写者从树中删掉。
+ * 它们的键和删除一起提交到一串页中，崩溃以后打开数据库时先删掉这些行，提交了的删除不会丢失。
+ * 每页：通用头部：10字节（父节点指针是下一页，0表示最后一页），项数：4字节；之后每项：表项的位置：4字节，键：4字节
+ */
+const uint32_t PURGE_NODE_NUM_ENTRIES_SIZE = sizeof(uint32_t);    // 项数的大小
+const uint32_t PURGE_NODE_NUM_ENTRIES_OFFSET = COMMON_NODE_HEADER_SIZE;    // 项数的偏移量
+const uint32_t PURGE_NODE_HEADER_SIZE = PURGE_NODE_NUM_ENTRIES_OFFSET + PURGE_NODE_NUM_ENTRIES_SIZE;    // 待清除列表页头部的大小
+const uint32_t PURGE_NODE_ENTRY_SIZE = 2 * sizeof(uint32_t);    // 一项的大小
+const uint32_t PURGE_NODE_MAX_ENTRIES = (PAGE_SIZE - PURGE_NODE_HEADER_SIZE) / PURGE_NODE_ENTRY_SIZE;    // 一页最多的项数
 
 /**
  * 节点类型
@@ -82,43 +299,381 @@ const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_
 typedef enum
 {
     NODE_INTERNAL,
-    NODE_LEAF
+    NODE_LEAF,
+    NODE_INDEX_INTERNAL,            // 索引的内部节点
+    NODE_INDEX_LEAF,                // 索引的叶子节点
+    NODE_CATALOG,                   // 目录页
+    NODE_FREE,                      // 空闲页链表中的页
+    NODE_PURGE                      // 待清除列表中的页
 } NodeType;
 
+/**
+ * 页锁（latch）
+ * 读者沿B+树下降时对经过的页加共享锁（锁耦合：先锁住子节点再释放父节点），写者修改页之前加排它锁
+ * 读者持有锁时从不阻塞等待另一个页锁，所以读者和写者之间不会死锁
+ */
+typedef struct
+{
+    pthread_rwlock_t lock;  // 读写锁，写者优先，频繁的读者不会让写者一直等待
+    bool exclusive;         // 写者是否持有排它锁，写者下一次取消固定这个页时释放
+} PageLatch;
+
+/**
+ * 缓冲池帧
+ * 帧是缓冲池中的一个槽位，缓存文件中的一页
+ */
+typedef struct
+{
+    uint32_t page_num;      // 缓存的页号，空闲帧为INVALID_PAGE_NUM
+    void *data;             // 页数据
+    uint32_t pin_count;     // 固定计数，大于0时不能被淘汰
+    bool dirty;             // 是否被修改过，淘汰或关闭时需要写回文件
+    bool referenced;        // CLOCK算法的访问位
+    int32_t hash_next;      // 页表中同一个桶里的下一个帧，-1表示没有
+    PageLatch latch;        // 页锁，页被固定时才能加锁，所以加锁的页不会被淘汰
+} Frame;
+
+/**
+ * 日志帧头
+ */
+typedef struct
+{
+    uint32_t page_num;      // 页号
+    uint32_t commit;        // 不为0表示提交帧，值为提交后数据库的页数
+    uint32_t salt;          // 盐值，和日志头部一致的帧才有效
+    uint32_t checksum;      // 帧头前三个字段和页内容的校验和
+} WalFrameHeader;
+
+/**
+ * 数据库选项
+ * 命令行参数解析后传给 db_open
+ */
+typedef struct
+{
+    uint32_t pool_pages;    // 缓冲池帧数
+    uint32_t group_commit;  // 多少次提交合并成一次 fdatasync
+    bool use_mmap;          // 是否使用内存映射模式代替缓冲池
+    uint32_t scan_threads;  // 并行扫描的线程数
+    bool compress;          // 新建的数据库文件是否使用压缩格式，已有的文件按文件头决定
+} DbOptions;
+
+/**
+ * 压缩文件中页的槽
+ * 长度为 PAGE_SIZE 表示页没有压缩，为0表示页还没有写进文件
+ */
+typedef struct
+{
+    uint32_t offset;        // 槽在文件中的偏移，以 COMPRESS_SLOT_UNIT 为单位
+    uint16_t length;        // 槽中数据的字节数
+    uint16_t capacity;      // 槽的大小，以 COMPRESS_SLOT_UNIT 为单位，页压缩后放不下时换一个新槽
+} PageSlot;
+
 /**
  * 分页器
  * 分页器是一个抽象层，用于管理文件的读写，以及缓存页
+ * 页缓存在容量固定的缓冲池中，通过页表（页号 -> 帧的哈希表）查找，满了以后用CLOCK算法淘汰没有被固定的页
+ * 修改过的页先追加到预写日志，检查点时才写回数据库文件；日志索引记录每个页在日志中的最新帧
+ * 内存映射模式下不使用缓冲池：数据库文件以私有映射（写时复制）映射到内存，get_page 直接返回映射中的地址，
+ * 修改只发生在进程私有的副本上，和缓冲池模式一样通过预写日志和检查点写回文件
+ * 压缩文件中的页不在固定的偏移上，通过页映射找到它的槽
+ * 显式事务中被修改的页在撤销缓冲区里有一份事务开始前的副本，回滚时原地恢复；提交时所有脏页一起写到日志
+ * 多个线程共享分页器：页表、固定计数、CLOCK指针、日志和日志索引都由 mutex 保护，页的内容由页锁保护
  */
 typedef struct
 {
+    pthread_mutex_t mutex;  // 保护分页器的元数据，持有它时不会等待页锁
+    pthread_mutex_t sync_mutex; // 同一时间只有一个线程 fdatasync 日志，返回时之前的提交都已经落盘
     int file_descriptor;    // 文件描述符
-    uint32_t file_length;   // 文件长度
+    off_t file_length;      // 文件长度
     uint32_t num_pages;     // 页数
-    void *pages[TABLE_MAX_PAGES];   // 页，用于缓存文件中的数据
+    uint32_t capacity;      // 缓冲池帧数
+    Frame *frames;          // 缓冲池帧
+    void *frame_data;       // 所有帧的页数据，连续分配
+    int32_t *page_table;    // 页表的桶，保存每个桶中第一个帧的下标，-1表示空桶
+    uint32_t page_table_mask;   // 页表桶数减1，桶数是2的幂
+    uint32_t clock_hand;    // CLOCK算法的指针
+    char *wal_filename;     // 预写日志文件名
+    int wal_fd;             // 预写日志文件描述符
+    uint32_t wal_salt;      // 当前日志的盐值
+    uint32_t wal_num_frames;    // 日志中的帧数
+    uint32_t wal_pending_syncs; // 已经写入日志但还没有 fdatasync 的提交数
+    uint32_t group_commit;  // 多少次提交合并成一次 fdatasync
+    uint32_t *wal_index_pages;  // 日志索引的页号，开放寻址哈希表，空槽为INVALID_PAGE_NUM
+    uint32_t *wal_index_frames; // 日志索引中页对应的最新帧号
+    uint32_t wal_index_capacity;    // 日志索引的槽数，是2的幂
+    uint32_t wal_index_count;   // 日志索引中的页数
+    void *map_base;         // 内存映射模式下映射的起始地址，缓冲池模式为NULL
+    size_t map_reserved;    // 预留的地址空间大小
+    uint32_t map_pages;     // 已经映射的页数
+    uint8_t *map_dirty;     // 内存映射模式下每个页是否被修改过
+    uint32_t *map_dirty_pages;  // 内存映射模式下被修改过的页号
+    uint32_t map_num_dirty; // 被修改过的页数
+    uint32_t map_dirty_capacity;    // map_dirty_pages 的容量
+    PageLatch **map_latches;    // 内存映射模式下的页锁，按块懒分配，块的地址不会移动
+    char *filename;         // 数据库文件名，重写压缩文件时用
+    bool compressed;        // 数据库文件是否是压缩格式
+    uint32_t *compress_header;  // 压缩文件的文件头
+    PageSlot *slots;        // 压缩文件中每个页的槽，按页号下标，项数是块数乘以 COMPRESS_CHUNK_ENTRIES
+    uint32_t compress_end;  // 压缩文件中已经分配到的位置，以 COMPRESS_SLOT_UNIT 为单位
+    uint8_t *compress_buffer;   // 读写压缩页的缓冲区，持有 mutex 时使用
+    bool in_transaction;    // 是否在显式事务中，事务中第一次修改已有的页之前先把它保存到撤销缓冲区
+    uint32_t transaction_num_pages; // 事务开始时的页数，之后新分配的页没有需要恢复的内容
+    uint32_t *undo_pages;   // 撤销缓冲区的页号，开放寻址哈希表，空槽为INVALID_PAGE_NUM
+    void **undo_images;     // 撤销缓冲区中页在事务开始前的内容
+    uint32_t *taken_pages;  // 事务从空闲页链表取出的页，回滚时不恢复内容，和事务新分配的页一起释放
+    uint32_t num_taken;     // taken_pages 中的页数
+    uint32_t taken_capacity;    // taken_pages 的容量
+    uint32_t undo_capacity; // 撤销缓冲区的槽数，是2的幂
+    uint32_t undo_count;    // 撤销缓冲区中的页数
 } Pager;
 
+/**
+ * 行版本
+ * 记录某个键的行是哪个版本插入的，以及哪个版本删除了它
+ * 快照能看到的行：插入的版本不大于快照，并且没有被删除或者删除的版本比快照新
+ */
+typedef struct
+{
+    uint32_t key;                   // 行的键
+    uint64_t version;               // 插入这一行的语句的版本，删除以前就有的行时为0
+    uint64_t deleted;               // 删除这一行的语句的版本，0表示没有删除；行从树中真正删掉以后清零
+    uint64_t hash_next;             // 同一个桶中更旧的行版本的序号加1，0表示没有
+} RowVersion;
+
+/**
+ * 版本存储
+ * 行版本按记录的顺序编号，放在环形数组中，序号和版本都是递增的，回收时从最旧的一端丢弃；
+ * 哈希桶把同一个桶中的行版本从新到旧串起来，序号小于 first 的已经被回收，遍历到它就停止
+ * 活跃的快照按版本递增保存，最旧的快照决定哪些行版本还不能回收
+ */
+typedef struct
+{
+    pthread_rwlock_t lock;          // 读者过滤行时加共享锁，其他操作加排它锁
+    uint64_t commit_version;        // 最近提交的版本
+    RowVersion *versions;           // 行版本的环形数组，序号对容量取模是下标
+    uint64_t *buckets;              // 哈希桶，保存桶中最新的行版本的序号加1，0表示空桶
+    uint32_t capacity;              // 环形数组的容量和哈希桶数，是2的幂
+    uint64_t first;                 // 最旧的没有回收的行版本的序号
+    uint64_t next;                  // 下一个行版本的序号
+    uint64_t *snapshots;            // 活跃的快照，按版本递增，同一个版本可以出现多次
+    uint32_t num_snapshots;         // 活跃的快照数
+    uint32_t snapshot_capacity;     // snapshots 的容量
+} VersionStore;
+
+/**
+ * 列类型
+ */
+typedef enum
+{
+    COLUMN_INT,                     // 32位有符号整数，第一列（键）是无符号的
+    COLUMN_VARCHAR                  // 变长字符串，有最大长度
+} ColumnType;
+
+/**
+ * 列
+ * 列的定义和它在序列化的行中的位置
+ */
+typedef struct
+{
+    char name[CATALOG_NAME_SIZE];   // 列名
+    ColumnType type;                // 类型
+    uint32_t size;                  // 字符串列的最大长度，整数列为 INT_COLUMN_SIZE
+    uint32_t offset;                // 整数列的偏移量；字符串列是第一个字符串列的长度前缀的偏移量
+    uint32_t skip;                  // 字符串列前面还有几个字符串列，为0时长度前缀就在固定的偏移量上
+} Column;
+
+/**
+ * 行的布局
+ * 建表或者打开数据库时从列的定义算出每一列的位置，读取列时不需要再解析表的定义
+ */
+typedef struct
+{
+    uint32_t num_columns;           // 列数
+    Column columns[MAX_TABLE_COLUMNS];    // 列，按定义的顺序
+    uint32_t fixed_size;            // 所有整数列的大小，第一个字符串列从这里开始
+    uint32_t num_strings;           // 字符串列数
+    uint32_t max_size;              // 行的最大大小
+} RowLayout;
+
+typedef struct Database Database;
+
 /**
  * 表
- * 表是一个抽象层，用于管理行
+ * 表是一个抽象层，用于管理行；每个表是一棵B+树，所有的表共享数据库的分页器和写者互斥锁
+ * 同一时间只有一个写者（插入、导入）；查询读取快照，不需要等待写者的语句结束，
+ * 只在复制叶子节点时短暂地和写者在页锁上互斥
  */
 typedef struct
 {
-    Pager *pager;                   // 分页器
+    Database *database;             // 表所在的数据库
+    Pager *pager;                   // 分页器，就是数据库的分页器
+    char name[CATALOG_NAME_SIZE];   // 表名
+    uint32_t catalog_slot;          // 表项在目录页中的位置
     uint32_t root_page_num;         // 根节点页号
+    RowLayout layout;               // 行的布局
+    VersionStore versions;          // 版本存储，键只在表内唯一，所以每个表有自己的版本存储
+    uint32_t index_roots[MAX_TABLE_COLUMNS];    // 每一列上索引的根节点页号，0表示没有索引；写者持有 writer_mutex 修改，查询原子地读取
+    uint32_t *deleted_keys;         // 写者标记删除、还没有提交的键，提交时成为一批待清除的删除；由 writer_mutex 保护
+    uint32_t num_deleted;           // deleted_keys 中的键数
+    uint32_t deleted_capacity;      // deleted_keys 的容量
 } Table;
 
+/**
+ * 一批释放的页
+ * 同一条语句（或者回滚）释放的页，记下释放后每个表的提交版本；
+ * 所有表中比它旧的快照都结束以后，没有查询还会读这些页，才能加到空闲页链表
+ */
+typedef struct
+{
+    uint32_t *page_nums;            // 释放的页号
+    uint32_t num_pages;             // 页数
+    uint64_t *guards;               // 释放后每个表的提交版本，按表的顺序
+    uint32_t num_guards;            // 释放时的表数，之后新建的表不会读这些页
+} FreeBatch;
+
+/**
+ * 一批待清除的删除
+ * 同一条语句（或者事务）在一个表中删除的键，记下提交后表的提交版本；
+ * 表中比它旧的快照都结束以后，没有查询还能看到这些行，才从树中删掉
+ */
+typedef struct
+{
+    Table *table;                   // 删除行的表
+    uint32_t *keys;                 // 删除的键
+    uint32_t num_keys;              // 键数
+    uint64_t guard;                 // 提交后表的提交版本
+} PurgeBatch;
+
+/**
+ * 线程池中的任务
+ * 一个任务可以请求多个线程一起执行同一个函数，任务结构体由提交的线程持有，结束之前不能释放
+ */
+typedef struct PoolJob
+{
+    void *(*function)(void *);      // 线程执行的函数
+    void *argument;                 // 函数的参数
+    uint32_t num_wanted;            // 还需要的线程数
+    uint32_t num_running;           // 正在执行函数的线程数
+    struct PoolJob *next;           // 队列中的下一个任务
+} PoolJob;
+
+/**
+ * 线程池
+ * 打开数据库时按扫描线程数创建一次，并行扫描和完整性检查从这里借线程，语句不用自己创建线程；
+ * 多条语句同时提交任务时线程按提交的顺序分配，总线程数不会超过池的大小
+ */
+typedef struct
+{
+    pthread_t *threads;             // 线程
+    uint32_t num_threads;           // 线程数
+    PoolJob *jobs;                  // 还需要线程的任务，先提交的在前
+    bool stopping;                  // 是否正在关闭
+    pthread_mutex_t mutex;          // 保护任务队列和任务的计数
+    pthread_cond_t work_cond;       // 有新任务或者关闭时通知池中的线程
+    pthread_cond_t done_cond;       // 有线程执行完任务时通知提交任务的线程
+} WorkerPool;
+
+/**
+ * 数据库
+ * 一个文件中的所有表，共享分页器、缓冲池和写者互斥锁；表只会增加，已经打开的表的地址不变
+ */
+struct Database
+{
+    Pager *pager;                   // 分页器
+    pthread_mutex_t writer_mutex;   // 写者互斥锁，修改树的语句和需要稳定的树的元命令持有它
+    bool in_transaction;            // 是否有会话打开了显式事务，同一时间最多一个，由 writer_mutex 保护
+    uint32_t scan_threads;          // 全表扫描和区间扫描的线程数，为1时不并行
+    WorkerPool *scan_pool;          // 帮助执行语句的线程扫描的线程池，有 scan_threads - 1 个线程；不并行时为NULL
+    Table **tables;                 // 表，按目录页中的顺序，容量是 CATALOG_MAX_TABLES
+    uint32_t num_tables;            // 表数，写者持有 writer_mutex 先放好表再增加，准备语句时原子地读取
+    pthread_rwlock_t vacuum_lock;   // 查询加共享锁，.vacuum 移动页时加排它锁
+    uint32_t *freed_pages;          // 当前语句释放的页，提交以后成为一批；由 writer_mutex 保护
+    uint32_t num_freed;             // freed_pages 中的页数
+    uint32_t freed_capacity;        // freed_pages 的容量
+    FreeBatch *free_batches;        // 还不能复用的页，按释放的顺序；由 writer_mutex 保护
+    uint32_t num_free_batches;      // 批数
+    uint32_t free_batches_capacity; // free_batches 的容量
+    PurgeBatch *purge_batches;      // 提交了、还留在树中的删除，按提交的顺序；由 writer_mutex 保护
+    uint32_t num_purge_batches;     // 批数
+    uint32_t purge_batches_capacity;    // purge_batches 的容量
+    uint32_t *purge_pages;          // 待清除列表的页，按链表的顺序；由 writer_mutex 保护
+    uint32_t num_purge_pages;       // 页数
+    uint32_t purge_pages_capacity;  // purge_pages 的容量
+    bool purge_list_dirty;          // 待清除的删除变了，提交前要重写待清除列表
+};
+
+/**
+ * 批量建树器
+ * 每一层保存一个正在填充的节点，节点满了就写到页里，并把它的最大键加到上一层的节点中
+ * 节点开始填充时就分配页号，这样子节点写出时已经知道父节点的页号
+ */
+typedef struct
+{
+    Table *table;                   // 表
+    uint32_t fill_factor;           // 填充因子（百分比）
+    uint32_t num_levels;            // 已有的层数，第0层是叶子节点
+    void *nodes[BULK_LOADER_MAX_LEVELS];    // 每一层正在填充的节点
+    uint32_t page_nums[BULK_LOADER_MAX_LEVELS];    // 每一层正在填充的节点的页号
+    uint32_t max_keys[BULK_LOADER_MAX_LEVELS];    // 每一层正在填充的节点中的最大键
+    uint32_t first_page_num;        // 第一个新分配的页号
+    uint64_t num_rows;              // 已经加入的行数
+} BulkLoader;
+
+/**
+ * 导入的有序段
+ * 内存放不下的导入数据按段排序后写到临时文件，归并时每个段读出当前最小的一行
+ */
+typedef struct
+{
+    FILE *file;                     // 临时文件
+    uint8_t record[ROW_MAX_SIZE];   // 当前行（序列化后的格式）
+    uint32_t length;                // 当前行的长度
+    bool done;                      // 是否已经读完
+} ImportRun;
+
 /**
  * 游标
  * 游标是一个抽象层，用于遍历表中的行
+ * 查找返回的游标固定着所在的叶子节点；快照游标只读叶子节点的私有副本，副本中只有快照能看到的行
  */
 typedef struct
 {
     Table *table;                   // 表
     uint32_t page_num;              // 页号
+    void *node;                     // 所在的叶子节点，快照游标指向副本
     uint32_t cell_num;              // 单元格号
     bool end_of_table;              // 是否到表尾
+    bool latched;                   // 是否持有叶子节点的共享锁
+    void *copy;                     // 快照游标的叶子节点副本，其他游标为NULL
+    uint64_t snapshot;              // 快照游标读取的快照
 } Cursor;
 
+/**
+ * 区间游标
+ * 区间游标在游标的基础上加了一个上界：打开时通过B+树查找定位到第一个不小于下界的键，
+ * 沿叶子节点链表前进，遇到大于上界的键就停止，不会扫描区间以外的行
+ */
+typedef struct
+{
+    Cursor *cursor;                 // 底层游标
+    uint32_t end_key;               // 区间上界（包含）
+    bool end_of_range;              // 是否已经超出区间
+} RangeCursor;
+
+/**
+ * 索引项
+ * 修改索引节点时把单元格解码成索引项（补上公共前缀），改完再整体编码回页里，公共前缀在编码时重新计算
+ * 内部节点解码后最后一项是最右子节点，它的键比所有键都大，不编码成单元格
+ */
+typedef struct
+{
+    uint32_t id;                    // 行的id
+    uint32_t child;                 // 内部节点中这一项的子节点页号
+    uint8_t length;                 // 字符串的长度
+    bool infinite;                  // 是否为最右子节点的项
+    char string[VARCHAR_MAX_SIZE];  // 字符串，没有结尾的'\0'
+} IndexEntry;
+
 /**
  * 语句类型
  * 语句类型用于表示语句的类型
@@ -126,9 +681,75 @@ typedef struct
 typedef enum
 {
     STATEMENT_INSERT,               // 插入语句
-    STATEMENT_SELECT                // 查询语句
+    STATEMENT_SELECT,               // 查询语句
+    STATEMENT_BEGIN,                // 开始事务
+    STATEMENT_COMMIT,               // 提交事务
+    STATEMENT_ROLLBACK,             // 回滚事务
+    STATEMENT_CREATE_INDEX,         // 在字符串列上建索引
+    STATEMENT_CREATE_TABLE,         // 建表
+    STATEMENT_DELETE                // 删除语句
 } StatementType;
 
+/**
+ * 查询条件类型
+ * 查询条件类型用于表示查询语句的过滤方式
+ */
+typedef enum
+{
+    WHERE_NONE,                     // 没有条件，全表扫描
+    WHERE_ID_EQUALS,                // 按键等值查询，通过B+树查找
+    WHERE_ID_BETWEEN,               // 按键区间查询，通过区间游标扫描
+    WHERE_STRING_EQUALS,            // 字符串列等于给定的值，列上有索引时通过索引查找，否则全表扫描时逐行比较
+    WHERE_STRING_PREFIX             // 字符串列以给定的值开头（like 'xxx%'）
+} WhereType;
+
+/**
+ * 聚合函数
+ * 聚合查询在扫描时累加，不输出行，只输出一行结果
+ */
+typedef enum
+{
+    AGGREGATE_COUNT,                // count(*)，行数
+    AGGREGATE_MIN_ID,               // min(id)
+    AGGREGATE_MAX_ID,               // max(id)
+    AGGREGATE_SUM_ID                // sum(id)
+} Aggregate;
+
+/**
+ * 聚合结果
+ * 扫描按键递增进行，所以最小的id是第一个累加的键，最大的id是最后一个
+ */
+typedef struct
+{
+    uint64_t count;                 // 行数，为0时最小值、最大值和总和都是NULL
+    uint64_t sum;                   // id的总和，uint32 的键互不相同，总和不会超过 uint64
+    uint32_t min;                   // 最小的id
+    uint32_t max;                   // 最大的id
+} AggregateState;
+
+/**
+ * 参数类型
+ * 参数类型用于表示预处理语句中的占位符绑定到语句的哪个字段
+ */
+typedef enum
+{
+    PARAMETER_VALUE,                // 插入的行中的一列
+    PARAMETER_WHERE_ID,             // 查询条件中的键或者区间下界
+    PARAMETER_WHERE_ID_END,         // 查询条件中的区间上界
+    PARAMETER_WHERE_STRING          // 查询条件中字符串列的值
+} ParameterType;
+
+/**
+ * 参数
+ * 参数用于表示预处理语句中的一个占位符
+ */
+typedef struct
+{
+    ParameterType type;             // 参数类型
+    uint32_t row;                   // 插入语句中占位符所在的行
+    uint32_t column;                // 插入语句中占位符所在的列
+} Parameter;
+
 /**
  * 语句
  * 语句用于表示用户输入的语句
@@ -136,20 +757,246 @@ typedef enum
 typedef struct
 {
     StatementType type;             // 语句类型
-    Row row_to_insert;              // 插入的行，只有在语句类型为STATEMENT_INSERT时有效
+    Table *table;                   // 语句访问的表，准备语句时按表名查找；表不会被删除，缓存的语句一直有效
+    Row *rows_to_insert;            // 插入的行，只有在语句类型为STATEMENT_INSERT时有效
+    uint32_t num_rows;              // 插入的行数
+    uint32_t rows_capacity;         // rows_to_insert 的容量，语句对象重复使用时不需要重新分配
+    WhereType where_type;           // 查询条件类型，只有在语句类型为STATEMENT_SELECT或STATEMENT_DELETE时有效
+    uint32_t where_id;              // 查询的id，条件类型为WHERE_ID_BETWEEN时是区间下界
+    uint32_t where_id_end;          // 区间上界（包含），只有在条件类型为WHERE_ID_BETWEEN时有效
+    uint32_t where_column;          // 字符串条件的列号，只有在条件类型为WHERE_STRING_EQUALS或WHERE_STRING_PREFIX时有效
+    char where_string[VARCHAR_MAX_SIZE + 1];    // 字符串条件的值，前缀匹配时不包括结尾的 %
+    uint32_t where_string_length;   // 字符串条件的值的长度
+    uint32_t columns[MAX_SELECT_COLUMNS];    // 查询输出的列号，按列出的顺序
+    uint32_t num_columns;           // 查询输出的列数
+    Aggregate aggregates[MAX_SELECT_COLUMNS];    // 聚合函数，按列出的顺序
+    uint32_t num_aggregates;        // 聚合函数的个数，不为0时是聚合查询，不输出行
+    Parameter parameters[MAX_PARAMETERS];    // 占位符，按在语句中出现的顺序
+    uint32_t num_parameters;        // 占位符数量，直接执行的语句不能有占位符
+    uint32_t index_column;          // 建索引的列号，只有在语句类型为STATEMENT_CREATE_INDEX时有效
+    char table_name[CATALOG_NAME_SIZE];    // 新表的表名，只有在语句类型为STATEMENT_CREATE_TABLE时有效
+    RowLayout layout;               // 新表的列，只有在语句类型为STATEMENT_CREATE_TABLE时有效
 } Statement;
 
+/**
+ * 缓存的执行计划
+ * 执行计划就是解析好的语句，以语句文本为键
+ */
+typedef struct
+{
+    char *text;                     // 语句文本，空槽为NULL
+    uint32_t hash;                  // 语句文本的哈希值，查找时先比较哈希值
+    uint64_t last_used;             // 最近一次使用的时间，淘汰最久没有使用的条目
+    Statement statement;            // 解析好的语句
+} CachedPlan;
+
+/**
+ * 预处理语句
+ * prepare <名字> as <语句> 解析一次，之后 execute <名字> <参数...> 只需要绑定参数
+ */
+typedef struct
+{
+    char *name;                     // 名字
+    Statement statement;            // 解析好的语句，带有占位符
+} PreparedStatement;
+
+/**
+ * 语句缓存
+ * 语句缓存保存按名字查找的预处理语句，以及最近执行过的查询语句的执行计划（LRU）
+ * 带常量的插入语句重复执行一定是键重复，所以不缓存
+ * 每个会话（交互模式、服务器的每个连接）有自己的语句缓存，会话的事务状态也记在这里
+ */
+typedef struct
+{
+    CachedPlan plans[PLAN_CACHE_SIZE];    // 执行计划缓存
+    uint64_t clock;                 // 逻辑时钟，每次使用执行计划时加1
+    PreparedStatement *prepared;    // 预处理语句
+    uint32_t num_prepared;          // 预处理语句数量
+    uint32_t prepared_capacity;     // prepared 的容量
+    bool in_transaction;            // 会话是否打开了显式事务
+} StatementCache;
+
 /**
  * 输入缓冲区
  * 输入缓冲区用于存储用户输入
  */
 typedef struct
 {
-    char *buffer;           // 输入缓冲区
+    char *buffer;           // 输入缓冲区，保存当前语句，以字符串结束符结尾
     size_t buffer_length;   // 缓冲区长度
     ssize_t input_length;   // 输入长度
+    char *read_buffer;      // 读缓冲区，一次 read 读入尽量多的数据，可能包含多条语句
+    size_t read_capacity;   // 读缓冲区的大小
+    size_t read_start;      // 读缓冲区中还没有处理的数据的起始位置
+    size_t read_end;        // 读缓冲区中数据的结束位置
+    bool framed;            // 语句是否用长度前缀分帧，否则每行一条语句
+    int fd;                 // 读取的文件描述符
+    bool closed;            // 输入是否已经结束（对端关闭或者读取出错）
+    bool too_long;          // 下一条语句超过了 MAX_STATEMENT_LENGTH，输入随之结束
 } InputBuffer;
 
+/**
+ * 输出缓冲区
+ * 语句的结果（包括提示符和错误信息）都先格式化到一个大缓冲区里，满了或者等待下一条输入之前才一次写到标准输出，
+ * 连续执行多条语句时结果不需要逐条写出
+ * 分帧模式下每条语句的结果前面加上长度前缀，结果没有写完之前缓冲区只扩大，不写出不完整的帧
+ */
+typedef struct
+{
+    char *buffer;           // 输出缓冲区
+    size_t length;          // 已写入的长度
+    size_t capacity;        // 缓冲区的大小
+    int fd;                 // 写出的文件描述符，为-1时只在内存中累积
+    bool framed;            // 结果是否用长度前缀分帧
+    bool in_response;       // 是否正在写一条语句的结果
+    size_t response_start;  // 当前结果的帧头在缓冲区中的位置
+    bool failed;            // 写出失败（对端已经关闭），之后的输出都丢弃
+} OutputBuffer;
+
+/**
+ * 致命错误退出之前要先写出的输出缓冲区
+ * 交互和批处理模式下是标准输出的缓冲区，已经执行完的语句的结果不会因为退出而丢失；其他时候为 NULL，错误信息直接打印
+ */
+OutputBuffer *fatal_output = NULL;
+
+/**
+ * 扫描区间
+ * 并行扫描中由一个线程扫描的一段键
+ */
+typedef struct
+{
+    uint32_t start_key;             // 区间下界（包含）
+    uint32_t end_key;               // 区间上界（包含）
+    OutputBuffer *output;           // 区间的结果，只在内存中累积
+    AggregateState aggregate;       // 聚合查询时区间的聚合结果
+    bool done;                      // 是否已经扫描完
+} ScanRange;
+
+/**
+ * 并行扫描
+ * 参与扫描的线程按顺序领取区间；扫描完的区间由执行查询的线程按顺序写到输出缓冲区
+ */
+typedef struct
+{
+    Table *table;                   // 表
+    Statement *statement;           // 查询语句
+    uint64_t snapshot;              // 所有区间读取同一个快照
+    AggregateState *aggregate;      // 聚合查询的结果，区间的聚合结果按顺序合并到这里；不是聚合查询时为NULL
+    ScanRange *ranges;              // 区间，按键递增
+    uint32_t num_ranges;            // 区间数
+    uint32_t next_range;            // 下一个没有被领取的区间
+    pthread_mutex_t mutex;          // 保护 next_range 和区间的 done
+    pthread_cond_t cond;            // 有区间扫描完时通知合并结果的线程
+} ParallelScan;
+
+/**
+ * 完整性检查中待检查的页
+ * 页中的键必须在父节点给出的范围 (下界, 上界] 里；索引树的界是父节点中的键，编码成（长度：1字节，字符串，id：4字节）
+ */
+typedef struct
+{
+    uint32_t page_num;              // 页号
+    uint32_t parent;                // 父节点页号，根节点为 INVALID_PAGE_NUM
+    int64_t low;                    // 表的树中键的下界（不包含），-1表示没有下界
+    int64_t high;                   // 表的树中键的上界（包含），-1表示没有上界
+    uint8_t *index_low;             // 索引树中键的下界（不包含），NULL表示没有下界
+    uint8_t *index_high;            // 索引树中键的上界（包含），NULL表示没有上界
+    NodeType type;                  // 检查前是期望的类型（表的树中用 NODE_LEAF，索引树中用 NODE_INDEX_LEAF），检查后是实际的类型
+    bool valid;                     // 检查后记下页是否读出来了并且类型正确
+    uint32_t next;                  // 检查后记下叶子节点的下一个页号；目录页和空闲页是空闲页链表中的下一个页
+} CheckItem;
+
+/**
+ * 完整性检查中一层的一段页
+ * 一段页的子节点按顺序放在这一段自己的数组里，这一层检查完以后按段的顺序连起来就是下一层
+ */
+typedef struct
+{
+    uint32_t start;                 // 这一段在这一层中的起始下标
+    uint32_t end;                   // 结束下标（不包含）
+    CheckItem *children;            // 子节点，按键递增
+    uint32_t num_children;          // 子节点数
+    uint32_t children_capacity;     // children 的容量
+    uint8_t **bounds;               // 为索引内部节点中的键分配的界，下一层检查完以后释放
+    uint32_t num_bounds;            // 界的块数
+    uint32_t bounds_capacity;       // bounds 的容量
+} CheckChunk;
+
+/**
+ * 完整性检查发现的问题
+ */
+typedef struct
+{
+    uint32_t page_num;              // 有问题的页
+    char message[CHECK_MESSAGE_SIZE];    // 问题的描述
+} CheckProblem;
+
+/**
+ * 完整性检查
+ * 检查时持有 writer_mutex，日志和数据库文件都不会变化，线程可以不加分页器的锁直接读页
+ */
+typedef struct
+{
+    Pager *pager;                   // 分页器
+    uint32_t num_pages;             // 页数
+    uint8_t *seen;                  // 每个页是否已经被引用过
+    uint32_t num_checked;           // 读过的页数
+    CheckItem *level;               // 当前层的页，按键递增
+    CheckChunk *chunks;             // 当前层的段
+    uint32_t num_chunks;            // 段数
+    uint32_t next_chunk;            // 下一个没有被领取的段
+    pthread_mutex_t mutex;          // 保护 next_chunk 和问题列表
+    WorkerPool *pool;               // 帮助检查的线程池，可以为NULL
+    CheckProblem *problems;         // 发现的问题，最多 CHECK_MAX_PROBLEMS 个
+    uint32_t num_problems;          // 发现的问题数，可能比保存的多
+} IntegrityCheck;
+
+/**
+ * 连接
+ * 服务器模式下的一个客户端连接，每个连接有自己的输入输出缓冲区和预处理语句
+ */
+typedef struct Connection
+{
+    int fd;                         // 套接字
+    InputBuffer *input_buffer;      // 输入缓冲区，从套接字读取分帧的语句
+    OutputBuffer *output;           // 输出缓冲区，分帧的结果写到套接字
+    Statement statement;            // 语句，每条语句重复使用
+    StatementCache *cache;          // 语句缓存
+    uint32_t events;                // 当前在 epoll 中关注的事件
+    bool stalled;                   // 输出积压太多，暂停执行后面的语句
+    bool closing;                   // 收到了 .exit，结果写完以后关闭
+    bool busy;                      // 正在工作线程中执行，事件循环不能访问它的缓冲区
+    struct Connection *next;        // 任务队列或完成队列中的下一个连接
+} Connection;
+
+/**
+ * 服务器
+ * 服务器在一个线程里用 epoll 处理所有连接，所有连接共享同一个数据库和缓冲池
+ * 每一轮先执行所有连接收到的完整语句，再把这一轮的提交一起同步到磁盘，最后才把结果写回客户端
+ * 有工作线程时，事件循环把收到完整语句的连接放进任务队列，由工作线程并发执行；
+ * 执行完的连接放进完成队列并通过 event_fd 唤醒事件循环，事件循环同步日志以后写出结果
+ */
+typedef struct
+{
+    Database *database;             // 数据库
+    int epoll_fd;                   // epoll 实例
+    int unix_fd;                    // Unix 域套接字监听描述符，没有监听时为-1
+    int tcp_fd;                     // TCP 监听描述符，没有监听时为-1
+    int signal_fd;                  // 接收 SIGINT 和 SIGTERM 的描述符
+    const char *socket_path;        // Unix 域套接字的路径，退出时删除
+    Connection **connections;       // 连接，按套接字描述符索引
+    uint32_t connections_capacity;  // connections 的容量
+    uint32_t num_workers;           // 工作线程数，为0时在事件循环的线程里执行语句
+    pthread_t *workers;             // 工作线程
+    pthread_mutex_t queue_mutex;    // 保护任务队列、完成队列和 stopping
+    pthread_cond_t queue_cond;      // 任务队列非空或者服务器停止时通知工作线程
+    Connection *queue_head;         // 任务队列的队首
+    Connection *queue_tail;         // 任务队列的队尾
+    Connection *finished;           // 完成队列
+    int event_fd;                   // 工作线程执行完一个连接时通知事件循环
+    bool stopping;                  // 服务器正在停止，工作线程处理完队列后退出
+} Server;
+
 /**
  * 元命令执行结果
  * 元命令是一种特殊的命令，用于执行一些特殊的操作，比如退出程序
@@ -157,6 +1004,7 @@ typedef struct
 typedef enum
 {
     META_COMMAND_SUCCESS,            // 元命令执行成功
+    META_COMMAND_EXIT,               // 退出，由调用者关闭数据库或者连接
     META_COMMAND_UNRECOGNIZED_COMMAND // 未识别的元命令
 } MetaCommandResult;
 
@@ -170,7 +1018,12 @@ typedef enum
     PREPARE_NEGATIVE_ID,            // id为负数
     PREPARE_SYNTAX_TOO_LONG,        // 语法过长
     PREPARE_SYNTAX_ERROR,           // 语法错误
-    PREPARE_UNRECOGNIZED_STATEMENT  // 未识别的语句
+    PREPARE_UNRECOGNIZED_STATEMENT, // 未识别的语句
+    PREPARE_UNKNOWN_PREPARED,       // 没有这个名字的预处理语句
+    PREPARE_UNKNOWN_TABLE,          // 没有这个名字的表
+    PREPARE_ROW_TOO_LARGE,          // 新表的行可能超过 ROW_MAX_SIZE
+    PREPARE_TOO_MANY_COLUMNS,       // 新表的列超过 MAX_TABLE_COLUMNS
+    PREPARE_STORED                  // 预处理语句已保存，没有要执行的语句
 } PrepareResult;
 
 /**
@@ -180,95 +1033,725 @@ typedef enum
 typedef enum
 {
     EXECUTE_SUCCESS,                // 执行成功
-    EXECUTE_TABLE_FULL              // 表已满
+    EXECUTE_TABLE_FULL,             // 表已满
+    EXECUTE_DUPLICATE_KEY,          // 键已存在
+    EXECUTE_BUSY,                   // 另一个会话打开了事务
+    EXECUTE_NO_TRANSACTION,         // 没有打开的事务
+    EXECUTE_IN_TRANSACTION,         // 已经打开了事务
+    EXECUTE_NOT_ALLOWED_IN_TRANSACTION,    // 语句不能在事务中执行
+    EXECUTE_INDEX_EXISTS,           // 列上已经有索引
+    EXECUTE_TABLE_EXISTS,           // 已经有同名的表
+    EXECUTE_CATALOG_FULL,           // 目录页中放不下更多的表
+    EXECUTE_DELETE_PENDING          // 键的删除已经提交，之前开始的查询还能看到旧的行，它们结束以后才能再插入这个键
 } ExecuteResult;
 
+/**
+ * 导入结果
+ * 导入结果用于表示批量导入的结果
+ */
+typedef enum
+{
+    IMPORT_SUCCESS,                 // 导入成功
+    IMPORT_FILE_ERROR,              // 文件无法打开
+    IMPORT_SYNTAX_ERROR,            // 行格式错误
+    IMPORT_DUPLICATE_KEY,           // 键重复
+    IMPORT_TABLE_NOT_EMPTY          // 表不为空
+} ImportResult;
+
+uint32_t row_serialized_size(Row *source);    // 计算行序列化后的大小
+uint32_t row_size(RowLayout *layout, void *source);    // 获取序列化的行的大小
 void serialize_row(Row *source, void *destination);    // 序列化行
-void deserialize_row(void *source, Row *destination);  // 反序列化行
-void print_constants();    // 打印常量
-void print_leaf_node(void *node);    // 打印叶子节点
-MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table);    // 语句处理
-PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement);  // 准备插入语句
-PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement);    // 准备语句
-void print_row(Row *row);    // 打印行
+void row_init(RowLayout *layout, Row *row);    // 初始化要插入的行
+void row_set_int(RowLayout *layout, Row *row, uint32_t column, int32_t value);    // 设置要插入的行中的整数列
+void row_set_string(RowLayout *layout, Row *row, uint32_t column, const char *value, uint32_t length);    // 设置要插入的行中的字符串列
+uint32_t row_id(void *source);    // 直接从序列化的行中读取id
+int32_t row_int(RowLayout *layout, void *source, uint32_t column);    // 直接从序列化的行中读取整数列
+char* row_string(RowLayout *layout, void *source, uint32_t column, uint32_t *length);    // 直接从序列化的行中读取字符串列
+void row_layout_compute(RowLayout *layout);    // 计算行的布局
+int32_t row_layout_find(RowLayout *layout, const char *name);    // 按名字查找列
+void print_constants(OutputBuffer *output);    // 打印常量
+void indent(uint32_t level, OutputBuffer *output);    // 打印缩进
+MetaCommandResult do_meta_command(InputBuffer *input_buffer, Database *database, StatementCache *cache, OutputBuffer *output);    // 语句处理
+Table* meta_command_table(Database *database, char *name, OutputBuffer *output);    // 查找元命令参数中的表
+bool meta_command_in_transaction(Database *database, StatementCache *cache, OutputBuffer *output);    // 是否有打开的事务，元命令不能执行
+void print_schema(Table *table, OutputBuffer *output);    // 打印表的定义
+PrepareResult prepare_insert(InputBuffer *input_buffer, Database *database, Statement *statement);  // 准备插入语句
+PrepareResult prepare_insert_tuples(char *values, Statement *statement);    // 准备多行插入语句
+PrepareResult prepare_row(Statement *statement, char **values);    // 检查并填充要插入的行
+Row* statement_add_row(Statement *statement);    // 在语句中添加一个要插入的行
+PrepareResult prepare_value(Statement *statement, ParameterType type, uint32_t row, uint32_t column, char *value);    // 填充语句中的一个值或者记录占位符
+bool parse_int(const char *value, int32_t *number);    // 把字符串解析成32位整数
+PrepareResult bind_value(Statement *statement, Parameter *parameter, char *value);    // 检查并把值填到语句中
+PrepareResult bind_parameters(Statement *statement, char *arguments);    // 把参数绑定到占位符
+void statement_copy(Statement *destination, Statement *source);    // 复制语句
+StatementCache *new_statement_cache();    // 创建语句缓存
+PrepareResult prepare_cached(StatementCache *cache, InputBuffer *input_buffer, Database *database, Statement *statement);    // 通过语句缓存准备语句
+PrepareResult prepare_named(StatementCache *cache, Database *database, char *text);    // 保存预处理语句
+PrepareResult execute_named(StatementCache *cache, char *text, Statement *statement);    // 绑定预处理语句的参数
+PreparedStatement* find_prepared(StatementCache *cache, const char *name);    // 按名字查找预处理语句
+uint32_t statement_hash(const char *text);    // 计算语句文本的哈希值
+CachedPlan* plan_cache_lookup(StatementCache *cache, const char *text, uint32_t hash);    // 在执行计划缓存中查找
+void plan_cache_put(StatementCache *cache, const char *text, uint32_t hash, Statement *statement);    // 把执行计划放进缓存
+PrepareResult prepare_select(InputBuffer *input_buffer, Database *database, Statement *statement);  // 准备查询语句
+bool is_aggregate_of(const char *token, const char *function, const char *column);    // 判断是不是对某一列的聚合函数
+PrepareResult prepare_transaction(InputBuffer *input_buffer, Statement *statement);    // 准备事务语句
+PrepareResult prepare_create_table(InputBuffer *input_buffer, Statement *statement);    // 准备建表语句
+bool is_identifier(const char *name);    // 判断是不是合法的表名或列名
+PrepareResult prepare_delete(InputBuffer *input_buffer, Database *database, Statement *statement);    // 准备删除语句
+PrepareResult prepare_statement(InputBuffer *input_buffer, Database *database, Statement *statement);    // 准备语句
+void write_row(OutputBuffer *output, void *source, Statement *statement);    // 把行中要查询的列写到输出缓冲区
 ExecuteResult execute_insert(Statement *statement, Table *table);    // 执行插入语句
-ExecuteResult execute_select(Statement *statement, Table *table);    // 执行查询语句
-ExecuteResult execute_statement(Statement *statement, Table *table);    // 执行语句
-Table* db_open(const char *filename);    // 打开数据库
-Pager* pager_open(const char *filename);    // 打开分页器
+ExecuteResult execute_insert_batch(Statement *statement, Table *table);    // 执行多行插入语句
+ExecuteResult execute_delete(Statement *statement, Table *table);    // 执行删除语句
+void table_purge(Table *table, uint32_t *keys, uint32_t num_keys);    // 把提交了的删除从树中删掉
+void table_defer_purge(Table *table);    // 把提交了的删除记成一批待清除的删除
+void table_reclaim_deleted(Table *table, uint32_t key);    // 从树中删掉写者删除了又要重新插入的行
+int compare_rows_by_id(const void *a, const void *b);    // 按id比较两个行
+ExecuteResult execute_select(Statement *statement, Table *table, OutputBuffer *output, bool own_writes);    // 执行查询语句
+void execute_aggregate(Statement *statement, Table *table, OutputBuffer *output, uint64_t snapshot);    // 执行聚合查询
+void statement_key_range(Statement *statement, uint32_t *start_key, uint32_t *end_key);    // 获取查询条件限定的id区间
+bool row_matches(Statement *statement, void *source);    // 判断行是否满足字符串条件
+void scan_range(Statement *statement, Table *table, uint32_t start_key, uint32_t end_key, uint64_t snapshot, OutputBuffer *output, AggregateState *aggregate);    // 扫描一段键
+bool table_last_key(Table *table, uint32_t start_key, uint32_t end_key, uint64_t snapshot, uint32_t *key);    // 查找区间中快照能看到的最大的键
+void aggregate_keys(AggregateState *aggregate, void *node, uint32_t start, uint32_t end);    // 把叶子节点中一段连续的键累加到聚合结果
+void aggregate_merge(AggregateState *destination, AggregateState *source);    // 合并后一个区间的聚合结果
+void write_aggregates(OutputBuffer *output, Statement *statement, AggregateState *aggregate);    // 把聚合结果写到输出缓冲区
+bool parallel_scan(Statement *statement, Table *table, uint32_t start_key, uint32_t end_key, uint64_t snapshot, OutputBuffer *output, AggregateState *aggregate);    // 并行扫描一段键
+bool parallel_scan_next(ParallelScan *scan);    // 领取并扫描下一个区间
+uint32_t parallel_scan_merge(ParallelScan *scan, OutputBuffer *output, uint32_t merged, bool wait);    // 按顺序写出扫描完的区间
+void* parallel_scan_worker(void *argument);    // 并行扫描的线程
+WorkerPool *new_worker_pool(uint32_t num_threads);    // 创建线程池
+void worker_pool_submit(WorkerPool *pool, PoolJob *job, void *(*function)(void *), void *argument, uint32_t num_threads);    // 请求池中的线程执行函数
+void worker_pool_finish(WorkerPool *pool, PoolJob *job);    // 取消任务还没有开始的部分，等待已经开始的线程执行完
+void* worker_pool_thread(void *argument);    // 线程池中的线程
+void close_worker_pool(WorkerPool *pool);    // 关闭线程池
+ExecuteResult execute_transaction(Statement *statement, Database *database, StatementCache *cache);    // 执行事务语句
+void transaction_rollback(Database *database, StatementCache *cache);    // 回滚会话打开的事务
+void database_version_commit(Database *database);    // 提交所有表的写者版本
+ExecuteResult execute_statement(Statement *statement, Database *database, StatementCache *cache, OutputBuffer *output);    // 执行语句
+Database* db_open(const char *filename, DbOptions *options);    // 打开数据库
+uint32_t* catalog_format_version(void *node);    // 获取目录页中的文件格式版本
+uint32_t* catalog_num_tables(void *node);    // 获取目录页中的表数量
+uint32_t* catalog_purge_head(void *node);    // 获取目录页中待清除列表的第一页
+uint32_t* purge_node_num_entries(void *node);    // 获取待清除列表页中的项数
+uint32_t* purge_node_entry(void *node, uint32_t entry_num);    // 获取待清除列表页中的一项
+void* catalog_table(void *node, uint32_t slot);    // 获取目录页中的表项
+void* catalog_column(void *entry, uint32_t column);    // 获取表项中的列项
+void initialize_catalog(void *node);    // 初始化目录页
+void catalog_write_table(Table *table);    // 把表写到目录页中它的表项
+bool catalog_format_supported(Pager *pager);    // 判断数据库文件的格式是否支持
+void default_table_layout(RowLayout *layout);    // 默认表的列
+bool row_layout_add(RowLayout *layout, const char *name, ColumnType type, uint32_t size);    // 在布局的最后加一列
+Table* table_new(Database *database, uint32_t slot, const char *name, uint32_t root_page_num, RowLayout *layout);    // 创建内存中的表
+Table* table_open(Database *database, uint32_t slot);    // 按目录页中的表项打开表
+Table* table_create(Database *database, const char *name, RowLayout *layout);    // 新建一个空表
+void database_add_table(Database *database, Table *table);    // 让准备语句时能找到表
+Table* database_find_table(Database *database, const char *name);    // 按名字查找表
+ExecuteResult execute_create_table(Statement *statement, Database *database);    // 执行建表语句
+Pager* pager_open(const char *filename, DbOptions *options);    // 打开分页器
 void pager_flush(Pager *pager, uint32_t page_num);    // 刷新分页器
-void* get_page(Pager *pager, uint32_t page_num);    // 获取页
-void db_close(Table *table);    // 关闭数据库
-InputBuffer *new_input_buffer();    // 创建输入缓冲区
-void print_prompt();    // 打印提示符
-void read_input(InputBuffer *input_buffer);    // 读取输入
+void pager_commit(Pager *pager);    // 提交所有脏页到预写日志
+void pager_sync(Pager *pager);    // 把已提交的日志同步到磁盘
+void pager_checkpoint(Pager *pager);    // 检查点，把日志中的页写回数据库文件
+void pager_write_pages(Pager *pager, uint32_t *entries, uint32_t num_entries);    // 把日志中的页写回数据库文件
+void pager_compress_open(Pager *pager);    // 打开压缩格式的数据库文件
+PageSlot *pager_slot(Pager *pager, uint32_t page_num);    // 查找页在压缩文件中的槽
+bool pager_read_slot(Pager *pager, uint32_t page_num, void *data, uint8_t *buffer);    // 从压缩文件中读取页
+void compress_write(Pager *pager, const void *data, size_t length, off_t offset);    // 写压缩文件
+void pager_write_slots(Pager *pager, uint32_t *entries, uint32_t num_entries);    // 把日志中的页压缩后写回压缩文件
+void pager_compact(Pager *pager);    // 重写压缩文件
+void pager_truncate(Pager *pager, uint32_t num_pages);    // 截断数据库文件
+void pager_begin(Pager *pager);    // 开始显式事务
+void pager_rollback(Pager *pager);    // 回滚显式事务
+void undo_save(Pager *pager, uint32_t page_num, void *page);    // 把页原来的内容保存到撤销缓冲区
+void undo_clear(Pager *pager);    // 清空撤销缓冲区
+void wal_open(Pager *pager, const char *filename);    // 打开预写日志并恢复
+void wal_reset(Pager *pager);    // 清空预写日志
+void wal_append_frames(Pager *pager, uint32_t *page_nums, void **pages, uint32_t num_frames, uint32_t commit);    // 追加帧到预写日志
+void pager_map_open(Pager *pager);    // 建立数据库文件的内存映射
+void pager_map_file(Pager *pager);    // 把数据库文件重新映射到预留空间的开头
+void pager_map_grow(Pager *pager, uint32_t min_pages);    // 扩展内存映射
+void* pager_clean_page(Pager *pager, uint32_t page_num);    // 获取内存中和日志一致的页
+void pager_advise_sequential(Pager *pager, bool sequential);    // 提示接下来是顺序扫描
+void pager_prefetch(Pager *pager, uint32_t page_num);    // 提前读取页
+uint32_t wal_checksum(WalFrameHeader *header, void *data);    // 计算帧的校验和
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);    // 计算CRC32C
+#if defined(__x86_64__)
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t *bytes, size_t length);    // 用SSE4.2的crc32指令计算CRC32C
+#endif
+uint32_t page_checksum(void *page);    // 计算页的校验和
+bool page_checksum_valid(void *page);    // 验证页的校验和
+bool pager_read_page(Pager *pager, uint32_t page_num, void *data, uint8_t *buffer);    // 从日志或数据库文件中读取页
+uint32_t lz4_compress(const uint8_t *source, uint32_t length, uint8_t *destination, uint32_t capacity);    // 用LZ4块格式压缩
+int32_t lz4_decompress(const uint8_t *source, uint32_t length, uint8_t *destination, uint32_t capacity);    // 解压LZ4块格式的数据
+uint32_t wal_index_find(Pager *pager, uint32_t page_num);    // 在日志索引中查找页的最新帧
+void wal_index_put(Pager *pager, uint32_t page_num, uint32_t frame_num);    // 更新日志索引
+bool input_pending(InputBuffer *input_buffer);    // 是否还有待处理的输入
+void* get_page(Pager *pager, uint32_t page_num);    // 获取页并固定
+void unpin_page(Pager *pager, uint32_t page_num);    // 取消固定页
+void pager_mark_dirty(Pager *pager, uint32_t page_num);    // 标记页已被修改
+void page_latch_init(PageLatch *latch);    // 初始化页锁
+PageLatch* pager_latch(Pager *pager, uint32_t page_num, void *page);    // 获取页的页锁
+void* page_latch_shared(Pager *pager, uint32_t page_num);    // 固定页并加共享锁
+void* page_latch_next(Pager *pager, uint32_t page_num, uint32_t next_page_num);    // 锁耦合：锁住下一个页再释放当前页
+void page_unlatch_shared(Pager *pager, uint32_t page_num);    // 释放共享锁并取消固定
+int compare_frames_by_page_num(const void *a, const void *b);    // 按页号比较两个帧
+int compare_uint32(const void *a, const void *b);    // 比较两个 uint32
+int compare_uint32_pairs(const void *a, const void *b);    // 按第一个元素比较两个 uint32 对
+Frame* pager_lookup(Pager *pager, uint32_t page_num);    // 在页表中查找页所在的帧
+Frame* pager_evict(Pager *pager);    // 淘汰一个帧
+uint32_t page_table_bucket(Pager *pager, uint32_t page_num);    // 计算页号在页表中的桶
+void page_table_remove(Pager *pager, Frame *frame);    // 把帧从页表中移除
+void db_close(Database *database);    // 关闭数据库
+InputBuffer *new_input_buffer(int fd, bool framed);    // 创建输入缓冲区
+void print_prompt(OutputBuffer *output);    // 打印提示符
+bool read_input(InputBuffer *input_buffer);    // 读取一条语句
+bool input_next_statement(InputBuffer *input_buffer);    // 从读缓冲区中取出一条完整的语句
+bool input_find_statement(InputBuffer *input_buffer, size_t *offset, size_t *length, size_t *consumed);    // 在读缓冲区中查找完整的语句
+bool input_has_statement(InputBuffer *input_buffer);    // 读缓冲区中是否有完整的语句
+bool input_fill(InputBuffer *input_buffer);    // 读取更多数据到读缓冲区
+void frame_header_encode(uint8_t *header, uint32_t length);    // 写入帧头
+uint32_t frame_header_decode(const uint8_t *header);    // 读取帧头
 void close_input_buffer(InputBuffer *input_buffer);    // 关闭输入缓冲区
+OutputBuffer *new_output_buffer(int fd, bool framed);    // 创建输出缓冲区
+void output_write(OutputBuffer *output, const char *data, size_t length);    // 写入输出缓冲区
+void output_printf(OutputBuffer *output, const char *format, ...);    // 格式化写入输出缓冲区
+void output_uint32(OutputBuffer *output, uint32_t value);    // 把整数写入输出缓冲区
+void output_uint64(OutputBuffer *output, uint64_t value);    // 把64位整数写入输出缓冲区
+void output_reserve(OutputBuffer *output, size_t length);    // 保证输出缓冲区有足够的空间
+void output_begin_response(OutputBuffer *output);    // 开始一条语句的结果
+void output_end_response(OutputBuffer *output);    // 结束一条语句的结果
+void output_flush(OutputBuffer *output);    // 把输出缓冲区写出
+void close_output_buffer(OutputBuffer *output);    // 关闭输出缓冲区
+_Noreturn void fatal_error(const char *format, ...);    // 打印错误信息并退出程序
+bool process_input(InputBuffer *input_buffer, Database *database, StatementCache *cache, Statement *statement, OutputBuffer *output);    // 处理一条输入
+void run_server(Database *database, const char *socket_path, uint32_t port, uint32_t num_workers);    // 以服务器模式运行
+int server_listen(Server *server, int domain, struct sockaddr *address, socklen_t address_length);    // 创建监听套接字
+void server_accept(Server *server, int listen_fd);    // 接受新连接
+void server_watch(Server *server, Connection *connection, uint32_t events);    // 更新连接在 epoll 中关注的事件
+void server_close(Server *server, Connection *connection);    // 关闭连接
+void connection_process(Database *database, Connection *connection);    // 执行连接收到的完整语句
+void server_dispatch(Server *server, Connection *connection);    // 把连接交给工作线程执行
+void* server_worker(void *argument);    // 工作线程
+int client_connect(const char *socket_path, uint32_t port);    // 连接服务器
+bool client_send(int fd, const char *statement, uint32_t length);    // 向服务器发送一条语句
+bool client_receive(int fd, char **response, uint32_t *length, uint32_t *capacity);    // 接收一条语句的结果
+bool write_fully(int fd, const void *data, size_t length);    // 写出全部数据
+bool read_fully(int fd, void *data, size_t length);    // 读取指定长度的数据
+void run_client(const char *socket_path, uint32_t port, bool batch);    // 以客户端模式运行
 
-Cursor *table_start(Table *table);    // 获取表的起始游标
-Cursor *table_end(Table *table);    // 获取表的结束游标
+Cursor *table_find(Table *table, uint32_t key);    // 查找键所在位置的游标
+uint32_t leaf_node_search(void *node, uint32_t key);    // 二分查找键所在的单元格
+Cursor *leaf_node_find(Table *table, uint32_t page_num, void *node, uint32_t key);    // 在叶子节点中查找键
+Cursor *internal_node_find(Table *table, uint32_t page_num, void *node, uint32_t key);    // 在内部节点中查找键
 void *cursor_value(Cursor *cursor);    // 获取游标指向的行地址
+uint32_t cursor_key(Cursor *cursor);    // 获取游标指向的键
 void cursor_advance(Cursor *cursor);    // 游标前进
+void cursor_close(Cursor *cursor);    // 释放游标
+void cursor_snapshot(Cursor *cursor, uint64_t snapshot);    // 把游标转为快照游标
+void cursor_copy_leaf(Cursor *cursor, uint32_t page_num, void *node);    // 把加了共享锁的叶子节点复制到快照游标
+void cursor_skip_leaves(Cursor *cursor);    // 快照游标跳过已经读完的叶子节点
+RangeCursor *range_cursor_open(Table *table, uint32_t start_key, uint32_t end_key, uint64_t snapshot);    // 打开区间游标
+void *range_cursor_value(RangeCursor *range);    // 获取区间游标指向的行地址
+void range_cursor_advance(RangeCursor *range);    // 区间游标前进
+void range_cursor_close(RangeCursor *range);    // 释放区间游标
 
 uint32_t* leaf_node_num_cells(void *node);    // 获取叶子节点中单元格数量
-void* leaf_node_cell(void *node, uint32_t cell_num);    // 获取叶子节点中的单元格
+uint32_t* leaf_node_next_leaf(void *node);    // 获取下一个叶子节点页号
+uint16_t* leaf_node_heap_start(void *node);    // 获取叶子节点中堆的起始位置
+void* leaf_node_cell(void *node, uint32_t cell_num);    // 获取叶子节点中的单元格（槽）
 uint32_t* leaf_node_key(void *node, uint32_t cell_num);    // 获取叶子节点中单元格的键
+uint16_t* leaf_node_value_offset(void *node, uint32_t cell_num);    // 获取叶子节点中单元格的值在页中的偏移
+uint16_t* leaf_node_value_length(void *node, uint32_t cell_num);    // 获取叶子节点中单元格的值的长度
 void* leaf_node_value(void *node, uint32_t cell_num);    // 获取叶子节点中单元格的值
+uint32_t leaf_node_free_space(void *node);    // 获取叶子节点中的空闲空间
+uint32_t leaf_node_upper_bound(void *node, uint32_t cell_num, uint32_t key);    // 查找叶子节点中第一个大于键的单元格
+void* leaf_node_allocate_cell(void *node, uint32_t cell_num, uint32_t key, uint32_t value_length);    // 在叶子节点中分配单元格
 void initialize_leaf_node(void *node);    // 初始化叶子节点
 void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value);    // 插入叶子节点
+void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value);    // 分裂叶子节点并插入
+uint32_t leaf_node_batch_end(Pager *pager, void *node, Row *rows, uint32_t start, uint32_t num_rows);    // 查找一批有序的行中属于叶子节点的部分
+uint32_t leaf_node_insert_batch(Table *table, uint32_t page_num, Row *rows, uint32_t num_rows);    // 把一批有序的行插入叶子节点
+uint32_t leaf_node_used_space(void *node);    // 获取叶子节点中单元格占用的空间
+void leaf_node_append_cells(void *node, void *source, bool *skip);    // 把叶子节点副本中的单元格追加到叶子节点末尾
+uint32_t table_find_leaf(Table *table, uint32_t key);    // 查找键所在的叶子节点
+Cursor *table_find_for_write(Table *table, uint32_t key);    // 查找写者插入键的位置
+uint32_t leaf_node_previous(Table *table, uint32_t page_num);    // 查找前一个叶子节点
+void leaf_node_rebalance(Table *table, uint32_t page_num);    // 删除后检查叶子节点是否太空
+void leaf_node_merge(Table *table, uint32_t parent_page_num, uint32_t index);    // 合并两个相邻的叶子节点
+
+NodeType get_node_type(void *node);    // 获取节点类型
+void set_node_type(void *node, NodeType type);    // 设置节点类型
+bool is_node_root(void *node);    // 判断是否为根节点
+void set_node_root(void *node, bool is_root);    // 设置是否为根节点
+uint32_t* node_parent(void *node);    // 获取父节点页号
+uint32_t* node_checksum(void *node);    // 获取页的校验和
+uint32_t get_node_max_key(Pager *pager, void *node);    // 获取节点中的最大键
+
+uint32_t* internal_node_num_keys(void *node);    // 获取内部节点中键数量
+uint32_t* internal_node_right_child(void *node);    // 获取内部节点的最右子节点页号
+uint32_t* internal_node_cell(void *node, uint32_t cell_num);    // 获取内部节点中的单元格
+uint32_t* internal_node_child(void *node, uint32_t child_num);    // 获取内部节点中的子节点页号
+uint32_t* internal_node_key(void *node, uint32_t key_num);    // 获取内部节点中的键
+void initialize_internal_node(void *node);    // 初始化内部节点
+uint32_t internal_node_find_child(void *node, uint32_t key);    // 查找键所在的子节点下标
+void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key);    // 更新内部节点中的键
+void internal_node_insert(Table *table, uint32_t parent_page_num, uint32_t child_page_num);    // 向内部节点插入子节点
+void internal_node_split_and_insert(Table *table, uint32_t parent_page_num, uint32_t child_page_num);    // 分裂内部节点并插入
+void create_new_root(Table *table, uint32_t right_child_page_num);    // 创建新的根节点
+uint32_t internal_node_child_index(void *node, uint32_t child_page_num);    // 查找子节点在内部节点中的下标
+void internal_node_remove_child(Table *table, uint32_t page_num, uint32_t index);    // 从内部节点中去掉一个子节点
+void internal_node_rebalance(Table *table, uint32_t page_num);    // 去掉子节点后检查内部节点是否太空
+void internal_node_merge(Table *table, uint32_t parent_page_num, uint32_t index);    // 合并两个相邻的内部节点
+void collapse_root(Table *table);    // 降低树的层数
+uint32_t get_unused_page_num(Pager *pager);    // 获取未使用的页号
+uint32_t pager_allocate_page(Pager *pager);    // 分配一个新页
+void database_free_page(Database *database, uint32_t page_num);    // 释放一个页
+void database_fence_pages(Database *database);    // 把语句释放的页记成一批
+void database_release_pages(Database *database);    // 把已经没有查询会读到的页加到空闲页链表
+void database_add_purge_batch(Database *database, Table *table, uint32_t *keys, uint32_t num_keys, uint64_t guard);    // 添加一批待清除的删除
+void database_purge_deleted(Database *database);    // 把已经没有快照能看到的删除从树中删掉
+void database_write_purge_list(Database *database);    // 把待清除的删除写到待清除列表
+void database_load_purge_list(Database *database);    // 打开数据库时读入待清除列表
+uint32_t table_depth(Table *table);    // 获取树的层数
+uint32_t* table_split_keys(Table *table, uint32_t start_key, uint32_t end_key, uint32_t max_keys, uint32_t *num_keys);    // 按内部节点中的键把一段键切成区间
+void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level, OutputBuffer *output);    // 打印树
+
+void do_vacuum(Database *database, OutputBuffer *output);    // 整理数据库文件
+void vacuum_mark(Pager *pager, uint32_t page_num, bool *used);    // 标记一棵树用到的页
+void vacuum_translate(void *node, uint32_t *new_page_nums, uint32_t num_pages);    // 改写节点中指向其他页的页号
+void do_check(Database *database, OutputBuffer *output);    // 检查数据库文件的完整性
+void check_tree(IntegrityCheck *check, uint32_t root_page_num, NodeType type, uint32_t num_threads);    // 一层一层地检查一棵树
+void check_level(IntegrityCheck *check, uint32_t level_size, uint32_t num_threads);    // 并行检查树的一层
+void* check_worker(void *argument);    // 完整性检查的线程
+void check_page(IntegrityCheck *check, CheckItem *item, CheckChunk *chunk, void *page, uint8_t *buffer, IndexEntry *entries);    // 检查一个页并记下它的子节点
+void check_table_node(IntegrityCheck *check, CheckItem *item, CheckChunk *chunk, void *node);    // 检查表的树中的节点
+void check_index_node(IntegrityCheck *check, CheckItem *item, CheckChunk *chunk, void *node, IndexEntry *entries);    // 检查索引树中的节点
+void check_add_child(IntegrityCheck *check, CheckChunk *chunk, CheckItem *parent, uint32_t page_num, CheckItem *child);    // 把子节点放进下一层
+bool check_reference(IntegrityCheck *check, uint32_t from_page_num, uint32_t page_num);    // 记下对一个页的引用
+void check_problem(IntegrityCheck *check, uint32_t page_num, const char *format, ...);    // 记下一个问题
+int compare_check_problems(const void *a, const void *b);    // 按页号比较两个问题
+int compare_index_bound(IndexEntry *entry, uint8_t *bound);    // 比较索引项和编码后的界
+void do_import(Table *table, const char *filename, uint32_t fill_factor, OutputBuffer *output);    // 批量导入并打印结果
+ImportResult table_import(Table *table, const char *filename, uint32_t fill_factor, uint64_t *num_rows);    // 批量导入
+bool import_parse_line(RowLayout *layout, char *line, Row *row);    // 解析导入文件中的一行
+int compare_records_by_key(const void *a, const void *b);    // 按键比较两个序列化的行
+FILE* import_write_run(RowLayout *layout, uint8_t **records, uint32_t num_records);    // 把一个有序段写到临时文件
+bool import_run_next(ImportRun *run, RowLayout *layout);    // 读取有序段中的下一行
+void bulk_loader_init(BulkLoader *loader, Table *table, uint32_t fill_factor);    // 初始化批量建树器
+bool bulk_loader_add(BulkLoader *loader, void *record, uint32_t length);    // 向批量建树器加入一行
+uint32_t bulk_loader_new_page(BulkLoader *loader);    // 为批量建树分配新页
+void bulk_loader_start_node(BulkLoader *loader, uint32_t level);    // 开始填充某一层的新节点
+uint32_t bulk_loader_add_child(BulkLoader *loader, uint32_t level, uint32_t child_page_num, uint32_t child_max_key);    // 把子节点加到某一层
+void bulk_loader_write_node(BulkLoader *loader, uint32_t level);    // 把某一层填充好的节点写到页里
+void bulk_loader_finish(BulkLoader *loader);    // 写出所有节点，把最上层的节点放到根节点
+void bulk_loader_free(BulkLoader *loader);    // 释放批量建树器
+
+void version_store_init(VersionStore *store);    // 初始化版本存储
+void version_store_free(VersionStore *store);    // 释放版本存储
+uint64_t snapshot_begin(Table *table);    // 开始一个快照
+void snapshot_end(Table *table, uint64_t snapshot);    // 结束一个快照
+void version_record(Table *table, uint32_t key);    // 记录写者正在插入的行
+void version_delete(Table *table, uint32_t key);    // 记录写者正在删除的行
+void version_clear_deleted(Table *table);    // 清除删除标记
+bool version_deleted_by_writer(Table *table, uint32_t key);    // 判断键是否被写者还没提交的删除标记了
+void version_undelete(Table *table, uint32_t key);    // 去掉写者对一个键的删除
+bool version_delete_pending(Table *table, uint32_t key);    // 判断键的删除是否已经提交、行还留在树中
+void version_purged(Table *table, uint32_t *keys, uint32_t num_keys);    // 删除的行已经从树中删掉
+RowVersion* version_append(VersionStore *store, uint32_t key);    // 在版本存储末尾追加一个行版本
+void version_commit(Table *table);    // 提交写者的版本
+void version_collect(VersionStore *store);    // 回收所有快照都能看到的行版本
+void version_store_grow(VersionStore *store);    // 扩大版本存储
+RowVersion* version_find(VersionStore *store, uint32_t key);    // 查找键最新的行版本
+bool version_visible(Table *table, uint32_t key, uint64_t snapshot);    // 判断快照能否看到键所在的行
+bool row_version_visible(RowVersion *version, uint64_t snapshot);    // 判断快照能否看到行版本对应的行
+uint32_t version_filter_leaf(Table *table, void *node, uint64_t snapshot, uint32_t cell_num);    // 从叶子节点副本中去掉快照看不到的行
+uint16_t* index_node_num_cells(void *node);    // 获取索引节点中单元格数量
+uint32_t* index_node_next(void *node);    // 获取索引节点的下一个页号
+uint16_t* index_node_prefix_length(void *node);    // 获取索引节点公共前缀的长度
+uint8_t* index_node_cells(void *node, IndexEntry *entry);    // 读取索引节点的公共前缀
+uint8_t* index_node_read_cell(void *node, uint8_t *cell, IndexEntry *entry);    // 读取索引节点中的一个单元格
+int compare_index_key(const char *a, uint32_t a_length, uint32_t a_id, const char *b, uint32_t b_length, uint32_t b_id);    // 比较两个索引键
+int compare_index_records(const void *a, const void *b);    // 按索引键比较两条建索引的记录
+uint32_t index_common_prefix(IndexEntry *a, IndexEntry *b);    // 计算两个索引项的公共前缀长度
+uint32_t index_node_size(IndexEntry *entries, uint32_t num_entries, bool internal);    // 计算索引项编码成一个节点后的大小
+void index_node_encode(void *node, bool internal, IndexEntry *entries, uint32_t num_entries, uint32_t next_leaf);    // 把索引项编码成一个节点
+uint32_t index_node_decode(void *node, IndexEntry *entries);    // 把索引节点解码成索引项
+uint32_t index_node_find(void *node, const char *string, uint32_t length, uint32_t id, uint32_t *child, uint8_t **position);    // 在索引节点中查找第一个不小于键的单元格
+bool index_leaf_insert_cell(void *node, const char *string, uint32_t length, uint32_t id);    // 直接在索引叶子节点中插入单元格
+uint32_t index_split(IndexEntry *entries, uint32_t start, uint32_t end, bool internal, uint32_t *ends, uint32_t num_pieces);    // 把放不下的索引项对半分成能放进节点的几段
+void index_insert(Table *table, uint32_t root_page_num, const char *string, uint32_t length, uint32_t id);    // 把键插入索引
+void index_insert_row(Table *table, Row *row);    // 把行加到所有索引
+void index_delete(Table *table, uint32_t root_page_num, const char *string, uint32_t length, uint32_t id);    // 从索引中删除键
+void index_delete_row(Table *table, void *source);    // 把行从所有索引中删除
+ExecuteResult execute_create_index(Statement *statement, Table *table);    // 执行建索引语句
+void index_build(Table *table, uint32_t column, uint32_t root_page_num);    // 用表中所有的行建索引
+IndexEntry* index_build_level(Pager *pager, uint8_t **records, IndexEntry *entries, uint32_t num_entries, bool internal, uint32_t *num_parents);    // 按顺序把索引项装进一层节点
+uint32_t* index_lookup(Table *table, uint32_t root_page_num, const char *string, uint32_t length, bool prefix, uint32_t *num_ids);    // 在索引中查找字符串等于值或者以值开头的行
+bool index_select(Statement *statement, Table *table, uint64_t snapshot, OutputBuffer *output, AggregateState *aggregate);    // 通过索引执行字符串条件的查询
+PrepareResult prepare_create_index(InputBuffer *input_buffer, Database *database, Statement *statement);    // 准备建索引语句
 
 /**
- * 序列化行
+ * 计算行序列化后的大小
  * @param source 源行
- * @param destination 目标地址
+ * @return 序列化后的字节数
  */
-void serialize_row(Row *source, void *destination)
+uint32_t row_serialized_size(Row *source)
 {
-    memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-    memcpy(destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-    memcpy(destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
+    return source->length;
 }
 
 /**
- * 反序列化行
- * @param source 源地址
- * @param destination 目标行
+ * 获取序列化的行的大小
+ * 整数列的大小是固定的，只需要跳过所有字符串列
+ * @param layout 行的布局
+ * @param source 序列化的行
+ * @return 字节数
  */
-void deserialize_row(void *source, Row *destination)
+uint32_t row_size(RowLayout *layout, void *source)
 {
-    memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-    memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+    uint8_t *position = source + layout->fixed_size;
+    for(uint32_t i = 0; i < layout->num_strings; i++)
+    {
+        position += STRING_LENGTH_SIZE + *position;
+    }
+
+    return position - (uint8_t *)source;
 }
 
 /**
- * 获取游标指向的行地址
- * @param cursor 游标
- * @return 行地址
+ * 序列化行
+ * 行在准备语句时已经序列化好了，目标地址至少要有 row_serialized_size 字节
+ * @param source 源行
+ * @param destination 目标地址
  */
-void *cursor_value(Cursor *cursor)
+void serialize_row(Row *source, void *destination)
 {
-    uint32_t page_num = cursor->page_num;
-    void *page = get_page(cursor->table->pager, page_num);
-
-    return leaf_node_cell(page, cursor->cell_num);
+    memcpy(destination, source->data, source->length);
 }
 
 /**
- * 游标前进
+ * 初始化要插入的行
+ * 整数列都是0，字符串列都是空字符串，之后逐列填入值
+ * @param layout 行的布局
+ * @param row 行
+ */
+void row_init(RowLayout *layout, Row *row)
+{
+    row->id = 0;
+    row->length = layout->fixed_size + layout->num_strings * STRING_LENGTH_SIZE;
+    memset(row->data, 0, row->length);
+}
+
+/**
+ * 设置要插入的行中的整数列
+ * 第一列是键，同时更新 Row 的 id
+ * @param layout 行的布局
+ * @param row 行
+ * @param column 列号
+ * @param value 值
+ */
+void row_set_int(RowLayout *layout, Row *row, uint32_t column, int32_t value)
+{
+    memcpy(row->data + layout->columns[column].offset, &value, INT_COLUMN_SIZE);
+    if(column == 0)
+    {
+        row->id = (uint32_t)value;
+    }
+}
+
+/**
+ * 设置要插入的行中的字符串列
+ * 新值和旧值长度不同时，把后面的字符串列整体移动
+ * @param layout 行的布局
+ * @param row 行
+ * @param column 列号
+ * @param value 值
+ * @param length 值的长度，调用者保证不超过列的最大长度
+ */
+void row_set_string(RowLayout *layout, Row *row, uint32_t column, const char *value, uint32_t length)
+{
+    uint32_t old_length;
+    uint8_t *position = (uint8_t *)row_string(layout, row->data, column, &old_length) - STRING_LENGTH_SIZE;
+    uint8_t *tail = position + STRING_LENGTH_SIZE + old_length;
+    memmove(tail + length - old_length, tail, row->data + row->length - tail);
+    row->length += length - old_length;
+    *position = length;
+    memcpy(position + STRING_LENGTH_SIZE, value, length);
+}
+
+/**
+ * 直接从序列化的行中读取id
+ * 行在页中不一定按4字节对齐，所以用 memcpy 读取
+ * @param source 序列化的行
+ * @return id
+ */
+uint32_t row_id(void *source)
+{
+    uint32_t id;
+    memcpy(&id, source + ID_OFFSET, ID_SIZE);
+    return id;
+}
+
+/**
+ * 直接从序列化的行中读取整数列
+ * @param layout 行的布局
+ * @param source 序列化的行
+ * @param column 列号
+ * @return 值
+ */
+int32_t row_int(RowLayout *layout, void *source, uint32_t column)
+{
+    int32_t value;
+    memcpy(&value, source + layout->columns[column].offset, INT_COLUMN_SIZE);
+    return value;
+}
+
+/**
+ * 直接从序列化的行中读取字符串列
+ * 返回的指针指向页中的数据，不需要复制；字符串没有结束符，长度通过 length 返回。
+ * 第一个字符串列在固定的偏移量上，后面的字符串列要先跳过前面的
+ * @param layout 行的布局
+ * @param source 序列化的行
+ * @param column 列号
+ * @param length 字符串长度
+ * @return 字符串
+ */
+char* row_string(RowLayout *layout, void *source, uint32_t column, uint32_t *length)
+{
+    Column *definition = &(layout->columns[column]);
+    uint8_t *position = source + definition->offset;
+    for(uint32_t i = 0; i < definition->skip; i++)
+    {
+        position += STRING_LENGTH_SIZE + *position;
+    }
+    *length = *position;
+    return (char *)(position + STRING_LENGTH_SIZE);
+}
+
+/**
+ * 计算行的布局
+ * 列的名字、类型和最大长度已经填好，算出每一列的位置和行的最大大小
+ * @param layout 行的布局
+ */
+void row_layout_compute(RowLayout *layout)
+{
+    uint32_t num_ints = 0;
+    for(uint32_t i = 0; i < layout->num_columns; i++)
+    {
+        if(layout->columns[i].type == COLUMN_INT)
+        {
+            layout->columns[i].offset = ID_OFFSET + num_ints * INT_COLUMN_SIZE;
+            layout->columns[i].size = INT_COLUMN_SIZE;
+            layout->columns[i].skip = 0;
+            num_ints++;
+        }
+    }
+
+    layout->fixed_size = num_ints * INT_COLUMN_SIZE;
+    layout->num_strings = 0;
+    layout->max_size = layout->fixed_size;
+    for(uint32_t i = 0; i < layout->num_columns; i++)
+    {
+        if(layout->columns[i].type == COLUMN_VARCHAR)
+        {
+            layout->columns[i].offset = layout->fixed_size;
+            layout->columns[i].skip = layout->num_strings++;
+            layout->max_size += STRING_LENGTH_SIZE + layout->columns[i].size;
+        }
+    }
+}
+
+/**
+ * 按名字查找列
+ * @param layout 行的布局
+ * @param name 列名
+ * @return 列号，没有这一列时返回 -1
+ */
+int32_t row_layout_find(RowLayout *layout, const char *name)
+{
+    for(uint32_t i = 0; i < layout->num_columns; i++)
+    {
+        if(strcmp(layout->columns[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * 获取游标指向的行地址
+ * 游标一直固定着所在的叶子节点（快照游标读的是副本），所以返回的地址在游标移动到其他页之前都有效
  * @param cursor 游标
+ * @return 行地址
  */
-void cursor_advance(Cursor *cursor)
+void *cursor_value(Cursor *cursor)
+{
+    return leaf_node_value(cursor->node, cursor->cell_num);
+}
+
+/**
+ * 获取游标指向的键
+ * 键在槽数组中，不需要访问行
+ * @param cursor 游标
+ * @return 键
+ */
+uint32_t cursor_key(Cursor *cursor)
 {
-    uint32_t page_num = cursor->page_num;
-    void *node = get_page(cursor->table->pager, page_num);
+    return *leaf_node_key(cursor->node, cursor->cell_num);
+}
 
+/**
+ * 游标前进
+ * 只有快照游标可以前进，游标指向的单元格必须有效
+ * @param cursor 快照游标
+ */
+void cursor_advance(Cursor *cursor)
+{
     cursor->cell_num += 1;
-    if(cursor->cell_num >= (*leaf_node_num_cells(node)))
+    cursor_skip_leaves(cursor);
+}
+
+/**
+ * 释放游标
+ * 释放游标在所在叶子节点上的共享锁和固定（快照游标释放副本），并释放游标内存空间
+ * @param cursor 游标
+ */
+void cursor_close(Cursor *cursor)
+{
+    if(cursor->copy != NULL)
+    {
+        free(cursor->copy);
+    }
+    else if(cursor->latched)
+    {
+        page_unlatch_shared(cursor->table->pager, cursor->page_num);
+    }
+    else
+    {
+        unpin_page(cursor->table->pager, cursor->page_num);
+    }
+    free(cursor);
+}
+
+/**
+ * 把游标转为快照游标
+ * 游标必须持有叶子节点的共享锁；如果游标位置在过滤后的叶子节点末尾之后，移动到下一个叶子节点
+ * @param cursor 游标
+ * @param snapshot 快照
+ */
+void cursor_snapshot(Cursor *cursor, uint64_t snapshot)
+{
+    cursor->copy = malloc(PAGE_SIZE);
+    cursor->snapshot = snapshot;
+    cursor_copy_leaf(cursor, cursor->page_num, cursor->node);
+    cursor_skip_leaves(cursor);
+}
+
+/**
+ * 把加了共享锁的叶子节点复制到快照游标
+ * 复制完马上释放共享锁和固定，再从副本中去掉快照看不到的行；之后游标只读副本，扫描再慢也不会挡住写者
+ * @param cursor 快照游标，cell_num 是副本过滤前的位置
+ * @param page_num 叶子节点页号
+ * @param node 叶子节点，调用者持有它的共享锁
+ */
+void cursor_copy_leaf(Cursor *cursor, uint32_t page_num, void *node)
+{
+    memcpy(cursor->copy, node, PAGE_SIZE);
+    page_unlatch_shared(cursor->table->pager, page_num);
+    cursor->page_num = page_num;
+    cursor->node = cursor->copy;
+    cursor->latched = false;
+    cursor->cell_num = version_filter_leaf(cursor->table, cursor->copy, cursor->snapshot, cursor->cell_num);
+}
+
+/**
+ * 快照游标跳过已经读完的叶子节点
+ * 副本中的下一个叶子节点页号可能已经过时：之后当前节点又分裂出的右兄弟节点里，
+ * 要么是已经复制过的行，要么是快照开始以后才插入的行，跳过它不会漏掉快照能看到的行
+ * @param cursor 快照游标
+ */
+void cursor_skip_leaves(Cursor *cursor)
+{
+    Pager *pager = cursor->table->pager;
+    cursor->end_of_table = false;
+    while(cursor->cell_num >= *leaf_node_num_cells(cursor->node))
+    {
+        uint32_t next_page_num = *leaf_node_next_leaf(cursor->node);
+        if(next_page_num == INVALID_PAGE_NUM)
+        {
+            cursor->end_of_table = true;
+            return;
+        }
+
+        cursor->cell_num = 0;
+        cursor_copy_leaf(cursor, next_page_num, page_latch_shared(pager, next_page_num));
+
+        // 读当前叶子节点的同时，让内核提前读取再下一个叶子节点
+        if(*leaf_node_next_leaf(cursor->node) != INVALID_PAGE_NUM)
+        {
+            pager_prefetch(pager, *leaf_node_next_leaf(cursor->node));
+        }
+    }
+}
+
+/**
+ * 打开区间游标
+ * 通过B+树查找定位到第一个不小于 start_key 的键；它可能在查找到的叶子节点末尾之后，这时移动到下一个叶子节点
+ * @param start_key 区间下界（包含）
+ * @param end_key 区间上界（包含）
+ * @param snapshot 快照
+ * @return 区间游标
+ */
+RangeCursor *range_cursor_open(Table *table, uint32_t start_key, uint32_t end_key, uint64_t snapshot)
+{
+    RangeCursor *range = (RangeCursor *)malloc(sizeof(RangeCursor));    // 分配区间游标内存空间
+    range->cursor = table_find(table, start_key);
+    range->end_key = end_key;
+    cursor_snapshot(range->cursor, snapshot);
+
+    Cursor *cursor = range->cursor;
+    range->end_of_range = (start_key > end_key) || cursor->end_of_table || cursor_key(cursor) > end_key;
+
+    return range;
+}
+
+/**
+ * 获取区间游标指向的行地址
+ * @param range 区间游标
+ * @return 行地址
+ */
+void *range_cursor_value(RangeCursor *range)
+{
+    return cursor_value(range->cursor);
+}
+
+/**
+ * 区间游标前进
+ * 键按顺序排列，第一次遇到大于上界的键时区间就结束了
+ * @param range 区间游标
+ */
+void range_cursor_advance(RangeCursor *range)
+{
+    cursor_advance(range->cursor);
+    if(range->cursor->end_of_table || cursor_key(range->cursor) > range->end_key)
     {
-        cursor->end_of_table = true;
+        range->end_of_range = true;
     }
 }
 
+/**
+ * 释放区间游标
+ * @param range 区间游标
+ */
+void range_cursor_close(RangeCursor *range)
+{
+    cursor_close(range->cursor);
+    free(range);
+}
+
 /**
  * 获取叶子节点中单元格数量
  * @param node 节点
@@ -280,14 +1763,36 @@ uint32_t* leaf_node_num_cells(void *node)
 }
 
 /**
- * 获取叶子节点中的单元格
+ * 获取下一个叶子节点页号
+ * 最右边的叶子节点没有下一个叶子节点，值为 INVALID_PAGE_NUM
+ * @param node 节点
+ * @return 下一个叶子节点页号
+ */
+uint32_t* leaf_node_next_leaf(void *node)
+{
+    return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+/**
+ * 获取叶子节点中堆的起始位置
+ * 堆从页尾向前增长，起始位置是最前面的值的偏移
+ * @param node 节点
+ * @return 堆的起始位置
+ */
+uint16_t* leaf_node_heap_start(void *node)
+{
+    return node + LEAF_NODE_HEAP_START_OFFSET;
+}
+
+/**
+ * 获取叶子节点中的单元格（槽）
  * @param node 节点
  * @param cell_num 单元格编号
  * @return 单元格
  */
 void* leaf_node_cell(void *node, uint32_t cell_num)
 {
-    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_SLOT_SIZE;
 }
 
 /**
@@ -298,7 +1803,29 @@ void* leaf_node_cell(void *node, uint32_t cell_num)
  */
 uint32_t* leaf_node_key(void *node, uint32_t cell_num)
 {
-    return leaf_node_cell(node, cell_num);
+    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_OFFSET;
+}
+
+/**
+ * 获取叶子节点中单元格的值在页中的偏移
+ * @param node 节点
+ * @param cell_num 单元格编号
+ * @return 值偏移
+ */
+uint16_t* leaf_node_value_offset(void *node, uint32_t cell_num)
+{
+    return leaf_node_cell(node, cell_num) + LEAF_NODE_VALUE_OFFSET_OFFSET;
+}
+
+/**
+ * 获取叶子节点中单元格的值的长度
+ * @param node 节点
+ * @param cell_num 单元格编号
+ * @return 值长度
+ */
+uint16_t* leaf_node_value_length(void *node, uint32_t cell_num)
+{
+    return leaf_node_cell(node, cell_num) + LEAF_NODE_VALUE_LENGTH_OFFSET;
 }
 
 /**
@@ -309,501 +1836,10793 @@ uint32_t* leaf_node_key(void *node, uint32_t cell_num)
  */
 void* leaf_node_value(void *node, uint32_t cell_num)
 {
-    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+    return node + *leaf_node_value_offset(node, cell_num);
 }
 
 /**
- * 初始化叶子节点
+ * 获取叶子节点中的空闲空间
+ * 空闲空间是槽数组末尾和堆起始位置之间的字节数，插入一个单元格需要值的长度加一个槽
  * @param node 节点
+ * @return 空闲字节数
  */
-void initialize_leaf_node(void *node)
+uint32_t leaf_node_free_space(void *node)
 {
-    *leaf_node_num_cells(node) = 0;
+    return *leaf_node_heap_start(node) - (LEAF_NODE_HEADER_SIZE + *leaf_node_num_cells(node) * LEAF_NODE_SLOT_SIZE);
 }
 
 /**
- * 插入叶子节点
- * @param cursor 游标
+ * 查找叶子节点中第一个大于键的单元格
+ * 区间扫描用它一次找出叶子节点中还在区间里的所有单元格，不需要逐个比较
+ * @param node 叶子节点
+ * @param cell_num 从这个单元格开始查找
  * @param key 键
- * @param value 值
+ * @return 单元格号，所有键都不大于 key 时是单元格数量
  */
-void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value)
+uint32_t leaf_node_upper_bound(void *node, uint32_t cell_num, uint32_t key)
 {
-    void *node = get_page(cursor->table->pager, cursor->page_num);
-
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    if(num_cells >= LEAF_NODE_MAX_CELLS)
+    uint32_t min_index = cell_num;
+    uint32_t one_past_max_index = *leaf_node_num_cells(node);
+    while(min_index != one_past_max_index)
     {
-        // 节点已满，需要分裂
+        uint32_t index = (min_index + one_past_max_index) / 2;
+        if(*leaf_node_key(node, index) <= key)
+        {
+            min_index = index + 1;
+        }
+        else
+        {
+            one_past_max_index = index;
+        }
     }
 
-    if(cursor->cell_num < num_cells)
+    return min_index;
+}
+
+/**
+ * 在叶子节点中分配单元格
+ * 在堆的前面分配值的空间，把 cell_num 及后面的槽后移一位，写入新槽；调用者保证空闲空间足够
+ * @param node 节点
+ * @param cell_num 新单元格的编号
+ * @param key 键
+ * @param value_length 值的长度
+ * @return 值的地址，由调用者写入
+ */
+void* leaf_node_allocate_cell(void *node, uint32_t cell_num, uint32_t key, uint32_t value_length)
+{
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    if(cell_num < num_cells)
     {
-        // 移动现有单元格，为新单元格腾出空间
-        for(uint32_t i = num_cells; i > cursor->cell_num; i--)
-        {
-            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
-        }
+        // 移动现有的槽，为新槽腾出空间；值在堆中不需要移动
+        memmove(leaf_node_cell(node, cell_num + 1), leaf_node_cell(node, cell_num), (num_cells - cell_num) * LEAF_NODE_SLOT_SIZE);
     }
 
-    *(leaf_node_num_cells(node)) += 1;
-    *(leaf_node_key(node, cursor->cell_num)) = key;
-    serialize_row(value, leaf_node_value(node, cursor->cell_num));
+    *leaf_node_heap_start(node) -= value_length;
+    *leaf_node_num_cells(node) = num_cells + 1;
+    *leaf_node_key(node, cell_num) = key;
+    *leaf_node_value_offset(node, cell_num) = *leaf_node_heap_start(node);
+    *leaf_node_value_length(node, cell_num) = value_length;
+
+    return node + *leaf_node_heap_start(node);
 }
 
 /**
- * 打印常量
+ * 获取节点类型
+ * @param node 节点
+ * @return 节点类型
  */
-void print_constants()
+NodeType get_node_type(void *node)
 {
-    printf("ROW_SIZE: %d\n", ROW_SIZE);
-    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+    uint8_t value = *((uint8_t *)(node + NODE_TYPE_OFFSET));
+    return (NodeType)value;
 }
 
 /**
- * 打印叶子节点
+ * 设置节点类型
  * @param node 节点
+ * @param type 节点类型
  */
-void print_leaf_node(void *node)
+void set_node_type(void *node, NodeType type)
 {
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    printf("leaf (size %d)\n", num_cells);
-    for(uint32_t i = 0; i < num_cells; i++)
-    {
-        uint32_t key = *leaf_node_key(node, i);
-        printf("  - %d : %d\n", i, key);
-    }
+    uint8_t value = type;
+    *((uint8_t *)(node + NODE_TYPE_OFFSET)) = value;
 }
 
 /**
- * 语句处理
- * @param input_buffer 输入缓冲区
- * @param table 表
- * @return 元命令执行结果
+ * 判断是否为根节点
+ * @param node 节点
+ * @return 是否为根节点
  */
-MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table)
+bool is_node_root(void *node)
 {
-    if(strcmp(input_buffer->buffer, ".exit") == 0)
-    {
-        close_input_buffer(input_buffer);
-        db_close(table);
-        exit(EXIT_SUCCESS);
-    }
-    else if(strcmp(input_buffer->buffer, ".constants") == 0)
-    {
-        printf("Constants:\n");
-        print_constants();
-        return META_COMMAND_SUCCESS;
-    }
-    else if(strcmp(input_buffer->buffer, ".btree") == 0)
-    {
-        printf("Tree:\n");
-        print_leaf_node(get_page(table->pager, 0));
-        return META_COMMAND_SUCCESS;
-    }
-    else
-    {
-        return META_COMMAND_UNRECOGNIZED_COMMAND;
-    }
+    uint8_t value = *((uint8_t *)(node + IS_ROOT_OFFSET));
+    return (bool)value;
 }
 
 /**
- * 准备插入语句
- * @param input_buffer 输入缓冲区
- * @param statement 语句
- * @return 语句识别结果
+ * 设置是否为根节点
+ * @param node 节点
+ * @param is_root 是否为根节点
  */
-PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement)
+void set_node_root(void *node, bool is_root)
 {
-    statement->type = STATEMENT_INSERT;
-    
-    char *keyword = strtok(input_buffer->buffer, " ");  // 解析关键字
-    char *id_string = strtok(NULL, " ");                // 解析id
-    char *username = strtok(NULL, " ");                 // 解析用户名
-    char *email = strtok(NULL, " ");                    // 解析邮箱
+    uint8_t value = is_root;
+    *((uint8_t *)(node + IS_ROOT_OFFSET)) = value;
+}
 
-    if(id_string == NULL || username == NULL || email == NULL)
-    {
-        return PREPARE_SYNTAX_ERROR;
+/**
+ * 获取父节点页号
+ * @param node 节点
+ * @return 父节点页号
+ */
+uint32_t* node_parent(void *node)
+{
+    return node + PARENT_POINTER_OFFSET;
+}
+
+/**
+ * 获取页的校验和
+ * @param node 节点
+ * @return 校验和
+ */
+uint32_t* node_checksum(void *node)
+{
+    return node + PAGE_CHECKSUM_OFFSET;
+}
+
+/**
+ * 获取内部节点中键数量
+ * @param node 节点
+ * @return 键数量
+ */
+uint32_t* internal_node_num_keys(void *node)
+{
+    return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+}
+
+/**
+ * 获取内部节点的最右子节点页号
+ * @param node 节点
+ * @return 最右子节点页号
+ */
+uint32_t* internal_node_right_child(void *node)
+{
+    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+/**
+ * 获取内部节点中的单元格
+ * @param node 节点
+ * @param cell_num 单元格编号
+ * @return 单元格
+ */
+uint32_t* internal_node_cell(void *node, uint32_t cell_num)
+{
+    return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+}
+
+/**
+ * 获取内部节点中的子节点页号
+ * 下标等于键数量时返回最右子节点
+ * @param node 节点
+ * @param child_num 子节点下标
+ * @return 子节点页号
+ */
+uint32_t* internal_node_child(void *node, uint32_t child_num)
+{
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if(child_num > num_keys)
+    {
+        fatal_error("Tried to access child_num %d > num_keys %d\n", child_num, num_keys);
+    }
+    else if(child_num == num_keys)
+    {
+        uint32_t *right_child = internal_node_right_child(node);
+        if(*right_child == INVALID_PAGE_NUM)
+        {
+            fatal_error("Tried to access right child of node, but was invalid page\n");
+        }
+        return right_child;
+    }
+    else
+    {
+        uint32_t *child = internal_node_cell(node, child_num);
+        if(*child == INVALID_PAGE_NUM)
+        {
+            fatal_error("Tried to access child %d of node, but was invalid page\n", child_num);
+        }
+        return child;
+    }
+}
+
+/**
+ * 获取内部节点中的键
+ * @param node 节点
+ * @param key_num 键下标
+ * @return 键
+ */
+uint32_t* internal_node_key(void *node, uint32_t key_num)
+{
+    return (void *)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+}
+
+/**
+ * 获取节点中的最大键
+ * 内部节点的最大键在最右子树中，需要一直向右下降到叶子节点
+ * @param pager 分页器
+ * @param node 节点
+ * @return 最大键
+ */
+uint32_t get_node_max_key(Pager *pager, void *node)
+{
+    if(get_node_type(node) == NODE_LEAF)
+    {
+        return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    }
+
+    uint32_t right_child_page_num = *internal_node_right_child(node);
+    void *right_child = get_page(pager, right_child_page_num);
+    uint32_t max_key = get_node_max_key(pager, right_child);
+    unpin_page(pager, right_child_page_num);
+
+    return max_key;
+}
+
+/**
+ * 初始化叶子节点
+ * @param node 节点
+ */
+void initialize_leaf_node(void *node)
+{
+    set_node_type(node, NODE_LEAF);
+    set_node_root(node, false);
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_next_leaf(node) = INVALID_PAGE_NUM;    // 还没有下一个叶子节点
+    *leaf_node_heap_start(node) = PAGE_SIZE;    // 堆为空，从页尾开始
+}
+
+/**
+ * 初始化内部节点
+ * @param node 节点
+ */
+void initialize_internal_node(void *node)
+{
+    set_node_type(node, NODE_INTERNAL);
+    set_node_root(node, false);
+    *internal_node_num_keys(node) = 0;
+    // 根节点页号为0，所以不能用0表示“没有最右子节点”
+    *internal_node_right_child(node) = INVALID_PAGE_NUM;
+}
+
+/**
+ * 插入叶子节点
+ * @param cursor 游标
+ * @param key 键
+ * @param value 值
+ */
+void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value)
+{
+    void *node = get_page(cursor->table->pager, cursor->page_num);
+
+    uint32_t value_length = row_serialized_size(value);
+    if(leaf_node_free_space(node) < value_length + LEAF_NODE_SLOT_SIZE)
+    {
+        // 节点已满，需要分裂
+        unpin_page(cursor->table->pager, cursor->page_num);
+        leaf_node_split_and_insert(cursor, key, value);
+        return;
+    }
+
+    pager_mark_dirty(cursor->table->pager, cursor->page_num);
+    serialize_row(value, leaf_node_allocate_cell(node, cursor->cell_num, key, value_length));
+
+    unpin_page(cursor->table->pager, cursor->page_num);
+}
+
+/**
+ * 分裂叶子节点并插入
+ * 新建一个右兄弟节点，把原有单元格和新单元格按顺序分到两个节点，两边的字节数尽量相等，再更新父节点
+ * @param cursor 游标
+ * @param key 键
+ * @param value 值
+ */
+void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value)
+{
+    Pager *pager = cursor->table->pager;
+    void *old_node = get_page(pager, cursor->page_num);
+    uint32_t old_max = get_node_max_key(pager, old_node);
+    uint32_t new_page_num = pager_allocate_page(pager);
+    void *new_node = get_page(pager, new_page_num);
+    pager_mark_dirty(pager, cursor->page_num);
+    pager_mark_dirty(pager, new_page_num);
+    initialize_leaf_node(new_node);
+    *node_parent(new_node) = *node_parent(old_node);
+
+    // 旧节点要原地重建，先把它复制一份，从副本中读取原有的单元格
+    void *old_copy = malloc(PAGE_SIZE);
+    memcpy(old_copy, old_node, PAGE_SIZE);
+    uint32_t old_num_cells = *leaf_node_num_cells(old_copy);
+    uint32_t total_cells = old_num_cells + 1;
+    uint32_t value_length = row_serialized_size(value);
+
+    // 按字节数找分裂点：左节点取到总字节数的一半为止，右节点至少留一个单元格
+    uint32_t total_bytes = 0;
+    for(uint32_t i = 0; i < old_num_cells; i++)
+    {
+        total_bytes += *leaf_node_value_length(old_copy, i) + LEAF_NODE_SLOT_SIZE;
+    }
+    total_bytes += value_length + LEAF_NODE_SLOT_SIZE;
+
+    uint32_t left_count = 0;
+    uint32_t left_bytes = 0;
+    while(left_count < total_cells - 1 && left_bytes * 2 < total_bytes)
+    {
+        uint32_t i = left_count;
+        if(i == cursor->cell_num)
+        {
+            left_bytes += value_length + LEAF_NODE_SLOT_SIZE;
+        }
+        else
+        {
+            uint32_t old_index = (i > cursor->cell_num) ? i - 1 : i;
+            left_bytes += *leaf_node_value_length(old_copy, old_index) + LEAF_NODE_SLOT_SIZE;
+        }
+        left_count++;
+    }
+
+    *leaf_node_num_cells(old_node) = 0;
+    *leaf_node_heap_start(old_node) = PAGE_SIZE;
+    for(uint32_t i = 0; i < total_cells; i++)
+    {
+        void *destination_node = (i < left_count) ? old_node : new_node;
+        uint32_t index_within_node = *leaf_node_num_cells(destination_node);
+
+        if(i == cursor->cell_num)
+        {
+            serialize_row(value, leaf_node_allocate_cell(destination_node, index_within_node, key, value_length));
+        }
+        else
+        {
+            uint32_t old_index = (i > cursor->cell_num) ? i - 1 : i;
+            uint32_t length = *leaf_node_value_length(old_copy, old_index);
+            void *destination = leaf_node_allocate_cell(destination_node, index_within_node, *leaf_node_key(old_copy, old_index), length);
+            memcpy(destination, leaf_node_value(old_copy, old_index), length);
+        }
+    }
+    free(old_copy);
+
+    // 新节点接在旧节点后面
+    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+    *leaf_node_next_leaf(old_node) = new_page_num;
+
+    bool splitting_root = is_node_root(old_node);
+    uint32_t parent_page_num = *node_parent(old_node);
+    uint32_t new_max = get_node_max_key(pager, old_node);
+    unpin_page(pager, cursor->page_num);
+    unpin_page(pager, new_page_num);
+
+    if(splitting_root)
+    {
+        create_new_root(cursor->table, new_page_num);
+        return;
+    }
+
+    void *parent = get_page(pager, parent_page_num);
+    pager_mark_dirty(pager, parent_page_num);
+    update_internal_node_key(parent, old_max, new_max);
+    unpin_page(pager, parent_page_num);
+    internal_node_insert(cursor->table, parent_page_num, new_page_num);
+}
+
+/**
+ * 查找一批有序的行中属于叶子节点的部分
+ * 键不大于叶子节点的最大键的行属于这个叶子节点，最后一个叶子节点接收所有更大的键；
+ * 删除以后比最大键大的行也可能属于这个节点，这些行留给下一轮，从根节点查找时还会落到这里
+ * @param pager 分页器
+ * @param node 叶子节点，rows[start] 属于这个节点
+ * @param rows 按id排序的行
+ * @param start 第一行的下标
+ * @param num_rows 行数
+ * @return 第一个不属于这个叶子节点的行的下标
+ */
+uint32_t leaf_node_batch_end(Pager *pager, void *node, Row *rows, uint32_t start, uint32_t num_rows)
+{
+    if(*leaf_node_next_leaf(node) == INVALID_PAGE_NUM)
+    {
+        return num_rows;
+    }
+
+    uint32_t max_key = get_node_max_key(pager, node);
+    uint32_t end = start + 1;
+    while(end < num_rows && (uint32_t)rows[end].id <= max_key)
+    {
+        end++;
+    }
+
+    return end;
+}
+
+/**
+ * 把一批有序的行插入叶子节点
+ * 叶子节点只固定和修改一次：把原有单元格和新行按键合并后重建节点，放不下时按需要的页数一次分裂成多个节点，
+ * 每个节点分到的字节数尽量相等，最后再把新节点逐个加到父节点中
+ * @param page_num 叶子节点页号，rows[0] 属于这个节点
+ * @param rows 按id排序的行，键都不在表中
+ * @param num_rows 行数
+ * @return 插入的行数
+ */
+uint32_t leaf_node_insert_batch(Table *table, uint32_t page_num, Row *rows, uint32_t num_rows)
+{
+    Pager *pager = table->pager;
+    void *node = get_page(pager, page_num);
+    uint32_t count = leaf_node_batch_end(pager, node, rows, 0, num_rows);
+    pager_mark_dirty(pager, page_num);
+
+    // 节点要原地重建，先把它复制一份，从副本中读取原有的单元格
+    void *old_copy = malloc(PAGE_SIZE);
+    memcpy(old_copy, node, PAGE_SIZE);
+    uint32_t old_num_cells = *leaf_node_num_cells(old_copy);
+    uint32_t total_cells = old_num_cells + count;
+    bool splitting_root = is_node_root(old_copy);
+    uint32_t parent_page_num = *node_parent(old_copy);
+    uint32_t old_max = (old_num_cells > 0) ? get_node_max_key(pager, old_copy) : 0;
+
+    uint64_t total_bytes = 0;
+    for(uint32_t i = 0; i < old_num_cells; i++)
+    {
+        total_bytes += *leaf_node_value_length(old_copy, i) + LEAF_NODE_SLOT_SIZE;
+    }
+    for(uint32_t i = 0; i < count; i++)
+    {
+        total_bytes += row_serialized_size(&rows[i]) + LEAF_NODE_SLOT_SIZE;
+    }
+    uint64_t num_nodes = (total_bytes + LEAF_NODE_SPACE_FOR_CELLS - 1) / LEAF_NODE_SPACE_FOR_CELLS;
+
+    uint32_t *new_page_nums = malloc(total_cells * sizeof(uint32_t));
+    uint32_t num_new_pages = 0;
+    void *destination_node = node;
+    uint32_t destination_page_num = page_num;
+    uint64_t placed_bytes = 0;
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_heap_start(node) = PAGE_SIZE;
+
+    uint32_t old_index = 0;
+    uint32_t new_index = 0;
+    for(uint32_t i = 0; i < total_cells; i++)
+    {
+        bool take_new = old_index == old_num_cells ||
+            (new_index < count && (uint32_t)rows[new_index].id < *leaf_node_key(old_copy, old_index));
+        uint32_t length = take_new ? row_serialized_size(&rows[new_index]) : *leaf_node_value_length(old_copy, old_index);
+
+        // 当前节点已经分到了应得的字节数，或者放不下这个单元格时，换到新的右兄弟节点
+        if(*leaf_node_num_cells(destination_node) > 0 &&
+            (placed_bytes * num_nodes >= total_bytes * (num_new_pages + 1) ||
+            leaf_node_free_space(destination_node) < length + LEAF_NODE_SLOT_SIZE))
+        {
+            uint32_t new_page_num = pager_allocate_page(pager);
+            void *new_node = get_page(pager, new_page_num);
+            pager_mark_dirty(pager, new_page_num);
+            initialize_leaf_node(new_node);
+            *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(destination_node);
+            *leaf_node_next_leaf(destination_node) = new_page_num;
+            if(destination_page_num != page_num)
+            {
+                unpin_page(pager, destination_page_num);
+            }
+            destination_node = new_node;
+            destination_page_num = new_page_num;
+            new_page_nums[num_new_pages++] = new_page_num;
+        }
+
+        uint32_t index_within_node = *leaf_node_num_cells(destination_node);
+        if(take_new)
+        {
+            serialize_row(&rows[new_index], leaf_node_allocate_cell(destination_node, index_within_node, rows[new_index].id, length));
+            new_index++;
+        }
+        else
+        {
+            void *destination = leaf_node_allocate_cell(destination_node, index_within_node, *leaf_node_key(old_copy, old_index), length);
+            memcpy(destination, leaf_node_value(old_copy, old_index), length);
+            old_index++;
+        }
+        placed_bytes += length + LEAF_NODE_SLOT_SIZE;
+    }
+    free(old_copy);
+
+    if(destination_page_num != page_num)
+    {
+        unpin_page(pager, destination_page_num);
+    }
+    uint32_t new_max = get_node_max_key(pager, node);
+    unpin_page(pager, page_num);
+
+    if(num_new_pages == 0)
+    {
+        free(new_page_nums);
+        return count;
+    }
+
+    uint32_t first_new_page = 0;
+    if(splitting_root)
+    {
+        create_new_root(table, new_page_nums[0]);
+        first_new_page = 1;
+    }
+    else
+    {
+        void *parent = get_page(pager, parent_page_num);
+        pager_mark_dirty(pager, parent_page_num);
+        update_internal_node_key(parent, old_max, new_max);
+        unpin_page(pager, parent_page_num);
+    }
+
+    // 新节点依次接在前一个节点后面；父节点分裂后前一个节点可能换了父节点，新节点跟着它
+    uint32_t previous_page_num = splitting_root ? new_page_nums[0] : page_num;
+    for(uint32_t i = first_new_page; i < num_new_pages; i++)
+    {
+        void *previous = get_page(pager, previous_page_num);
+        uint32_t new_parent_page_num = *node_parent(previous);
+        unpin_page(pager, previous_page_num);
+
+        void *new_node = get_page(pager, new_page_nums[i]);
+        pager_mark_dirty(pager, new_page_nums[i]);
+        *node_parent(new_node) = new_parent_page_num;
+        unpin_page(pager, new_page_nums[i]);
+
+        internal_node_insert(table, new_parent_page_num, new_page_nums[i]);
+        previous_page_num = new_page_nums[i];
+    }
+    free(new_page_nums);
+
+    return count;
+}
+
+/**
+ * 创建新的根节点
+ * 根节点始终在 root_page_num 上：把旧根复制到新的左子节点，再把根页改写成只有两个子节点的内部节点
+ * @param right_child_page_num 右子节点页号
+ */
+void create_new_root(Table *table, uint32_t right_child_page_num)
+{
+    Pager *pager = table->pager;
+    void *root = get_page(pager, table->root_page_num);
+    void *right_child = get_page(pager, right_child_page_num);
+    uint32_t left_child_page_num = pager_allocate_page(pager);
+    void *left_child = get_page(pager, left_child_page_num);
+    pager_mark_dirty(pager, table->root_page_num);
+    pager_mark_dirty(pager, right_child_page_num);
+    pager_mark_dirty(pager, left_child_page_num);
+
+    memcpy(left_child, root, PAGE_SIZE);
+    set_node_root(left_child, false);
+
+    // 旧根是内部节点时，它的子节点现在挂在左子节点下面
+    if(get_node_type(left_child) == NODE_INTERNAL)
+    {
+        for(uint32_t i = 0; i <= *internal_node_num_keys(left_child); i++)
+        {
+            uint32_t child_page_num = *internal_node_child(left_child, i);
+            void *child = get_page(pager, child_page_num);
+            pager_mark_dirty(pager, child_page_num);
+            *node_parent(child) = left_child_page_num;
+            unpin_page(pager, child_page_num);
+        }
+    }
+
+    initialize_internal_node(root);
+    set_node_root(root, true);
+    *internal_node_num_keys(root) = 1;
+    *internal_node_child(root, 0) = left_child_page_num;
+    *internal_node_key(root, 0) = get_node_max_key(pager, left_child);
+    *internal_node_right_child(root) = right_child_page_num;
+    *node_parent(left_child) = table->root_page_num;
+    *node_parent(right_child) = table->root_page_num;
+
+    unpin_page(pager, table->root_page_num);
+    unpin_page(pager, right_child_page_num);
+    unpin_page(pager, left_child_page_num);
+}
+
+/**
+ * 查找键所在的子节点下标
+ * 二分查找第一个不小于 key 的键，返回值等于键数量时表示最右子节点
+ * @param node 内部节点
+ * @param key 键
+ * @return 子节点下标
+ */
+uint32_t internal_node_find_child(void *node, uint32_t key)
+{
+    uint32_t num_keys = *internal_node_num_keys(node);
+
+    uint32_t min_index = 0;
+    uint32_t max_index = num_keys;    // 子节点比键多一个
+    while(min_index != max_index)
+    {
+        uint32_t index = (min_index + max_index) / 2;
+        uint32_t key_to_right = *internal_node_key(node, index);
+        if(key_to_right >= key)
+        {
+            max_index = index;
+        }
+        else
+        {
+            min_index = index + 1;
+        }
+    }
+
+    return min_index;
+}
+
+/**
+ * 更新内部节点中的键
+ * 子节点分裂后最大键会变小，需要同步父节点中对应的键
+ * @param node 内部节点
+ * @param old_key 旧键
+ * @param new_key 新键
+ */
+void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key)
+{
+    uint32_t old_child_index = internal_node_find_child(node, old_key);
+    if(old_child_index < *internal_node_num_keys(node))    // 最右子节点没有对应的键
+    {
+        *internal_node_key(node, old_child_index) = new_key;
+    }
+}
+
+/**
+ * 向内部节点插入子节点
+ * @param parent_page_num 父节点页号
+ * @param child_page_num 子节点页号
+ */
+void internal_node_insert(Table *table, uint32_t parent_page_num, uint32_t child_page_num)
+{
+    Pager *pager = table->pager;
+    void *child = get_page(pager, child_page_num);
+    uint32_t child_max_key = get_node_max_key(pager, child);
+    unpin_page(pager, child_page_num);
+
+    void *parent = get_page(pager, parent_page_num);
+    uint32_t index = internal_node_find_child(parent, child_max_key);
+
+    uint32_t original_num_keys = *internal_node_num_keys(parent);
+    if(original_num_keys >= INTERNAL_NODE_MAX_KEYS)
+    {
+        // 节点已满，需要分裂
+        unpin_page(pager, parent_page_num);
+        internal_node_split_and_insert(table, parent_page_num, child_page_num);
+        return;
+    }
+
+    pager_mark_dirty(pager, parent_page_num);
+    uint32_t right_child_page_num = *internal_node_right_child(parent);
+    if(right_child_page_num == INVALID_PAGE_NUM)
+    {
+        // 空的内部节点，直接作为最右子节点
+        *internal_node_right_child(parent) = child_page_num;
+        unpin_page(pager, parent_page_num);
+        return;
+    }
+
+    void *right_child = get_page(pager, right_child_page_num);
+    uint32_t right_child_max_key = get_node_max_key(pager, right_child);
+    unpin_page(pager, right_child_page_num);
+    *internal_node_num_keys(parent) = original_num_keys + 1;
+
+    if(child_max_key > right_child_max_key)
+    {
+        // 新子节点成为最右子节点，原最右子节点移到单元格末尾
+        *internal_node_child(parent, original_num_keys) = right_child_page_num;
+        *internal_node_key(parent, original_num_keys) = right_child_max_key;
+        *internal_node_right_child(parent) = child_page_num;
+    }
+    else
+    {
+        // 移动现有单元格，为新单元格腾出空间
+        for(uint32_t i = original_num_keys; i > index; i--)
+        {
+            memcpy(internal_node_cell(parent, i), internal_node_cell(parent, i - 1), INTERNAL_NODE_CELL_SIZE);
+        }
+        *internal_node_child(parent, index) = child_page_num;
+        *internal_node_key(parent, index) = child_max_key;
+    }
+
+    unpin_page(pager, parent_page_num);
+}
+
+/**
+ * 分裂内部节点并插入
+ * 把原有子节点和新子节点按键排好，前一半留在原节点，后一半移到新的右兄弟节点，再更新父节点
+ * @param parent_page_num 需要分裂的内部节点页号
+ * @param child_page_num 新子节点页号
+ */
+void internal_node_split_and_insert(Table *table, uint32_t parent_page_num, uint32_t child_page_num)
+{
+    Pager *pager = table->pager;
+    void *old_node = get_page(pager, parent_page_num);
+    void *child = get_page(pager, child_page_num);
+    uint32_t old_max = get_node_max_key(pager, old_node);
+    uint32_t child_max = get_node_max_key(pager, child);
+    pager_mark_dirty(pager, parent_page_num);
+    pager_mark_dirty(pager, child_page_num);
+    *node_parent(child) = parent_page_num;
+    unpin_page(pager, child_page_num);
+
+    // 收集所有子节点和对应的最大键，最后一个子节点的键就是整个节点的最大键
+    uint32_t num_children = INTERNAL_NODE_MAX_KEYS + 2;
+    uint32_t *children = malloc(num_children * sizeof(uint32_t));
+    uint32_t *keys = malloc(num_children * sizeof(uint32_t));
+    uint32_t index = (child_max > old_max) ? INTERNAL_NODE_MAX_KEYS + 1 : internal_node_find_child(old_node, child_max);
+    uint32_t j = 0;
+    for(uint32_t i = 0; i <= INTERNAL_NODE_MAX_KEYS; i++)
+    {
+        if(i == index)
+        {
+            children[j] = child_page_num;
+            keys[j] = child_max;
+            j++;
+        }
+        children[j] = *internal_node_child(old_node, i);
+        keys[j] = (i < INTERNAL_NODE_MAX_KEYS) ? *internal_node_key(old_node, i) : old_max;
+        j++;
+    }
+    if(index > INTERNAL_NODE_MAX_KEYS)    // 新子节点比原最右子节点还大
+    {
+        children[j] = child_page_num;
+        keys[j] = child_max;
+    }
+
+    uint32_t new_page_num = pager_allocate_page(pager);
+    void *new_node = get_page(pager, new_page_num);
+    pager_mark_dirty(pager, new_page_num);
+    initialize_internal_node(new_node);
+    *node_parent(new_node) = *node_parent(old_node);
+
+    // 左节点保留前 left_count 个子节点，其余的移到右节点
+    uint32_t left_count = num_children / 2;
+    *internal_node_num_keys(old_node) = left_count - 1;
+    for(uint32_t i = 0; i < left_count - 1; i++)
+    {
+        *internal_node_cell(old_node, i) = children[i];
+        *internal_node_key(old_node, i) = keys[i];
+    }
+    *internal_node_right_child(old_node) = children[left_count - 1];
+
+    *internal_node_num_keys(new_node) = num_children - left_count - 1;
+    for(uint32_t i = left_count; i < num_children - 1; i++)
+    {
+        *internal_node_cell(new_node, i - left_count) = children[i];
+        *internal_node_key(new_node, i - left_count) = keys[i];
+    }
+    *internal_node_right_child(new_node) = children[num_children - 1];
+    for(uint32_t i = left_count; i < num_children; i++)
+    {
+        void *moved_child = get_page(pager, children[i]);
+        pager_mark_dirty(pager, children[i]);
+        *node_parent(moved_child) = new_page_num;
+        unpin_page(pager, children[i]);
+    }
+
+    uint32_t new_max = keys[left_count - 1];
+    free(children);
+    free(keys);
+
+    bool splitting_root = is_node_root(old_node);
+    uint32_t grandparent_page_num = *node_parent(old_node);
+    unpin_page(pager, parent_page_num);
+    unpin_page(pager, new_page_num);
+
+    if(splitting_root)
+    {
+        create_new_root(table, new_page_num);
+        return;
+    }
+
+    void *grandparent = get_page(pager, grandparent_page_num);
+    pager_mark_dirty(pager, grandparent_page_num);
+    update_internal_node_key(grandparent, old_max, new_max);
+    unpin_page(pager, grandparent_page_num);
+    internal_node_insert(table, grandparent_page_num, new_page_num);
+}
+
+/**
+ * 获取叶子节点中单元格占用的空间
+ * 值的长度加上槽，不包括删除后留在堆中的空洞
+ * @param node 叶子节点
+ * @return 字节数
+ */
+uint32_t leaf_node_used_space(void *node)
+{
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t used = num_cells * LEAF_NODE_SLOT_SIZE;
+    for(uint32_t i = 0; i < num_cells; i++)
+    {
+        used += *leaf_node_value_length(node, i);
+    }
+    return used;
+}
+
+/**
+ * 把叶子节点副本中的单元格追加到叶子节点末尾
+ * @param node 叶子节点，副本中的键都比它的键大，调用者保证空间足够
+ * @param source 叶子节点副本
+ * @param skip 不复制的单元格，为NULL时全部复制
+ */
+void leaf_node_append_cells(void *node, void *source, bool *skip)
+{
+    uint32_t num_cells = *leaf_node_num_cells(source);
+    for(uint32_t i = 0; i < num_cells; i++)
+    {
+        if(skip != NULL && skip[i])
+        {
+            continue;
+        }
+        uint32_t length = *leaf_node_value_length(source, i);
+        void *destination = leaf_node_allocate_cell(node, *leaf_node_num_cells(node), *leaf_node_key(source, i), length);
+        memcpy(destination, leaf_node_value(source, i), length);
+    }
+}
+
+/**
+ * 查找键所在的叶子节点
+ * 写者持有 writer_mutex 时使用，不加共享锁，只按内部节点中的键下降，不像 leaf_node_find 那样向右移动：
+ * 删除以后内部节点中的键只是子节点键区间的上界，可能比子节点的最大键大，落在这个区间里的键仍然属于这个子节点，
+ * 插到右边的叶子节点会让它的键超出父节点给它的区间
+ * @param key 键
+ * @return 叶子节点页号
+ */
+uint32_t table_find_leaf(Table *table, uint32_t key)
+{
+    Pager *pager = table->pager;
+    uint32_t page_num = table->root_page_num;
+    while(true)
+    {
+        void *node = get_page(pager, page_num);
+        if(get_node_type(node) != NODE_INTERNAL)
+        {
+            unpin_page(pager, page_num);
+            return page_num;
+        }
+        uint32_t child_page_num = *internal_node_child(node, internal_node_find_child(node, key));
+        unpin_page(pager, page_num);
+        page_num = child_page_num;
+    }
+}
+
+/**
+ * 查找写者插入键的位置
+ * 按 table_find_leaf 找到叶子节点，游标只固定叶子节点不加共享锁，之后写者可以直接对它加排它锁
+ * @param key 键
+ * @return 游标，用完后需要调用 cursor_close
+ */
+Cursor *table_find_for_write(Table *table, uint32_t key)
+{
+    uint32_t page_num = table_find_leaf(table, key);
+    Cursor *cursor = (Cursor *)malloc(sizeof(Cursor));    // 分配游标内存空间
+    cursor->table = table;    // 设置表
+    cursor->page_num = page_num;    // 设置页号
+    cursor->node = get_page(table->pager, page_num);    // 设置叶子节点
+    cursor->cell_num = leaf_node_search(cursor->node, key);    // 设置单元格号
+    cursor->end_of_table = false;    // 设置是否到表尾
+    cursor->latched = false;    // 只固定不加锁
+    cursor->copy = NULL;    // 不是快照游标
+    return cursor;
+}
+
+/**
+ * 查找子节点在内部节点中的下标
+ * @param node 内部节点
+ * @param child_page_num 子节点页号
+ * @return 子节点下标，等于键数量时表示最右子节点
+ */
+uint32_t internal_node_child_index(void *node, uint32_t child_page_num)
+{
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for(uint32_t i = 0; i <= num_keys; i++)
+    {
+        if(*internal_node_child(node, i) == child_page_num)
+        {
+            return i;
+        }
+    }
+
+    fatal_error("Page %u is not a child of its parent.\n", child_page_num);
+}
+
+/**
+ * 查找前一个叶子节点
+ * 沿父节点指针向上，直到不是最左子节点，再从左边的兄弟子树一直向右下降
+ * @param page_num 叶子节点页号，不是根节点
+ * @return 前一个叶子节点页号，没有时返回 INVALID_PAGE_NUM
+ */
+uint32_t leaf_node_previous(Table *table, uint32_t page_num)
+{
+    Pager *pager = table->pager;
+    uint32_t child_page_num = page_num;
+    while(child_page_num != table->root_page_num)
+    {
+        void *child = get_page(pager, child_page_num);
+        uint32_t parent_page_num = *node_parent(child);
+        unpin_page(pager, child_page_num);
+
+        void *parent = get_page(pager, parent_page_num);
+        uint32_t index = internal_node_child_index(parent, child_page_num);
+        uint32_t left_page_num = (index > 0) ? *internal_node_child(parent, index - 1) : INVALID_PAGE_NUM;
+        unpin_page(pager, parent_page_num);
+        if(left_page_num == INVALID_PAGE_NUM)
+        {
+            child_page_num = parent_page_num;
+            continue;
+        }
+
+        uint32_t previous_page_num = left_page_num;
+        while(true)
+        {
+            void *node = get_page(pager, previous_page_num);
+            bool leaf = get_node_type(node) == NODE_LEAF;
+            uint32_t right_page_num = leaf ? previous_page_num : *internal_node_right_child(node);
+            unpin_page(pager, previous_page_num);
+            if(leaf)
+            {
+                return previous_page_num;
+            }
+            previous_page_num = right_page_num;
+        }
+    }
+
+    return INVALID_PAGE_NUM;
+}
+
+/**
+ * 删除后检查叶子节点是否太空
+ * 用到的空间不到一半时，和同一个父节点下左边或右边的兄弟节点合并，合并后要放得下；
+ * 都放不下时保持原样。不在兄弟节点之间移动单元格：快照游标复制叶子节点以后沿旧的下一个页号前进，
+ * 合并时右节点的内容原样保留到页被复用为止，移动单元格会让游标重复或者漏掉行
+ * 父节点只有这一个子节点、叶子节点又空了时，把它从叶子节点链表和父节点中去掉
+ * @param page_num 叶子节点页号
+ */
+void leaf_node_rebalance(Table *table, uint32_t page_num)
+{
+    Pager *pager = table->pager;
+    void *node = get_page(pager, page_num);
+    uint32_t used = leaf_node_used_space(node);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t parent_page_num = *node_parent(node);
+    bool root = is_node_root(node);
+    unpin_page(pager, page_num);
+    if(root || used * 2 >= LEAF_NODE_SPACE_FOR_CELLS)
+    {
+        return;
+    }
+
+    void *parent = get_page(pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    uint32_t index = internal_node_child_index(parent, page_num);
+    uint32_t left_page_num = (index > 0) ? *internal_node_child(parent, index - 1) : INVALID_PAGE_NUM;
+    uint32_t right_page_num = (index < num_keys) ? *internal_node_child(parent, index + 1) : INVALID_PAGE_NUM;
+    unpin_page(pager, parent_page_num);
+
+    if(left_page_num != INVALID_PAGE_NUM)
+    {
+        void *left = get_page(pager, left_page_num);
+        bool fits = leaf_node_used_space(left) + used <= LEAF_NODE_SPACE_FOR_CELLS;
+        unpin_page(pager, left_page_num);
+        if(fits)
+        {
+            leaf_node_merge(table, parent_page_num, index - 1);
+            return;
+        }
+    }
+    if(right_page_num != INVALID_PAGE_NUM)
+    {
+        void *right = get_page(pager, right_page_num);
+        bool fits = leaf_node_used_space(right) + used <= LEAF_NODE_SPACE_FOR_CELLS;
+        unpin_page(pager, right_page_num);
+        if(fits)
+        {
+            leaf_node_merge(table, parent_page_num, index);
+            return;
+        }
+    }
+    if(num_cells > 0 || num_keys > 0)
+    {
+        return;
+    }
+
+    // 父节点唯一的子节点空了：前一个叶子节点直接指向下一个叶子节点
+    node = get_page(pager, page_num);
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    unpin_page(pager, page_num);
+    uint32_t previous_page_num = leaf_node_previous(table, page_num);
+    if(previous_page_num != INVALID_PAGE_NUM)
+    {
+        void *previous = get_page(pager, previous_page_num);
+        pager_mark_dirty(pager, previous_page_num);
+        *leaf_node_next_leaf(previous) = next_page_num;
+        unpin_page(pager, previous_page_num);
+    }
+    database_free_page(table->database, page_num);
+    internal_node_remove_child(table, parent_page_num, index);
+}
+
+/**
+ * 合并两个相邻的叶子节点
+ * 右节点的单元格追加到左节点，左节点接上右节点的下一个叶子节点，右节点释放
+ * @param parent_page_num 父节点页号
+ * @param index 左节点在父节点中的下标，右节点是下一个子节点
+ */
+void leaf_node_merge(Table *table, uint32_t parent_page_num, uint32_t index)
+{
+    Pager *pager = table->pager;
+    void *parent = get_page(pager, parent_page_num);
+    uint32_t left_page_num = *internal_node_child(parent, index);
+    uint32_t right_page_num = *internal_node_child(parent, index + 1);
+    unpin_page(pager, parent_page_num);
+
+    void *right_copy = malloc(PAGE_SIZE);
+    void *right = get_page(pager, right_page_num);
+    memcpy(right_copy, right, PAGE_SIZE);
+    unpin_page(pager, right_page_num);
+
+    // 左节点原地重建，重建时顺便整理掉删除留下的空洞
+    void *left_copy = malloc(PAGE_SIZE);
+    void *left = get_page(pager, left_page_num);
+    pager_mark_dirty(pager, left_page_num);
+    memcpy(left_copy, left, PAGE_SIZE);
+    *leaf_node_num_cells(left) = 0;
+    *leaf_node_heap_start(left) = PAGE_SIZE;
+    leaf_node_append_cells(left, left_copy, NULL);
+    leaf_node_append_cells(left, right_copy, NULL);
+    *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right_copy);
+    unpin_page(pager, left_page_num);
+    free(left_copy);
+    free(right_copy);
+
+    database_free_page(table->database, right_page_num);
+    internal_node_remove_child(table, parent_page_num, index + 1);
+}
+
+/**
+ * 从内部节点中去掉一个子节点
+ * 去掉的子节点的键区间并到左边的子节点，它是最左子节点时并到右边的子节点；
+ * 内部节点没有子节点了时，根节点变成空的叶子节点，其他节点释放并从它的父节点中去掉
+ * @param page_num 内部节点页号
+ * @param index 子节点下标，等于键数量时表示最右子节点
+ */
+void internal_node_remove_child(Table *table, uint32_t page_num, uint32_t index)
+{
+    Pager *pager = table->pager;
+    void *node = get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if(num_keys == 0)
+    {
+        if(is_node_root(node))
+        {
+            initialize_leaf_node(node);
+            set_node_root(node, true);
+            unpin_page(pager, page_num);
+            return;
+        }
+
+        uint32_t parent_page_num = *node_parent(node);
+        unpin_page(pager, page_num);
+        void *parent = get_page(pager, parent_page_num);
+        uint32_t parent_index = internal_node_child_index(parent, page_num);
+        unpin_page(pager, parent_page_num);
+        database_free_page(table->database, page_num);
+        internal_node_remove_child(table, parent_page_num, parent_index);
+        return;
+    }
+
+    if(index < num_keys)
+    {
+        if(index > 0)
+        {
+            *internal_node_key(node, index - 1) = *internal_node_key(node, index);
+        }
+        memmove(internal_node_cell(node, index), internal_node_cell(node, index + 1), (num_keys - index - 1) * INTERNAL_NODE_CELL_SIZE);
+    }
+    else
+    {
+        *internal_node_right_child(node) = *internal_node_child(node, num_keys - 1);
+    }
+    *internal_node_num_keys(node) = num_keys - 1;
+    unpin_page(pager, page_num);
+
+    internal_node_rebalance(table, page_num);
+}
+
+/**
+ * 去掉子节点后检查内部节点是否太空
+ * 根节点只剩一个子节点时树降低一层；其他节点的子节点不到一半时和兄弟节点合并，放不下时保持原样
+ * @param page_num 内部节点页号
+ */
+void internal_node_rebalance(Table *table, uint32_t page_num)
+{
+    Pager *pager = table->pager;
+    void *node = get_page(pager, page_num);
+    uint32_t num_children = *internal_node_num_keys(node) + 1;
+    uint32_t parent_page_num = *node_parent(node);
+    bool root = is_node_root(node);
+    unpin_page(pager, page_num);
+    if(root)
+    {
+        collapse_root(table);
+        return;
+    }
+    if(num_children * 2 >= INTERNAL_NODE_MAX_KEYS + 1)
+    {
+        return;
+    }
+
+    void *parent = get_page(pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    uint32_t index = internal_node_child_index(parent, page_num);
+    uint32_t left_page_num = (index > 0) ? *internal_node_child(parent, index - 1) : INVALID_PAGE_NUM;
+    uint32_t right_page_num = (index < num_keys) ? *internal_node_child(parent, index + 1) : INVALID_PAGE_NUM;
+    unpin_page(pager, parent_page_num);
+
+    if(left_page_num != INVALID_PAGE_NUM)
+    {
+        void *left = get_page(pager, left_page_num);
+        bool fits = *internal_node_num_keys(left) + 1 + num_children <= INTERNAL_NODE_MAX_KEYS + 1;
+        unpin_page(pager, left_page_num);
+        if(fits)
+        {
+            internal_node_merge(table, parent_page_num, index - 1);
+            return;
+        }
+    }
+    if(right_page_num != INVALID_PAGE_NUM)
+    {
+        void *right = get_page(pager, right_page_num);
+        bool fits = *internal_node_num_keys(right) + 1 + num_children <= INTERNAL_NODE_MAX_KEYS + 1;
+        unpin_page(pager, right_page_num);
+        if(fits)
+        {
+            internal_node_merge(table, parent_page_num, index);
+        }
+    }
+}
+
+/**
+ * 合并两个相邻的内部节点
+ * 左节点的最右子节点变成普通的子节点，键是父节点中左节点的键，再接上右节点所有的子节点；右节点释放
+ * @param parent_page_num 父节点页号
+ * @param index 左节点在父节点中的下标，右节点是下一个子节点
+ */
+void internal_node_merge(Table *table, uint32_t parent_page_num, uint32_t index)
+{
+    Pager *pager = table->pager;
+    void *parent = get_page(pager, parent_page_num);
+    uint32_t left_page_num = *internal_node_child(parent, index);
+    uint32_t right_page_num = *internal_node_child(parent, index + 1);
+    uint32_t separator = *internal_node_key(parent, index);
+    unpin_page(pager, parent_page_num);
+
+    void *right_copy = malloc(PAGE_SIZE);
+    void *right = get_page(pager, right_page_num);
+    memcpy(right_copy, right, PAGE_SIZE);
+    unpin_page(pager, right_page_num);
+
+    void *left = get_page(pager, left_page_num);
+    pager_mark_dirty(pager, left_page_num);
+    uint32_t num_keys = *internal_node_num_keys(left);
+    uint32_t right_num_keys = *internal_node_num_keys(right_copy);
+    *internal_node_cell(left, num_keys) = *internal_node_right_child(left);    // 下标等于键数时 internal_node_child 返回的是最右子节点，所以直接写单元格
+    *internal_node_key(left, num_keys) = separator;
+    memcpy(internal_node_cell(left, num_keys + 1), internal_node_cell(right_copy, 0), right_num_keys * INTERNAL_NODE_CELL_SIZE);
+    *internal_node_right_child(left) = *internal_node_right_child(right_copy);
+    *internal_node_num_keys(left) = num_keys + 1 + right_num_keys;
+    unpin_page(pager, left_page_num);
+
+    for(uint32_t i = 0; i <= right_num_keys; i++)
+    {
+        uint32_t child_page_num = *internal_node_child(right_copy, i);
+        void *child = get_page(pager, child_page_num);
+        pager_mark_dirty(pager, child_page_num);
+        *node_parent(child) = left_page_num;
+        unpin_page(pager, child_page_num);
+    }
+    free(right_copy);
+
+    database_free_page(table->database, right_page_num);
+    internal_node_remove_child(table, parent_page_num, index + 1);
+}
+
+/**
+ * 降低树的层数
+ * 根节点始终在 root_page_num 上：根节点只有一个子节点时，把子节点复制到根页，子节点的子节点改挂在根节点下面，
+ * 再释放原来的子节点页，直到根节点是叶子节点或者至少有两个子节点
+ */
+void collapse_root(Table *table)
+{
+    Pager *pager = table->pager;
+    while(true)
+    {
+        void *root = get_page(pager, table->root_page_num);
+        if(get_node_type(root) != NODE_INTERNAL || *internal_node_num_keys(root) > 0)
+        {
+            unpin_page(pager, table->root_page_num);
+            return;
+        }
+
+        uint32_t child_page_num = *internal_node_right_child(root);
+        void *child = get_page(pager, child_page_num);
+        pager_mark_dirty(pager, table->root_page_num);
+        memcpy(root, child, PAGE_SIZE);
+        set_node_root(root, true);
+        unpin_page(pager, child_page_num);
+        unpin_page(pager, table->root_page_num);
+
+        root = get_page(pager, table->root_page_num);
+        if(get_node_type(root) == NODE_INTERNAL)
+        {
+            for(uint32_t i = 0; i <= *internal_node_num_keys(root); i++)
+            {
+                uint32_t grandchild_page_num = *internal_node_child(root, i);
+                void *grandchild = get_page(pager, grandchild_page_num);
+                pager_mark_dirty(pager, grandchild_page_num);
+                *node_parent(grandchild) = table->root_page_num;
+                unpin_page(pager, grandchild_page_num);
+            }
+        }
+        unpin_page(pager, table->root_page_num);
+        database_free_page(table->database, child_page_num);
+    }
+}
+
+/**
+ * 获取未使用的页号
+ * 新页追加在文件末尾；批量导入、建索引这些一次写很多页的操作直接用它，页号连续，写出时是顺序写
+ * @param pager 分页器
+ * @return 页号
+ */
+uint32_t get_unused_page_num(Pager *pager)
+{
+    return pager->num_pages;
+}
+
+/**
+ * 分配一个新页
+ * 先从空闲页链表的头取，链表为空时追加在文件末尾。显式事务中取出的页记在 taken_pages 中：
+ * 回滚时它们和事务新分配的页一样可能还有扫描在读，不能马上放回链表
+ * 调用者持有 writer_mutex，并且会马上初始化这个页
+ * @param pager 分页器
+ * @return 页号
+ */
+uint32_t pager_allocate_page(Pager *pager)
+{
+    void *catalog = get_page(pager, CATALOG_PAGE_NUM);
+    uint32_t page_num = *node_parent(catalog);
+    if(page_num == 0)
+    {
+        unpin_page(pager, CATALOG_PAGE_NUM);
+        return get_unused_page_num(pager);
+    }
+
+    void *page = get_page(pager, page_num);
+    uint32_t next_page_num = *node_parent(page);
+    unpin_page(pager, page_num);
+    pager_mark_dirty(pager, CATALOG_PAGE_NUM);
+    *node_parent(catalog) = next_page_num;
+    unpin_page(pager, CATALOG_PAGE_NUM);
+
+    if(pager->in_transaction)
+    {
+        if(pager->num_taken == pager->taken_capacity)
+        {
+            pager->taken_capacity = (pager->taken_capacity == 0) ? 16 : pager->taken_capacity * 2;
+            pager->taken_pages = (uint32_t *)realloc(pager->taken_pages, sizeof(uint32_t) * pager->taken_capacity);
+        }
+        pager->taken_pages[pager->num_taken++] = page_num;
+    }
+    return page_num;
+}
+
+/**
+ * 释放一个页
+ * 页的内容原样保留，语句提交时和同一条语句释放的其他页一起成为一批，等能复用时才加到空闲页链表；调用者持有 writer_mutex
+ * @param page_num 页号
+ */
+void database_free_page(Database *database, uint32_t page_num)
+{
+    if(database->num_freed == database->freed_capacity)
+    {
+        database->freed_capacity = (database->freed_capacity == 0) ? 16 : database->freed_capacity * 2;
+        database->freed_pages = (uint32_t *)realloc(database->freed_pages, sizeof(uint32_t) * database->freed_capacity);
+    }
+    database->freed_pages[database->num_freed++] = page_num;
+}
+
+/**
+ * 把语句释放的页记成一批
+ * 先提交一次所有表的版本，之后开始的查询都不会再读到这些页；记下每个表这时的提交版本，
+ * 比它旧的快照都结束以后这一批才能复用。在语句的修改提交以后调用，调用者持有 writer_mutex
+ * @param database 数据库
+ */
+void database_fence_pages(Database *database)
+{
+    if(database->num_freed == 0)
+    {
+        return;
+    }
+
+    database_version_commit(database);
+    if(database->num_free_batches == database->free_batches_capacity)
+    {
+        database->free_batches_capacity = (database->free_batches_capacity == 0) ? 4 : database->free_batches_capacity * 2;
+        database->free_batches = (FreeBatch *)realloc(database->free_batches, sizeof(FreeBatch) * database->free_batches_capacity);
+    }
+
+    FreeBatch *batch = &(database->free_batches[database->num_free_batches++]);
+    batch->page_nums = database->freed_pages;
+    batch->num_pages = database->num_freed;
+    batch->num_guards = database->num_tables;
+    batch->guards = (uint64_t *)malloc(sizeof(uint64_t) * batch->num_guards);
+    for(uint32_t i = 0; i < batch->num_guards; i++)
+    {
+        VersionStore *store = &(database->tables[i]->versions);
+        pthread_rwlock_rdlock(&(store->lock));
+        batch->guards[i] = store->commit_version;
+        pthread_rwlock_unlock(&(store->lock));
+    }
+
+    database->freed_pages = NULL;
+    database->num_freed = 0;
+    database->freed_capacity = 0;
+}
+
+/**
+ * 把已经没有查询会读到的页加到空闲页链表
+ * 按释放的顺序检查每一批，遇到还有旧快照的一批就停下。加到链表的页改成空闲页，
+ * 父节点指针指向原来的链表头；修改在下一次提交时写到日志。调用者持有 writer_mutex，不在显式事务中
+ * @param database 数据库
+ */
+void database_release_pages(Database *database)
+{
+    Pager *pager = database->pager;
+    uint32_t released = 0;
+    while(released < database->num_free_batches)
+    {
+        FreeBatch *batch = &(database->free_batches[released]);
+        bool safe = true;
+        for(uint32_t i = 0; i < batch->num_guards && safe; i++)
+        {
+            VersionStore *store = &(database->tables[i]->versions);
+            pthread_rwlock_rdlock(&(store->lock));
+            safe = store->num_snapshots == 0 || store->snapshots[0] >= batch->guards[i];
+            pthread_rwlock_unlock(&(store->lock));
+        }
+        if(!safe)
+        {
+            break;
+        }
+
+        void *catalog = get_page(pager, CATALOG_PAGE_NUM);
+        pager_mark_dirty(pager, CATALOG_PAGE_NUM);
+        for(uint32_t i = 0; i < batch->num_pages; i++)
+        {
+            uint32_t page_num = batch->page_nums[i];
+            void *page = get_page(pager, page_num);
+            pager_mark_dirty(pager, page_num);
+            set_node_type(page, NODE_FREE);
+            set_node_root(page, false);
+            *node_parent(page) = *node_parent(catalog);
+            unpin_page(pager, page_num);
+            *node_parent(catalog) = page_num;
+        }
+        unpin_page(pager, CATALOG_PAGE_NUM);
+
+        free(batch->page_nums);
+        free(batch->guards);
+        released++;
+    }
+
+    if(released > 0)    // 还没有释放过页时 free_batches 是NULL
+    {
+        memmove(database->free_batches, database->free_batches + released, sizeof(FreeBatch) * (database->num_free_batches - released));
+        database->num_free_batches -= released;
+    }
+}
+
+/**
+ * 添加一批待清除的删除
+ * 批持有键的数组；待清除列表在下一次提交之前重写。调用者持有 writer_mutex
+ * @param database 数据库
+ * @param table 删除行的表
+ * @param keys 删除的键
+ * @param num_keys 键数
+ * @param guard 提交后表的提交版本
+ */
+void database_add_purge_batch(Database *database, Table *table, uint32_t *keys, uint32_t num_keys, uint64_t guard)
+{
+    if(database->num_purge_batches == database->purge_batches_capacity)
+    {
+        database->purge_batches_capacity = (database->purge_batches_capacity == 0) ? 4 : database->purge_batches_capacity * 2;
+        database->purge_batches = (PurgeBatch *)realloc(database->purge_batches, sizeof(PurgeBatch) * database->purge_batches_capacity);
+    }
+
+    PurgeBatch *batch = &(database->purge_batches[database->num_purge_batches++]);
+    batch->table = table;
+    batch->keys = keys;
+    batch->num_keys = num_keys;
+    batch->guard = guard;
+    database->purge_list_dirty = true;
+}
+
+/**
+ * 把已经没有快照能看到的删除从树中删掉
+ * 和 database_release_pages 一样只检查不等待：表中比一批旧的快照都结束了才删掉这一批，还有旧快照的留给之后的写者。
+ * 同一个表的批按提交的顺序，前一批不能删时后面的也不能删。待清除的删除变了时重写待清除列表，和语句的修改一起提交；
+ * 调用者持有 writer_mutex，在提交之前调用，不在显式事务中（提交事务时除外）
+ * @param database 数据库
+ */
+void database_purge_deleted(Database *database)
+{
+    uint32_t kept = 0;
+    for(uint32_t i = 0; i < database->num_purge_batches; i++)
+    {
+        PurgeBatch batch = database->purge_batches[i];
+        VersionStore *store = &(batch.table->versions);
+        pthread_rwlock_rdlock(&(store->lock));
+        bool safe = store->num_snapshots == 0 || store->snapshots[0] >= batch.guard;
+        pthread_rwlock_unlock(&(store->lock));
+        if(!safe)
+        {
+            database->purge_batches[kept++] = batch;
+            continue;
+        }
+
+        table_purge(batch.table, batch.keys, batch.num_keys);
+        free(batch.keys);
+        database->purge_list_dirty = true;
+    }
+    database->num_purge_batches = kept;
+
+    if(database->purge_list_dirty)
+    {
+        database_write_purge_list(database);
+    }
+}
+
+/**
+ * 把待清除的删除写到待清除列表
+ * 按批的顺序重写所有的项，页不够时分配新页，多出来的页释放掉；没有待清除的删除时链表头为0。调用者持有 writer_mutex
+ * @param database 数据库
+ */
+void database_write_purge_list(Database *database)
+{
+    Pager *pager = database->pager;
+    uint32_t num_entries = 0;
+    for(uint32_t i = 0; i < database->num_purge_batches; i++)
+    {
+        num_entries += database->purge_batches[i].num_keys;
+    }
+
+    uint32_t num_pages = (num_entries + PURGE_NODE_MAX_ENTRIES - 1) / PURGE_NODE_MAX_ENTRIES;
+    while(database->num_purge_pages > num_pages)
+    {
+        database_free_page(database, database->purge_pages[--database->num_purge_pages]);
+    }
+    if(num_pages > database->purge_pages_capacity)
+    {
+        database->purge_pages_capacity = num_pages;
+        database->purge_pages = (uint32_t *)realloc(database->purge_pages, sizeof(uint32_t) * database->purge_pages_capacity);
+    }
+    while(database->num_purge_pages < num_pages)
+    {
+        database->purge_pages[database->num_purge_pages++] = pager_allocate_page(pager);
+    }
+
+    uint32_t batch_num = 0;
+    uint32_t key_num = 0;
+    for(uint32_t i = 0; i < num_pages; i++)
+    {
+        uint32_t page_num = database->purge_pages[i];
+        void *page = get_page(pager, page_num);
+        pager_mark_dirty(pager, page_num);
+        set_node_type(page, NODE_PURGE);
+        set_node_root(page, false);
+        *node_parent(page) = (i + 1 < num_pages) ? database->purge_pages[i + 1] : 0;
+        uint32_t num_page_entries = 0;
+        while(num_page_entries < PURGE_NODE_MAX_ENTRIES && batch_num < database->num_purge_batches)
+        {
+            PurgeBatch *batch = &(database->purge_batches[batch_num]);
+            uint32_t *entry = purge_node_entry(page, num_page_entries++);
+            entry[0] = batch->table->catalog_slot;
+            entry[1] = batch->keys[key_num++];
+            if(key_num == batch->num_keys)
+            {
+                batch_num++;
+                key_num = 0;
+            }
+        }
+        *purge_node_num_entries(page) = num_page_entries;
+        unpin_page(pager, page_num);
+    }
+
+    void *catalog = get_page(pager, CATALOG_PAGE_NUM);
+    pager_mark_dirty(pager, CATALOG_PAGE_NUM);
+    *catalog_purge_head(catalog) = (num_pages > 0) ? database->purge_pages[0] : 0;
+    unpin_page(pager, CATALOG_PAGE_NUM);
+    database->purge_list_dirty = false;
+}
+
+/**
+ * 打开数据库时读入待清除列表
+ * 上次没有正常关闭时，提交了的删除可能还留在树中；每个表的键记成一批，还没有查询，马上就能删掉
+ * @param database 数据库，表都已经打开
+ */
+void database_load_purge_list(Database *database)
+{
+    Pager *pager = database->pager;
+    uint32_t **keys = (uint32_t **)calloc(database->num_tables, sizeof(uint32_t *));
+    uint32_t *num_keys = (uint32_t *)calloc(database->num_tables, sizeof(uint32_t));
+    uint32_t *capacities = (uint32_t *)calloc(database->num_tables, sizeof(uint32_t));
+    void *catalog = get_page(pager, CATALOG_PAGE_NUM);
+    uint32_t page_num = *catalog_purge_head(catalog);
+    unpin_page(pager, CATALOG_PAGE_NUM);
+    while(page_num != 0)
+    {
+        if(database->num_purge_pages == database->purge_pages_capacity)
+        {
+            database->purge_pages_capacity = (database->purge_pages_capacity == 0) ? 4 : database->purge_pages_capacity * 2;
+            database->purge_pages = (uint32_t *)realloc(database->purge_pages, sizeof(uint32_t) * database->purge_pages_capacity);
+        }
+        database->purge_pages[database->num_purge_pages++] = page_num;
+
+        void *page = get_page(pager, page_num);
+        for(uint32_t i = 0; i < *purge_node_num_entries(page); i++)
+        {
+            uint32_t *entry = purge_node_entry(page, i);
+            uint32_t slot = entry[0];
+            if(num_keys[slot] == capacities[slot])
+            {
+                capacities[slot] = (capacities[slot] == 0) ? 64 : capacities[slot] * 2;
+                keys[slot] = (uint32_t *)realloc(keys[slot], sizeof(uint32_t) * capacities[slot]);
+            }
+            keys[slot][num_keys[slot]++] = entry[1];
+        }
+        uint32_t next_page_num = *node_parent(page);
+        unpin_page(pager, page_num);
+        page_num = next_page_num;
+    }
+
+    for(uint32_t slot = 0; slot < database->num_tables; slot++)
+    {
+        if(num_keys[slot] > 0)
+        {
+            database_add_purge_batch(database, database->tables[slot], keys[slot], num_keys[slot], 0);
+        }
+    }
+    free(capacities);
+    free(num_keys);
+    free(keys);
+}
+
+/**
+ * 获取树的层数
+ * @return 层数，只有一个叶子节点时为1
+ */
+uint32_t table_depth(Table *table)
+{
+    uint32_t depth = 1;
+    uint32_t page_num = table->root_page_num;
+    void *node = get_page(table->pager, page_num);
+    while(get_node_type(node) == NODE_INTERNAL)
+    {
+        uint32_t child_page_num = *internal_node_child(node, 0);
+        unpin_page(table->pager, page_num);
+        page_num = child_page_num;
+        node = get_page(table->pager, page_num);
+        depth++;
+    }
+    unpin_page(table->pager, page_num);
+
+    return depth;
+}
+
+/**
+ * 按内部节点中的键把一段键切成区间
+ * 从根节点一层一层往下读和这段键相交的子节点，直到一层中的键够多或者下一层是叶子节点。
+ * 每个节点单独加共享锁读取，不同时刻读到的节点可能不一致，所以最后排序去重；
+ * 边界只决定怎么分工，每个区间都读同一个快照，边界不准确也不会漏掉或重复行
+ * @param start_key 下界（包含）
+ * @param end_key 上界（包含）
+ * @param max_keys 最多返回的键数，一层中的键更多时均匀地取
+ * @param num_keys 返回键数
+ * @return 在 [start_key, end_key) 中的键，按递增排列，调用者释放
+ */
+uint32_t* table_split_keys(Table *table, uint32_t start_key, uint32_t end_key, uint32_t max_keys, uint32_t *num_keys)
+{
+    Pager *pager = table->pager;
+    uint32_t *keys = NULL;
+    *num_keys = 0;
+    uint32_t *level = (uint32_t *)malloc(sizeof(uint32_t));    // 当前层要读的节点
+    uint32_t level_size = 1;
+    level[0] = table->root_page_num;
+
+    while(*num_keys < max_keys && level_size > 0)
+    {
+        uint32_t *children = NULL;
+        uint32_t num_children = 0;
+        uint32_t *level_keys = NULL;
+        uint32_t num_level_keys = 0;
+        bool leaves = false;
+        for(uint32_t i = 0; i < level_size && !leaves; i++)
+        {
+            void *node = page_latch_shared(pager, level[i]);
+            if(get_node_type(node) == NODE_LEAF)
+            {
+                leaves = true;
+            }
+            else
+            {
+                uint32_t node_num_keys = *internal_node_num_keys(node);
+                children = (uint32_t *)realloc(children, (num_children + node_num_keys + 1) * sizeof(uint32_t));
+                level_keys = (uint32_t *)realloc(level_keys, (num_level_keys + node_num_keys) * sizeof(uint32_t));
+                // 第 j 个子节点的键在 (key[j-1], key[j]] 中，最右子节点的键都大于最后一个键
+                for(uint32_t j = 0; j <= node_num_keys; j++)
+                {
+                    uint32_t child_page_num = (j < node_num_keys) ? *internal_node_child(node, j) : *internal_node_right_child(node);
+                    bool after_start = (j == node_num_keys) || *internal_node_key(node, j) >= start_key;
+                    bool before_end = (j == 0) || *internal_node_key(node, j - 1) < end_key;
+                    if(after_start && before_end && child_page_num != INVALID_PAGE_NUM)
+                    {
+                        children[num_children++] = child_page_num;
+                    }
+                    if(j < node_num_keys && *internal_node_key(node, j) >= start_key && *internal_node_key(node, j) < end_key)
+                    {
+                        level_keys[num_level_keys++] = *internal_node_key(node, j);
+                    }
+                }
+            }
+            page_unlatch_shared(pager, level[i]);
+        }
+
+        free(level);
+        level = children;
+        level_size = num_children;
+        if(leaves)
+        {
+            free(level_keys);
+            break;
+        }
+        free(keys);
+        keys = level_keys;
+        *num_keys = num_level_keys;
+    }
+    free(level);
+
+    if(*num_keys == 0)
+    {
+        free(keys);
+        return NULL;
+    }
+    qsort(keys, *num_keys, sizeof(uint32_t), compare_uint32);
+    uint32_t num_unique = 1;
+    for(uint32_t i = 1; i < *num_keys; i++)
+    {
+        if(keys[i] != keys[num_unique - 1])
+        {
+            keys[num_unique++] = keys[i];
+        }
+    }
+    if(num_unique > max_keys)
+    {
+        for(uint32_t i = 0; i < max_keys; i++)
+        {
+            keys[i] = keys[(uint64_t)(i + 1) * num_unique / (max_keys + 1)];
+        }
+        num_unique = max_keys;
+    }
+    *num_keys = num_unique;
+
+    return keys;
+}
+
+/**
+ * 整理数据库文件
+ * 标记所有表和索引用到的页，把文件末尾用到的页依次搬到前面没用到的页里，改写所有指向它们的页号，
+ * 再提交、检查点并截断文件。搬动页的时候持有 vacuum_lock 的排它锁，不能有查询在读树；
+ * 没有查询时所有待清除的行都能先删掉；空闲页链表和还没复用的页都在截掉的部分里或者被覆盖了，全部清空
+ * @param output 输出缓冲区
+ */
+void do_vacuum(Database *database, OutputBuffer *output)
+{
+    Pager *pager = database->pager;
+    pthread_rwlock_wrlock(&(database->vacuum_lock));
+    database_purge_deleted(database);
+    database->num_freed = 0;    // 删掉行时合并掉的节点和待清除列表的页都没有被标记，会被覆盖或者截掉
+    for(uint32_t i = 0; i < database->num_free_batches; i++)
+    {
+        free(database->free_batches[i].page_nums);
+        free(database->free_batches[i].guards);
+    }
+    database->num_free_batches = 0;
+
+    uint32_t num_pages = pager->num_pages;
+    bool *used = (bool *)calloc(num_pages, sizeof(bool));
+    used[CATALOG_PAGE_NUM] = true;
+    for(uint32_t i = 0; i < database->num_tables; i++)
+    {
+        Table *table = database->tables[i];
+        vacuum_mark(pager, table->root_page_num, used);
+        for(uint32_t column = 1; column < table->layout.num_columns; column++)
+        {
+            if(table->index_roots[column] != 0)
+            {
+                vacuum_mark(pager, table->index_roots[column], used);
+            }
+        }
+    }
+
+    // 从小到大把 target 之后用到的页依次放进 target 之前的空位，两边的数量相等
+    uint32_t target = 0;
+    for(uint32_t page_num = 0; page_num < num_pages; page_num++)
+    {
+        target += used[page_num];
+    }
+    uint32_t *new_page_nums = (uint32_t *)malloc(sizeof(uint32_t) * num_pages);
+    uint32_t hole = 0;
+    for(uint32_t page_num = 0; page_num < num_pages; page_num++)
+    {
+        new_page_nums[page_num] = page_num;
+        if(page_num < target || !used[page_num])
+        {
+            continue;
+        }
+        while(used[hole])
+        {
+            hole++;
+        }
+        new_page_nums[page_num] = hole++;
+
+        void *source = get_page(pager, page_num);
+        void *destination = get_page(pager, new_page_nums[page_num]);
+        pager_mark_dirty(pager, new_page_nums[page_num]);
+        memcpy(destination, source, PAGE_SIZE);
+        unpin_page(pager, new_page_nums[page_num]);
+        unpin_page(pager, page_num);
+    }
+
+    // 改写指向搬走的页的页号，没有变化的页不标记为脏页
+    void *scratch = malloc(PAGE_SIZE);
+    for(uint32_t page_num = 0; page_num < target; page_num++)
+    {
+        void *page = get_page(pager, page_num);
+        memcpy(scratch, page, PAGE_SIZE);
+        vacuum_translate(scratch, new_page_nums, num_pages);
+        if(memcmp(scratch, page, PAGE_SIZE) != 0)
+        {
+            pager_mark_dirty(pager, page_num);
+            memcpy(page, scratch, PAGE_SIZE);
+        }
+        unpin_page(pager, page_num);
+    }
+    free(scratch);
+
+    for(uint32_t i = 0; i < database->num_tables; i++)
+    {
+        Table *table = database->tables[i];
+        table->root_page_num = new_page_nums[table->root_page_num];
+        for(uint32_t column = 1; column < table->layout.num_columns; column++)
+        {
+            if(table->index_roots[column] != 0)
+            {
+                __atomic_store_n(&(table->index_roots[column]), new_page_nums[table->index_roots[column]], __ATOMIC_RELEASE);
+            }
+        }
+        catalog_write_table(table);
+    }
+    void *catalog = get_page(pager, CATALOG_PAGE_NUM);
+    pager_mark_dirty(pager, CATALOG_PAGE_NUM);
+    *node_parent(catalog) = 0;    // 空闲页链表清空
+    unpin_page(pager, CATALOG_PAGE_NUM);
+    free(new_page_nums);
+    free(used);
+
+    pager_commit(pager);
+    pager_checkpoint(pager);
+    pager_truncate(pager, target);
+    pthread_rwlock_unlock(&(database->vacuum_lock));
+    output_printf(output, "Vacuum freed %u pages.\n", num_pages - target);
+}
+
+/**
+ * 标记一棵树用到的页
+ * 表的内部节点沿所有子节点递归，索引的内部节点沿单元格中的子节点和最右子节点递归
+ * @param page_num 树的根节点页号
+ * @param used 每个页是否用到
+ */
+void vacuum_mark(Pager *pager, uint32_t page_num, bool *used)
+{
+    used[page_num] = true;
+    void *node = get_page(pager, page_num);
+    if(get_node_type(node) == NODE_INTERNAL)
+    {
+        for(uint32_t i = 0; i <= *internal_node_num_keys(node); i++)
+        {
+            vacuum_mark(pager, *internal_node_child(node, i), used);
+        }
+    }
+    else if(get_node_type(node) == NODE_INDEX_INTERNAL)
+    {
+        IndexEntry entry;
+        uint8_t *cell = index_node_cells(node, &entry);
+        for(uint32_t i = 0; i < *index_node_num_cells(node); i++)
+        {
+            cell = index_node_read_cell(node, cell, &entry);
+            vacuum_mark(pager, entry.child, used);
+        }
+        vacuum_mark(pager, *index_node_next(node), used);
+    }
+    unpin_page(pager, page_num);
+}
+
+/**
+ * 改写节点中指向其他页的页号
+ * 叶子节点的父节点和下一个叶子节点，内部节点的父节点和子节点，索引节点的下一个页号和内部节点单元格中的子节点
+ * @param node 节点的副本
+ * @param new_page_nums 每个旧页号对应的新页号
+ * @param num_pages 旧的页数
+ */
+void vacuum_translate(void *node, uint32_t *new_page_nums, uint32_t num_pages)
+{
+    bool root = is_node_root(node);
+    switch(get_node_type(node))
+    {
+        case NODE_LEAF:
+            if(!root)
+            {
+                *node_parent(node) = new_page_nums[*node_parent(node)];
+            }
+            if(*leaf_node_next_leaf(node) < num_pages)
+            {
+                *leaf_node_next_leaf(node) = new_page_nums[*leaf_node_next_leaf(node)];
+            }
+            break;
+        case NODE_INTERNAL:
+            if(!root)
+            {
+                *node_parent(node) = new_page_nums[*node_parent(node)];
+            }
+            for(uint32_t i = 0; i <= *internal_node_num_keys(node); i++)
+            {
+                *internal_node_child(node, i) = new_page_nums[*internal_node_child(node, i)];
+            }
+            break;
+        case NODE_INDEX_LEAF:
+        case NODE_INDEX_INTERNAL:
+            if(*index_node_next(node) < num_pages)
+            {
+                *index_node_next(node) = new_page_nums[*index_node_next(node)];
+            }
+            if(get_node_type(node) == NODE_INDEX_INTERNAL)
+            {
+                // 单元格是变长的，子节点页号在每个单元格的最后
+                uint8_t *cell = (uint8_t *)node + INDEX_NODE_HEADER_SIZE + *index_node_prefix_length(node);
+                for(uint32_t i = 0; i < *index_node_num_cells(node); i++)
+                {
+                    uint32_t *child = (uint32_t *)(cell + STRING_LENGTH_SIZE + *cell + ID_SIZE);
+                    *child = new_page_nums[*child];
+                    cell = (uint8_t *)child + INDEX_NODE_CHILD_SIZE;
+                }
+            }
+            break;
+        case NODE_CATALOG:
+        case NODE_FREE:
+        case NODE_PURGE:
+            break;
+    }
+}
+
+/**
+ * 检查数据库文件的完整性
+ * 依次检查目录页、每个表和它的索引、空闲页链表和待清除列表，打印发现的问题（按页号排序）和读过的页数。
+ * 还不能复用的页先记为已引用，树中再指向它们时会被发现。调用者持有 writer_mutex，不在显式事务中
+ * @param database 数据库
+ * @param output 输出缓冲区
+ */
+void do_check(Database *database, OutputBuffer *output)
+{
+    Pager *pager = database->pager;
+    IntegrityCheck check;
+    check.pager = pager;
+    check.num_pages = pager->num_pages;
+    check.seen = (uint8_t *)calloc(check.num_pages, sizeof(uint8_t));
+    check.num_checked = 0;
+    check.problems = (CheckProblem *)malloc(sizeof(CheckProblem) * CHECK_MAX_PROBLEMS);
+    check.num_problems = 0;
+    pthread_mutex_init(&(check.mutex), NULL);
+    check.pool = database->scan_pool;
+    uint32_t num_threads = (check.num_pages >= PARALLEL_SCAN_MIN_PAGES) ? database->scan_threads : 1;
+
+    for(uint32_t i = 0; i < database->num_free_batches; i++)
+    {
+        FreeBatch *batch = &(database->free_batches[i]);
+        for(uint32_t j = 0; j < batch->num_pages; j++)
+        {
+            check.seen[batch->page_nums[j]] = 1;
+        }
+    }
+
+    void *page = malloc(PAGE_SIZE);
+    uint8_t *buffer = (uint8_t *)malloc(PAGE_SIZE);
+    CheckItem item;
+    item.page_num = CATALOG_PAGE_NUM;
+    item.type = NODE_CATALOG;
+    check.seen[CATALOG_PAGE_NUM] = 1;
+    check_page(&check, &item, NULL, page, buffer, NULL);
+    uint32_t free_page_num = item.valid ? item.next : 0;
+    uint32_t purge_page_num = item.valid ? *catalog_purge_head(page) : 0;
+
+    for(uint32_t i = 0; i < database->num_tables; i++)
+    {
+        Table *table = database->tables[i];
+        check_tree(&check, table->root_page_num, NODE_LEAF, num_threads);
+        for(uint32_t column = 1; column < table->layout.num_columns; column++)
+        {
+            if(table->index_roots[column] != 0)
+            {
+                check_tree(&check, table->index_roots[column], NODE_INDEX_LEAF, num_threads);
+            }
+        }
+    }
+
+    // 空闲页链表只能顺序读
+    uint32_t previous_page_num = CATALOG_PAGE_NUM;
+    while(free_page_num != 0 && check_reference(&check, previous_page_num, free_page_num))
+    {
+        item.page_num = free_page_num;
+        item.type = NODE_FREE;
+        check_page(&check, &item, NULL, page, buffer, NULL);
+        previous_page_num = free_page_num;
+        free_page_num = item.valid ? item.next : 0;
+    }
+    previous_page_num = CATALOG_PAGE_NUM;
+    while(purge_page_num != 0 && check_reference(&check, previous_page_num, purge_page_num))
+    {
+        item.page_num = purge_page_num;
+        item.type = NODE_PURGE;
+        check_page(&check, &item, NULL, page, buffer, NULL);
+        previous_page_num = purge_page_num;
+        purge_page_num = item.valid ? item.next : 0;
+    }
+    free(buffer);
+    free(page);
+
+    uint32_t num_saved = (check.num_problems < CHECK_MAX_PROBLEMS) ? check.num_problems : CHECK_MAX_PROBLEMS;
+    qsort(check.problems, num_saved, sizeof(CheckProblem), compare_check_problems);
+    for(uint32_t i = 0; i < num_saved; i++)
+    {
+        output_printf(output, "Page %u: %s.\n", check.problems[i].page_num, check.problems[i].message);
+    }
+    if(check.num_problems == 0)
+    {
+        output_printf(output, "Checked %u pages: ok.\n", check.num_checked);
+    }
+    else
+    {
+        output_printf(output, "Checked %u pages: %u %s.\n", check.num_checked, check.num_problems, (check.num_problems == 1) ? "problem" : "problems");
+    }
+
+    pthread_mutex_destroy(&(check.mutex));
+    free(check.problems);
+    free(check.seen);
+}
+
+/**
+ * 一层一层地检查一棵树
+ * 每一层检查完以后，都是叶子节点时验证叶子节点链表按顺序连接了它们，叶子节点和内部节点混在一起说明树不平衡
+ * @param check 完整性检查
+ * @param root_page_num 根节点页号
+ * @param type 表的树为 NODE_LEAF，索引树为 NODE_INDEX_LEAF
+ * @param num_threads 线程数
+ */
+void check_tree(IntegrityCheck *check, uint32_t root_page_num, NodeType type, uint32_t num_threads)
+{
+    if(!check_reference(check, CATALOG_PAGE_NUM, root_page_num))
+    {
+        return;
+    }
+
+    uint32_t level_size = 1;
+    check->level = (CheckItem *)malloc(sizeof(CheckItem));
+    check->level[0].page_num = root_page_num;
+    check->level[0].parent = INVALID_PAGE_NUM;
+    check->level[0].low = -1;
+    check->level[0].high = -1;
+    check->level[0].index_low = NULL;
+    check->level[0].index_high = NULL;
+    check->level[0].type = type;
+    uint8_t **bounds = NULL;    // 内部节点分配的界，最左和最右的子节点继承父节点的界，所以检查完整棵树才释放
+    uint32_t num_bounds = 0;
+    while(level_size > 0)
+    {
+        check_level(check, level_size, num_threads);
+
+        CheckItem *level = check->level;
+        CheckItem *first_leaf = NULL;
+        bool internal = false;
+        for(uint32_t i = 0; i < level_size; i++)
+        {
+            if(!level[i].valid)
+            {
+                continue;
+            }
+            if(level[i].type == NODE_LEAF || level[i].type == NODE_INDEX_LEAF)
+            {
+                first_leaf = (first_leaf == NULL) ? &(level[i]) : first_leaf;
+            }
+            else
+            {
+                internal = true;
+            }
+        }
+        if(first_leaf != NULL && internal)
+        {
+            check_problem(check, first_leaf->page_num, "leaf is not at the same depth as the other leaves");
+        }
+        else if(first_leaf != NULL)
+        {
+            for(uint32_t i = 0; i < level_size; i++)
+            {
+                uint32_t expected = (i + 1 < level_size) ? level[i + 1].page_num : INVALID_PAGE_NUM;
+                bool known = (i + 1 == level_size) || level[i + 1].valid;    // 下一个页读不出来时已经报告过了
+                if(level[i].valid && known && level[i].next != expected)
+                {
+                    check_problem(check, level[i].page_num, "next leaf is %u, expected %u", level[i].next, expected);
+                }
+            }
+        }
+
+        free(level);
+
+        // 按段的顺序把子节点连起来
+        level_size = 0;
+        uint32_t total_bounds = num_bounds;
+        for(uint32_t i = 0; i < check->num_chunks; i++)
+        {
+            level_size += check->chunks[i].num_children;
+            total_bounds += check->chunks[i].num_bounds;
+        }
+        check->level = (CheckItem *)malloc(sizeof(CheckItem) * (level_size + 1));
+        bounds = (uint8_t **)realloc(bounds, sizeof(uint8_t *) * (total_bounds + 1));
+        level_size = 0;
+        for(uint32_t i = 0; i < check->num_chunks; i++)
+        {
+            CheckChunk *chunk = &(check->chunks[i]);
+            if(chunk->num_children > 0)    // 没有子节点的段 children 和 bounds 都是NULL
+            {
+                memcpy(check->level + level_size, chunk->children, sizeof(CheckItem) * chunk->num_children);
+            }
+            if(chunk->num_bounds > 0)
+            {
+                memcpy(bounds + num_bounds, chunk->bounds, sizeof(uint8_t *) * chunk->num_bounds);
+            }
+            level_size += chunk->num_children;
+            num_bounds += chunk->num_bounds;
+            free(chunk->children);
+            free(chunk->bounds);
+        }
+        free(check->chunks);
+    }
+
+    for(uint32_t i = 0; i < num_bounds; i++)
+    {
+        free(bounds[i]);
+    }
+    free(bounds);
+    free(check->level);
+}
+
+/**
+ * 并行检查树的一层
+ * 这一层的页按顺序每 CHECK_CHUNK_PAGES 页切成一段，执行检查的线程和线程池中空闲的线程一起领取
+ * @param check 完整性检查，level 是这一层的页，返回时 chunks 中是每一段的子节点
+ * @param level_size 这一层的页数
+ * @param num_threads 线程数
+ */
+void check_level(IntegrityCheck *check, uint32_t level_size, uint32_t num_threads)
+{
+    check->num_chunks = (level_size + CHECK_CHUNK_PAGES - 1) / CHECK_CHUNK_PAGES;
+    check->chunks = (CheckChunk *)calloc(check->num_chunks, sizeof(CheckChunk));
+    for(uint32_t i = 0; i < check->num_chunks; i++)
+    {
+        check->chunks[i].start = i * CHECK_CHUNK_PAGES;
+        check->chunks[i].end = (i + 1 == check->num_chunks) ? level_size : (i + 1) * CHECK_CHUNK_PAGES;
+    }
+    check->next_chunk = 0;
+
+    uint32_t num_helpers = ((num_threads < check->num_chunks) ? num_threads : check->num_chunks) - 1;
+    PoolJob job;
+    worker_pool_submit(check->pool, &job, check_worker, check, num_helpers);
+    check_worker(check);
+    worker_pool_finish(check->pool, &job);
+}
+
+/**
+ * 完整性检查的线程
+ * 领取一段页，逐个读出来检查，直到所有的段都被领取
+ * @param argument 完整性检查
+ * @return NULL
+ */
+void* check_worker(void *argument)
+{
+    IntegrityCheck *check = (IntegrityCheck *)argument;
+    void *page = malloc(PAGE_SIZE);
+    uint8_t *buffer = (uint8_t *)malloc(PAGE_SIZE);
+    IndexEntry *entries = (IndexEntry *)malloc(sizeof(IndexEntry) * INDEX_NODE_MAX_ENTRIES);
+    while(true)
+    {
+        pthread_mutex_lock(&(check->mutex));
+        uint32_t index = check->next_chunk;
+        if(index < check->num_chunks)
+        {
+            check->next_chunk++;
+        }
+        pthread_mutex_unlock(&(check->mutex));
+        if(index >= check->num_chunks)
+        {
+            break;
+        }
+
+        CheckChunk *chunk = &(check->chunks[index]);
+        for(uint32_t i = chunk->start; i < chunk->end; i++)
+        {
+            check_page(check, &(check->level[i]), chunk, page, buffer, entries);
+        }
+    }
+    free(entries);
+    free(buffer);
+    free(page);
+
+    return NULL;
+}
+
+/**
+ * 检查一个页并记下它的子节点
+ * 先验证校验和和节点类型，再按类型检查节点的内容
+ * @param check 完整性检查
+ * @param item 要检查的页，返回时记下实际的类型和下一个页号
+ * @param chunk 页所在的段，子节点放进这一段；目录页和空闲页没有子节点，为NULL
+ * @param page 一页大小的缓冲区
+ * @param buffer 一页大小的缓冲区，解压时使用
+ * @param entries 解码索引节点用的索引项，至少能放下 INDEX_NODE_MAX_ENTRIES 项
+ */
+void check_page(IntegrityCheck *check, CheckItem *item, CheckChunk *chunk, void *page, uint8_t *buffer, IndexEntry *entries)
+{
+    NodeType expected = item->type;
+    item->valid = false;
+    item->next = INVALID_PAGE_NUM;
+    __atomic_fetch_add(&(check->num_checked), 1, __ATOMIC_RELAXED);
+    if(!pager_read_page(check->pager, item->page_num, page, buffer))
+    {
+        check_problem(check, item->page_num, "compressed data is corrupt");
+        return;
+    }
+    if(*node_checksum(page) != page_checksum(page))
+    {
+        check_problem(check, item->page_num, "checksum mismatch");
+        return;
+    }
+
+    NodeType type = get_node_type(page);
+    bool table_node = (type == NODE_LEAF || type == NODE_INTERNAL);
+    bool index_node = (type == NODE_INDEX_LEAF || type == NODE_INDEX_INTERNAL);
+    if((expected == NODE_LEAF) ? !table_node : (expected == NODE_INDEX_LEAF) ? !index_node : type != expected)
+    {
+        check_problem(check, item->page_num, "unexpected node type %u", type);
+        return;
+    }
+    item->type = type;
+    item->valid = true;
+
+    if(table_node)
+    {
+        check_table_node(check, item, chunk, page);
+    }
+    else if(index_node)
+    {
+        check_index_node(check, item, chunk, page, entries);
+    }
+    else if(type == NODE_PURGE && *purge_node_num_entries(page) > PURGE_NODE_MAX_ENTRIES)
+    {
+        check_problem(check, item->page_num, "%u purge entries do not fit in the page", *purge_node_num_entries(page));
+        item->valid = false;
+    }
+    else
+    {
+        item->next = *node_parent(page);    // 目录页和空闲页的父节点指针是空闲页链表中的下一个页，待清除列表的页的是列表中的下一个页
+    }
+}
+
+/**
+ * 检查表的树中的节点
+ * 根节点标记和父节点指针要和树的结构一致，键递增并且在父节点给出的范围里；叶子节点的值都在堆中
+ * @param check 完整性检查
+ * @param item 要检查的页
+ * @param chunk 页所在的段
+ * @param node 节点
+ */
+void check_table_node(IntegrityCheck *check, CheckItem *item, CheckChunk *chunk, void *node)
+{
+    bool root = (item->parent == INVALID_PAGE_NUM);
+    if(is_node_root(node) != root)
+    {
+        check_problem(check, item->page_num, root ? "root is not marked as root" : "non-root node is marked as root");
+    }
+    else if(!root && *node_parent(node) != item->parent)
+    {
+        check_problem(check, item->page_num, "parent pointer is %u, expected %u", *node_parent(node), item->parent);
+    }
+
+    int64_t previous = item->low;
+    if(get_node_type(node) == NODE_LEAF)
+    {
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        uint32_t heap_start = *leaf_node_heap_start(node);
+        if(num_cells > LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_SLOT_SIZE ||
+            heap_start < LEAF_NODE_HEADER_SIZE + num_cells * LEAF_NODE_SLOT_SIZE || heap_start > PAGE_SIZE)
+        {
+            check_problem(check, item->page_num, "%u cells do not fit in the page", num_cells);
+            return;
+        }
+        for(uint32_t i = 0; i < num_cells; i++)
+        {
+            uint32_t key = *leaf_node_key(node, i);
+            uint32_t offset = *leaf_node_value_offset(node, i);
+            if(offset < heap_start || offset + *leaf_node_value_length(node, i) > PAGE_SIZE)
+            {
+                check_problem(check, item->page_num, "value of key %u is outside the heap", key);
+                return;
+            }
+            if((int64_t)key <= previous || (item->high >= 0 && (int64_t)key > item->high))
+            {
+                check_problem(check, item->page_num, "key %u is out of order", key);
+                return;
+            }
+            previous = key;
+        }
+        item->next = *leaf_node_next_leaf(node);
+        return;
+    }
+
+    uint32_t num_keys = *internal_node_num_keys(node);
+    if(num_keys > INTERNAL_NODE_MAX_KEYS)
+    {
+        check_problem(check, item->page_num, "%u keys do not fit in the page", num_keys);
+        return;
+    }
+    for(uint32_t i = 0; i < num_keys; i++)
+    {
+        uint32_t key = *internal_node_key(node, i);
+        if((int64_t)key <= previous || (item->high >= 0 && (int64_t)key > item->high))
+        {
+            check_problem(check, item->page_num, "key %u is out of order", key);
+            return;
+        }
+        previous = key;
+    }
+
+    // 第 i 个子节点的键在 (key[i-1], key[i]] 中，最右子节点的键在 (最后一个键, 上界] 中
+    CheckItem child;
+    child.parent = item->page_num;
+    child.index_low = NULL;
+    child.index_high = NULL;
+    child.type = NODE_LEAF;
+    child.low = item->low;
+    for(uint32_t i = 0; i < num_keys; i++)
+    {
+        child.high = *internal_node_key(node, i);
+        check_add_child(check, chunk, item, *internal_node_cell(node, i), &child);
+        child.low = child.high;
+    }
+    child.high = item->high;
+    check_add_child(check, chunk, item, *internal_node_right_child(node), &child);
+}
+
+/**
+ * 检查索引树中的节点
+ * 先确认变长的单元格都在页里再解码，键（字符串，id）严格递增并且在父节点给出的范围里；
+ * 内部节点的键编码到一块新分配的内存里，作为子节点的界
+ * @param check 完整性检查
+ * @param item 要检查的页
+ * @param chunk 页所在的段
+ * @param node 节点
+ * @param entries 解码用的索引项
+ */
+void check_index_node(IntegrityCheck *check, CheckItem *item, CheckChunk *chunk, void *node, IndexEntry *entries)
+{
+    bool internal = (get_node_type(node) == NODE_INDEX_INTERNAL);
+    uint32_t num_cells = *index_node_num_cells(node);
+    uint32_t prefix_length = *index_node_prefix_length(node);
+    uint32_t position = INDEX_NODE_HEADER_SIZE + prefix_length;
+    bool fits = num_cells + 2 <= INDEX_NODE_MAX_ENTRIES && prefix_length <= VARCHAR_MAX_SIZE && position <= PAGE_SIZE;
+    for(uint32_t i = 0; i < num_cells && fits; i++)
+    {
+        uint8_t suffix_length = ((uint8_t *)node)[position];
+        fits = position < PAGE_SIZE && prefix_length + suffix_length <= VARCHAR_MAX_SIZE;
+        position += STRING_LENGTH_SIZE + suffix_length + ID_SIZE + (internal ? INDEX_NODE_CHILD_SIZE : 0);
+        fits = fits && position <= PAGE_SIZE;
+    }
+    if(!fits)
+    {
+        check_problem(check, item->page_num, "%u cells do not fit in the page", num_cells);
+        return;
+    }
+
+    index_node_decode(node, entries);
+    for(uint32_t i = 0; i < num_cells; i++)
+    {
+        IndexEntry *entry = &(entries[i]);
+        bool after_previous = (i > 0) ?
+            compare_index_key(entries[i - 1].string, entries[i - 1].length, entries[i - 1].id, entry->string, entry->length, entry->id) < 0 :
+            (item->index_low == NULL || compare_index_bound(entry, item->index_low) > 0);
+        if(!after_previous || (item->index_high != NULL && compare_index_bound(entry, item->index_high) > 0))
+        {
+            check_problem(check, item->page_num, "entry %u (id %u) is out of order", i, entry->id);
+            return;
+        }
+    }
+    if(!internal)
+    {
+        item->next = *index_node_next(node);
+        return;
+    }
+
+    uint32_t size = 0;
+    for(uint32_t i = 0; i < num_cells; i++)
+    {
+        size += STRING_LENGTH_SIZE + entries[i].length + ID_SIZE;
+    }
+    uint8_t *bounds = (uint8_t *)malloc(size + 1);
+    if(chunk->num_bounds == chunk->bounds_capacity)
+    {
+        chunk->bounds_capacity = chunk->bounds_capacity ? chunk->bounds_capacity * 2 : 16;
+        chunk->bounds = (uint8_t **)realloc(chunk->bounds, sizeof(uint8_t *) * chunk->bounds_capacity);
+    }
+    chunk->bounds[chunk->num_bounds++] = bounds;
+
+    CheckItem child;
+    child.parent = item->page_num;
+    child.low = -1;
+    child.high = -1;
+    child.type = NODE_INDEX_LEAF;
+    child.index_low = item->index_low;
+    for(uint32_t i = 0; i <= num_cells; i++)
+    {
+        child.index_high = item->index_high;
+        if(i < num_cells)
+        {
+            child.index_high = bounds;
+            *bounds = entries[i].length;
+            memcpy(bounds + STRING_LENGTH_SIZE, entries[i].string, entries[i].length);
+            memcpy(bounds + STRING_LENGTH_SIZE + entries[i].length, &(entries[i].id), ID_SIZE);
+            bounds += STRING_LENGTH_SIZE + entries[i].length + ID_SIZE;
+        }
+        check_add_child(check, chunk, item, entries[i].child, &child);
+        child.index_low = child.index_high;
+    }
+}
+
+/**
+ * 比较索引项和编码后的界
+ * @param entry 索引项
+ * @param bound 界（长度：1字节，字符串，id：4字节）
+ * @return 索引项小于、等于、大于界时分别返回负数、0、正数
+ */
+int compare_index_bound(IndexEntry *entry, uint8_t *bound)
+{
+    uint32_t id;
+    memcpy(&id, bound + STRING_LENGTH_SIZE + *bound, ID_SIZE);
+    return compare_index_key(entry->string, entry->length, entry->id, (const char *)bound + STRING_LENGTH_SIZE, *bound, id);
+}
+
+/**
+ * 把子节点放进下一层
+ * @param check 完整性检查
+ * @param chunk 父节点所在的段
+ * @param parent 父节点
+ * @param page_num 子节点页号
+ * @param child 子节点的父节点、界和期望的类型
+ */
+void check_add_child(IntegrityCheck *check, CheckChunk *chunk, CheckItem *parent, uint32_t page_num, CheckItem *child)
+{
+    if(!check_reference(check, parent->page_num, page_num))
+    {
+        return;
+    }
+    if(chunk->num_children == chunk->children_capacity)
+    {
+        chunk->children_capacity = chunk->children_capacity ? chunk->children_capacity * 2 : 256;
+        chunk->children = (CheckItem *)realloc(chunk->children, sizeof(CheckItem) * chunk->children_capacity);
+    }
+    CheckItem *item = &(chunk->children[chunk->num_children++]);
+    *item = *child;
+    item->page_num = page_num;
+}
+
+/**
+ * 记下对一个页的引用
+ * 页号超出范围或者页已经被引用过（重复的指针或者环）时记下问题
+ * @param check 完整性检查
+ * @param from_page_num 引用它的页
+ * @param page_num 被引用的页
+ * @return 是否应该检查这个页
+ */
+bool check_reference(IntegrityCheck *check, uint32_t from_page_num, uint32_t page_num)
+{
+    if(page_num == CATALOG_PAGE_NUM || page_num >= check->num_pages)
+    {
+        check_problem(check, from_page_num, "points to page %u which is out of range", page_num);
+        return false;
+    }
+    if(__atomic_exchange_n(&(check->seen[page_num]), 1, __ATOMIC_RELAXED))
+    {
+        check_problem(check, from_page_num, "points to page %u which is already in use", page_num);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * 记下一个问题
+ * @param check 完整性检查
+ * @param page_num 有问题的页
+ * @param format 问题描述的格式
+ */
+void check_problem(IntegrityCheck *check, uint32_t page_num, const char *format, ...)
+{
+    pthread_mutex_lock(&(check->mutex));
+    if(check->num_problems < CHECK_MAX_PROBLEMS)
+    {
+        CheckProblem *problem = &(check->problems[check->num_problems]);
+        problem->page_num = page_num;
+        va_list arguments;
+        va_start(arguments, format);
+        vsnprintf(problem->message, CHECK_MESSAGE_SIZE, format, arguments);
+        va_end(arguments);
+    }
+    check->num_problems++;
+    pthread_mutex_unlock(&(check->mutex));
+}
+
+/**
+ * 按页号比较两个问题，同一个页的问题按描述排序，输出和线程的执行顺序无关
+ */
+int compare_check_problems(const void *a, const void *b)
+{
+    const CheckProblem *problem_a = (const CheckProblem *)a;
+    const CheckProblem *problem_b = (const CheckProblem *)b;
+    if(problem_a->page_num != problem_b->page_num)
+    {
+        return (problem_a->page_num > problem_b->page_num) - (problem_a->page_num < problem_b->page_num);
+    }
+    return strcmp(problem_a->message, problem_b->message);
+}
+
+/**
+ * 批量导入并打印结果
+ * @param filename 导入文件名
+ * @param fill_factor 填充因子（百分比）
+ * @param output 输出缓冲区
+ */
+void do_import(Table *table, const char *filename, uint32_t fill_factor, OutputBuffer *output)
+{
+    uint64_t num_rows = 0;
+    switch(table_import(table, filename, fill_factor, &num_rows))
+    {
+        case (IMPORT_SUCCESS):
+            output_printf(output, "Imported %llu rows.\n", (unsigned long long)num_rows);
+            break;
+        case (IMPORT_FILE_ERROR):
+            output_printf(output, "Unable to open import file '%s'.\n", filename);    // 打印错误信息
+            break;
+        case (IMPORT_SYNTAX_ERROR):
+            output_printf(output, "Syntax error on import line %llu.\n", (unsigned long long)num_rows + 1);    // 打印错误信息
+            break;
+        case (IMPORT_DUPLICATE_KEY):
+            output_printf(output, "Error: Duplicate key.\n");    // 打印错误信息
+            break;
+        case (IMPORT_TABLE_NOT_EMPTY):
+            output_printf(output, "Error: Table must be empty to import.\n");    // 打印错误信息
+            break;
+    }
+}
+
+/**
+ * 批量导入
+ * 文件每行是用逗号分隔的各列的值；读入的行序列化后存在内存中，超过 IMPORT_RUN_BYTES 时排序写成临时文件，
+ * 最后归并所有有序段，按键的顺序交给批量建树器。输入本来就有序时不需要排序
+ * 只能导入到空表：建树过程中根节点一直不变，失败时表仍然是空的，建树分配的页都在文件末尾，失败时截掉
+ * @param filename 导入文件名
+ * @param fill_factor 填充因子（百分比）
+ * @param num_rows 返回导入的行数；格式错误时是出错行之前的行数
+ * @return 导入结果
+ */
+ImportResult table_import(Table *table, const char *filename, uint32_t fill_factor, uint64_t *num_rows)
+{
+    *num_rows = 0;
+
+    void *root = get_page(table->pager, table->root_page_num);
+    bool empty = get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+    unpin_page(table->pager, table->root_page_num);
+    if(!empty)
+    {
+        return IMPORT_TABLE_NOT_EMPTY;
+    }
+
+    FILE *input = fopen(filename, "r");
+    if(input == NULL)
+    {
+        return IMPORT_FILE_ERROR;
+    }
+
+    uint8_t *arena = (uint8_t *)malloc(IMPORT_RUN_BYTES);    // 当前有序段的行
+    uint32_t arena_length = 0;
+    RowLayout *layout = &(table->layout);
+    uint32_t max_records = IMPORT_RUN_BYTES / (layout->fixed_size + layout->num_strings * STRING_LENGTH_SIZE);
+    uint8_t **records = (uint8_t **)malloc(sizeof(uint8_t *) * max_records);
+    uint32_t num_records = 0;
+    FILE **runs = NULL;
+    uint32_t num_runs = 0;
+    bool sorted = true;    // 当前有序段中的行是否已经按键排好序
+    uint32_t last_key = 0;
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ImportResult result = IMPORT_SUCCESS;
+    Row row;
+    while(getline(&line, &line_capacity, input) > 0)
+    {
+        if(!import_parse_line(layout, line, &row))
+        {
+            result = IMPORT_SYNTAX_ERROR;
+            break;
+        }
+
+        uint32_t length = row_serialized_size(&row);
+        if(arena_length + length > IMPORT_RUN_BYTES)
+        {
+            // 当前段放不下了，排序后写到临时文件
+            if(!sorted)
+            {
+                qsort(records, num_records, sizeof(uint8_t *), compare_records_by_key);
+            }
+            runs = (FILE **)realloc(runs, sizeof(FILE *) * (num_runs + 1));
+            runs[num_runs++] = import_write_run(layout, records, num_records);
+            arena_length = 0;
+            num_records = 0;
+            sorted = true;
+        }
+
+        if(num_records > 0 && row.id <= last_key)
+        {
+            sorted = false;
+        }
+        last_key = row.id;
+        records[num_records++] = arena + arena_length;
+        serialize_row(&row, arena + arena_length);
+        arena_length += length;
+        (*num_rows)++;
+    }
+    free(line);
+    fclose(input);
+
+    if(result == IMPORT_SUCCESS)
+    {
+        if(!sorted)
+        {
+            qsort(records, num_records, sizeof(uint8_t *), compare_records_by_key);
+        }
+
+        BulkLoader loader;
+        bulk_loader_init(&loader, table, fill_factor);
+        if(num_runs == 0)
+        {
+            // 所有行都在内存中
+            for(uint32_t i = 0; i < num_records && result == IMPORT_SUCCESS; i++)
+            {
+                if(!bulk_loader_add(&loader, records[i], row_size(layout, records[i])))
+                {
+                    result = IMPORT_DUPLICATE_KEY;
+                }
+            }
+        }
+        else
+        {
+            // 最后一段也写到临时文件，然后归并所有段；段数不多，每次线性找出最小的键
+            runs = (FILE **)realloc(runs, sizeof(FILE *) * (num_runs + 1));
+            runs[num_runs++] = import_write_run(layout, records, num_records);
+            ImportRun *merge = (ImportRun *)malloc(sizeof(ImportRun) * num_runs);
+            for(uint32_t i = 0; i < num_runs; i++)
+            {
+                merge[i].file = runs[i];
+                rewind(runs[i]);
+                import_run_next(&merge[i], layout);
+            }
+
+            while(result == IMPORT_SUCCESS)
+            {
+                ImportRun *smallest = NULL;
+                for(uint32_t i = 0; i < num_runs; i++)
+                {
+                    if(!merge[i].done && (smallest == NULL || row_id(merge[i].record) < row_id(smallest->record)))
+                    {
+                        smallest = &merge[i];
+                    }
+                }
+                if(smallest == NULL)
+                {
+                    break;
+                }
+
+                if(!bulk_loader_add(&loader, smallest->record, smallest->length))
+                {
+                    result = IMPORT_DUPLICATE_KEY;
+                }
+                import_run_next(smallest, layout);
+            }
+            free(merge);
+        }
+
+        if(result == IMPORT_SUCCESS)
+        {
+            bulk_loader_finish(&loader);
+
+            // 导入前在空表上建的索引也是空的，导入以后重建
+            for(uint32_t column = 1; column < layout->num_columns; column++)
+            {
+                if(table->index_roots[column] != 0)
+                {
+                    index_build(table, column, table->index_roots[column]);
+                }
+            }
+        }
+        else
+        {
+            // 已经建好的页都不可达，提交后截掉，文件恢复成导入前的大小
+            pager_commit(table->pager);
+            pager_checkpoint(table->pager);
+            pager_truncate(table->pager, loader.first_page_num);
+        }
+        bulk_loader_free(&loader);
+    }
+
+    for(uint32_t i = 0; i < num_runs; i++)
+    {
+        fclose(runs[i]);    // 临时文件关闭后自动删除
+    }
+    free(runs);
+    free(records);
+    free(arena);
+    pager_commit(table->pager);
+
+    return result;
+}
+
+/**
+ * 解析导入文件中的一行
+ * 各列的值用逗号分隔，最后一列是剩下的所有内容，行尾的换行符会被忽略
+ * @param layout 行的布局
+ * @param line 一行
+ * @param row 解析出的行
+ * @return 是否解析成功
+ */
+bool import_parse_line(RowLayout *layout, char *line, Row *row)
+{
+    line[strcspn(line, "\r\n")] = 0;
+    row_init(layout, row);
+    char *value = line;
+    for(uint32_t i = 0; i < layout->num_columns; i++)
+    {
+        char *next = NULL;
+        if(i + 1 < layout->num_columns)
+        {
+            next = strchr(value, ',');
+            if(next == NULL)
+            {
+                return false;
+            }
+            *next++ = 0;
+        }
+
+        Column *column = &(layout->columns[i]);
+        if(column->type == COLUMN_INT)
+        {
+            int32_t number;
+            if(!parse_int(value, &number) || (i == 0 && number < 0))
+            {
+                return false;
+            }
+            row_set_int(layout, row, i, number);
+        }
+        else
+        {
+            size_t length = strlen(value);
+            if(length > column->size)
+            {
+                return false;
+            }
+            row_set_string(layout, row, i, value, length);
+        }
+        value = next;
+    }
+
+    return true;
+}
+
+/**
+ * 按键比较两个序列化的行，用于排序有序段
+ */
+int compare_records_by_key(const void *a, const void *b)
+{
+    uint32_t key_a = row_id(*(uint8_t **)a);
+    uint32_t key_b = row_id(*(uint8_t **)b);
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+/**
+ * 把一个有序段写到临时文件
+ * @param layout 行的布局
+ * @param records 按键排好序的行
+ * @param num_records 行数
+ * @return 临时文件
+ */
+FILE* import_write_run(RowLayout *layout, uint8_t **records, uint32_t num_records)
+{
+    FILE *run = tmpfile();
+    if(run == NULL)
+    {
+        fatal_error("Unable to create temporary file for import: %d\n", errno);    // 打印错误信息
+    }
+
+    for(uint32_t i = 0; i < num_records; i++)
+    {
+        fwrite(records[i], 1, row_size(layout, records[i]), run);
+    }
+    return run;
+}
+
+/**
+ * 读取有序段中的下一行
+ * 行是自描述的：先读出所有整数列，再逐个读出字符串列的长度和内容
+ * @param run 有序段
+ * @param layout 行的布局
+ * @return 是否读到一行
+ */
+bool import_run_next(ImportRun *run, RowLayout *layout)
+{
+    if(fread(run->record, 1, layout->fixed_size, run->file) != layout->fixed_size)
+    {
+        run->done = true;
+        return false;
+    }
+
+    uint8_t *position = run->record + layout->fixed_size;
+    for(uint32_t i = 0; i < layout->num_strings; i++)
+    {
+        fread(position, 1, STRING_LENGTH_SIZE, run->file);
+        fread(position + STRING_LENGTH_SIZE, 1, *position, run->file);
+        position += STRING_LENGTH_SIZE + *position;
+    }
+
+    run->length = position - run->record;
+    run->done = false;
+    return true;
+}
+
+/**
+ * 初始化批量建树器
+ * @param loader 批量建树器
+ * @param fill_factor 填充因子（百分比），超出范围时使用默认值
+ */
+void bulk_loader_init(BulkLoader *loader, Table *table, uint32_t fill_factor)
+{
+    loader->table = table;
+    loader->fill_factor = (fill_factor >= 10 && fill_factor <= 100) ? fill_factor : DEFAULT_FILL_FACTOR;
+    loader->num_levels = 0;
+    loader->first_page_num = get_unused_page_num(table->pager);
+    loader->num_rows = 0;
+    for(uint32_t i = 0; i < BULK_LOADER_MAX_LEVELS; i++)
+    {
+        loader->nodes[i] = NULL;
+    }
+}
+
+/**
+ * 向批量建树器加入一行
+ * 行必须按键递增的顺序加入；当前叶子节点达到填充因子时写出，再开始新的叶子节点
+ * @param loader 批量建树器
+ * @param record 序列化的行
+ * @param length 行的长度
+ * @return 键比前一行大时返回true，键重复时返回false
+ */
+bool bulk_loader_add(BulkLoader *loader, void *record, uint32_t length)
+{
+    uint32_t key = row_id(record);
+    if(loader->num_rows > 0 && key <= loader->max_keys[0])
+    {
+        return false;
+    }
+
+    if(loader->num_levels == 0)
+    {
+        loader->num_levels = 1;
+        bulk_loader_start_node(loader, 0);
+    }
+
+    void *leaf = loader->nodes[0];
+    uint32_t used = LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(leaf);
+    uint32_t limit = LEAF_NODE_SPACE_FOR_CELLS * loader->fill_factor / 100;
+    if(*leaf_node_num_cells(leaf) > 0 &&
+        (used + length + LEAF_NODE_SLOT_SIZE > limit || leaf_node_free_space(leaf) < length + LEAF_NODE_SLOT_SIZE))
+    {
+        // 先给下一个叶子节点分配页号，写出当前叶子节点时才能链接到它
+        uint32_t next_page_num = bulk_loader_new_page(loader);
+        *leaf_node_next_leaf(leaf) = next_page_num;
+        bulk_loader_write_node(loader, 0);
+        initialize_leaf_node(leaf);
+        loader->page_nums[0] = next_page_num;
+    }
+
+    memcpy(leaf_node_allocate_cell(leaf, *leaf_node_num_cells(leaf), key, length), record, length);
+    loader->max_keys[0] = key;
+    loader->num_rows++;
+    return true;
+}
+
+/**
+ * 为批量建树分配新页
+ * 新页在表的最后面，只有写出时才会真正读进缓冲池；每分配一批页就提交一次，
+ * 这时根节点还没有改变，提交的页都不可达，中途崩溃时表仍然是空的
+ * @param loader 批量建树器
+ * @return 新页号
+ */
+uint32_t bulk_loader_new_page(BulkLoader *loader)
+{
+    Pager *pager = loader->table->pager;
+    uint32_t page_num = get_unused_page_num(pager);
+    if(page_num >= TABLE_MAX_PAGES)
+    {
+        fatal_error("Tried to fetch page number out of bounds. %u >= %u\n", page_num, TABLE_MAX_PAGES);    // 打印错误信息
+    }
+    pager->num_pages = page_num + 1;
+
+    if((page_num - loader->first_page_num + 1) % IMPORT_COMMIT_PAGES == 0)
+    {
+        pager_commit(pager);
+    }
+    return page_num;
+}
+
+/**
+ * 开始填充某一层的新节点
+ * @param loader 批量建树器
+ * @param level 层
+ */
+void bulk_loader_start_node(BulkLoader *loader, uint32_t level)
+{
+    if(loader->nodes[level] == NULL)
+    {
+        loader->nodes[level] = malloc(PAGE_SIZE);
+    }
+
+    if(level == 0)
+    {
+        initialize_leaf_node(loader->nodes[level]);
+    }
+    else
+    {
+        initialize_internal_node(loader->nodes[level]);
+    }
+    loader->page_nums[level] = bulk_loader_new_page(loader);
+}
+
+/**
+ * 把子节点加到某一层
+ * 内部节点的键是对应子节点的最大键，最右子节点没有键：新的子节点先放在最右子节点的位置，
+ * 再来一个子节点时把它移到单元格中
+ * @param loader 批量建树器
+ * @param level 层
+ * @param child_page_num 子节点页号
+ * @param child_max_key 子节点中的最大键
+ * @return 子节点的父节点页号
+ */
+uint32_t bulk_loader_add_child(BulkLoader *loader, uint32_t level, uint32_t child_page_num, uint32_t child_max_key)
+{
+    if(level == loader->num_levels)
+    {
+        if(level == BULK_LOADER_MAX_LEVELS)
+        {
+            fatal_error("Bulk load tree is too deep.\n");    // 打印错误信息
+        }
+        loader->num_levels++;
+        bulk_loader_start_node(loader, level);
+    }
+
+    void *node = loader->nodes[level];
+    uint32_t limit = INTERNAL_NODE_MAX_KEYS * loader->fill_factor / 100;
+    if(limit == 0)
+    {
+        limit = 1;
+    }
+    if(*internal_node_right_child(node) != INVALID_PAGE_NUM && *internal_node_num_keys(node) >= limit)
+    {
+        // 当前节点满了，写出后开始同一层的新节点
+        bulk_loader_write_node(loader, level);
+        bulk_loader_start_node(loader, level);
+    }
+
+    if(*internal_node_right_child(node) != INVALID_PAGE_NUM)
+    {
+        uint32_t num_keys = *internal_node_num_keys(node);
+        *internal_node_cell(node, num_keys) = *internal_node_right_child(node);
+        *internal_node_key(node, num_keys) = loader->max_keys[level];
+        *internal_node_num_keys(node) = num_keys + 1;
+    }
+    *internal_node_right_child(node) = child_page_num;
+    loader->max_keys[level] = child_max_key;
+
+    return loader->page_nums[level];
+}
+
+/**
+ * 把某一层填充好的节点写到页里
+ * 先把节点加到上一层，得到父节点页号，再写出这个节点
+ * @param loader 批量建树器
+ * @param level 层
+ */
+void bulk_loader_write_node(BulkLoader *loader, uint32_t level)
+{
+    Pager *pager = loader->table->pager;
+    void *node = loader->nodes[level];
+    uint32_t page_num = loader->page_nums[level];
+    *node_parent(node) = bulk_loader_add_child(loader, level + 1, page_num, loader->max_keys[level]);
+
+    void *page = get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+    memcpy(page, node, PAGE_SIZE);
+    unpin_page(pager, page_num);
+}
+
+/**
+ * 写出所有节点，把最上层的节点放到根节点
+ * 从下往上写出每一层最后一个节点；最上层只有一个节点，它就是根，复制到根节点的页，
+ * 再把它的子节点的父节点改成根节点。它原来分配的页是最后一页时就收回
+ * @param loader 批量建树器
+ */
+void bulk_loader_finish(BulkLoader *loader)
+{
+    if(loader->num_levels == 0)
+    {
+        return;    // 没有导入任何行
+    }
+
+    Pager *pager = loader->table->pager;
+    uint32_t root_page_num = loader->table->root_page_num;
+    for(uint32_t level = 0; level < loader->num_levels; level++)
+    {
+        if(level + 1 < loader->num_levels)
+        {
+            bulk_loader_write_node(loader, level);
+            continue;
+        }
+
+        void *node = loader->nodes[level];
+        set_node_root(node, true);
+        *node_parent(node) = 0;
+        void *root = get_page(pager, root_page_num);
+        pager_mark_dirty(pager, root_page_num);
+        memcpy(root, node, PAGE_SIZE);
+        unpin_page(pager, root_page_num);
+
+        if(get_node_type(node) == NODE_INTERNAL)
+        {
+            for(uint32_t i = 0; i <= *internal_node_num_keys(node); i++)
+            {
+                uint32_t child_page_num = *internal_node_child(node, i);
+                void *child = get_page(pager, child_page_num);
+                pager_mark_dirty(pager, child_page_num);
+                *node_parent(child) = root_page_num;
+                unpin_page(pager, child_page_num);
+            }
+        }
+
+        if(loader->page_nums[level] == pager->num_pages - 1)
+        {
+            pager->num_pages--;
+        }
+        break;
+    }
+}
+
+/**
+ * 释放批量建树器
+ * @param loader 批量建树器
+ */
+void bulk_loader_free(BulkLoader *loader)
+{
+    for(uint32_t i = 0; i < BULK_LOADER_MAX_LEVELS; i++)
+    {
+        free(loader->nodes[i]);
+    }
+}
+
+/**
+ * 初始化版本存储
+ * @param store 版本存储
+ */
+void version_store_init(VersionStore *store)
+{
+    pthread_rwlock_init(&(store->lock), NULL);
+    store->commit_version = 0;
+    store->capacity = VERSION_STORE_INITIAL_CAPACITY;
+    store->versions = (RowVersion *)malloc(sizeof(RowVersion) * store->capacity);
+    store->buckets = (uint64_t *)calloc(store->capacity, sizeof(uint64_t));
+    store->first = 0;
+    store->next = 0;
+    store->snapshots = NULL;
+    store->num_snapshots = 0;
+    store->snapshot_capacity = 0;
+}
+
+/**
+ * 释放版本存储
+ * @param store 版本存储
+ */
+void version_store_free(VersionStore *store)
+{
+    free(store->versions);
+    free(store->buckets);
+    free(store->snapshots);
+    pthread_rwlock_destroy(&(store->lock));
+}
+
+/**
+ * 开始一个快照
+ * 快照是当前的提交版本，查询结束前它之后插入的行都看不到，它需要的行版本也不会被回收
+ * @return 快照
+ */
+uint64_t snapshot_begin(Table *table)
+{
+    VersionStore *store = &(table->versions);
+    pthread_rwlock_wrlock(&(store->lock));
+    uint64_t snapshot = store->commit_version;
+    if(store->num_snapshots == store->snapshot_capacity)
+    {
+        store->snapshot_capacity = (store->snapshot_capacity == 0) ? 16 : store->snapshot_capacity * 2;
+        store->snapshots = (uint64_t *)realloc(store->snapshots, sizeof(uint64_t) * store->snapshot_capacity);
+    }
+    store->snapshots[store->num_snapshots++] = snapshot;    // 提交版本只会增大，追加到末尾仍然有序
+    pthread_rwlock_unlock(&(store->lock));
+    return snapshot;
+}
+
+/**
+ * 结束一个快照
+ * 最旧的快照结束后，只有它需要的行版本就可以回收了
+ * @param snapshot 快照
+ */
+void snapshot_end(Table *table, uint64_t snapshot)
+{
+    VersionStore *store = &(table->versions);
+    pthread_rwlock_wrlock(&(store->lock));
+    uint32_t i = 0;
+    while(store->snapshots[i] != snapshot)
+    {
+        i++;
+    }
+    memmove(store->snapshots + i, store->snapshots + i + 1, sizeof(uint64_t) * (store->num_snapshots - i - 1));
+    store->num_snapshots--;
+    if(i == 0)
+    {
+        version_collect(store);
+    }
+    pthread_rwlock_unlock(&(store->lock));
+}
+
+/**
+ * 记录写者正在插入的行
+ * 必须在修改叶子节点之前调用：读者复制叶子节点以后才过滤，这时新行的版本一定已经在版本存储里
+ * @param key 键
+ */
+void version_record(Table *table, uint32_t key)
+{
+    VersionStore *store = &(table->versions);
+    pthread_rwlock_wrlock(&(store->lock));
+    RowVersion *version = version_append(store, key);
+    version->version = store->commit_version + 1;    // 写者的版本在提交之前比所有快照都新
+    pthread_rwlock_unlock(&(store->lock));
+}
+
+/**
+ * 记录写者正在删除的行
+ * 行还留在树中，提交后比它旧的快照都结束了才由 table_purge 删掉；在这之前快照按删除的版本判断能不能看到它
+ * @param key 键，在表中存在
+ */
+void version_delete(Table *table, uint32_t key)
+{
+    VersionStore *store = &(table->versions);
+    pthread_rwlock_wrlock(&(store->lock));
+    RowVersion *version = version_find(store, key);
+    if(version == NULL)
+    {
+        version = version_append(store, key);
+        version->version = 0;    // 行版本已经被回收，所有快照都能看到插入
+    }
+    version->deleted = store->commit_version + 1;
+    pthread_rwlock_unlock(&(store->lock));
+
+    if(table->num_deleted == table->deleted_capacity)
+    {
+        table->deleted_capacity = (table->deleted_capacity == 0) ? 64 : table->deleted_capacity * 2;
+        table->deleted_keys = (uint32_t *)realloc(table->deleted_keys, sizeof(uint32_t) * table->deleted_capacity);
+    }
+    table->deleted_keys[table->num_deleted++] = key;
+}
+
+/**
+ * 清除删除标记
+ * 回滚时调用：行还在树中，去掉删除的版本以后所有快照又都能看到它们
+ */
+void version_clear_deleted(Table *table)
+{
+    VersionStore *store = &(table->versions);
+    pthread_rwlock_wrlock(&(store->lock));
+    for(uint32_t i = 0; i < table->num_deleted; i++)
+    {
+        RowVersion *version = version_find(store, table->deleted_keys[i]);
+        if(version != NULL)
+        {
+            version->deleted = 0;
+        }
+    }
+    version_collect(store);
+    pthread_rwlock_unlock(&(store->lock));
+    table->num_deleted = 0;
+}
+
+/**
+ * 判断键是否被写者还没提交的删除标记了
+ * 这样的行还留在树中，写者再插入同一个键时不算重复；调用者持有 writer_mutex
+ * @param key 键
+ * @return 是否被写者删除
+ */
+bool version_deleted_by_writer(Table *table, uint32_t key)
+{
+    if(table->num_deleted == 0)
+    {
+        return false;
+    }
+
+    VersionStore *store = &(table->versions);
+    pthread_rwlock_rdlock(&(store->lock));
+    RowVersion *version = version_find(store, key);
+    bool deleted = version != NULL && version->deleted == store->commit_version + 1;
+    pthread_rwlock_unlock(&(store->lock));
+    return deleted;
+}
+
+/**
+ * 判断键的删除是否已经提交、行还留在树中
+ * 还有旧的快照能看到这一行，同一个键上不能有两个行版本，写者要等它从树中删掉以后才能再插入这个键；调用者持有 writer_mutex
+ * @param key 键，在树中
+ * @return 删除是否已经提交
+ */
+bool version_delete_pending(Table *table, uint32_t key)
+{
+    VersionStore *store = &(table->versions);
+    pthread_rwlock_rdlock(&(store->lock));
+    RowVersion *version = version_find(store, key);
+    bool pending = version != NULL && version->deleted != 0 && version->deleted <= store->commit_version;
+    pthread_rwlock_unlock(&(store->lock));
+    return pending;
+}
+
+/**
+ * 去掉写者对一个键的删除
+ * 旧的行已经从树中删掉，写者要重新插入这个键。行版本改成写者的版本插入的，提交之前其他查询看不到这个键，
+ * 提交以后看到新的行；键从 deleted_keys 中去掉，提交时不再删除
+ * @param key 键，被写者删除了
+ */
+void version_undelete(Table *table, uint32_t key)
+{
+    VersionStore *store = &(table->versions);
+    pthread_rwlock_wrlock(&(store->lock));
+    RowVersion *version = version_find(store, key);
+    version->version = store->commit_version + 1;
+    version->deleted = 0;
+    pthread_rwlock_unlock(&(store->lock));
+
+    // 刚删除的键在末尾，从后往前找；table_purge 会排序，顺序不用保持
+    for(uint32_t i = table->num_deleted; i-- > 0;)
+    {
+        if(table->deleted_keys[i] == key)
+        {
+            table->deleted_keys[i] = table->deleted_keys[--table->num_deleted];
+            break;
+        }
+    }
+}
+
+/**
+ * 删除的行已经从树中删掉
+ * 快照已经不能靠树中有没有这一行来判断：删除前开始的查询可能在删掉之前复制了叶子节点，还没有过滤。
+ * 把行版本改成下一个提交版本插入的，这些查询看不到它；再提交一次版本，之后开始的查询在树中也找不到它，
+ * 旧的查询都结束以后行版本就被回收了。打开数据库时删掉的行没有行版本，也没有查询，不需要改
+ * @param keys 删掉的键
+ * @param num_keys 键数
+ */
+void version_purged(Table *table, uint32_t *keys, uint32_t num_keys)
+{
+    VersionStore *store = &(table->versions);
+    pthread_rwlock_wrlock(&(store->lock));
+    for(uint32_t i = 0; i < num_keys; i++)
+    {
+        RowVersion *version = version_find(store, keys[i]);
+        if(version != NULL)
+        {
+            version->version = store->commit_version + 1;
+            version->deleted = 0;
+        }
+    }
+    store->commit_version++;
+    version_collect(store);
+    pthread_rwlock_unlock(&(store->lock));
+}
+
+/**
+ * 在版本存储末尾追加一个行版本
+ * 调用者持有排它锁，并设置插入的版本
+ * @param store 版本存储
+ * @param key 键
+ * @return 新的行版本
+ */
+RowVersion* version_append(VersionStore *store, uint32_t key)
+{
+    if(store->next - store->first == store->capacity)
+    {
+        version_store_grow(store);
+    }
+
+    uint32_t mask = store->capacity - 1;
+    uint32_t bucket = (key * 2654435761u) & mask;
+    RowVersion *version = &(store->versions[store->next & mask]);
+    version->key = key;
+    version->deleted = 0;
+    version->hash_next = store->buckets[bucket];
+    store->buckets[bucket] = ++store->next;
+    return version;
+}
+
+/**
+ * 提交写者的版本
+ * 之后开始的快照能看到这个版本插入的行
+ */
+void version_commit(Table *table)
+{
+    VersionStore *store = &(table->versions);
+    pthread_rwlock_wrlock(&(store->lock));
+    store->commit_version++;
+    version_collect(store);
+    pthread_rwlock_unlock(&(store->lock));
+}
+
+/**
+ * 回收所有快照都能看到的行版本
+ * 没有活跃的快照时，所有已经提交的行版本都可以回收；调用者持有排它锁
+ * @param store 版本存储
+ */
+void version_collect(VersionStore *store)
+{
+    uint64_t oldest = (store->num_snapshots > 0) ? store->snapshots[0] : store->commit_version;
+    uint32_t mask = store->capacity - 1;
+    while(store->first < store->next && store->versions[store->first & mask].version <= oldest &&
+          store->versions[store->first & mask].deleted == 0)    // 删除的行从树中删掉以前还要用行版本判断
+    {
+        store->first++;
+    }
+}
+
+/**
+ * 扩大版本存储
+ * 环形数组和哈希桶都扩大一倍，按序号从旧到新重新放入，哈希链仍然是从新到旧；调用者持有排它锁
+ * @param store 版本存储
+ */
+void version_store_grow(VersionStore *store)
+{
+    uint32_t old_mask = store->capacity - 1;
+    RowVersion *old_versions = store->versions;
+
+    store->capacity *= 2;
+    uint32_t mask = store->capacity - 1;
+    store->versions = (RowVersion *)malloc(sizeof(RowVersion) * store->capacity);
+    free(store->buckets);
+    store->buckets = (uint64_t *)calloc(store->capacity, sizeof(uint64_t));
+    for(uint64_t sequence = store->first; sequence < store->next; sequence++)
+    {
+        RowVersion *version = &(store->versions[sequence & mask]);
+        *version = old_versions[sequence & old_mask];
+        uint32_t bucket = (version->key * 2654435761u) & mask;
+        version->hash_next = store->buckets[bucket];
+        store->buckets[bucket] = sequence + 1;
+    }
+    free(old_versions);
+}
+
+/**
+ * 查找键最新的行版本
+ * 调用者持有锁
+ * @param store 版本存储
+ * @param key 键
+ * @return 行版本，键没有未回收的行版本时返回NULL
+ */
+RowVersion* version_find(VersionStore *store, uint32_t key)
+{
+    uint32_t mask = store->capacity - 1;
+    uint64_t sequence = store->buckets[(key * 2654435761u) & mask];
+    while(sequence > store->first)    // 序号加1不大于 first 的行版本已经被回收
+    {
+        RowVersion *version = &(store->versions[(sequence - 1) & mask]);
+        if(version->key == key)
+        {
+            return version;
+        }
+        sequence = version->hash_next;
+    }
+    return NULL;
+}
+
+/**
+ * 判断快照能否看到键所在的行
+ * 行版本被回收说明所有快照都能看到这一行
+ * @param key 键，在表中存在
+ * @param snapshot 快照
+ * @return 是否能看到
+ */
+bool version_visible(Table *table, uint32_t key, uint64_t snapshot)
+{
+    VersionStore *store = &(table->versions);
+    pthread_rwlock_rdlock(&(store->lock));
+    bool visible = row_version_visible(version_find(store, key), snapshot);
+    pthread_rwlock_unlock(&(store->lock));
+    return visible;
+}
+
+/**
+ * 判断快照能否看到行版本对应的行
+ * @param version 键最新的行版本，NULL表示已经被回收
+ * @param snapshot 快照
+ * @return 是否能看到
+ */
+bool row_version_visible(RowVersion *version, uint64_t snapshot)
+{
+    return version == NULL ||
+           (version->version <= snapshot && (version->deleted == 0 || version->deleted > snapshot));
+}
+
+/**
+ * 从叶子节点副本中去掉快照看不到的行
+ * 只移动槽，行的内容留在原来的位置；版本存储为空时（没有并发的写者）什么都不用做
+ * @param node 叶子节点的副本
+ * @param snapshot 快照
+ * @param cell_num 过滤前的单元格号
+ * @return 过滤后 cell_num 对应的单元格号
+ */
+uint32_t version_filter_leaf(Table *table, void *node, uint64_t snapshot, uint32_t cell_num)
+{
+    VersionStore *store = &(table->versions);
+    pthread_rwlock_rdlock(&(store->lock));
+    if(store->first == store->next)
+    {
+        pthread_rwlock_unlock(&(store->lock));
+        return cell_num;
+    }
+
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t num_visible = 0;
+    uint32_t new_cell_num = 0;
+    for(uint32_t i = 0; i < num_cells; i++)
+    {
+        if(i == cell_num)
+        {
+            new_cell_num = num_visible;
+        }
+        if(!row_version_visible(version_find(store, *leaf_node_key(node, i)), snapshot))
+        {
+            continue;
+        }
+        if(num_visible != i)
+        {
+            memcpy(leaf_node_cell(node, num_visible), leaf_node_cell(node, i), LEAF_NODE_SLOT_SIZE);
+        }
+        num_visible++;
+    }
+    pthread_rwlock_unlock(&(store->lock));
+
+    if(cell_num >= num_cells)
+    {
+        new_cell_num = num_visible;
+    }
+    *leaf_node_num_cells(node) = num_visible;
+    return new_cell_num;
+}
+
+/**
+ * 获取索引节点中单元格数量
+ * @param node 索引节点
+ * @return 单元格数量
+ */
+uint16_t* index_node_num_cells(void *node)
+{
+    return node + INDEX_NODE_NUM_CELLS_OFFSET;
+}
+
+/**
+ * 获取索引节点的下一个页号
+ * @param node 索引节点
+ * @return 叶子节点是下一个叶子节点页号，内部节点是最右子节点页号
+ */
+uint32_t* index_node_next(void *node)
+{
+    return node + INDEX_NODE_NEXT_OFFSET;
+}
+
+/**
+ * 获取索引节点公共前缀的长度
+ * @param node 索引节点
+ * @return 公共前缀长度
+ */
+uint16_t* index_node_prefix_length(void *node)
+{
+    return node + INDEX_NODE_PREFIX_LENGTH_OFFSET;
+}
+
+/**
+ * 读取索引节点的公共前缀
+ * 前缀复制到 entry 的字符串开头，之后读取单元格只需要在它后面写入后缀
+ * @param node 索引节点
+ * @param entry 索引项
+ * @return 第一个单元格的位置
+ */
+uint8_t* index_node_cells(void *node, IndexEntry *entry)
+{
+    uint32_t prefix_length = *index_node_prefix_length(node);
+    memcpy(entry->string, node + INDEX_NODE_HEADER_SIZE, prefix_length);
+    entry->length = prefix_length;
+    entry->infinite = false;
+    return node + INDEX_NODE_HEADER_SIZE + prefix_length;
+}
+
+/**
+ * 读取索引节点中的一个单元格
+ * 单元格不是对齐存放的，id 和子节点页号用 memcpy 读取
+ * @param node 索引节点
+ * @param cell 单元格的位置
+ * @param entry 索引项，字符串开头已经是公共前缀
+ * @return 下一个单元格的位置
+ */
+uint8_t* index_node_read_cell(void *node, uint8_t *cell, IndexEntry *entry)
+{
+    uint32_t prefix_length = *index_node_prefix_length(node);
+    uint32_t suffix_length = *cell;
+    memcpy(entry->string + prefix_length, cell + STRING_LENGTH_SIZE, suffix_length);
+    entry->length = prefix_length + suffix_length;
+    cell += STRING_LENGTH_SIZE + suffix_length;
+    memcpy(&(entry->id), cell, ID_SIZE);
+    cell += ID_SIZE;
+    if(get_node_type(node) == NODE_INDEX_INTERNAL)
+    {
+        memcpy(&(entry->child), cell, INDEX_NODE_CHILD_SIZE);
+        cell += INDEX_NODE_CHILD_SIZE;
+    }
+    return cell;
+}
+
+/**
+ * 比较两个索引键
+ * 先按字节比较字符串（较短的字符串是另一个的前缀时较小），字符串相同再比较id
+ * @param a 字符串a
+ * @param a_length 字符串a的长度
+ * @param a_id id a
+ * @param b 字符串b
+ * @param b_length 字符串b的长度
+ * @param b_id id b
+ * @return 比较结果
+ */
+int compare_index_key(const char *a, uint32_t a_length, uint32_t a_id, const char *b, uint32_t b_length, uint32_t b_id)
+{
+    int result = memcmp(a, b, a_length < b_length ? a_length : b_length);
+    if(result != 0)
+    {
+        return result;
+    }
+    if(a_length != b_length)
+    {
+        return (a_length > b_length) - (a_length < b_length);
+    }
+    return (a_id > b_id) - (a_id < b_id);
+}
+
+/**
+ * 按索引键比较两条建索引的记录
+ * 记录的格式是 id：4字节，字符串长度：1字节，字符串
+ * @param a 记录的地址
+ * @param b 记录的地址
+ * @return 比较结果
+ */
+int compare_index_records(const void *a, const void *b)
+{
+    const uint8_t *record_a = *(const uint8_t **)a;
+    const uint8_t *record_b = *(const uint8_t **)b;
+    uint32_t id_a;
+    uint32_t id_b;
+    memcpy(&id_a, record_a, ID_SIZE);
+    memcpy(&id_b, record_b, ID_SIZE);
+    return compare_index_key((const char *)record_a + ID_SIZE + STRING_LENGTH_SIZE, record_a[ID_SIZE], id_a,
+        (const char *)record_b + ID_SIZE + STRING_LENGTH_SIZE, record_b[ID_SIZE], id_b);
+}
+
+/**
+ * 计算两个索引项的公共前缀长度
+ * 索引项是有序的，第一项和最后一项的公共前缀也是中间所有项的公共前缀
+ * @param a 索引项
+ * @param b 索引项
+ * @return 公共前缀长度
+ */
+uint32_t index_common_prefix(IndexEntry *a, IndexEntry *b)
+{
+    uint32_t length = a->length < b->length ? a->length : b->length;
+    uint32_t prefix_length = 0;
+    while(prefix_length < length && a->string[prefix_length] == b->string[prefix_length])
+    {
+        prefix_length++;
+    }
+    return prefix_length;
+}
+
+/**
+ * 计算索引项编码成一个节点后的大小
+ * @param entries 有序的索引项
+ * @param num_entries 索引项数量，内部节点包括最后一项（最右子节点）
+ * @param internal 是否为内部节点
+ * @return 字节数
+ */
+uint32_t index_node_size(IndexEntry *entries, uint32_t num_entries, bool internal)
+{
+    uint32_t num_cells = internal ? num_entries - 1 : num_entries;
+    uint32_t prefix_length = num_cells > 0 ? index_common_prefix(&entries[0], &entries[num_cells - 1]) : 0;
+    uint32_t size = INDEX_NODE_HEADER_SIZE + prefix_length;
+    for(uint32_t i = 0; i < num_cells; i++)
+    {
+        size += STRING_LENGTH_SIZE + entries[i].length - prefix_length + ID_SIZE + (internal ? INDEX_NODE_CHILD_SIZE : 0);
+    }
+    return size;
+}
+
+/**
+ * 把索引项编码成一个节点
+ * 不改变节点是否为根节点和父节点指针，索引节点不使用父节点指针
+ * @param node 节点
+ * @param internal 是否为内部节点
+ * @param entries 有序的索引项，编码后的大小不能超过一页
+ * @param num_entries 索引项数量，内部节点的最后一项是最右子节点
+ * @param next_leaf 叶子节点的下一个叶子节点页号，内部节点忽略
+ */
+void index_node_encode(void *node, bool internal, IndexEntry *entries, uint32_t num_entries, uint32_t next_leaf)
+{
+    uint32_t num_cells = internal ? num_entries - 1 : num_entries;
+    uint32_t prefix_length = num_cells > 0 ? index_common_prefix(&entries[0], &entries[num_cells - 1]) : 0;
+    set_node_type(node, internal ? NODE_INDEX_INTERNAL : NODE_INDEX_LEAF);
+    *index_node_num_cells(node) = num_cells;
+    *index_node_next(node) = internal ? entries[num_entries - 1].child : next_leaf;
+    *index_node_prefix_length(node) = prefix_length;
+
+    uint8_t *cell = node + INDEX_NODE_HEADER_SIZE;
+    if(num_cells > 0)
+    {
+        memcpy(cell, entries[0].string, prefix_length);
+        cell += prefix_length;
+    }
+    for(uint32_t i = 0; i < num_cells; i++)
+    {
+        uint32_t suffix_length = entries[i].length - prefix_length;
+        *cell = suffix_length;
+        memcpy(cell + STRING_LENGTH_SIZE, entries[i].string + prefix_length, suffix_length);
+        cell += STRING_LENGTH_SIZE + suffix_length;
+        memcpy(cell, &(entries[i].id), ID_SIZE);
+        cell += ID_SIZE;
+        if(internal)
+        {
+            memcpy(cell, &(entries[i].child), INDEX_NODE_CHILD_SIZE);
+            cell += INDEX_NODE_CHILD_SIZE;
+        }
+    }
+}
+
+/**
+ * 把索引节点解码成索引项
+ * @param node 索引节点
+ * @param entries 返回的索引项，至少能放下 INDEX_NODE_MAX_ENTRIES 项
+ * @return 索引项数量，内部节点包括最后的最右子节点
+ */
+uint32_t index_node_decode(void *node, IndexEntry *entries)
+{
+    uint32_t num_cells = *index_node_num_cells(node);
+    IndexEntry entry;
+    uint8_t *cell = index_node_cells(node, &entry);
+    for(uint32_t i = 0; i < num_cells; i++)
+    {
+        cell = index_node_read_cell(node, cell, &entry);
+        entries[i] = entry;
+    }
+
+    if(get_node_type(node) != NODE_INDEX_INTERNAL)
+    {
+        return num_cells;
+    }
+    entries[num_cells].infinite = true;
+    entries[num_cells].length = 0;
+    entries[num_cells].id = 0;
+    entries[num_cells].child = *index_node_next(node);
+    return num_cells + 1;
+}
+
+/**
+ * 在索引节点中查找第一个不小于键的单元格
+ * 单元格是变长的，只能从头顺序查找；键和公共前缀的比较结果对所有单元格都一样，先比较一次，
+ * 之后直接在页里比较后缀，不复制单元格
+ * @param node 索引节点
+ * @param string 字符串
+ * @param length 字符串的长度
+ * @param id id
+ * @param child 内部节点时返回键所在的子节点页号，可以为NULL
+ * @param position 返回找到的单元格的地址，所有键都比它小时是最后一个单元格之后，可以为NULL
+ * @return 单元格号，等于单元格数量时表示所有键都比它小
+ */
+uint32_t index_node_find(void *node, const char *string, uint32_t length, uint32_t id, uint32_t *child, uint8_t **position)
+{
+    uint32_t num_cells = *index_node_num_cells(node);
+    uint32_t prefix_length = *index_node_prefix_length(node);
+    uint32_t child_size = get_node_type(node) == NODE_INDEX_INTERNAL ? INDEX_NODE_CHILD_SIZE : 0;
+    uint8_t *cell = (uint8_t *)node + INDEX_NODE_HEADER_SIZE + prefix_length;
+    uint32_t cell_num = 0;
+    int result = memcmp(string, (uint8_t *)node + INDEX_NODE_HEADER_SIZE, length < prefix_length ? length : prefix_length);
+    if(result > 0 || (result == 0 && length >= prefix_length))    // 比前缀小时就是第一个单元格
+    {
+        for(; cell_num < num_cells; cell_num++)
+        {
+            uint32_t suffix_length = *cell;
+            if(result == 0)
+            {
+                uint32_t cell_id;
+                memcpy(&cell_id, cell + STRING_LENGTH_SIZE + suffix_length, ID_SIZE);
+                if(compare_index_key((char *)cell + STRING_LENGTH_SIZE, suffix_length, cell_id,
+                    string + prefix_length, length - prefix_length, id) >= 0)
+                {
+                    break;
+                }
+            }
+            cell += STRING_LENGTH_SIZE + suffix_length + ID_SIZE + child_size;
+        }
+    }
+
+    if(child != NULL && child_size != 0)
+    {
+        if(cell_num == num_cells)
+        {
+            *child = *index_node_next(node);
+        }
+        else
+        {
+            memcpy(child, cell + STRING_LENGTH_SIZE + *cell + ID_SIZE, INDEX_NODE_CHILD_SIZE);
+        }
+    }
+    if(position != NULL)
+    {
+        *position = cell;
+    }
+    return cell_num;
+}
+
+/**
+ * 直接在索引叶子节点中插入单元格
+ * 新键以节点的公共前缀开头、剩余空间放得下时，把后面的单元格往后移，不需要解码整个节点；
+ * 节点的公共前缀不一定是最长的了，下次编码时重新计算
+ * @param node 索引叶子节点，调用者持有排它锁
+ * @param string 字符串
+ * @param length 字符串的长度
+ * @param id 行的id
+ * @return 是否插入了；返回false时节点没有改变
+ */
+bool index_leaf_insert_cell(void *node, const char *string, uint32_t length, uint32_t id)
+{
+    uint32_t num_cells = *index_node_num_cells(node);
+    uint32_t prefix_length = *index_node_prefix_length(node);
+    if(num_cells == 0 || length < prefix_length || memcmp(string, node + INDEX_NODE_HEADER_SIZE, prefix_length) != 0)
+    {
+        return false;
+    }
+
+    // 找到插入位置，再走到最后一个单元格之后，得到已经使用的空间
+    uint8_t *position;
+    uint8_t *cell;
+    uint32_t cell_num = index_node_find(node, string, length, id, NULL, &position);
+    for(cell = position; cell_num < num_cells; cell_num++)
+    {
+        cell += STRING_LENGTH_SIZE + *cell + ID_SIZE;
+    }
+
+    uint32_t suffix_length = length - prefix_length;
+    uint32_t cell_size = STRING_LENGTH_SIZE + suffix_length + ID_SIZE;
+    if((uint32_t)(cell - (uint8_t *)node) + cell_size > PAGE_SIZE)
+    {
+        return false;
+    }
+
+    memmove(position + cell_size, position, cell - position);
+    *position = suffix_length;
+    memcpy(position + STRING_LENGTH_SIZE, string + prefix_length, suffix_length);
+    memcpy(position + STRING_LENGTH_SIZE + suffix_length, &id, ID_SIZE);
+    *index_node_num_cells(node) = num_cells + 1;
+    return true;
+}
+
+/**
+ * 把放不下的索引项对半分成能放进节点的几段
+ * 新的键可能让节点的公共前缀变短，每一项都变长，所以分成两半也不一定放得下，这时继续对半分
+ * @param entries 有序的索引项
+ * @param start 第一项
+ * @param end 最后一项之后
+ * @param internal 是否为内部节点
+ * @param ends 返回每一段的结束位置
+ * @param num_pieces 已经分出的段数
+ * @return 分完以后的段数
+ */
+uint32_t index_split(IndexEntry *entries, uint32_t start, uint32_t end, bool internal, uint32_t *ends, uint32_t num_pieces)
+{
+    if(end - start == 1 || index_node_size(entries + start, end - start, internal) <= PAGE_SIZE)
+    {
+        ends[num_pieces] = end;
+        return num_pieces + 1;
+    }
+
+    uint32_t middle = start + (end - start) / 2;
+    num_pieces = index_split(entries, start, middle, internal, ends, num_pieces);
+    return index_split(entries, middle, end, internal, ends, num_pieces);
+}
+
+/**
+ * 把键插入索引
+ * 调用者持有 writer_mutex。从根节点下降到叶子节点并记下路径，能直接插入单元格时就直接插入，否则把叶子节点解码后插入新的项；
+ * 放不下时分成几段，第一段留在原来的页，其他段写到新页并接在叶子节点链表里，再把新的子节点加到父节点中，
+ * 父节点也放不下时继续向上分裂。根节点的页不变：根节点分裂时所有段都写到新页，根节点改写成它们的父节点
+ * 新页先写好，最后才改写原来的页，查询沿链表前进时不会读到还没写好的页
+ * @param root_page_num 索引的根节点页号
+ * @param string 字符串
+ * @param length 字符串的长度
+ * @param id 行的id
+ */
+void index_insert(Table *table, uint32_t root_page_num, const char *string, uint32_t length, uint32_t id)
+{
+    Pager *pager = table->pager;
+    uint32_t path[INDEX_MAX_DEPTH];
+    uint32_t depth = 0;
+    uint32_t page_num = root_page_num;
+    while(true)
+    {
+        if(depth == INDEX_MAX_DEPTH)
+        {
+            fatal_error("Index tree is too deep.\n");
+        }
+        path[depth++] = page_num;
+        void *node = get_page(pager, page_num);
+        bool leaf = get_node_type(node) == NODE_INDEX_LEAF;
+        if(!leaf)
+        {
+            index_node_find(node, string, length, id, &page_num, NULL);
+        }
+        unpin_page(pager, path[depth - 1]);
+        if(leaf)
+        {
+            break;
+        }
+    }
+
+    void *leaf = get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+    bool inserted = index_leaf_insert_cell(leaf, string, length, id);
+    unpin_page(pager, page_num);
+    if(inserted)
+    {
+        return;
+    }
+
+    IndexEntry *entries = (IndexEntry *)malloc(sizeof(IndexEntry) * INDEX_NODE_MAX_ENTRIES);
+    IndexEntry *parents = (IndexEntry *)malloc(sizeof(IndexEntry) * INDEX_NODE_MAX_ENTRIES);
+    uint32_t *ends = (uint32_t *)malloc(sizeof(uint32_t) * INDEX_NODE_MAX_ENTRIES);
+    uint32_t *piece_pages = (uint32_t *)malloc(sizeof(uint32_t) * INDEX_NODE_MAX_ENTRIES);
+    void **piece_nodes = (void **)malloc(sizeof(void *) * INDEX_NODE_MAX_ENTRIES);
+
+    // 叶子节点中的项是有序的，新项插到第一个比它大的项前面
+    leaf = get_page(pager, page_num);
+    uint32_t num_entries = index_node_decode(leaf, entries);
+    unpin_page(pager, page_num);
+    uint32_t position = num_entries;
+    for(uint32_t i = 0; i < num_entries; i++)
+    {
+        if(compare_index_key(entries[i].string, entries[i].length, entries[i].id, string, length, id) > 0)
+        {
+            position = i;
+            break;
+        }
+    }
+    memmove(entries + position + 1, entries + position, sizeof(IndexEntry) * (num_entries - position));
+    entries[position].id = id;
+    entries[position].child = 0;
+    entries[position].length = length;
+    entries[position].infinite = false;
+    memcpy(entries[position].string, string, length);
+    num_entries++;
+
+    uint32_t level = depth - 1;
+    bool internal = false;
+    while(true)
+    {
+        page_num = path[level];
+        void *node = get_page(pager, page_num);
+        uint32_t next_leaf = internal ? INVALID_PAGE_NUM : *index_node_next(node);
+        bool root = level == 0;
+        if(index_node_size(entries, num_entries, internal) <= PAGE_SIZE)
+        {
+            pager_mark_dirty(pager, page_num);
+            index_node_encode(node, internal, entries, num_entries, next_leaf);
+            unpin_page(pager, page_num);
+            break;
+        }
+
+        uint32_t num_pieces = index_split(entries, 0, num_entries, internal, ends, 0);
+        for(uint32_t i = 0; i < num_pieces; i++)
+        {
+            piece_pages[i] = (i == 0 && !root) ? page_num : pager_allocate_page(pager);
+            piece_nodes[i] = (i == 0 && !root) ? node : get_page(pager, piece_pages[i]);
+        }
+
+        // 从后往前写，原来的页最后改写
+        for(uint32_t i = num_pieces; i-- > 0;)
+        {
+            uint32_t start = (i == 0) ? 0 : ends[i - 1];
+            pager_mark_dirty(pager, piece_pages[i]);
+            index_node_encode(piece_nodes[i], internal, entries + start, ends[i] - start, (i + 1 < num_pieces) ? piece_pages[i + 1] : next_leaf);
+            if(piece_pages[i] != page_num)
+            {
+                unpin_page(pager, piece_pages[i]);
+            }
+        }
+
+        uint32_t num_parents = 0;
+        if(root)
+        {
+            // 根节点改写成所有段的父节点，它自己也放不下时下一轮继续分裂
+            for(uint32_t i = 0; i < num_pieces; i++)
+            {
+                parents[num_parents] = entries[ends[i] - 1];
+                parents[num_parents].child = piece_pages[i];
+                num_parents++;
+            }
+            parents[num_parents - 1].infinite = true;
+            unpin_page(pager, page_num);
+            level = 1;    // 下一轮还是根节点
+        }
+        else
+        {
+            unpin_page(pager, page_num);
+
+            // 父节点中指向原来的页的项改为指向最后一段，键（子节点的上界）不变，前面的段按最大键插在它前面
+            void *parent = get_page(pager, path[level - 1]);
+            uint32_t num_parent_entries = index_node_decode(parent, parents);
+            unpin_page(pager, path[level - 1]);
+            uint32_t slot = 0;
+            while(parents[slot].child != page_num)
+            {
+                slot++;
+            }
+            parents[slot].child = piece_pages[num_pieces - 1];
+            memmove(parents + slot + num_pieces - 1, parents + slot, sizeof(IndexEntry) * (num_parent_entries - slot));
+            for(uint32_t i = 0; i + 1 < num_pieces; i++)
+            {
+                parents[slot + i] = entries[ends[i] - 1];
+                parents[slot + i].child = piece_pages[i];
+            }
+            num_parents = num_parent_entries + num_pieces - 1;
+        }
+
+        IndexEntry *swap = entries;
+        entries = parents;
+        parents = swap;
+        num_entries = num_parents;
+        internal = true;
+        level--;
+    }
+
+    free(entries);
+    free(parents);
+    free(ends);
+    free(piece_pages);
+    free(piece_nodes);
+}
+
+/**
+ * 把行加到所有索引
+ * 调用者持有 writer_mutex
+ * @param row 插入的行
+ */
+void index_insert_row(Table *table, Row *row)
+{
+    RowLayout *layout = &(table->layout);
+    for(uint32_t column = 1; column < layout->num_columns; column++)
+    {
+        if(table->index_roots[column] != 0)
+        {
+            uint32_t length;
+            char *string = row_string(layout, row->data, column, &length);
+            index_insert(table, table->index_roots[column], string, length, row->id);
+        }
+    }
+}
+
+/**
+ * 从索引中删除键
+ * 调用者持有 writer_mutex。和 index_insert 一样下降到叶子节点，解码后去掉这一项再编码；
+ * 索引节点不合并，空的叶子节点留在链表里，查找时沿链表跳过
+ * @param root_page_num 索引的根节点页号
+ * @param string 字符串
+ * @param length 字符串的长度
+ * @param id 行的id
+ */
+void index_delete(Table *table, uint32_t root_page_num, const char *string, uint32_t length, uint32_t id)
+{
+    Pager *pager = table->pager;
+    uint32_t page_num = root_page_num;
+    while(true)
+    {
+        void *node = get_page(pager, page_num);
+        uint32_t child_page_num = page_num;
+        bool leaf = get_node_type(node) == NODE_INDEX_LEAF;
+        if(!leaf)
+        {
+            index_node_find(node, string, length, id, &child_page_num, NULL);
+        }
+        unpin_page(pager, page_num);
+        if(leaf)
+        {
+            break;
+        }
+        page_num = child_page_num;
+    }
+
+    IndexEntry *entries = (IndexEntry *)malloc(sizeof(IndexEntry) * INDEX_NODE_MAX_ENTRIES);
+    void *leaf = get_page(pager, page_num);
+    uint32_t num_entries = index_node_decode(leaf, entries);
+    for(uint32_t i = 0; i < num_entries; i++)
+    {
+        if(compare_index_key(entries[i].string, entries[i].length, entries[i].id, string, length, id) == 0)
+        {
+            memmove(entries + i, entries + i + 1, sizeof(IndexEntry) * (num_entries - i - 1));
+            pager_mark_dirty(pager, page_num);
+            index_node_encode(leaf, false, entries, num_entries - 1, *index_node_next(leaf));
+            break;
+        }
+    }
+    unpin_page(pager, page_num);
+    free(entries);
+}
+
+/**
+ * 把行从所有索引中删除
+ * 调用者持有 writer_mutex
+ * @param source 序列化的行
+ */
+void index_delete_row(Table *table, void *source)
+{
+    RowLayout *layout = &(table->layout);
+    for(uint32_t column = 1; column < layout->num_columns; column++)
+    {
+        if(table->index_roots[column] != 0)
+        {
+            uint32_t length;
+            char *string = row_string(layout, source, column, &length);
+            index_delete(table, table->index_roots[column], string, length, row_id(source));
+        }
+    }
+}
+
+/**
+ * 执行建索引语句
+ * 调用者持有 writer_mutex。索引建好以后才让查询使用它，同时把根节点页号写进目录页
+ * @param statement 语句
+ * @return 执行结果
+ */
+ExecuteResult execute_create_index(Statement *statement, Table *table)
+{
+    Pager *pager = table->pager;
+    uint32_t column = statement->index_column;
+    if(table->index_roots[column] != 0)
+    {
+        return EXECUTE_INDEX_EXISTS;
+    }
+
+    uint32_t index_root_page_num = pager_allocate_page(pager);
+    void *index_root = get_page(pager, index_root_page_num);
+    pager_mark_dirty(pager, index_root_page_num);
+    index_node_encode(index_root, false, NULL, 0, INVALID_PAGE_NUM);
+    set_node_root(index_root, true);
+    unpin_page(pager, index_root_page_num);
+    index_build(table, column, index_root_page_num);
+
+    __atomic_store_n(&(table->index_roots[column]), index_root_page_num, __ATOMIC_RELEASE);
+    catalog_write_table(table);
+    return EXECUTE_SUCCESS;
+}
+
+/**
+ * 用表中所有的行建索引
+ * 读出每一行的（字符串，id）排序，再从叶子节点开始一层一层向上建树，每个节点只写一次；
+ * 最上层只有一个节点，复制到索引根节点的页，它原来分配的页是最后一页时就收回
+ * @param column 索引的列
+ * @param root_page_num 索引的根节点页号，根节点是空的叶子节点
+ */
+void index_build(Table *table, uint32_t column, uint32_t root_page_num)
+{
+    Pager *pager = table->pager;
+    uint8_t *arena = NULL;
+    size_t arena_length = 0;
+    size_t arena_capacity = 0;
+    uint32_t num_records = 0;
+
+    // 快照取最大值，树中所有的行都能看到
+    RangeCursor *range = range_cursor_open(table, 0, UINT32_MAX, UINT64_MAX);
+    while(range->end_of_range != true)
+    {
+        void *value = range_cursor_value(range);
+        uint32_t length;
+        char *string = row_string(&(table->layout), value, column, &length);
+        if(arena_length + ID_SIZE + STRING_LENGTH_SIZE + length > arena_capacity)
+        {
+            arena_capacity = arena_capacity ? arena_capacity * 2 : PAGE_SIZE;
+            arena = (uint8_t *)realloc(arena, arena_capacity);
+        }
+        uint32_t id = row_id(value);
+        memcpy(arena + arena_length, &id, ID_SIZE);
+        arena[arena_length + ID_SIZE] = length;
+        memcpy(arena + arena_length + ID_SIZE + STRING_LENGTH_SIZE, string, length);
+        arena_length += ID_SIZE + STRING_LENGTH_SIZE + length;
+        num_records++;
+        range_cursor_advance(range);
+    }
+    range_cursor_close(range);
+
+    if(num_records > 0)
+    {
+        // arena 扩大时会移动，全部读完以后才记下每条记录的地址
+        uint8_t **records = (uint8_t **)malloc(sizeof(uint8_t *) * num_records);
+        size_t offset = 0;
+        for(uint32_t i = 0; i < num_records; i++)
+        {
+            records[i] = arena + offset;
+            offset += ID_SIZE + STRING_LENGTH_SIZE + arena[offset + ID_SIZE];
+        }
+        qsort(records, num_records, sizeof(uint8_t *), compare_index_records);
+
+        uint32_t num_parents;
+        IndexEntry *level = index_build_level(pager, records, NULL, num_records, false, &num_parents);
+        while(num_parents > 1)
+        {
+            IndexEntry *parents = index_build_level(pager, NULL, level, num_parents, true, &num_parents);
+            free(level);
+            level = parents;
+        }
+
+        uint32_t top_page_num = level[0].child;
+        void *top = get_page(pager, top_page_num);
+        void *root = get_page(pager, root_page_num);
+        pager_mark_dirty(pager, root_page_num);
+        memcpy(root, top, PAGE_SIZE);
+        set_node_root(root, true);
+        unpin_page(pager, root_page_num);
+        unpin_page(pager, top_page_num);
+        if(top_page_num == pager->num_pages - 1)
+        {
+            pager->num_pages--;
+        }
+        free(level);
+        free(records);
+    }
+    free(arena);
+}
+
+/**
+ * 按顺序把索引项装进一层节点
+ * 节点按填充因子装满就写到新页；同一层的节点连续分配，叶子节点的下一个叶子节点就是下一页
+ * @param pager 分页器
+ * @param records 建叶子节点时是排好序的记录，否则为NULL
+ * @param entries 建内部节点时是下一层返回的索引项，最后一项是最右子节点
+ * @param num_entries 记录或者索引项的数量，大于0
+ * @param internal 是否为内部节点
+ * @param num_parents 返回上一层的索引项数量，就是这一层的节点数
+ * @return 上一层的索引项：每个节点一项，键是节点中的最大键，最后一项是最右子节点
+ */
+IndexEntry* index_build_level(Pager *pager, uint8_t **records, IndexEntry *entries, uint32_t num_entries, bool internal, uint32_t *num_parents)
+{
+    uint32_t limit = PAGE_SIZE * DEFAULT_FILL_FACTOR / 100;
+    IndexEntry *node_entries = (IndexEntry *)malloc(sizeof(IndexEntry) * INDEX_NODE_MAX_ENTRIES);
+    IndexEntry *parents = NULL;
+    uint32_t parents_capacity = 0;
+    uint32_t count = 0;
+    *num_parents = 0;
+    for(uint32_t i = 0; i <= num_entries; i++)
+    {
+        if(i < num_entries)
+        {
+            IndexEntry *entry = &node_entries[count];
+            if(records != NULL)
+            {
+                memcpy(&(entry->id), records[i], ID_SIZE);
+                entry->length = records[i][ID_SIZE];
+                memcpy(entry->string, records[i] + ID_SIZE + STRING_LENGTH_SIZE, entry->length);
+                entry->child = 0;
+                entry->infinite = false;
+            }
+            else
+            {
+                *entry = entries[i];
+            }
+            if(count == 0 || index_node_size(node_entries, count + 1, internal) <= limit)
+            {
+                count++;
+                continue;
+            }
+        }
+
+        // 节点装满了，或者已经没有更多的项，写到新页
+        uint32_t page_num = get_unused_page_num(pager);
+        void *node = get_page(pager, page_num);
+        pager_mark_dirty(pager, page_num);
+        index_node_encode(node, internal, node_entries, count, (i < num_entries) ? page_num + 1 : INVALID_PAGE_NUM);
+        unpin_page(pager, page_num);
+
+        if(*num_parents == parents_capacity)
+        {
+            parents_capacity = parents_capacity ? parents_capacity * 2 : 64;
+            parents = (IndexEntry *)realloc(parents, sizeof(IndexEntry) * parents_capacity);
+        }
+        parents[*num_parents] = node_entries[count - 1];
+        parents[*num_parents].child = page_num;
+        (*num_parents)++;
+
+        node_entries[0] = node_entries[count];
+        count = 1;
+    }
+    parents[*num_parents - 1].infinite = true;
+
+    free(node_entries);
+    return parents;
+}
+
+/**
+ * 在索引中查找字符串等于值或者以值开头的行
+ * 每个节点在共享锁下复制一份再读，不用锁耦合；副本中的下一个页号过时的原因和快照游标一样，
+ * 跳过的新页里只有已经读过的键，或者查询开始以后才插入的行。下降时父节点也可能已经过时，
+ * 落到偏左的叶子节点上，这时沿链表往后找到第一个不小于值的键
+ * @param root_page_num 索引的根节点页号
+ * @param string 值
+ * @param length 值的长度
+ * @param prefix 是否前缀匹配
+ * @param num_ids 返回找到的行数
+ * @return 找到的行的id，按索引键的顺序，调用者释放
+ */
+uint32_t* index_lookup(Table *table, uint32_t root_page_num, const char *string, uint32_t length, bool prefix, uint32_t *num_ids)
+{
+    Pager *pager = table->pager;
+    void *copy = malloc(PAGE_SIZE);
+    uint32_t page_num = root_page_num;
+    while(true)
+    {
+        memcpy(copy, page_latch_shared(pager, page_num), PAGE_SIZE);
+        page_unlatch_shared(pager, page_num);
+        if(get_node_type(copy) != NODE_INDEX_INTERNAL)
+        {
+            break;
+        }
+        index_node_find(copy, string, length, 0, &page_num, NULL);
+    }
+
+    uint32_t capacity = 16;
+    uint32_t *ids = (uint32_t *)malloc(sizeof(uint32_t) * capacity);
+    *num_ids = 0;
+    bool done = false;
+    while(!done)
+    {
+        IndexEntry entry;
+        uint8_t *cell = index_node_cells(copy, &entry);
+        uint32_t num_cells = *index_node_num_cells(copy);
+        for(uint32_t i = 0; i < num_cells && !done; i++)
+        {
+            cell = index_node_read_cell(copy, cell, &entry);
+            if(compare_index_key(entry.string, entry.length, entry.id, string, length, 0) < 0)
+            {
+                continue;
+            }
+            done = entry.length < length || memcmp(entry.string, string, length) != 0 || (!prefix && entry.length != length);
+            if(!done)
+            {
+                if(*num_ids == capacity)
+                {
+                    capacity *= 2;
+                    ids = (uint32_t *)realloc(ids, sizeof(uint32_t) * capacity);
+                }
+                ids[(*num_ids)++] = entry.id;
+            }
+        }
+
+        page_num = *index_node_next(copy);
+        if(!done && page_num != INVALID_PAGE_NUM)
+        {
+            memcpy(copy, page_latch_shared(pager, page_num), PAGE_SIZE);
+            page_unlatch_shared(pager, page_num);
+        }
+        else
+        {
+            done = true;
+        }
+    }
+    free(copy);
+
+    return ids;
+}
+
+/**
+ * 通过索引执行字符串条件的查询
+ * 从索引中取出满足条件的id，按id排序（和扫描的输出顺序一致）后逐个沿表的B+树查找，
+ * 快照看不到的行跳过。like '%' 匹配所有行，这时扫描更快，不用索引
+ * @param statement 查询语句
+ * @param snapshot 快照
+ * @param output 输出缓冲区，聚合查询时为NULL
+ * @param aggregate 聚合结果，普通查询时为NULL
+ * @return 是否用索引执行了；条件的列上没有索引时返回false，由调用者扫描
+ */
+bool index_select(Statement *statement, Table *table, uint64_t snapshot, OutputBuffer *output, AggregateState *aggregate)
+{
+    if(statement->where_type != WHERE_STRING_EQUALS && statement->where_type != WHERE_STRING_PREFIX)
+    {
+        return false;
+    }
+    uint32_t root_page_num = __atomic_load_n(&(table->index_roots[statement->where_column]), __ATOMIC_ACQUIRE);
+    if(root_page_num == 0 || (statement->where_type == WHERE_STRING_PREFIX && statement->where_string_length == 0))
+    {
+        return false;
+    }
+
+    uint32_t num_ids;
+    uint32_t *ids = index_lookup(table, root_page_num, statement->where_string, statement->where_string_length,
+        statement->where_type == WHERE_STRING_PREFIX, &num_ids);
+    qsort(ids, num_ids, sizeof(uint32_t), compare_uint32);
+    for(uint32_t i = 0; i < num_ids; i++)
+    {
+        Cursor *cursor = table_find(table, ids[i]);
+        if(cursor->cell_num < *leaf_node_num_cells(cursor->node) && cursor_key(cursor) == ids[i] &&
+            version_visible(table, ids[i], snapshot))
+        {
+            if(aggregate != NULL)
+            {
+                aggregate_keys(aggregate, cursor->node, cursor->cell_num, cursor->cell_num + 1);
+            }
+            else
+            {
+                write_row(output, cursor_value(cursor), statement);
+            }
+        }
+        cursor_close(cursor);
+    }
+    free(ids);
+
+    return true;
+}
+
+/**
+ * 打印常量
+ * @param output 输出缓冲区
+ */
+void print_constants(OutputBuffer *output)
+{
+    output_printf(output, "ROW_MAX_SIZE: %d\n", ROW_MAX_SIZE);
+    output_printf(output, "COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+    output_printf(output, "LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+    output_printf(output, "LEAF_NODE_SLOT_SIZE: %d\n", LEAF_NODE_SLOT_SIZE);
+    output_printf(output, "LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+    output_printf(output, "LEAF_NODE_MIN_CELLS: %d\n", LEAF_NODE_MIN_CELLS);
+}
+
+/**
+ * 打印缩进
+ * @param level 缩进层级
+ * @param output 输出缓冲区
+ */
+void indent(uint32_t level, OutputBuffer *output)
+{
+    for(uint32_t i = 0; i < level; i++)
+    {
+        output_write(output, "  ", 2);
+    }
+}
+
+/**
+ * 打印树
+ * 叶子节点打印每个单元格的下标和键，内部节点递归打印子节点，并在子节点之间打印分隔键
+ * @param pager 分页器
+ * @param page_num 页号
+ * @param indentation_level 缩进层级
+ * @param output 输出缓冲区
+ */
+void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level, OutputBuffer *output)
+{
+    void *node = get_page(pager, page_num);
+    uint32_t num_keys, child;
+
+    switch(get_node_type(node))
+    {
+        case (NODE_LEAF):
+            num_keys = *leaf_node_num_cells(node);
+            indent(indentation_level, output);
+            output_printf(output, "leaf (size %d)\n", num_keys);
+            for(uint32_t i = 0; i < num_keys; i++)
+            {
+                indent(indentation_level, output);
+                output_printf(output, "  - %d : %d\n", i, *leaf_node_key(node, i));
+            }
+            break;
+        case (NODE_INTERNAL):
+            num_keys = *internal_node_num_keys(node);
+            indent(indentation_level, output);
+            output_printf(output, "internal (size %d)\n", num_keys);
+            if(*internal_node_right_child(node) != INVALID_PAGE_NUM)    // 删除以后内部节点可能只剩最右子节点
+            {
+                for(uint32_t i = 0; i < num_keys; i++)
+                {
+                    child = *internal_node_child(node, i);
+                    print_tree(pager, child, indentation_level + 1, output);
+
+                    indent(indentation_level + 1, output);
+                    output_printf(output, "- key %d\n", *internal_node_key(node, i));
+                }
+                child = *internal_node_right_child(node);
+                print_tree(pager, child, indentation_level + 1, output);
+            }
+            break;
+        case (NODE_INDEX_INTERNAL):
+        case (NODE_INDEX_LEAF):
+        case (NODE_CATALOG):
+        case (NODE_FREE):
+        case (NODE_PURGE):
+            // 表的树中没有索引节点、目录页、空闲页和待清除列表的页
+            indent(indentation_level, output);
+            output_printf(output, "index node (size %d)\n", *index_node_num_cells(node));
+            break;
+    }
+
+    unpin_page(pager, page_num);
+}
+
+/**
+ * 语句处理
+ * 导入和打印树的元命令可以在最后指定表名，没有时使用默认表
+ * @param input_buffer 输入缓冲区
+ * @param database 数据库
+ * @param cache 会话的语句缓存
+ * @param output 输出缓冲区
+ * @return 元命令执行结果
+ */
+MetaCommandResult do_meta_command(InputBuffer *input_buffer, Database *database, StatementCache *cache, OutputBuffer *output)
+{
+    char *saveptr;    // strtok_r 的解析位置（工作线程会同时解析语句，不能用 strtok 的全局状态）
+    if(strcmp(input_buffer->buffer, ".exit") == 0)
+    {
+        return META_COMMAND_EXIT;
+    }
+    else if(strcmp(input_buffer->buffer, ".constants") == 0)
+    {
+        output_printf(output, "Constants:\n");
+        print_constants(output);
+        return META_COMMAND_SUCCESS;
+    }
+    else if(strcmp(input_buffer->buffer, ".checkpoint") == 0)
+    {
+        // 日志中可能有事务被淘汰出缓冲池的未提交的页，不能写回数据库文件
+        if(meta_command_in_transaction(database, cache, output))
+        {
+            return META_COMMAND_SUCCESS;
+        }
+        pager_checkpoint(database->pager);
+        output_printf(output, "Checkpoint complete.\n");
+        return META_COMMAND_SUCCESS;
+    }
+    else if(strncmp(input_buffer->buffer, ".import ", 8) == 0)
+    {
+        // .import <文件名> [填充因子] [表名]
+        strtok_r(input_buffer->buffer, " ", &saveptr);
+        char *filename = strtok_r(NULL, " ", &saveptr);
+        char *argument = strtok_r(NULL, " ", &saveptr);
+        uint32_t fill_factor = DEFAULT_FILL_FACTOR;
+        if(argument != NULL && argument[0] >= '0' && argument[0] <= '9')
+        {
+            fill_factor = (uint32_t)strtoul(argument, NULL, 10);
+            argument = strtok_r(NULL, " ", &saveptr);
+        }
+        if(filename == NULL || strtok_r(NULL, " ", &saveptr) != NULL)
+        {
+            return META_COMMAND_UNRECOGNIZED_COMMAND;
+        }
+        Table *table = meta_command_table(database, argument, output);
+        if(table == NULL)
+        {
+            return META_COMMAND_SUCCESS;
+        }
+        if(meta_command_in_transaction(database, cache, output))    // 导入中途会提交，不能放在事务里
+        {
+            return META_COMMAND_SUCCESS;
+        }
+        database_purge_deleted(database);    // 删除了所有行的表，行从树中删掉以后才是空表
+        pager_commit(database->pager);
+        database_fence_pages(database);
+        do_import(table, filename, fill_factor, output);
+        return META_COMMAND_SUCCESS;
+    }
+    else if(strcmp(input_buffer->buffer, ".btree") == 0 || strncmp(input_buffer->buffer, ".btree ", 7) == 0)
+    {
+        strtok_r(input_buffer->buffer, " ", &saveptr);
+        Table *table = meta_command_table(database, strtok_r(NULL, " ", &saveptr), output);
+        if(table != NULL)
+        {
+            output_printf(output, "Tree:\n");
+            print_tree(table->pager, table->root_page_num, 0, output);
+        }
+        return META_COMMAND_SUCCESS;
+    }
+    else if(strcmp(input_buffer->buffer, ".vacuum") == 0)
+    {
+        if(meta_command_in_transaction(database, cache, output))    // 回滚要恢复的页可能被搬走
+        {
+            return META_COMMAND_SUCCESS;
+        }
+        do_vacuum(database, output);
+        return META_COMMAND_SUCCESS;
+    }
+    else if(strcmp(input_buffer->buffer, ".check") == 0)
+    {
+        if(meta_command_in_transaction(database, cache, output))    // 只检查已经提交的内容
+        {
+            return META_COMMAND_SUCCESS;
+        }
+        do_check(database, output);
+        return META_COMMAND_SUCCESS;
+    }
+    else if(strcmp(input_buffer->buffer, ".schema") == 0)
+    {
+        for(uint32_t i = 0; i < database->num_tables; i++)
+        {
+            print_schema(database->tables[i], output);
+        }
+        return META_COMMAND_SUCCESS;
+    }
+    else
+    {
+        return META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+}
+
+/**
+ * 查找元命令参数中的表
+ * @param database 数据库
+ * @param name 表名，为NULL时是默认表
+ * @param output 输出缓冲区，没有这个表时打印错误信息
+ * @return 表，没有时返回NULL
+ */
+Table* meta_command_table(Database *database, char *name, OutputBuffer *output)
+{
+    Table *table = (name == NULL) ? database->tables[0] : database_find_table(database, name);
+    if(table == NULL)
+    {
+        output_printf(output, "Error: No such table.\n");
+    }
+    return table;
+}
+
+/**
+ * 是否有打开的事务，元命令不能执行
+ * 事务是这个会话自己打开的时候提示不能在事务中执行，是其他会话打开的时候提示数据库忙
+ * @param database 数据库
+ * @param cache 会话的语句缓存
+ * @param output 输出缓冲区，有打开的事务时打印错误信息
+ * @return 是否有打开的事务
+ */
+bool meta_command_in_transaction(Database *database, StatementCache *cache, OutputBuffer *output)
+{
+    if(cache->in_transaction)
+    {
+        output_printf(output, "Error: Not allowed inside a transaction.\n");
+        return true;
+    }
+    if(database->in_transaction)
+    {
+        output_printf(output, "Error: Database is busy.\n");
+        return true;
+    }
+    return false;
+}
+
+/**
+ * 打印表的定义
+ * 格式和建表语句相同，有索引的列后面加上 indexed
+ * @param output 输出缓冲区
+ */
+void print_schema(Table *table, OutputBuffer *output)
+{
+    RowLayout *layout = &(table->layout);
+    output_printf(output, "create table %s (", table->name);
+    for(uint32_t i = 0; i < layout->num_columns; i++)
+    {
+        Column *column = &(layout->columns[i]);
+        output_printf(output, "%s%s ", (i > 0) ? ", " : "", column->name);
+        if(column->type == COLUMN_INT)
+        {
+            output_printf(output, "int");
+        }
+        else
+        {
+            output_printf(output, "varchar(%d)", column->size);
+        }
+        if(table->index_roots[i] != 0)
+        {
+            output_printf(output, " indexed");
+        }
+    }
+    output_printf(output, ")\n");
+}
+
+/**
+ * 准备插入语句
+ * 格式是 insert [into 表名] 值 值 ... 或者 insert [into 表名] (值, 值, ...), (...)，值按表的列的顺序
+ * @param input_buffer 输入缓冲区
+ * @param database 数据库
+ * @param statement 语句
+ * @return 语句识别结果
+ */
+PrepareResult prepare_insert(InputBuffer *input_buffer, Database *database, Statement *statement)
+{
+    char *saveptr;    // strtok_r 的解析位置
+    statement->type = STATEMENT_INSERT;
+    statement->table = database->tables[0];
+    statement->num_rows = 0;
+    statement->num_parameters = 0;
+
+    char *values = input_buffer->buffer + strlen("insert");
+    while(*values == ' ')
+    {
+        values++;
+    }
+    if(strncmp(values, "into ", 5) == 0)
+    {
+        // 表名后面可以直接跟左括号
+        char *name = values + 5;
+        while(*name == ' ')
+        {
+            name++;
+        }
+        values = name + strcspn(name, " (");
+        char separator = *values;
+        *values = '\0';
+        statement->table = database_find_table(database, name);
+        *values = separator;
+        if(statement->table == NULL)
+        {
+            return PREPARE_UNKNOWN_TABLE;
+        }
+        while(*values == ' ')
+        {
+            values++;
+        }
+    }
+    if(*values == '(')
+    {
+        // insert (值, 值, ...), (值, 值, ...), ...
+        return prepare_insert_tuples(values, statement);
+    }
+
+    // 多出来的值被忽略
+    char *fields[MAX_TABLE_COLUMNS];
+    for(uint32_t i = 0; i < statement->table->layout.num_columns; i++)
+    {
+        fields[i] = strtok_r((i == 0) ? values : NULL, " ", &saveptr);
+    }
+
+    return prepare_row(statement, fields);
+}
+
+/**
+ * 准备多行插入语句
+ * 每一行写成括号中用逗号分隔的各列的值，行之间也用逗号分隔
+ * @param values 第一个左括号开始的字符串
+ * @param statement 语句
+ * @return 语句识别结果
+ */
+PrepareResult prepare_insert_tuples(char *values, Statement *statement)
+{
+    char *saveptr;    // strtok_r 的解析位置
+    char *position = values;
+    uint32_t num_columns = statement->table->layout.num_columns;
+    while(true)
+    {
+        char *end = strchr(position, ')');
+        if(*position != '(' || end == NULL)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        *end = '\0';
+
+        char *fields[MAX_TABLE_COLUMNS];
+        for(uint32_t i = 0; i < num_columns; i++)
+        {
+            fields[i] = strtok_r((i == 0) ? position + 1 : NULL, ", ", &saveptr);
+        }
+        if(fields[num_columns - 1] != NULL && strtok_r(NULL, ", ", &saveptr) != NULL)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        PrepareResult result = prepare_row(statement, fields);
+        if(result != PREPARE_SUCCESS)
+        {
+            return result;
+        }
+
+        position = end + 1;
+        while(*position == ' ')
+        {
+            position++;
+        }
+        if(*position == '\0')
+        {
+            return PREPARE_SUCCESS;
+        }
+        if(*position != ',')
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        position++;
+        while(*position == ' ')
+        {
+            position++;
+        }
+    }
+}
+
+/**
+ * 检查并填充要插入的行
+ * 值为 ? 时是占位符，执行时再绑定
+ * @param statement 语句
+ * @param values 每一列的值，个数是表的列数，缺少的值为NULL
+ * @return 语句识别结果
+ */
+PrepareResult prepare_row(Statement *statement, char **values)
+{
+    RowLayout *layout = &(statement->table->layout);
+    for(uint32_t i = 0; i < layout->num_columns; i++)
+    {
+        if(values[i] == NULL)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+    }
+
+    Row *row = statement_add_row(statement);
+    row_init(layout, row);
+    PrepareResult result = PREPARE_SUCCESS;
+    for(uint32_t i = 0; i < layout->num_columns && result == PREPARE_SUCCESS; i++)
+    {
+        result = prepare_value(statement, PARAMETER_VALUE, statement->num_rows - 1, i, values[i]);
+    }
+
+    return result;
+}
+
+/**
+ * 填充语句中的一个值或者记录占位符
+ * @param statement 语句
+ * @param type 值对应的字段
+ * @param row 插入语句中值所在的行
+ * @param column 插入语句中值所在的列
+ * @param value 值，为 ? 时是占位符
+ * @return 语句识别结果
+ */
+PrepareResult prepare_value(Statement *statement, ParameterType type, uint32_t row, uint32_t column, char *value)
+{
+    if(strcmp(value, "?") != 0)
+    {
+        Parameter parameter = {type, row, column};
+        return bind_value(statement, &parameter, value);
+    }
+
+    if(statement->num_parameters == MAX_PARAMETERS)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    statement->parameters[statement->num_parameters].type = type;
+    statement->parameters[statement->num_parameters].row = row;
+    statement->parameters[statement->num_parameters].column = column;
+    statement->num_parameters++;
+
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * 把字符串解析成32位整数
+ * 整个字符串都必须是数字，超出 int32_t 范围的值不会被截断
+ * @param value 字符串
+ * @param number 解析出的整数
+ * @return 是否解析成功
+ */
+bool parse_int(const char *value, int32_t *number)
+{
+    char *end;
+    errno = 0;
+    long result = strtol(value, &end, 10);
+    if(end == value || *end != 0 || errno == ERANGE || result > INT32_MAX || result < INT32_MIN)
+    {
+        return false;
+    }
+    *number = (int32_t)result;
+    return true;
+}
+
+/**
+ * 检查并把值填到语句中
+ * 直接写在语句中的值和执行时绑定的参数用同样的规则检查
+ * @param statement 语句
+ * @param parameter 值对应的字段
+ * @param value 值
+ * @return 语句识别结果
+ */
+PrepareResult bind_value(Statement *statement, Parameter *parameter, char *value)
+{
+    RowLayout *layout = &(statement->table->layout);
+    switch(parameter->type)
+    {
+        case PARAMETER_VALUE:
+        {
+            Row *row = &(statement->rows_to_insert[parameter->row]);
+            Column *column = &(layout->columns[parameter->column]);
+            if(column->type == COLUMN_INT)
+            {
+                int32_t number;
+                if(!parse_int(value, &number))
+                {
+                    return PREPARE_SYNTAX_ERROR;
+                }
+                if(parameter->column == 0 && number < 0)
+                {
+                    return PREPARE_NEGATIVE_ID;
+                }
+                row_set_int(layout, row, parameter->column, number);
+                break;
+            }
+
+            size_t length = strlen(value);
+            if(length > column->size)
+            {
+                return PREPARE_SYNTAX_TOO_LONG;
+            }
+            row_set_string(layout, row, parameter->column, value, length);
+            break;
+        }
+        case PARAMETER_WHERE_ID:
+        case PARAMETER_WHERE_ID_END:
+        {
+            int32_t id;
+            if(!parse_int(value, &id))
+            {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            if(id < 0)
+            {
+                return PREPARE_NEGATIVE_ID;
+            }
+            if(parameter->type == PARAMETER_WHERE_ID)
+            {
+                statement->where_id = id;
+            }
+            else
+            {
+                statement->where_id_end = id;
+            }
+            break;
+        }
+        case PARAMETER_WHERE_STRING:
+        {
+            size_t length = strlen(value);
+            if(value[0] == '\'' || value[0] == '"')
+            {
+                // 值可以用一对单引号或双引号括起来，比较时去掉引号
+                if(length < 2 || value[length - 1] != value[0])
+                {
+                    return PREPARE_SYNTAX_ERROR;
+                }
+                value++;
+                length -= 2;
+            }
+            if(statement->where_type == WHERE_STRING_PREFIX)
+            {
+                // 只支持前缀匹配：% 只能出现在结尾
+                if(length == 0 || value[length - 1] != '%' || memchr(value, '%', length - 1) != NULL)
+                {
+                    return PREPARE_SYNTAX_ERROR;
+                }
+                length--;
+            }
+            if(length > layout->columns[statement->where_column].size)
+            {
+                return PREPARE_SYNTAX_TOO_LONG;
+            }
+            memcpy(statement->where_string, value, length);
+            statement->where_string[length] = '\0';
+            statement->where_string_length = length;
+            break;
+        }
+    }
+
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * 把参数绑定到占位符
+ * 参数用空格分隔，个数必须和占位符一样多
+ * @param statement 从预处理语句复制出来的语句
+ * @param arguments 参数
+ * @return 语句识别结果
+ */
+PrepareResult bind_parameters(Statement *statement, char *arguments)
+{
+    char *saveptr;    // strtok_r 的解析位置
+    for(uint32_t i = 0; i < statement->num_parameters; i++)
+    {
+        char *value = strtok_r((i == 0) ? arguments : NULL, " ", &saveptr);
+        if(value == NULL)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        PrepareResult result = bind_value(statement, &(statement->parameters[i]), value);
+        if(result != PREPARE_SUCCESS)
+        {
+            return result;
+        }
+    }
+
+    if(strtok_r((statement->num_parameters == 0) ? arguments : NULL, " ", &saveptr) != NULL)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    statement->num_parameters = 0;
+
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * 复制语句
+ * 目标语句保留自己的行数组，只在容量不够时扩大
+ * @param destination 目标语句
+ * @param source 源语句
+ */
+void statement_copy(Statement *destination, Statement *source)
+{
+    Row *rows = destination->rows_to_insert;
+    uint32_t capacity = destination->rows_capacity;
+    *destination = *source;
+    destination->rows_to_insert = rows;
+    destination->rows_capacity = capacity;
+
+    if(source->type != STATEMENT_INSERT)
+    {
+        return;
+    }
+    if(destination->rows_capacity < source->num_rows)
+    {
+        destination->rows_capacity = source->num_rows;
+        destination->rows_to_insert = realloc(destination->rows_to_insert, destination->rows_capacity * sizeof(Row));
+        if(destination->rows_to_insert == NULL)
+        {
+            fatal_error("Unable to allocate rows to insert\n");
+        }
+    }
+    memcpy(destination->rows_to_insert, source->rows_to_insert, source->num_rows * sizeof(Row));
+}
+
+/**
+ * 创建语句缓存
+ * @return 语句缓存
+ */
+StatementCache *new_statement_cache()
+{
+    StatementCache *cache = (StatementCache *)calloc(1, sizeof(StatementCache));
+    if(cache == NULL)
+    {
+        fatal_error("Unable to allocate statement cache\n");
+    }
+
+    return cache;
+}
+
+/**
+ * 通过语句缓存准备语句
+ * prepare 和 execute 交给预处理语句处理；其他语句先按文本查找执行计划缓存，命中时直接复制解析好的语句，不需要再解析
+ * @param cache 语句缓存
+ * @param input_buffer 输入缓冲区
+ * @param database 数据库
+ * @param statement 语句
+ * @return 语句识别结果
+ */
+PrepareResult prepare_cached(StatementCache *cache, InputBuffer *input_buffer, Database *database, Statement *statement)
+{
+    if(strncmp(input_buffer->buffer, "prepare ", 8) == 0)
+    {
+        return prepare_named(cache, database, input_buffer->buffer + 8);
+    }
+    if(strncmp(input_buffer->buffer, "execute ", 8) == 0)
+    {
+        return execute_named(cache, input_buffer->buffer + 8, statement);
+    }
+
+    bool cacheable = strncmp(input_buffer->buffer, "select", 6) == 0;
+    uint32_t hash = 0;
+    char *text = NULL;
+    if(cacheable)
+    {
+        hash = statement_hash(input_buffer->buffer);
+        CachedPlan *plan = plan_cache_lookup(cache, input_buffer->buffer, hash);
+        if(plan != NULL)
+        {
+            statement_copy(statement, &(plan->statement));
+            return PREPARE_SUCCESS;
+        }
+        text = strdup(input_buffer->buffer);    // 解析会修改输入缓冲区，先保存语句文本
+    }
+
+    PrepareResult result = prepare_statement(input_buffer, database, statement);
+    if(result == PREPARE_SUCCESS && statement->num_parameters > 0)
+    {
+        result = PREPARE_SYNTAX_ERROR;    // 占位符只能出现在预处理语句中
+    }
+    if(result == PREPARE_SUCCESS && cacheable)
+    {
+        plan_cache_put(cache, text, hash, statement);
+    }
+    free(text);
+
+    return result;
+}
+
+/**
+ * 保存预处理语句
+ * 格式为 <名字> as <语句>，同名的预处理语句会被替换
+ * @param cache 语句缓存
+ * @param database 数据库
+ * @param text prepare 后面的文本
+ * @return 语句识别结果，成功时为PREPARE_STORED
+ */
+PrepareResult prepare_named(StatementCache *cache, Database *database, char *text)
+{
+    char *name = text;
+    char *separator = strstr(text, " as ");
+    if(separator == NULL || separator == name || strchr(name, ' ') != separator)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    *separator = '\0';
+
+    // 语句文本在输入缓冲区中间，包装成输入缓冲区交给 prepare_statement
+    InputBuffer statement_text;
+    statement_text.buffer = separator + 4;
+    statement_text.input_length = strlen(statement_text.buffer);
+    statement_text.buffer_length = statement_text.input_length + 1;
+
+    Statement plan;
+    plan.rows_to_insert = NULL;
+    plan.rows_capacity = 0;
+    PrepareResult result = prepare_statement(&statement_text, database, &plan);
+    if(result != PREPARE_SUCCESS)
+    {
+        free(plan.rows_to_insert);
+        return result;
+    }
+
+    PreparedStatement *prepared = find_prepared(cache, name);
+    if(prepared != NULL)
+    {
+        free(prepared->statement.rows_to_insert);
+    }
+    else
+    {
+        if(cache->num_prepared == cache->prepared_capacity)
+        {
+            cache->prepared_capacity = (cache->prepared_capacity == 0) ? 8 : cache->prepared_capacity * 2;
+            cache->prepared = realloc(cache->prepared, cache->prepared_capacity * sizeof(PreparedStatement));
+            if(cache->prepared == NULL)
+            {
+                fatal_error("Unable to allocate prepared statements\n");
+            }
+        }
+        prepared = &(cache->prepared[cache->num_prepared++]);
+        prepared->name = strdup(name);
+    }
+    prepared->statement = plan;
+
+    return PREPARE_STORED;
+}
+
+/**
+ * 绑定预处理语句的参数
+ * 格式为 <名字> <参数...>
+ * @param cache 语句缓存
+ * @param text execute 后面的文本
+ * @param statement 绑定好参数的语句
+ * @return 语句识别结果
+ */
+PrepareResult execute_named(StatementCache *cache, char *text, Statement *statement)
+{
+    char *arguments = strchr(text, ' ');
+    if(arguments != NULL)
+    {
+        *arguments = '\0';
+        arguments++;
+    }
+    else
+    {
+        arguments = text + strlen(text);
+    }
+
+    PreparedStatement *prepared = find_prepared(cache, text);
+    if(prepared == NULL)
+    {
+        return PREPARE_UNKNOWN_PREPARED;
+    }
+
+    statement_copy(statement, &(prepared->statement));
+    return bind_parameters(statement, arguments);
+}
+
+/**
+ * 按名字查找预处理语句
+ * @param cache 语句缓存
+ * @param name 名字
+ * @return 预处理语句，没有时返回NULL
+ */
+PreparedStatement* find_prepared(StatementCache *cache, const char *name)
+{
+    for(uint32_t i = 0; i < cache->num_prepared; i++)
+    {
+        if(strcmp(cache->prepared[i].name, name) == 0)
+        {
+            return &(cache->prepared[i]);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * 计算语句文本的哈希值
+ * FNV-1a
+ * @param text 语句文本
+ * @return 哈希值
+ */
+uint32_t statement_hash(const char *text)
+{
+    uint32_t hash = 2166136261u;
+    for(const char *c = text; *c != '\0'; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * 在执行计划缓存中查找
+ * @param cache 语句缓存
+ * @param text 语句文本
+ * @param hash 语句文本的哈希值
+ * @return 执行计划，没有时返回NULL
+ */
+CachedPlan* plan_cache_lookup(StatementCache *cache, const char *text, uint32_t hash)
+{
+    for(uint32_t i = 0; i < PLAN_CACHE_SIZE; i++)
+    {
+        CachedPlan *plan = &(cache->plans[i]);
+        if(plan->text != NULL && plan->hash == hash && strcmp(plan->text, text) == 0)
+        {
+            plan->last_used = ++cache->clock;
+            return plan;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * 把执行计划放进缓存
+ * 有空槽时放进空槽，否则淘汰最久没有使用的条目
+ * @param cache 语句缓存
+ * @param text 语句文本
+ * @param hash 语句文本的哈希值
+ * @param statement 解析好的语句
+ */
+void plan_cache_put(StatementCache *cache, const char *text, uint32_t hash, Statement *statement)
+{
+    CachedPlan *victim = &(cache->plans[0]);
+    for(uint32_t i = 0; i < PLAN_CACHE_SIZE && victim->text != NULL; i++)
+    {
+        CachedPlan *plan = &(cache->plans[i]);
+        if(plan->text == NULL || plan->last_used < victim->last_used)
+        {
+            victim = plan;
+        }
+    }
+
+    free(victim->text);
+    victim->text = strdup(text);
+    victim->hash = hash;
+    victim->last_used = ++cache->clock;
+    statement_copy(&(victim->statement), statement);
+}
+
+/**
+ * 在语句中添加一个要插入的行
+ * 容量不够时加倍
+ * @param statement 语句
+ * @return 新的行
+ */
+Row* statement_add_row(Statement *statement)
+{
+    if(statement->num_rows == statement->rows_capacity)
+    {
+        statement->rows_capacity = (statement->rows_capacity == 0) ? 16 : statement->rows_capacity * 2;
+        statement->rows_to_insert = realloc(statement->rows_to_insert, statement->rows_capacity * sizeof(Row));
+        if(statement->rows_to_insert == NULL)
+        {
+            fatal_error("Unable to allocate rows to insert\n");
+        }
+    }
+
+    return &(statement->rows_to_insert[statement->num_rows++]);
+}
+
+/**
+ * 准备查询语句
+ * 支持 select [列, ...] [from 表名] [where 条件]，没有列出列时输出所有列，没有表名时查询默认表。
+ * 条件可以是 键 = N、键 between A and B，或者 字符串列 = 值、字符串列 like 前缀%，字符串值可以用一对引号括起来。
+ * 列也可以换成聚合函数 count(*) 以及对键的 min、max、sum，这时只输出一行聚合结果
+ * @param input_buffer 输入缓冲区
+ * @param database 数据库
+ * @param statement 语句
+ * @return 语句识别结果
+ */
+PrepareResult prepare_select(InputBuffer *input_buffer, Database *database, Statement *statement)
+{
+    char *saveptr;    // strtok_r 的解析位置
+    statement->type = STATEMENT_SELECT;
+    statement->table = database->tables[0];
+    statement->where_type = WHERE_NONE;
+    statement->num_columns = 0;
+    statement->num_aggregates = 0;
+    statement->num_parameters = 0;
+
+    char *keyword = strtok_r(input_buffer->buffer, " ", &saveptr);  // 解析关键字
+    if(strcmp(keyword, "select") != 0)
+    {
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+
+    // 列名要等读到表名以后才能查找，先记下来
+    char *names[MAX_SELECT_COLUMNS];
+    uint32_t num_names = 0;
+    char *where = strtok_r(NULL, " ,", &saveptr);                   // 解析列名、from或者where
+    while(where != NULL && strcmp(where, "where") != 0 && strcmp(where, "from") != 0)
+    {
+        if(num_names == MAX_SELECT_COLUMNS)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        names[num_names++] = where;
+        where = strtok_r(NULL, " ,", &saveptr);
+    }
+    if(where != NULL && strcmp(where, "from") == 0)
+    {
+        char *name = strtok_r(NULL, " ", &saveptr);                 // 解析表名
+        if(name == NULL)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->table = database_find_table(database, name);
+        if(statement->table == NULL)
+        {
+            return PREPARE_UNKNOWN_TABLE;
+        }
+        where = strtok_r(NULL, " ", &saveptr);
+    }
+
+    RowLayout *layout = &(statement->table->layout);
+    const char *key = layout->columns[0].name;
+    for(uint32_t i = 0; i < num_names; i++)
+    {
+        if(strcmp(names[i], "count(*)") == 0)
+        {
+            statement->aggregates[statement->num_aggregates++] = AGGREGATE_COUNT;
+        }
+        else if(is_aggregate_of(names[i], "min", key))
+        {
+            statement->aggregates[statement->num_aggregates++] = AGGREGATE_MIN_ID;
+        }
+        else if(is_aggregate_of(names[i], "max", key))
+        {
+            statement->aggregates[statement->num_aggregates++] = AGGREGATE_MAX_ID;
+        }
+        else if(is_aggregate_of(names[i], "sum", key))
+        {
+            statement->aggregates[statement->num_aggregates++] = AGGREGATE_SUM_ID;
+        }
+        else
+        {
+            int32_t column = row_layout_find(layout, names[i]);
+            if(column < 0)
+            {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            statement->columns[statement->num_columns++] = column;
+        }
+    }
+
+    if(statement->num_columns > 0 && statement->num_aggregates > 0)
+    {
+        return PREPARE_SYNTAX_ERROR;    // 没有分组，聚合函数不能和列一起查询
+    }
+    if(statement->num_columns == 0 && statement->num_aggregates == 0)
+    {
+        // 没有列出列，输出所有列
+        for(uint32_t i = 0; i < layout->num_columns; i++)
+        {
+            statement->columns[i] = i;
+        }
+        statement->num_columns = layout->num_columns;
+    }
+
+    if(where == NULL)
+    {
+        return PREPARE_SUCCESS;
+    }
+
+    char *column = strtok_r(NULL, " ", &saveptr);                   // 解析列名
+    char *op = strtok_r(NULL, " ", &saveptr);                       // 解析运算符
+    char *id_string = strtok_r(NULL, " ", &saveptr);                // 解析id
+    if(strcmp(where, "where") != 0 || column == NULL || op == NULL || id_string == NULL)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    int32_t column_num = row_layout_find(layout, column);
+    if(column_num > 0 && layout->columns[column_num].type == COLUMN_VARCHAR)
+    {
+        // 字符串条件：等于一个值，或者 like 一个以 % 结尾的前缀
+        if(strcmp(op, "=") == 0)
+        {
+            statement->where_type = WHERE_STRING_EQUALS;
+        }
+        else if(strcmp(op, "like") == 0)
+        {
+            statement->where_type = WHERE_STRING_PREFIX;
+        }
+        else
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if(strtok_r(NULL, " ", &saveptr) != NULL)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        statement->where_column = column_num;
+        return prepare_value(statement, PARAMETER_WHERE_STRING, 0, 0, id_string);
+    }
+    if(column_num != 0)
+    {
+        return PREPARE_SYNTAX_ERROR;    // 整数条件只支持键
+    }
+
+    PrepareResult result = prepare_value(statement, PARAMETER_WHERE_ID, 0, 0, id_string);
+    if(result != PREPARE_SUCCESS)
+    {
+        return result;
+    }
+
+    if(strcmp(op, "between") == 0)
+    {
+        char *and = strtok_r(NULL, " ", &saveptr);                  // 解析and
+        char *end_string = strtok_r(NULL, " ", &saveptr);           // 解析区间上界
+        if(and == NULL || strcmp(and, "and") != 0 || end_string == NULL || strtok_r(NULL, " ", &saveptr) != NULL)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        statement->where_type = WHERE_ID_BETWEEN;
+        return prepare_value(statement, PARAMETER_WHERE_ID_END, 0, 0, end_string);
+    }
+
+    if(strcmp(op, "=") != 0 || strtok_r(NULL, " ", &saveptr) != NULL)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    statement->where_type = WHERE_ID_EQUALS;
+
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * 判断是不是对某一列的聚合函数
+ * 比如 function 是 min、column 是 id 时，只有 min(id) 满足
+ * @param token 查询语句中列出的列
+ * @param function 聚合函数名
+ * @param column 列名
+ * @return 是否满足
+ */
+bool is_aggregate_of(const char *token, const char *function, const char *column)
+{
+    size_t function_length = strlen(function);
+    size_t column_length = strlen(column);
+    return strncmp(token, function, function_length) == 0 && token[function_length] == '(' &&
+        strncmp(token + function_length + 1, column, column_length) == 0 &&
+        strcmp(token + function_length + 1 + column_length, ")") == 0;
+}
+
+/**
+ * 准备事务语句
+ * begin、commit、rollback 都没有参数
+ * @param input_buffer 输入缓冲区
+ * @param statement 语句
+ * @return 准备结果
+ */
+PrepareResult prepare_transaction(InputBuffer *input_buffer, Statement *statement)
+{
+    statement->num_rows = 0;
+    statement->num_parameters = 0;
+    if(strcmp(input_buffer->buffer, "begin") == 0)
+    {
+        statement->type = STATEMENT_BEGIN;
+    }
+    else if(strcmp(input_buffer->buffer, "commit") == 0)
+    {
+        statement->type = STATEMENT_COMMIT;
+    }
+    else
+    {
+        statement->type = STATEMENT_ROLLBACK;
+    }
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * 准备建索引语句
+ * 格式是 create index on 列名（默认表）或者 create index on 表名 (列名)，只能在字符串列上建索引
+ * @param input_buffer 输入缓冲区
+ * @param database 数据库
+ * @param statement 语句
+ * @return 准备结果
+ */
+PrepareResult prepare_create_index(InputBuffer *input_buffer, Database *database, Statement *statement)
+{
+    char *saveptr;    // strtok_r 的解析位置
+    statement->type = STATEMENT_CREATE_INDEX;
+    statement->table = database->tables[0];
+    statement->num_rows = 0;
+    statement->num_parameters = 0;
+
+    char *keyword = strtok_r(input_buffer->buffer, " ", &saveptr);  // 解析关键字
+    char *index = strtok_r(NULL, " ", &saveptr);                    // 解析index
+    char *on = strtok_r(NULL, " ", &saveptr);                       // 解析on
+    char *name = strtok_r(NULL, " (", &saveptr);                    // 解析列名或者表名
+    char *column = strtok_r(NULL, " ()", &saveptr);                 // 解析括号中的列名
+    if(strcmp(keyword, "create") != 0)
+    {
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+    if(index == NULL || strcmp(index, "index") != 0 || on == NULL || strcmp(on, "on") != 0 || name == NULL ||
+        strtok_r(NULL, " ()", &saveptr) != NULL)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if(column == NULL)
+    {
+        column = name;
+    }
+    else
+    {
+        statement->table = database_find_table(database, name);
+        if(statement->table == NULL)
+        {
+            return PREPARE_UNKNOWN_TABLE;
+        }
+    }
+
+    int32_t column_num = row_layout_find(&(statement->table->layout), column);
+    if(column_num <= 0 || statement->table->layout.columns[column_num].type != COLUMN_VARCHAR)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    statement->index_column = column_num;
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * 准备建表语句
+ * 格式是 create table 表名 (列名 类型, ...)，类型是 int 或者 varchar(n)，第一列必须是 int，作为表的键，最多 MAX_TABLE_COLUMNS 列
+ * @param input_buffer 输入缓冲区
+ * @param statement 语句
+ * @return 准备结果
+ */
+PrepareResult prepare_create_table(InputBuffer *input_buffer, Statement *statement)
+{
+    char *saveptr;    // strtok_r 的解析位置
+    statement->type = STATEMENT_CREATE_TABLE;
+    statement->num_rows = 0;
+    statement->num_parameters = 0;
+    statement->layout.num_columns = 0;
+
+    // 列的定义在第一个左括号和最后一个右括号之间
+    char *open = strchr(input_buffer->buffer, '(');
+    char *close = strrchr(input_buffer->buffer, ')');
+    if(open == NULL || close == NULL || close < open)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    *open = '\0';
+    *close = '\0';
+    for(char *rest = close + 1; *rest != '\0'; rest++)
+    {
+        if(*rest != ' ')
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+    }
+
+    strtok_r(input_buffer->buffer, " ", &saveptr);                  // 跳过create
+    strtok_r(NULL, " ", &saveptr);                                  // 跳过table
+    char *name = strtok_r(NULL, " ", &saveptr);                     // 解析表名
+    if(name == NULL || strtok_r(NULL, " ", &saveptr) != NULL || !is_identifier(name))
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    strcpy(statement->table_name, name);
+
+    char *definition = strtok_r(open + 1, ",", &saveptr);           // 解析列的定义
+    while(definition != NULL)
+    {
+        char *column_saveptr;    // 列的定义的解析位置
+        char *column = strtok_r(definition, " ", &column_saveptr);  // 解析列名
+        char *type = strtok_r(NULL, " ", &column_saveptr);          // 解析类型
+        if(column == NULL || type == NULL || strtok_r(NULL, " ", &column_saveptr) != NULL || !is_identifier(column))
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        if(statement->layout.num_columns == MAX_TABLE_COLUMNS)
+        {
+            return PREPARE_TOO_MANY_COLUMNS;
+        }
+
+        bool added;    // 是否加上了这一列
+        if(strcmp(type, "int") == 0)
+        {
+            added = row_layout_add(&(statement->layout), column, COLUMN_INT, INT_COLUMN_SIZE);
+        }
+        else
+        {
+            char *end;
+            if(strncmp(type, "varchar(", 8) != 0 || type[8] < '0' || type[8] > '9')
+            {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            long size = strtol(type + 8, &end, 10);
+            if(strcmp(end, ")") != 0 || size < 1 || size > VARCHAR_MAX_SIZE)
+            {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            added = row_layout_add(&(statement->layout), column, COLUMN_VARCHAR, size);
+        }
+        if(!added)
+        {
+            return PREPARE_SYNTAX_ERROR;    // 列名重复
+        }
+        definition = strtok_r(NULL, ",", &saveptr);
+    }
+
+    if(statement->layout.num_columns == 0 || statement->layout.columns[0].type != COLUMN_INT)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    row_layout_compute(&(statement->layout));
+    if(statement->layout.max_size > ROW_MAX_SIZE)
+    {
+        return PREPARE_ROW_TOO_LARGE;
+    }
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * 判断是不是合法的表名或列名
+ * 由字母、数字和下划线组成，不以数字开头，并且放得进目录页
+ * @param name 名字
+ * @return 是否合法
+ */
+bool is_identifier(const char *name)
+{
+    size_t length = strlen(name);
+    if(length == 0 || length >= CATALOG_NAME_SIZE || (name[0] >= '0' && name[0] <= '9'))
+    {
+        return false;
+    }
+    for(size_t i = 0; i < length; i++)
+    {
+        char c = name[i];
+        if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * 准备删除语句
+ * 格式是 delete [from 表名] [where 键 = id | where 键 between id and id]，没有条件时删除所有的行
+ * @param input_buffer 输入缓冲区
+ * @param database 数据库
+ * @param statement 语句
+ * @return 准备结果
+ */
+PrepareResult prepare_delete(InputBuffer *input_buffer, Database *database, Statement *statement)
+{
+    char *saveptr;    // strtok_r 的解析位置
+    statement->type = STATEMENT_DELETE;
+    statement->table = database->tables[0];
+    statement->where_type = WHERE_NONE;
+    statement->num_rows = 0;
+    statement->num_parameters = 0;
+
+    char *keyword = strtok_r(input_buffer->buffer, " ", &saveptr);  // 解析关键字
+    if(strcmp(keyword, "delete") != 0)
+    {
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+
+    char *where = strtok_r(NULL, " ", &saveptr);                    // 解析from或者where
+    if(where != NULL && strcmp(where, "from") == 0)
+    {
+        char *name = strtok_r(NULL, " ", &saveptr);                 // 解析表名
+        if(name == NULL)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->table = database_find_table(database, name);
+        if(statement->table == NULL)
+        {
+            return PREPARE_UNKNOWN_TABLE;
+        }
+        where = strtok_r(NULL, " ", &saveptr);
+    }
+    if(where == NULL)
+    {
+        return PREPARE_SUCCESS;
+    }
+
+    char *column = strtok_r(NULL, " ", &saveptr);                   // 解析列名
+    char *op = strtok_r(NULL, " ", &saveptr);                       // 解析运算符
+    char *id_string = strtok_r(NULL, " ", &saveptr);                // 解析id
+    if(strcmp(where, "where") != 0 || column == NULL || op == NULL || id_string == NULL ||
+        row_layout_find(&(statement->table->layout), column) != 0)
+    {
+        return PREPARE_SYNTAX_ERROR;    // 只支持按键删除
+    }
+
+    PrepareResult result = prepare_value(statement, PARAMETER_WHERE_ID, 0, 0, id_string);
+    if(result != PREPARE_SUCCESS)
+    {
+        return result;
+    }
+
+    if(strcmp(op, "between") == 0)
+    {
+        char *and = strtok_r(NULL, " ", &saveptr);                  // 解析and
+        char *end_string = strtok_r(NULL, " ", &saveptr);           // 解析区间上界
+        if(and == NULL || strcmp(and, "and") != 0 || end_string == NULL || strtok_r(NULL, " ", &saveptr) != NULL)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        statement->where_type = WHERE_ID_BETWEEN;
+        return prepare_value(statement, PARAMETER_WHERE_ID_END, 0, 0, end_string);
+    }
+
+    if(strcmp(op, "=") != 0 || strtok_r(NULL, " ", &saveptr) != NULL)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    statement->where_type = WHERE_ID_EQUALS;
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * 准备语句
+ * @param input_buffer 输入缓冲区
+ * @param database 数据库
+ * @param statement 语句
+ * @return 语句识别结果
+ */
+PrepareResult prepare_statement(InputBuffer *input_buffer, Database *database, Statement *statement)
+{
+    if(strncmp(input_buffer->buffer, "insert", 6) == 0) // 因为insert语句会包含其他字符，所以只需要比较前6个字符
+    {
+        return prepare_insert(input_buffer, database, statement);
+    }
+    if(strncmp(input_buffer->buffer, "select", 6) == 0)
+    {
+        return prepare_select(input_buffer, database, statement);
+    }
+    if(strncmp(input_buffer->buffer, "delete", 6) == 0)
+    {
+        return prepare_delete(input_buffer, database, statement);
+    }
+    if(strcmp(input_buffer->buffer, "begin") == 0 || strcmp(input_buffer->buffer, "commit") == 0 ||
+        strcmp(input_buffer->buffer, "rollback") == 0)
+    {
+        return prepare_transaction(input_buffer, statement);
+    }
+    if(strncmp(input_buffer->buffer, "create table ", 13) == 0)
+    {
+        return prepare_create_table(input_buffer, statement);
+    }
+    if(strncmp(input_buffer->buffer, "create", 6) == 0)
+    {
+        return prepare_create_index(input_buffer, database, statement);
+    }
+
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+/**
+ * 把行中要查询的列写到输出缓冲区
+ * 直接读取页中序列化的行，只访问要输出的列，不反序列化整行
+ * @param output 输出缓冲区
+ * @param source 序列化的行
+ * @param statement 语句
+ */
+void write_row(OutputBuffer *output, void *source, Statement *statement)
+{
+    RowLayout *layout = &(statement->table->layout);
+    output_write(output, "(", 1);
+    for(uint32_t i = 0; i < statement->num_columns; i++)
+    {
+        if(i > 0)
+        {
+            output_write(output, ", ", 2);
+        }
+
+        uint32_t column = statement->columns[i];
+        if(column == 0)
+        {
+            output_uint32(output, row_id(source));
+        }
+        else if(layout->columns[column].type == COLUMN_INT)
+        {
+            output_printf(output, "%d", row_int(layout, source, column));
+        }
+        else
+        {
+            uint32_t length;
+            char *string = row_string(layout, source, column, &length);
+            output_write(output, string, length);
+        }
+    }
+    output_write(output, ")\n", 2);
+}
+
+/**
+ * 执行插入语句
+ * @param statement 语句
+ * @return 执行结果
+ */
+ExecuteResult execute_insert(Statement *statement, Table *table)
+{
+    if(statement->num_rows > 1)
+    {
+        return execute_insert_batch(statement, table);
+    }
+
+    Row *row_to_insert = &(statement->rows_to_insert[0]);
+    uint32_t key_to_insert = row_to_insert->id;
+    Cursor *cursor = table_find_for_write(table, key_to_insert);
+
+    void *node = cursor->node;
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t key_at_cursor = (cursor->cell_num < num_cells) ? *leaf_node_key(node, cursor->cell_num) : 0;
+    if(cursor->cell_num < num_cells && key_at_cursor == key_to_insert)
+    {
+        cursor_close(cursor);
+        if(!version_deleted_by_writer(table, key_to_insert))
+        {
+            return version_delete_pending(table, key_to_insert) ? EXECUTE_DELETE_PENDING : EXECUTE_DUPLICATE_KEY;
+        }
+        table_reclaim_deleted(table, key_to_insert);    // 事务中删除过的键，先删掉旧的行
+        cursor = table_find_for_write(table, key_to_insert);
+        node = cursor->node;
+    }
+    bool leaf_full = leaf_node_free_space(node) < row_serialized_size(row_to_insert) + LEAF_NODE_SLOT_SIZE;
+
+    // 叶子节点已满时，分裂可能一直传递到根节点，每一层最多新增一页，新建根节点再多一页
+    if(leaf_full &&
+        (uint64_t)table->pager->num_pages + table_depth(table) + 1 > TABLE_MAX_PAGES)
+    {
+        cursor_close(cursor);
+        return EXECUTE_TABLE_FULL;
+    }
+
+    version_record(table, key_to_insert);
+    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+
+    cursor_close(cursor);
+    index_insert_row(table, row_to_insert);
+
+    return EXECUTE_SUCCESS;
+}
+
+/**
+ * 执行多行插入语句
+ * 先把行按id排序，再逐个叶子节点处理：每次从根节点下降到一个叶子节点，
+ * 把落在这个叶子节点中的所有行一次插入，不需要为每一行都查找一遍
+ * 插入之前先检查所有的键，有重复的键时整批都不插入；键的删除已经提交、行还在等旧的快照结束时返回 EXECUTE_DELETE_PENDING
+ * @param statement 语句
+ * @return 执行结果
+ */
+ExecuteResult execute_insert_batch(Statement *statement, Table *table)
+{
+    Pager *pager = table->pager;
+    Row *rows = statement->rows_to_insert;
+    uint32_t num_rows = statement->num_rows;
+
+    qsort(rows, num_rows, sizeof(Row), compare_rows_by_id);
+    for(uint32_t i = 1; i < num_rows; i++)
+    {
+        if(rows[i].id == rows[i - 1].id)
+        {
+            return EXECUTE_DUPLICATE_KEY;
+        }
+    }
+
+    // 每个叶子节点最多分裂出和新行一样多的页，每次分裂最多一直传递到根节点
+    if((uint64_t)pager->num_pages + (uint64_t)num_rows * (table_depth(table) + 1) > TABLE_MAX_PAGES)
+    {
+        return EXECUTE_TABLE_FULL;
+    }
+
+    // 第一遍只检查键是否已经存在，叶子节点中的键和这批行都是有序的，合并着比较
+    uint32_t start = 0;
+    while(start < num_rows)
+    {
+        Cursor *cursor = table_find_for_write(table, rows[start].id);
+        void *node = cursor->node;
+        uint32_t end = leaf_node_batch_end(pager, node, rows, start, num_rows);
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        uint32_t cell_num = cursor->cell_num;
+        bool duplicate = false;
+        bool pending = false;
+        for(uint32_t i = start; i < end && !duplicate; i++)
+        {
+            while(cell_num < num_cells && *leaf_node_key(node, cell_num) < (uint32_t)rows[i].id)
+            {
+                cell_num++;
+            }
+            duplicate = cell_num < num_cells && *leaf_node_key(node, cell_num) == (uint32_t)rows[i].id &&
+                        !version_deleted_by_writer(table, rows[i].id);
+            pending = duplicate && version_delete_pending(table, rows[i].id);
+        }
+        cursor_close(cursor);
+        if(duplicate)
+        {
+            return pending ? EXECUTE_DELETE_PENDING : EXECUTE_DUPLICATE_KEY;
+        }
+        start = end;
+    }
+
+    for(uint32_t i = 0; i < num_rows; i++)
+    {
+        if(version_deleted_by_writer(table, rows[i].id))
+        {
+            table_reclaim_deleted(table, rows[i].id);    // 事务中删除过的键，先删掉旧的行
+        }
+        version_record(table, rows[i].id);
+    }
+
+    // 第二遍逐个叶子节点插入，插入会改变树的结构，所以每个叶子节点都重新从根节点查找
+    start = 0;
+    while(start < num_rows)
+    {
+        uint32_t page_num = table_find_leaf(table, rows[start].id);
+        start += leaf_node_insert_batch(table, page_num, rows + start, num_rows - start);
+    }
+
+    for(uint32_t i = 0; i < num_rows; i++)
+    {
+        index_insert_row(table, &rows[i]);
+    }
+
+    return EXECUTE_SUCCESS;
+}
+
+/**
+ * 执行删除语句
+ * 只在版本存储中记下删除的版本，行还留在树中：写者的版本比所有快照都新，提交前其他查询仍然能看到这些行。
+ * 提交时成为一批待清除的删除，比它旧的快照都结束以后由之后的写者从树中删掉
+ * @param statement 语句
+ * @return 执行结果
+ */
+ExecuteResult execute_delete(Statement *statement, Table *table)
+{
+    uint32_t start_key;
+    uint32_t end_key;
+    statement_key_range(statement, &start_key, &end_key);
+
+    // 用写者的版本读，事务中插入还没提交的行也能删除，已经删除的行不会再删一次
+    uint32_t capacity = 64;
+    uint32_t num_keys = 0;
+    uint32_t *keys = (uint32_t *)malloc(sizeof(uint32_t) * capacity);
+    RangeCursor *range = range_cursor_open(table, start_key, end_key, table->versions.commit_version + 1);
+    while(range->end_of_range != true)
+    {
+        if(num_keys == capacity)
+        {
+            capacity *= 2;
+            keys = (uint32_t *)realloc(keys, sizeof(uint32_t) * capacity);
+        }
+        keys[num_keys++] = cursor_key(range->cursor);
+        range_cursor_advance(range);
+    }
+    range_cursor_close(range);
+
+    for(uint32_t i = 0; i < num_keys; i++)
+    {
+        version_delete(table, keys[i]);
+    }
+    free(keys);
+
+    return EXECUTE_SUCCESS;
+}
+
+/**
+ * 把提交了的删除记成一批待清除的删除
+ * 写者的版本已经提交，记下这时的提交版本，比它旧的快照都结束以后才能从树中删掉；调用者持有 writer_mutex
+ */
+void table_defer_purge(Table *table)
+{
+    if(table->num_deleted == 0)
+    {
+        return;
+    }
+
+    database_add_purge_batch(table->database, table, table->deleted_keys, table->num_deleted, table->versions.commit_version);
+    table->deleted_keys = NULL;
+    table->num_deleted = 0;
+    table->deleted_capacity = 0;
+}
+
+/**
+ * 把提交了的删除从树中删掉
+ * 比删除旧的快照都已经结束，不会再有查询需要看到这些行。第一遍按键的顺序逐个叶子节点重建，去掉删除的行，
+ * 同时从索引中删除；第二遍再检查改过的叶子节点，太空时和兄弟节点合并。调用者持有 writer_mutex
+ * @param keys 删除的键，会被排序
+ * @param num_keys 键数
+ */
+void table_purge(Table *table, uint32_t *keys, uint32_t num_keys)
+{
+    Pager *pager = table->pager;
+    Database *database = table->database;
+    qsort(keys, num_keys, sizeof(uint32_t), compare_uint32);
+    uint32_t *page_nums = (uint32_t *)malloc(sizeof(uint32_t) * num_keys);
+    uint32_t num_pages = 0;
+    void *copy = malloc(PAGE_SIZE);
+    bool *skip = (bool *)malloc(sizeof(bool) * PAGE_SIZE / LEAF_NODE_SLOT_SIZE);
+
+    uint32_t i = 0;
+    while(i < num_keys)
+    {
+        uint32_t page_num = table_find_leaf(table, keys[i]);
+        void *node = get_page(pager, page_num);
+        pager_mark_dirty(pager, page_num);
+        memcpy(copy, node, PAGE_SIZE);
+
+        // 叶子节点中的键和删除的键都是有序的，合并着比较
+        uint32_t num_cells = *leaf_node_num_cells(copy);
+        uint32_t next = i;
+        for(uint32_t cell_num = 0; cell_num < num_cells; cell_num++)
+        {
+            uint32_t key = *leaf_node_key(copy, cell_num);
+            while(next < num_keys && keys[next] < key)
+            {
+                next++;
+            }
+            skip[cell_num] = next < num_keys && keys[next] == key;
+        }
+        *leaf_node_num_cells(node) = 0;
+        *leaf_node_heap_start(node) = PAGE_SIZE;
+        leaf_node_append_cells(node, copy, skip);
+        unpin_page(pager, page_num);
+
+        for(uint32_t cell_num = 0; cell_num < num_cells; cell_num++)
+        {
+            if(skip[cell_num])
+            {
+                index_delete_row(table, leaf_node_value(copy, cell_num));
+            }
+        }
+
+        // 不大于这个叶子节点最大键的键都处理过了，至少前进一个
+        uint32_t max_key = (num_cells > 0) ? *leaf_node_key(copy, num_cells - 1) : 0;
+        next = i + 1;
+        while(next < num_keys && num_cells > 0 && keys[next] <= max_key)
+        {
+            next++;
+        }
+        if(num_pages == 0 || page_nums[num_pages - 1] != page_num)
+        {
+            page_nums[num_pages++] = page_num;
+        }
+        i = next;
+    }
+    free(copy);
+    free(skip);
+
+    // 合并会释放页，已经释放的叶子节点不再检查
+    for(uint32_t j = 0; j < num_pages; j++)
+    {
+        bool freed = false;
+        for(uint32_t k = 0; k < database->num_freed && !freed; k++)
+        {
+            freed = database->freed_pages[k] == page_nums[j];
+        }
+        if(!freed)
+        {
+            leaf_node_rebalance(table, page_nums[j]);
+        }
+    }
+    free(page_nums);
+
+    version_purged(table, keys, num_keys);
+}
+
+/**
+ * 从树中删掉写者删除了又要重新插入的行
+ * 删除的行提交时才从树中删掉，事务中再插入同一个键时先把旧的行从叶子节点和索引中删掉，并去掉删除标记。
+ * 回滚时页恢复成事务开始时的样子，旧的行又回到树中；调用者持有 writer_mutex
+ * @param key 键，被写者删除了
+ */
+void table_reclaim_deleted(Table *table, uint32_t key)
+{
+    Pager *pager = table->pager;
+    uint32_t page_num = table_find_leaf(table, key);
+    void *node = get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+    void *copy = malloc(PAGE_SIZE);
+    memcpy(copy, node, PAGE_SIZE);
+
+    uint32_t num_cells = *leaf_node_num_cells(copy);
+    uint32_t cell_num = leaf_node_search(copy, key);
+    bool *skip = (bool *)calloc(num_cells, sizeof(bool));
+    skip[cell_num] = true;
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_heap_start(node) = PAGE_SIZE;
+    leaf_node_append_cells(node, copy, skip);
+    unpin_page(pager, page_num);
+
+    index_delete_row(table, leaf_node_value(copy, cell_num));
+    version_undelete(table, key);
+    free(skip);
+    free(copy);
+}
+
+/**
+ * 按id比较两个行
+ * @param a 行
+ * @param b 行
+ * @return 比较结果
+ */
+int compare_rows_by_id(const void *a, const void *b)
+{
+    uint32_t id_a = ((const Row *)a)->id;
+    uint32_t id_b = ((const Row *)b)->id;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+/**
+ * 执行查询语句
+ * 查询读取开始时的快照，执行过程中提交的插入都看不到
+ * @param statement 语句
+ * @param output 输出缓冲区
+ * @param own_writes 会话是否在事务中：事务还没有提交，它的版本比提交版本大1，自己的查询要能看到
+ * @return 执行结果
+ */
+ExecuteResult execute_select(Statement *statement, Table *table, OutputBuffer *output, bool own_writes)
+{
+    uint64_t registered = snapshot_begin(table);
+    uint64_t snapshot = own_writes ? registered + 1 : registered;
+
+    if(statement->num_aggregates > 0)
+    {
+        execute_aggregate(statement, table, output, snapshot);
+    }
+    else if(statement->where_type == WHERE_ID_EQUALS)
+    {
+        // 按id查询只需要沿B+树下降到一个叶子节点，不需要全表扫描
+        Cursor *cursor = table_find(table, statement->where_id);
+        if(cursor->cell_num < *leaf_node_num_cells(cursor->node) && cursor_key(cursor) == statement->where_id &&
+            version_visible(table, statement->where_id, snapshot))
+        {
+            write_row(output, cursor_value(cursor), statement);
+        }
+        cursor_close(cursor);
+    }
+    else if(!index_select(statement, table, snapshot, output, NULL))
+    {
+        // 全表扫描或者按id区间扫描，字符串条件的列上没有索引时在扫描时逐行比较
+        uint32_t start_key;
+        uint32_t end_key;
+        statement_key_range(statement, &start_key, &end_key);
+        pager_advise_sequential(table->pager, true);
+        if(!parallel_scan(statement, table, start_key, end_key, snapshot, output, NULL))
+        {
+            scan_range(statement, table, start_key, end_key, snapshot, output, NULL);
+        }
+        pager_advise_sequential(table->pager, false);
+    }
+
+    snapshot_end(table, registered);
+    return EXECUTE_SUCCESS;
+}
+
+/**
+ * 执行聚合查询
+ * 只查询 min(id)、max(id) 并且没有字符串条件时，直接从区间两端的叶子节点得到结果；
+ * 其他情况扫描区间，边扫描边累加，不输出也不反序列化行
+ * @param statement 语句
+ * @param output 输出缓冲区
+ * @param snapshot 快照
+ */
+void execute_aggregate(Statement *statement, Table *table, OutputBuffer *output, uint64_t snapshot)
+{
+    uint32_t start_key;
+    uint32_t end_key;
+    statement_key_range(statement, &start_key, &end_key);
+    AggregateState aggregate = {0, 0, 0, 0};
+
+    bool extremes_only = statement->where_type != WHERE_STRING_EQUALS && statement->where_type != WHERE_STRING_PREFIX;
+    for(uint32_t i = 0; i < statement->num_aggregates; i++)
+    {
+        if(statement->aggregates[i] == AGGREGATE_COUNT || statement->aggregates[i] == AGGREGATE_SUM_ID)
+        {
+            extremes_only = false;
+        }
+    }
+
+    bool scanned = false;
+    if(extremes_only)
+    {
+        RangeCursor *range = range_cursor_open(table, start_key, end_key, snapshot);
+        if(range->end_of_range != true)
+        {
+            aggregate.count = 1;    // 只表示区间中有行，没有查询 count(*)
+            aggregate.min = cursor_key(range->cursor);
+            scanned = table_last_key(table, start_key, end_key, snapshot, &(aggregate.max));
+        }
+        else
+        {
+            scanned = true;
+        }
+        range_cursor_close(range);
+    }
+
+    if(!scanned && !index_select(statement, table, snapshot, NULL, &aggregate))
+    {
+        memset(&aggregate, 0, sizeof(aggregate));
+        pager_advise_sequential(table->pager, true);
+        if(!parallel_scan(statement, table, start_key, end_key, snapshot, NULL, &aggregate))
+        {
+            scan_range(statement, table, start_key, end_key, snapshot, NULL, &aggregate);
+        }
+        pager_advise_sequential(table->pager, false);
+    }
+
+    write_aggregates(output, statement, &aggregate);
+}
+
+/**
+ * 获取查询条件限定的id区间
+ * 没有id条件时是整个键空间
+ * @param statement 查询语句
+ * @param start_key 返回区间下界（包含）
+ * @param end_key 返回区间上界（包含）
+ */
+void statement_key_range(Statement *statement, uint32_t *start_key, uint32_t *end_key)
+{
+    *start_key = 0;
+    *end_key = UINT32_MAX;
+    if(statement->where_type == WHERE_ID_EQUALS)
+    {
+        *start_key = statement->where_id;
+        *end_key = statement->where_id;
+    }
+    else if(statement->where_type == WHERE_ID_BETWEEN)
+    {
+        *start_key = statement->where_id;
+        *end_key = statement->where_id_end;
+    }
+}
+
+/**
+ * 判断行是否满足字符串条件
+ * 直接比较页中序列化的字符串，不反序列化整行
+ * @param statement 查询语句
+ * @param source 序列化的行
+ * @return 是否满足；没有字符串条件时总是满足
+ */
+bool row_matches(Statement *statement, void *source)
+{
+    if(statement->where_type != WHERE_STRING_EQUALS && statement->where_type != WHERE_STRING_PREFIX)
+    {
+        return true;
+    }
+
+    uint32_t length;
+    char *value = row_string(&(statement->table->layout), source, statement->where_column, &length);
+    if(statement->where_type == WHERE_STRING_EQUALS && length != statement->where_string_length)
+    {
+        return false;
+    }
+
+    return length >= statement->where_string_length && memcmp(value, statement->where_string, statement->where_string_length) == 0;
+}
+
+/**
+ * 扫描一段键
+ * 普通查询把满足条件的行写到输出缓冲区；聚合查询累加到聚合结果，没有字符串条件时不读行，
+ * 每个叶子节点中落在区间里的键一次累加
+ * @param statement 查询语句
+ * @param start_key 下界（包含）
+ * @param end_key 上界（包含）
+ * @param snapshot 快照
+ * @param output 输出缓冲区，聚合查询时为NULL
+ * @param aggregate 聚合结果，普通查询时为NULL
+ */
+void scan_range(Statement *statement, Table *table, uint32_t start_key, uint32_t end_key, uint64_t snapshot, OutputBuffer *output, AggregateState *aggregate)
+{
+    bool keys_only = aggregate != NULL && statement->where_type != WHERE_STRING_EQUALS && statement->where_type != WHERE_STRING_PREFIX;
+    RangeCursor *range = range_cursor_open(table, start_key, end_key, snapshot);
+    while(range->end_of_range != true)
+    {
+        Cursor *cursor = range->cursor;
+        if(keys_only)
+        {
+            // 跳到叶子节点中最后一个还在区间里的单元格，前进时再移动到下一个叶子节点
+            uint32_t end = leaf_node_upper_bound(cursor->node, cursor->cell_num, end_key);
+            aggregate_keys(aggregate, cursor->node, cursor->cell_num, end);
+            cursor->cell_num = end - 1;
+        }
+        else if(row_matches(statement, range_cursor_value(range)))
+        {
+            if(aggregate != NULL)
+            {
+                aggregate_keys(aggregate, cursor->node, cursor->cell_num, cursor->cell_num + 1);
+            }
+            else
+            {
+                write_row(output, range_cursor_value(range), statement);
+            }
+        }
+        range_cursor_advance(range);
+    }
+    range_cursor_close(range);
+}
+
+/**
+ * 查找区间中快照能看到的最大的键
+ * 沿B+树下降到上界所在的叶子节点，复制后去掉快照看不到的行，从上界的位置往前找；
+ * 这个叶子节点里没有能看到的行时，用它的第一个键减1作为新的上界，到前一个叶子节点里找
+ * @param start_key 区间下界（包含）
+ * @param end_key 区间上界（包含）
+ * @param snapshot 快照
+ * @param key 返回找到的键
+ * @return 是否找到了；找不到时调用者扫描区间
+ */
+bool table_last_key(Table *table, uint32_t start_key, uint32_t end_key, uint64_t snapshot, uint32_t *key)
+{
+    void *copy = malloc(PAGE_SIZE);
+    bool found = false;
+    while(true)
+    {
+        Cursor *cursor = table_find(table, end_key);
+        memcpy(copy, cursor->node, PAGE_SIZE);
+        uint32_t cell_num = cursor->cell_num;
+        cursor_close(cursor);
+        if(*leaf_node_num_cells(copy) == 0)
+        {
+            break;
+        }
+
+        uint32_t first_key = *leaf_node_key(copy, 0);
+        cell_num = version_filter_leaf(table, copy, snapshot, cell_num);
+        if(cell_num < *leaf_node_num_cells(copy) && *leaf_node_key(copy, cell_num) == end_key)
+        {
+            cell_num++;    // 上界本身就在叶子节点里
+        }
+        if(cell_num > 0 && *leaf_node_key(copy, cell_num - 1) >= start_key)
+        {
+            *key = *leaf_node_key(copy, cell_num - 1);
+            found = true;
+            break;
+        }
+        // 下界已经在这个叶子节点里，或者上界落在两个叶子节点之间的空隙里（不知道前一个叶子节点在哪），交给扫描
+        if(first_key <= start_key || first_key > end_key)
+        {
+            break;
+        }
+        end_key = first_key - 1;
+    }
+    free(copy);
+
+    return found;
+}
+
+/**
+ * 把叶子节点中一段连续的键累加到聚合结果
+ * 键在槽数组中的间隔是固定的，求和的循环里没有分支，编译器可以向量化；
+ * 键是递增的，最小值和最大值就是这一段的两端
+ * @param aggregate 聚合结果
+ * @param node 叶子节点
+ * @param start 第一个单元格
+ * @param end 最后一个单元格之后
+ */
+void aggregate_keys(AggregateState *aggregate, void *node, uint32_t start, uint32_t end)
+{
+    if(start >= end)
+    {
+        return;
+    }
+
+    uint8_t *slots = (uint8_t *)leaf_node_cell(node, 0);
+    uint64_t sum = 0;
+    for(uint32_t i = start; i < end; i++)
+    {
+        uint32_t key;
+        memcpy(&key, slots + i * LEAF_NODE_SLOT_SIZE + LEAF_NODE_KEY_OFFSET, sizeof(key));
+        sum += key;
+    }
+
+    if(aggregate->count == 0)
+    {
+        aggregate->min = *leaf_node_key(node, start);
+    }
+    aggregate->max = *leaf_node_key(node, end - 1);
+    aggregate->count += end - start;
+    aggregate->sum += sum;
+}
+
+/**
+ * 合并后一个区间的聚合结果
+ * @param destination 前面所有区间的聚合结果
+ * @param source 紧接着的区间的聚合结果
+ */
+void aggregate_merge(AggregateState *destination, AggregateState *source)
+{
+    if(source->count == 0)
+    {
+        return;
+    }
+
+    if(destination->count == 0)
+    {
+        destination->min = source->min;
+    }
+    destination->max = source->max;
+    destination->count += source->count;
+    destination->sum += source->sum;
+}
+
+/**
+ * 把聚合结果写到输出缓冲区
+ * 没有行时 count(*) 是0，其他聚合函数是NULL
+ * @param output 输出缓冲区
+ * @param statement 聚合查询
+ * @param aggregate 聚合结果
+ */
+void write_aggregates(OutputBuffer *output, Statement *statement, AggregateState *aggregate)
+{
+    output_write(output, "(", 1);
+    for(uint32_t i = 0; i < statement->num_aggregates; i++)
+    {
+        if(i > 0)
+        {
+            output_write(output, ", ", 2);
+        }
+
+        if(statement->aggregates[i] == AGGREGATE_COUNT)
+        {
+            output_uint64(output, aggregate->count);
+        }
+        else if(aggregate->count == 0)
+        {
+            output_write(output, "NULL", 4);
+        }
+        else if(statement->aggregates[i] == AGGREGATE_MIN_ID)
+        {
+            output_uint32(output, aggregate->min);
+        }
+        else if(statement->aggregates[i] == AGGREGATE_MAX_ID)
+        {
+            output_uint32(output, aggregate->max);
+        }
+        else
+        {
+            output_uint64(output, aggregate->sum);
+        }
+    }
+    output_write(output, ")\n", 2);
+}
+
+/**
+ * 并行扫描一段键
+ * 执行查询的线程和线程池中空闲的线程一起领取区间，区间比线程多，先做完的线程接着领取，负载大致均衡；
+ * 执行查询的线程每扫描完一个区间，就把前面已经按顺序完成的区间写出，结果不需要全部留在内存里；
+ * 聚合查询时每个区间在自己的聚合结果里累加，按区间顺序合并
+ * @param statement 查询语句
+ * @param start_key 下界（包含）
+ * @param end_key 上界（包含）
+ * @param snapshot 快照
+ * @param output 输出缓冲区，聚合查询时为NULL
+ * @param aggregate 聚合结果，普通查询时为NULL
+ * @return 是否并行扫描了；表太小或者这段键切不开时返回false，由调用者顺序扫描
+ */
+bool parallel_scan(Statement *statement, Table *table, uint32_t start_key, uint32_t end_key, uint64_t snapshot, OutputBuffer *output, AggregateState *aggregate)
+{
+    if(table->database->scan_threads < 2 || table->pager->num_pages < PARALLEL_SCAN_MIN_PAGES || start_key > end_key)
+    {
+        return false;
+    }
+
+    uint32_t num_keys;
+    uint32_t *keys = table_split_keys(table, start_key, end_key, table->database->scan_threads * SCAN_RANGES_PER_THREAD, &num_keys);
+    if(num_keys == 0)
+    {
+        return false;
+    }
+
+    ParallelScan scan;
+    scan.table = table;
+    scan.statement = statement;
+    scan.snapshot = snapshot;
+    scan.aggregate = aggregate;
+    scan.ranges = (ScanRange *)calloc(num_keys + 1, sizeof(ScanRange));
+    scan.num_ranges = num_keys + 1;
+    scan.next_range = 0;
+    for(uint32_t i = 0; i <= num_keys; i++)
+    {
+        scan.ranges[i].start_key = (i == 0) ? start_key : keys[i - 1] + 1;
+        scan.ranges[i].end_key = (i == num_keys) ? end_key : keys[i];
+    }
+    free(keys);
+    pthread_mutex_init(&(scan.mutex), NULL);
+    pthread_cond_init(&(scan.cond), NULL);
+
+    // 池中的线程都在帮其他语句时，剩下的区间由执行查询的线程自己扫描
+    uint32_t num_helpers = ((table->database->scan_threads < scan.num_ranges) ? table->database->scan_threads : scan.num_ranges) - 1;
+    PoolJob job;
+    worker_pool_submit(table->database->scan_pool, &job, parallel_scan_worker, &scan, num_helpers);
+
+    uint32_t merged = 0;
+    while(parallel_scan_next(&scan))
+    {
+        merged = parallel_scan_merge(&scan, output, merged, false);
+    }
+    parallel_scan_merge(&scan, output, merged, true);
+
+    worker_pool_finish(table->database->scan_pool, &job);
+    pthread_cond_destroy(&(scan.cond));
+    pthread_mutex_destroy(&(scan.mutex));
+    free(scan.ranges);
+
+    return true;
+}
+
+/**
+ * 领取并扫描下一个区间
+ * 区间的结果写到只在内存中累积的输出缓冲区里（聚合查询时累加到区间的聚合结果），扫描完以后交给合并结果的线程
+ * @param scan 并行扫描
+ * @return 是否领取到了区间；所有区间都被领取了时返回false
+ */
+bool parallel_scan_next(ParallelScan *scan)
+{
+    pthread_mutex_lock(&(scan->mutex));
+    uint32_t index = scan->next_range;
+    if(index < scan->num_ranges)
+    {
+        scan->next_range++;
+    }
+    pthread_mutex_unlock(&(scan->mutex));
+    if(index >= scan->num_ranges)
+    {
+        return false;
+    }
+
+    ScanRange *range = &(scan->ranges[index]);
+    OutputBuffer *output = (scan->aggregate != NULL) ? NULL : new_output_buffer(-1, false);
+    scan_range(scan->statement, scan->table, range->start_key, range->end_key, scan->snapshot, output,
+        (scan->aggregate != NULL) ? &(range->aggregate) : NULL);
+
+    pthread_mutex_lock(&(scan->mutex));
+    range->output = output;
+    range->done = true;
+    pthread_cond_signal(&(scan->cond));
+    pthread_mutex_unlock(&(scan->mutex));
+
+    return true;
+}
+
+/**
+ * 按顺序写出扫描完的区间
+ * @param scan 并行扫描
+ * @param output 查询的输出缓冲区，聚合查询时不使用
+ * @param merged 已经写出的区间数
+ * @param wait 是否等待所有区间扫描完；为false时遇到没有扫描完的区间就返回
+ * @return 写出以后的区间数
+ */
+uint32_t parallel_scan_merge(ParallelScan *scan, OutputBuffer *output, uint32_t merged, bool wait)
+{
+    pthread_mutex_lock(&(scan->mutex));
+    while(merged < scan->num_ranges)
+    {
+        ScanRange *range = &(scan->ranges[merged]);
+        if(!range->done)
+        {
+            if(!wait)
+            {
+                break;
+            }
+            pthread_cond_wait(&(scan->cond), &(scan->mutex));
+            continue;
+        }
+
+        // 写出时不持有锁，其他线程可以继续交回区间
+        pthread_mutex_unlock(&(scan->mutex));
+        if(scan->aggregate != NULL)
+        {
+            aggregate_merge(scan->aggregate, &(range->aggregate));
+        }
+        else
+        {
+            output_write(output, range->output->buffer, range->output->length);
+            close_output_buffer(range->output);
+        }
+        merged++;
+        pthread_mutex_lock(&(scan->mutex));
+    }
+    pthread_mutex_unlock(&(scan->mutex));
+
+    return merged;
+}
+
+/**
+ * 并行扫描的线程
+ * @param argument 并行扫描
+ * @return NULL
+ */
+void* parallel_scan_worker(void *argument)
+{
+    ParallelScan *scan = (ParallelScan *)argument;
+    while(parallel_scan_next(scan))
+    {
+    }
+
+    return NULL;
+}
+
+/**
+ * 创建线程池
+ * @param num_threads 线程数，创建失败时少用几个线程
+ * @return 线程池，一个线程也没有时返回NULL
+ */
+WorkerPool *new_worker_pool(uint32_t num_threads)
+{
+    if(num_threads == 0)
+    {
+        return NULL;
+    }
+
+    WorkerPool *pool = (WorkerPool *)malloc(sizeof(WorkerPool));
+    pool->threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    pool->num_threads = 0;
+    pool->jobs = NULL;
+    pool->stopping = false;
+    pthread_mutex_init(&(pool->mutex), NULL);
+    pthread_cond_init(&(pool->work_cond), NULL);
+    pthread_cond_init(&(pool->done_cond), NULL);
+    while(pool->num_threads < num_threads && pthread_create(&(pool->threads[pool->num_threads]), NULL, worker_pool_thread, pool) == 0)
+    {
+        pool->num_threads++;
+    }
+    if(pool->num_threads == 0)
+    {
+        close_worker_pool(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+/**
+ * 请求池中的线程执行函数
+ * 函数要能被多个线程同时执行，任务被取消时可能一个线程也没有执行它；提交以后必须调用 worker_pool_finish
+ * @param pool 线程池，为NULL时不请求线程
+ * @param job 任务
+ * @param function 函数
+ * @param argument 函数的参数
+ * @param num_threads 请求的线程数
+ */
+void worker_pool_submit(WorkerPool *pool, PoolJob *job, void *(*function)(void *), void *argument, uint32_t num_threads)
+{
+    job->function = function;
+    job->argument = argument;
+    job->num_wanted = num_threads;
+    job->num_running = 0;
+    job->next = NULL;
+    if(pool == NULL || num_threads == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&(pool->mutex));
+    PoolJob **tail = &(pool->jobs);
+    while(*tail != NULL)
+    {
+        tail = &((*tail)->next);
+    }
+    *tail = job;
+    if(num_threads == 1)
+    {
+        pthread_cond_signal(&(pool->work_cond));
+    }
+    else
+    {
+        pthread_cond_broadcast(&(pool->work_cond));
+    }
+    pthread_mutex_unlock(&(pool->mutex));
+}
+
+/**
+ * 取消任务还没有开始的部分，等待已经开始的线程执行完
+ * 调用者自己执行完函数以后调用，这时工作已经做完，还没有来的线程不需要再来
+ * @param pool 线程池
+ * @param job 任务
+ */
+void worker_pool_finish(WorkerPool *pool, PoolJob *job)
+{
+    if(pool == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&(pool->mutex));
+    for(PoolJob **link = &(pool->jobs); *link != NULL; link = &((*link)->next))
+    {
+        if(*link == job)
+        {
+            *link = job->next;
+            break;
+        }
+    }
+    job->num_wanted = 0;
+    while(job->num_running > 0)
+    {
+        pthread_cond_wait(&(pool->done_cond), &(pool->mutex));
+    }
+    pthread_mutex_unlock(&(pool->mutex));
+}
+
+/**
+ * 线程池中的线程
+ * 从队列头部的任务开始领取，任务需要的线程够了就移出队列。
+ * 线程池在服务器屏蔽 SIGINT 和 SIGTERM 之前就创建了，池中的线程自己屏蔽所有信号，信号只交给主线程处理
+ * @param argument 线程池
+ * @return NULL
+ */
+void* worker_pool_thread(void *argument)
+{
+    WorkerPool *pool = (WorkerPool *)argument;
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    pthread_mutex_lock(&(pool->mutex));
+    while(true)
+    {
+        while(pool->jobs == NULL && !pool->stopping)
+        {
+            pthread_cond_wait(&(pool->work_cond), &(pool->mutex));
+        }
+        if(pool->jobs == NULL)
+        {
+            break;    // 正在关闭，队列中也没有任务了
+        }
+
+        PoolJob *job = pool->jobs;
+        job->num_wanted--;
+        if(job->num_wanted == 0)
+        {
+            pool->jobs = job->next;
+        }
+        job->num_running++;
+        pthread_mutex_unlock(&(pool->mutex));
+
+        job->function(job->argument);
+
+        pthread_mutex_lock(&(pool->mutex));
+        job->num_running--;
+        if(job->num_running == 0)
+        {
+            pthread_cond_broadcast(&(pool->done_cond));
+        }
+    }
+    pthread_mutex_unlock(&(pool->mutex));
+
+    return NULL;
+}
+
+/**
+ * 关闭线程池
+ * 等待所有的线程退出；调用者保证没有正在执行的任务
+ * @param pool 线程池，可以为NULL
+ */
+void close_worker_pool(WorkerPool *pool)
+{
+    if(pool == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&(pool->mutex));
+    pool->stopping = true;
+    pthread_cond_broadcast(&(pool->work_cond));
+    pthread_mutex_unlock(&(pool->mutex));
+    for(uint32_t i = 0; i < pool->num_threads; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&(pool->done_cond));
+    pthread_cond_destroy(&(pool->work_cond));
+    pthread_mutex_destroy(&(pool->mutex));
+    free(pool->threads);
+    free(pool);
+}
+
+/**
+ * 执行事务语句
+ * begin 让会话成为写者直到 commit 或 rollback，其他会话在这期间的写操作返回忙，不会阻塞等待；
+ * 事务中的插入和删除不单独提交，commit 时所有脏页一次写到预写日志，和自动提交一样在回复之前同步到磁盘
+ * @param statement 语句
+ * @param database 数据库
+ * @param cache 会话的语句缓存
+ * @return 执行结果
+ */
+ExecuteResult execute_transaction(Statement *statement, Database *database, StatementCache *cache)
+{
+    if(statement->type == STATEMENT_ROLLBACK)
+    {
+        if(!cache->in_transaction)
+        {
+            return EXECUTE_NO_TRANSACTION;
+        }
+        transaction_rollback(database, cache);
+        return EXECUTE_SUCCESS;
+    }
+
+    ExecuteResult result = EXECUTE_SUCCESS;
+    pthread_mutex_lock(&(database->writer_mutex));
+    if(statement->type == STATEMENT_BEGIN)
+    {
+        if(cache->in_transaction)
+        {
+            result = EXECUTE_IN_TRANSACTION;
+        }
+        else if(database->in_transaction)
+        {
+            result = EXECUTE_BUSY;
+        }
+        else
+        {
+            pager_begin(database->pager);
+            database->in_transaction = true;
+            cache->in_transaction = true;
+        }
+    }
+    else if(!cache->in_transaction)
+    {
+        result = EXECUTE_NO_TRANSACTION;
+    }
+    else
+    {
+        database_version_commit(database); // 之后开始的查询能看到事务插入的行、看不到删除的行
+        for(uint32_t i = 0; i < database->num_tables; i++)
+        {
+            table_defer_purge(database->tables[i]);
+        }
+        database_purge_deleted(database);  // 没有旧快照时马上删掉，否则留给之后的写者
+        pager_commit(database->pager);     // 提交事务修改的所有页，待清除列表和插入的行一起写到日志
+        database_fence_pages(database);
+        database->in_transaction = false;
+        cache->in_transaction = false;
+    }
+    pthread_mutex_unlock(&(database->writer_mutex));
+    return result;
+}
+
+/**
+ * 回滚会话打开的事务
+ * 会话执行 rollback、断开连接或者退出时调用
+ * @param database 数据库
+ * @param cache 会话的语句缓存，会话必须在事务中
+ */
+void transaction_rollback(Database *database, StatementCache *cache)
+{
+    pthread_mutex_lock(&(database->writer_mutex));
+    Pager *pager = database->pager;
+    uint32_t first_new_page = pager->transaction_num_pages;
+    pager_rollback(pager);
+    for(uint32_t i = 0; i < database->num_tables; i++)
+    {
+        version_clear_deleted(database->tables[i]);
+    }
+    database_version_commit(database);    // 回滚的版本也要用掉，它记录的行已经不在树中了
+
+    // 事务新分配的页和从空闲页链表取出的页不再被树引用，和合并掉的节点一样等旧的查询结束以后再复用
+    for(uint32_t page_num = first_new_page; page_num < pager->num_pages; page_num++)
+    {
+        database_free_page(database, page_num);
+    }
+    for(uint32_t i = 0; i < pager->num_taken; i++)
+    {
+        database_free_page(database, pager->taken_pages[i]);
+    }
+    pager->num_taken = 0;
+    database_fence_pages(database);
+    database->in_transaction = false;
+    cache->in_transaction = false;
+    pthread_mutex_unlock(&(database->writer_mutex));
+}
+
+/**
+ * 提交所有表的写者版本
+ * 事务可以插入多个表，提交或回滚时每个表的版本都要提交；调用者持有 writer_mutex
+ * @param database 数据库
+ */
+void database_version_commit(Database *database)
+{
+    for(uint32_t i = 0; i < database->num_tables; i++)
+    {
+        version_commit(database->tables[i]);
+    }
+}
+
+/**
+ * 执行语句
+ * 同一时间只有一个写者，查询读取快照，可以和其他查询、插入、删除同时执行；
+ * 不在事务中的插入和删除执行完马上提交，事务中的等到 commit 才提交
+ * @param statement 语句
+ * @param database 数据库
+ * @param cache 会话的语句缓存
+ * @param output 输出缓冲区
+ * @return 执行结果
+ */
+ExecuteResult execute_statement(Statement *statement, Database *database, StatementCache *cache, OutputBuffer *output)
+{
+    Table *table = statement->table;
+    switch(statement->type)
+    {
+        case STATEMENT_INSERT:
+        {
+            ExecuteResult result = EXECUTE_BUSY;
+            pthread_mutex_lock(&(database->writer_mutex));
+            if(cache->in_transaction || !database->in_transaction)
+            {
+                if(!cache->in_transaction)
+                {
+                    database_release_pages(database);   // 分裂需要新页时先复用空闲页
+                    database_purge_deleted(database);   // 删除的键可以重新插入
+                }
+                result = execute_insert(statement, table);
+                if(!cache->in_transaction)
+                {
+                    pager_commit(database->pager);  // 提交语句修改的页
+                    version_commit(table);          // 之后开始的查询能看到插入的行
+                    database_fence_pages(database); // 清除删除的行时合并掉的节点
+                }
+            }
+            pthread_mutex_unlock(&(database->writer_mutex));
+            return result;
+        }
+        case STATEMENT_DELETE:
+        {
+            ExecuteResult result = EXECUTE_BUSY;
+            pthread_mutex_lock(&(database->writer_mutex));
+            if(cache->in_transaction || !database->in_transaction)
+            {
+                result = execute_delete(statement, table);
+                if(!cache->in_transaction)
+                {
+                    // 提交版本以后开始的查询看不到删除的行；还在读的旧快照不等，删除的行留在树中，以后再删掉
+                    database_release_pages(database);
+                    version_commit(table);
+                    table_defer_purge(table);
+                    database_purge_deleted(database);
+                    pager_commit(database->pager);  // 待清除列表和删除一起提交，崩溃以后删除也不会丢失
+                    database_fence_pages(database);
+                }
+            }
+            pthread_mutex_unlock(&(database->writer_mutex));
+            return result;
+        }
+        case STATEMENT_SELECT:
+        {
+            pthread_rwlock_rdlock(&(database->vacuum_lock));    // .vacuum 移动页的时候不能读
+            ExecuteResult result = execute_select(statement, table, output, cache->in_transaction);
+            pthread_rwlock_unlock(&(database->vacuum_lock));
+            return result;
+        }
+        case STATEMENT_BEGIN:
+        case STATEMENT_COMMIT:
+        case STATEMENT_ROLLBACK:
+            return execute_transaction(statement, database, cache);
+        case STATEMENT_CREATE_INDEX:
+        case STATEMENT_CREATE_TABLE:
+        {
+            // 建索引和建表不能放在事务里：回滚会恢复目录页和索引的页，而其他会话的语句可能已经在用新的表和索引了
+            ExecuteResult result = cache->in_transaction ? EXECUTE_NOT_ALLOWED_IN_TRANSACTION : EXECUTE_BUSY;
+            pthread_mutex_lock(&(database->writer_mutex));
+            if(!database->in_transaction)
+            {
+                database_release_pages(database);
+                if(statement->type == STATEMENT_CREATE_INDEX)
+                {
+                    result = execute_create_index(statement, table);
+                }
+                else
+                {
+                    result = execute_create_table(statement, database);
+                }
+                pager_commit(database->pager);
+            }
+            pthread_mutex_unlock(&(database->writer_mutex));
+            return result;
+        }
+    }
+}
+
+/**
+ * 打开数据库
+ * 新文件先写目录页和默认表；没有目录页或者格式版本不同的旧文件不支持，报告后退出；之后按目录页打开所有的表，再删掉待清除列表中的行
+ * @param filename 文件名
+ * @param options 数据库选项
+ * @return 数据库
+ */
+Database* db_open(const char *filename, DbOptions *options)
+{
+    Pager *pager = pager_open(filename, options);    // 打开分页器
+
+    Database *database = (Database *)malloc(sizeof(Database));    // 分配数据库内存空间
+    database->pager = pager;    // 设置分页器
+    pthread_mutex_init(&(database->writer_mutex), NULL);    // 初始化写者互斥锁
+    database->in_transaction = false;    // 没有打开的事务
+    database->tables = (Table **)malloc(CATALOG_MAX_TABLES * sizeof(Table *));
+    database->num_tables = 0;
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);    // 查询不断时 .vacuum 也不会一直等
+    pthread_rwlock_init(&(database->vacuum_lock), &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+    database->freed_pages = NULL;
+    database->num_freed = 0;
+    database->freed_capacity = 0;
+    database->free_batches = NULL;
+    database->num_free_batches = 0;
+    database->free_batches_capacity = 0;
+    database->purge_batches = NULL;
+    database->num_purge_batches = 0;
+    database->purge_batches_capacity = 0;
+    database->purge_pages = NULL;
+    database->num_purge_pages = 0;
+    database->purge_pages_capacity = 0;
+    database->purge_list_dirty = false;
+    database->scan_threads = options->scan_threads;    // 设置并行扫描的线程数
+    if(database->scan_threads == 0)
+    {
+        database->scan_threads = 1;
+    }
+    if(database->scan_threads > MAX_SCAN_THREADS)
+    {
+        database->scan_threads = MAX_SCAN_THREADS;
+    }
+    database->scan_pool = new_worker_pool(database->scan_threads - 1);    // 执行语句的线程自己也参与扫描
+
+    if(pager->num_pages == 0)
+    {
+        // 新建数据库，第0页是目录页，默认表的根节点在第1页
+        void *catalog = get_page(pager, CATALOG_PAGE_NUM);
+        pager_mark_dirty(pager, CATALOG_PAGE_NUM);
+        initialize_catalog(catalog);
+        unpin_page(pager, CATALOG_PAGE_NUM);
+
+        RowLayout layout;
+        default_table_layout(&layout);
+        table_create(database, DEFAULT_TABLE_NAME, &layout);
+        pager_commit(pager);
+        return database;
+    }
+
+    if(!catalog_format_supported(pager))
+    {
+        fatal_error("Unsupported db file format.\n");    // 打印错误信息
+    }
+    void *catalog = get_page(pager, CATALOG_PAGE_NUM);
+    uint32_t num_tables = *catalog_num_tables(catalog);
+    unpin_page(pager, CATALOG_PAGE_NUM);
+
+    for(uint32_t i = 0; i < num_tables; i++)
+    {
+        database_add_table(database, table_open(database, i));
+    }
+
+    // 上次没有正常关闭时，先删掉提交了、还留在树中的行
+    database_load_purge_list(database);
+    if(database->num_purge_batches > 0)
+    {
+        database_purge_deleted(database);
+        pager_commit(pager);
+        database_fence_pages(database);
+    }
+
+    return database;
+}
+
+/**
+ * 获取目录页中的文件格式版本
+ * @param node 目录页
+ * @return 文件格式版本的地址
+ */
+uint32_t* catalog_format_version(void *node)
+{
+    return (uint32_t *)((char *)node + CATALOG_FORMAT_VERSION_OFFSET);
+}
+
+/**
+ * 获取目录页中的表数量
+ * @param node 目录页
+ * @return 表数量的地址
+ */
+uint32_t* catalog_num_tables(void *node)
+{
+    return (uint32_t *)((char *)node + CATALOG_NUM_TABLES_OFFSET);
+}
+
+/**
+ * 获取目录页中待清除列表的第一页
+ * @param node 目录页
+ * @return 第一页页号的地址，0表示没有待清除的删除
+ */
+uint32_t* catalog_purge_head(void *node)
+{
+    return (uint32_t *)((char *)node + CATALOG_PURGE_HEAD_OFFSET);
+}
+
+/**
+ * 获取待清除列表页中的项数
+ * @param node 待清除列表的页
+ * @return 项数的地址
+ */
+uint32_t* purge_node_num_entries(void *node)
+{
+    return (uint32_t *)((char *)node + PURGE_NODE_NUM_ENTRIES_OFFSET);
+}
+
+/**
+ * 获取待清除列表页中的一项
+ * @param node 待清除列表的页
+ * @param entry_num 项的位置
+ * @return 项的地址，第一个数是表项的位置，第二个数是键
+ */
+uint32_t* purge_node_entry(void *node, uint32_t entry_num)
+{
+    return (uint32_t *)((char *)node + PURGE_NODE_HEADER_SIZE + entry_num * PURGE_NODE_ENTRY_SIZE);
+}
+
+/**
+ * 获取目录页中的表项
+ * @param node 目录页
+ * @param slot 表项的位置
+ * @return 表项的地址
+ */
+void* catalog_table(void *node, uint32_t slot)
+{
+    return (char *)node + CATALOG_HEADER_SIZE + slot * CATALOG_TABLE_ENTRY_SIZE;
+}
+
+/**
+ * 获取表项中的列项
+ * @param entry 表项
+ * @param column 列号
+ * @return 列项的地址
+ */
+void* catalog_column(void *entry, uint32_t column)
+{
+    return (char *)entry + CATALOG_TABLE_COLUMNS_OFFSET + column * CATALOG_COLUMN_ENTRY_SIZE;
+}
+
+/**
+ * 初始化目录页
+ * @param node 目录页
+ */
+void initialize_catalog(void *node)
+{
+    memset(node, 0, PAGE_SIZE);
+    set_node_type(node, NODE_CATALOG);
+    set_node_root(node, false);
+    *node_parent(node) = 0;
+    *catalog_format_version(node) = DB_FORMAT_VERSION;
+    *catalog_num_tables(node) = 0;
+}
+
+/**
+ * 把表写到目录页中它的表项
+ * 调用者持有 writer_mutex，建表、建索引和 .vacuum 搬动根节点时调用
+ */
+void catalog_write_table(Table *table)
+{
+    Pager *pager = table->pager;
+    void *catalog = get_page(pager, CATALOG_PAGE_NUM);
+    pager_mark_dirty(pager, CATALOG_PAGE_NUM);
+
+    char *entry = (char *)catalog_table(catalog, table->catalog_slot);
+    memset(entry, 0, CATALOG_TABLE_ENTRY_SIZE);
+    strcpy(entry + CATALOG_TABLE_NAME_OFFSET, table->name);
+    *(uint32_t *)(entry + CATALOG_TABLE_ROOT_OFFSET) = table->root_page_num;
+    *(uint32_t *)(entry + CATALOG_TABLE_NUM_COLUMNS_OFFSET) = table->layout.num_columns;
+    for(uint32_t i = 0; i < table->layout.num_columns; i++)
+    {
+        Column *column = &(table->layout.columns[i]);
+        char *column_entry = (char *)catalog_column(entry, i);
+        strcpy(column_entry + CATALOG_COLUMN_NAME_OFFSET, column->name);
+        *(uint8_t *)(column_entry + CATALOG_COLUMN_TYPE_OFFSET) = column->type;
+        *(uint8_t *)(column_entry + CATALOG_COLUMN_SIZE_OFFSET) = column->size;
+        *(uint32_t *)(column_entry + CATALOG_COLUMN_INDEX_ROOT_OFFSET) = table->index_roots[i];
+    }
+
+    if(*catalog_num_tables(catalog) <= table->catalog_slot)
+    {
+        *catalog_num_tables(catalog) = table->catalog_slot + 1;
+    }
+    unpin_page(pager, CATALOG_PAGE_NUM);
+}
+
+/**
+ * 判断数据库文件的格式是否支持
+ * 不经过缓冲池读出目录页：get_page 会验证校验和，旧格式的页没有校验和，会被当成损坏的页。
+ * 第0页是目录页并且格式版本一致才支持；版本一致时页的损坏仍然由 get_page 报告
+ * @param pager 分页器，文件不是空的
+ * @return 是否支持
+ */
+bool catalog_format_supported(Pager *pager)
+{
+    void *page = malloc(PAGE_SIZE);
+    bool supported = pager_read_page(pager, CATALOG_PAGE_NUM, page, pager->compress_buffer) &&
+                     get_node_type(page) == NODE_CATALOG && *catalog_format_version(page) == DB_FORMAT_VERSION;
+    free(page);
+    return supported;
+}
+
+/**
+ * 默认表的列
+ * 和以前固定的行格式一样：id、username、email
+ * @param layout 行的布局
+ */
+void default_table_layout(RowLayout *layout)
+{
+    layout->num_columns = 0;
+    row_layout_add(layout, "id", COLUMN_INT, INT_COLUMN_SIZE);
+    row_layout_add(layout, "username", COLUMN_VARCHAR, COLUMN_USERNAME_SIZE);
+    row_layout_add(layout, "email", COLUMN_VARCHAR, COLUMN_EMAIL_SIZE);
+    row_layout_compute(layout);
+}
+
+/**
+ * 在布局的最后加一列
+ * 加完所有的列以后要调用 row_layout_compute 计算位置
+ * @param layout 行的布局
+ * @param name 列名
+ * @param type 类型
+ * @param size 字符串列的最大长度
+ * @return 列太多或者列名重复时返回 false
+ */
+bool row_layout_add(RowLayout *layout, const char *name, ColumnType type, uint32_t size)
+{
+    if(layout->num_columns == MAX_TABLE_COLUMNS || row_layout_find(layout, name) >= 0)
+    {
+        return false;
+    }
+
+    Column *column = &(layout->columns[layout->num_columns++]);
+    strcpy(column->name, name);
+    column->type = type;
+    column->size = size;
+    return true;
+}
+
+/**
+ * 创建内存中的表
+ * @param database 数据库
+ * @param slot 表项在目录页中的位置
+ * @param name 表名
+ * @param root_page_num 根节点页号
+ * @param layout 行的布局，已经算好位置
+ * @return 表
+ */
+Table* table_new(Database *database, uint32_t slot, const char *name, uint32_t root_page_num, RowLayout *layout)
+{
+    Table *table = (Table *)malloc(sizeof(Table));    // 分配表内存空间
+    table->database = database;
+    table->pager = database->pager;
+    strcpy(table->name, name);
+    table->catalog_slot = slot;
+    table->root_page_num = root_page_num;
+    table->layout = *layout;
+    version_store_init(&(table->versions));    // 初始化版本存储
+    memset(table->index_roots, 0, sizeof(table->index_roots));
+    table->deleted_keys = NULL;
+    table->num_deleted = 0;
+    table->deleted_capacity = 0;
+    return table;
+}
+
+/**
+ * 按目录页中的表项打开表
+ * @param database 数据库
+ * @param slot 表项的位置
+ * @return 表
+ */
+Table* table_open(Database *database, uint32_t slot)
+{
+    Pager *pager = database->pager;
+    void *catalog = get_page(pager, CATALOG_PAGE_NUM);
+    char *entry = (char *)catalog_table(catalog, slot);
+
+    RowLayout layout;
+    layout.num_columns = 0;
+    uint32_t num_columns = *(uint32_t *)(entry + CATALOG_TABLE_NUM_COLUMNS_OFFSET);
+    for(uint32_t i = 0; i < num_columns; i++)
+    {
+        char *column_entry = (char *)catalog_column(entry, i);
+        row_layout_add(&layout, column_entry + CATALOG_COLUMN_NAME_OFFSET, *(uint8_t *)(column_entry + CATALOG_COLUMN_TYPE_OFFSET),
+            *(uint8_t *)(column_entry + CATALOG_COLUMN_SIZE_OFFSET));
+    }
+    row_layout_compute(&layout);
+
+    Table *table = table_new(database, slot, entry + CATALOG_TABLE_NAME_OFFSET, *(uint32_t *)(entry + CATALOG_TABLE_ROOT_OFFSET), &layout);
+    for(uint32_t i = 0; i < num_columns; i++)
+    {
+        table->index_roots[i] = *(uint32_t *)((char *)catalog_column(entry, i) + CATALOG_COLUMN_INDEX_ROOT_OFFSET);
+    }
+    unpin_page(pager, CATALOG_PAGE_NUM);
+    return table;
+}
+
+/**
+ * 新建一个空表
+ * 调用者持有 writer_mutex（或者在打开数据库时），根节点是一个新叶子节点，有空闲页时复用空闲页
+ * @param database 数据库
+ * @param name 表名
+ * @param layout 行的布局，已经算好位置
+ * @return 表
+ */
+Table* table_create(Database *database, const char *name, RowLayout *layout)
+{
+    Pager *pager = database->pager;
+    uint32_t root_page_num = pager_allocate_page(pager);
+    void *root = get_page(pager, root_page_num);
+    pager_mark_dirty(pager, root_page_num);
+    initialize_leaf_node(root);
+    set_node_root(root, true);
+    unpin_page(pager, root_page_num);
+
+    Table *table = table_new(database, database->num_tables, name, root_page_num, layout);
+    catalog_write_table(table);
+    database_add_table(database, table);
+    return table;
+}
+
+/**
+ * 让准备语句时能找到表
+ * 先放好表再增加表数，准备语句的会话不需要持有 writer_mutex
+ * @param database 数据库
+ */
+void database_add_table(Database *database, Table *table)
+{
+    database->tables[database->num_tables] = table;
+    __atomic_store_n(&(database->num_tables), database->num_tables + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * 按名字查找表
+ * @param database 数据库
+ * @param name 表名
+ * @return 表，没有这个表时返回 NULL
+ */
+Table* database_find_table(Database *database, const char *name)
+{
+    uint32_t num_tables = __atomic_load_n(&(database->num_tables), __ATOMIC_ACQUIRE);
+    for(uint32_t i = 0; i < num_tables; i++)
+    {
+        if(strcmp(database->tables[i]->name, name) == 0)
+        {
+            return database->tables[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * 执行建表语句
+ * 调用者持有 writer_mutex
+ * @param statement 语句
+ * @param database 数据库
+ * @return 执行结果
+ */
+ExecuteResult execute_create_table(Statement *statement, Database *database)
+{
+    if(database_find_table(database, statement->table_name) != NULL)
+    {
+        return EXECUTE_TABLE_EXISTS;
+    }
+    if(database->num_tables == CATALOG_MAX_TABLES)
+    {
+        return EXECUTE_CATALOG_FULL;
+    }
+    if(database->pager->num_pages >= TABLE_MAX_PAGES)
+    {
+        return EXECUTE_TABLE_FULL;
+    }
+
+    table_create(database, statement->table_name, &(statement->layout));
+    return EXECUTE_SUCCESS;
+}
+
+/**
+ * 打开分页器
+ * 数据库文件加排它的 flock，同一个文件只能由一个进程打开：另一个进程做检查点时会删掉这个进程正在写的日志
+ * @param filename 文件名
+ * @param options 数据库选项
+ * @return 分页器
+ */
+Pager* pager_open(const char *filename, DbOptions *options)
+{
+    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);    // 打开文件
+    if(fd == -1)
+    {
+        fatal_error("Unable to open file\n");    // 打印错误信息
+    }
+    if(flock(fd, LOCK_EX | LOCK_NB) == -1)
+    {
+        fatal_error("Database is locked by another process.\n");    // 打印错误信息
+    }
+
+    off_t file_length = lseek(fd, 0, SEEK_END);    // 获取文件长度
+    uint32_t magic = 0;
+    bool compressed = (file_length == 0) ? options->compress :
+        (pread(fd, &magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) && magic == COMPRESS_MAGIC);
+
+    Pager *pager = (Pager *)malloc(sizeof(Pager));    // 分配分页器内存空间
+    pager->file_descriptor = fd;    // 设置文件描述符
+    pager->file_length = file_length;    // 设置文件长度
+    pager->num_pages = (file_length / PAGE_SIZE);    // 设置页数
+    if(!compressed && file_length % PAGE_SIZE != 0)
+    {
+        fatal_error("Db file is not a whole number of pages. Corrupt file.\n");    // 打印错误信息
+    }
+
+    pager->frames = NULL;
+    pager->frame_data = NULL;
+    pager->page_table = NULL;
+    pager->capacity = 0;
+    pager->map_base = NULL;
+    pager->map_dirty = NULL;
+    pager->map_dirty_pages = NULL;
+    pager->map_num_dirty = 0;
+    pager->map_dirty_capacity = 0;
+    pager->map_latches = NULL;
+    pager->filename = strdup(filename);
+    pager->compressed = false;
+    pager->compress_header = NULL;
+    pager->slots = NULL;
+    pager->compress_buffer = NULL;
+    if(compressed)
+    {
+        if(options->use_mmap)
+        {
+            fatal_error("Compressed db files cannot be opened with --mmap.\n");
+        }
+        pager_compress_open(pager);
+    }
+    pager->in_transaction = false;
+    pager->undo_capacity = 64;
+    pager->undo_count = 0;
+    pager->undo_pages = (uint32_t *)malloc(sizeof(uint32_t) * pager->undo_capacity);
+    pager->undo_images = (void **)malloc(sizeof(void *) * pager->undo_capacity);
+    for(uint32_t i = 0; i < pager->undo_capacity; i++)
+    {
+        pager->undo_pages[i] = INVALID_PAGE_NUM;
+    }
+    pager->taken_pages = NULL;
+    pager->num_taken = 0;
+    pager->taken_capacity = 0;
+    pthread_mutex_init(&(pager->mutex), NULL);
+    pthread_mutex_init(&(pager->sync_mutex), NULL);
+    pager->group_commit = (options->group_commit > 0) ? options->group_commit : 1;
+    pager->wal_index_capacity = 1024;
+    pager->wal_index_pages = (uint32_t *)malloc(sizeof(uint32_t) * pager->wal_index_capacity);
+    pager->wal_index_frames = (uint32_t *)malloc(sizeof(uint32_t) * pager->wal_index_capacity);
+
+    if(options->use_mmap)
+    {
+        // 先重放日志，再映射写回后的文件
+        wal_open(pager, filename);
+        pager_map_open(pager);
+        return pager;
+    }
+
+    uint32_t pool_pages = options->pool_pages;
+    if(pool_pages < MIN_BUFFER_POOL_PAGES)
+    {
+        pool_pages = MIN_BUFFER_POOL_PAGES;
+    }
+    pager->capacity = pool_pages;    // 设置缓冲池帧数
+    pager->frames = (Frame *)malloc(sizeof(Frame) * pool_pages);    // 分配帧
+    pager->frame_data = malloc((size_t)pool_pages * PAGE_SIZE);    // 分配所有帧的页数据
+    if(pager->frames == NULL || pager->frame_data == NULL)
+    {
+        fatal_error("Unable to allocate buffer pool of %d pages\n", pool_pages);    // 打印错误信息
+    }
+    for(uint32_t i = 0; i < pool_pages; i++)
+    {
+        Frame *frame = &(pager->frames[i]);
+        frame->page_num = INVALID_PAGE_NUM;
+        frame->data = pager->frame_data + (size_t)i * PAGE_SIZE;
+        frame->pin_count = 0;
+        frame->dirty = false;
+        frame->referenced = false;
+        frame->hash_next = -1;
+        page_latch_init(&(frame->latch));
+    }
+
+    // 桶数取不小于帧数的2的幂，平均每个桶不超过一个帧
+    uint32_t num_buckets = 1;
+    while(num_buckets < pool_pages)
+    {
+        num_buckets <<= 1;
+    }
+    pager->page_table = (int32_t *)malloc(sizeof(int32_t) * num_buckets);
+    for(uint32_t i = 0; i < num_buckets; i++)
+    {
+        pager->page_table[i] = -1;
+    }
+    pager->page_table_mask = num_buckets - 1;
+    pager->clock_hand = 0;
+
+    wal_open(pager, filename);    // 打开预写日志，重放上次没有写回的提交
+
+    return pager;
+}
+
+/**
+ * 建立数据库文件的内存映射
+ * 先预留一大段不可访问的地址空间，再把文件映射到预留空间的开头；
+ * 文件增长时在后面接着开放预留的空间，已经映射的地址不会移动，被固定的页的指针一直有效
+ * @param pager 分页器
+ */
+void pager_map_open(Pager *pager)
+{
+    pager->map_reserved = MMAP_RESERVE_BYTES;
+    pager->map_base = mmap(NULL, pager->map_reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(pager->map_base == MAP_FAILED)
+    {
+        fatal_error("Unable to reserve address space for mmap: %d\n", errno);    // 打印错误信息
+    }
+
+    pager->map_pages = 0;
+    pager->map_latches = (PageLatch **)calloc(MMAP_RESERVE_BYTES / PAGE_SIZE / MAP_LATCH_CHUNK_PAGES, sizeof(PageLatch *));
+    pager_map_file(pager);
+}
+
+/**
+ * 把数据库文件重新映射到预留空间的开头
+ * 映射是私有的（写时复制），修改只发生在进程自己的副本上；
+ * 检查点写回文件后重新映射，丢掉已经和文件一致的私有副本，之后直接共享页缓存
+ * @param pager 分页器
+ */
+void pager_map_file(Pager *pager)
+{
+    uint32_t file_pages = pager->file_length / PAGE_SIZE;
+    if(file_pages == 0)
+    {
+        return;
+    }
+
+    void *address = mmap(pager->map_base, (size_t)file_pages * PAGE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_FIXED, pager->file_descriptor, 0);
+    if(address == MAP_FAILED)
+    {
+        fatal_error("Error mapping db file: %d\n", errno);    // 打印错误信息
+    }
+
+    if(file_pages > pager->map_pages)
+    {
+        pager->map_dirty = (uint8_t *)realloc(pager->map_dirty, file_pages);
+        memset(pager->map_dirty + pager->map_pages, 0, file_pages - pager->map_pages);
+        pager->map_pages = file_pages;
+    }
+}
+
+/**
+ * 扩展内存映射
+ * 文件末尾之后的新页不需要先 ftruncate 扩展文件（崩溃时会在文件末尾留下空页），
+ * 而是把预留空间改成可读写的匿名内存，内容全是0；检查点把它们写进文件后再映射成文件页
+ * 每次至少扩展 MMAP_GROW_PAGES 页，减少系统调用
+ * @param pager 分页器
+ * @param min_pages 需要映射的最少页数
+ */
+void pager_map_grow(Pager *pager, uint32_t min_pages)
+{
+    if(min_pages <= pager->map_pages)
+    {
+        return;
+    }
+
+    uint32_t new_pages = min_pages;
+    if(new_pages < pager->map_pages + MMAP_GROW_PAGES)
+    {
+        new_pages = pager->map_pages + MMAP_GROW_PAGES;
+    }
+    if((size_t)new_pages * PAGE_SIZE > pager->map_reserved)
+    {
+        fatal_error("Db file outgrew the mmap reservation\n");    // 打印错误信息
+    }
+
+    size_t mapped_length = (size_t)pager->map_pages * PAGE_SIZE;
+    if(mprotect(pager->map_base + mapped_length, (size_t)new_pages * PAGE_SIZE - mapped_length, PROT_READ | PROT_WRITE) == -1)
+    {
+        fatal_error("Error extending mmap: %d\n", errno);    // 打印错误信息
+    }
+
+    pager->map_dirty = (uint8_t *)realloc(pager->map_dirty, new_pages);
+    memset(pager->map_dirty + pager->map_pages, 0, new_pages - pager->map_pages);
+    pager->map_pages = new_pages;
+}
+
+/**
+ * 提前读取页
+ * 页不在内存中、也不在日志中时，用 posix_fadvise 让内核在后台把它读进页缓存，之后 get_page 读文件时不用等磁盘；
+ * 内存映射模式下用 madvise(MADV_WILLNEED) 达到同样的效果
+ * @param pager 分页器
+ * @param page_num 页号
+ */
+void pager_prefetch(Pager *pager, uint32_t page_num)
+{
+    off_t offset = (off_t)page_num * PAGE_SIZE;
+    pthread_mutex_lock(&(pager->mutex));
+    if(pager->map_base != NULL)
+    {
+        if(page_num < pager->map_pages)
+        {
+            madvise(pager->map_base + offset, PAGE_SIZE, MADV_WILLNEED);
+        }
+        pthread_mutex_unlock(&(pager->mutex));
+        return;
+    }
+
+    bool cached = pager_lookup(pager, page_num) != NULL || wal_index_find(pager, page_num) != INVALID_PAGE_NUM;
+    off_t length = PAGE_SIZE;
+    if(pager->compressed)
+    {
+        PageSlot *slot = pager_slot(pager, page_num);
+        cached = cached || slot == NULL;
+        if(slot != NULL)
+        {
+            offset = (off_t)slot->offset * COMPRESS_SLOT_UNIT;
+            length = slot->length;
+        }
+    }
+    else
+    {
+        cached = cached || offset >= pager->file_length;
+    }
+    pthread_mutex_unlock(&(pager->mutex));
+    if(!cached)
+    {
+        posix_fadvise(pager->file_descriptor, offset, length, POSIX_FADV_WILLNEED);
+    }
+}
+
+/**
+ * 提示接下来是顺序扫描
+ * 内存映射模式下用 madvise 让内核加大预读，扫描结束后恢复默认；缓冲池模式下什么也不做
+ * @param pager 分页器
+ * @param sequential 是否顺序扫描
+ */
+void pager_advise_sequential(Pager *pager, bool sequential)
+{
+    if(pager->map_base == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&(pager->mutex));
+    if(pager->map_pages > 0)
+    {
+        madvise(pager->map_base, (size_t)pager->map_pages * PAGE_SIZE, sequential ? MADV_SEQUENTIAL : MADV_NORMAL);
+    }
+    pthread_mutex_unlock(&(pager->mutex));
+}
+
+/**
+ * 打开预写日志并恢复
+ * 顺序读取日志中的帧，校验盐值和校验和，直到遇到无效帧；最后一个提交帧之前的帧都是已提交的
+ * 已提交的帧通过检查点写回数据库文件，之后日志被清空
+ * @param pager 分页器
+ * @param filename 数据库文件名
+ */
+void wal_open(Pager *pager, const char *filename)
+{
+    pager->wal_filename = (char *)malloc(strlen(filename) + 5);
+    sprintf(pager->wal_filename, "%s-wal", filename);
+    pager->wal_fd = open(pager->wal_filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    if(pager->wal_fd == -1)
+    {
+        fatal_error("Unable to open write-ahead log\n");    // 打印错误信息
+    }
+
+    pager->wal_salt = 0;
+    pager->wal_num_frames = 0;
+    pager->wal_pending_syncs = 0;
+    pager->wal_index_count = 0;
+    for(uint32_t i = 0; i < pager->wal_index_capacity; i++)
+    {
+        pager->wal_index_pages[i] = INVALID_PAGE_NUM;
+    }
+
+    uint32_t header[4];
+    bool valid = pread(pager->wal_fd, header, WAL_HEADER_SIZE, 0) == (ssize_t)WAL_HEADER_SIZE && header[0] == WAL_MAGIC;
+    if(valid && header[1] != WAL_VERSION && lseek(pager->wal_fd, 0, SEEK_END) > (off_t)WAL_HEADER_SIZE)
+    {
+        // 旧版本的日志中可能有还没写回的提交，不能直接清空；只有头部的日志可以
+        fatal_error("Unsupported write-ahead log format.\n");    // 打印错误信息
+    }
+    if(!valid || header[2] != PAGE_SIZE)
+    {
+        wal_reset(pager);    // 没有日志或者日志头部无效
+        return;
+    }
+    pager->wal_salt = header[3];
+
+    // 第一遍：找到最后一个有效的提交帧
+    void *data = malloc(PAGE_SIZE);
+    uint32_t num_frames = 0;
+    uint32_t num_committed = 0;
+    uint32_t committed_pages = 0;
+    uint32_t *frame_pages = NULL;
+    uint32_t frame_pages_capacity = 0;
+    while(true)
+    {
+        WalFrameHeader frame_header;
+        off_t offset = WAL_HEADER_SIZE + (off_t)num_frames * (WAL_FRAME_HEADER_SIZE + PAGE_SIZE);
+        if(pread(pager->wal_fd, &frame_header, WAL_FRAME_HEADER_SIZE, offset) != (ssize_t)WAL_FRAME_HEADER_SIZE ||
+            pread(pager->wal_fd, data, PAGE_SIZE, offset + WAL_FRAME_HEADER_SIZE) != (ssize_t)PAGE_SIZE ||
+            frame_header.salt != pager->wal_salt || frame_header.checksum != wal_checksum(&frame_header, data))
+        {
+            break;    // 日志结束，或者是崩溃时没有写完的帧
+        }
+
+        if(num_frames == frame_pages_capacity)
+        {
+            frame_pages_capacity = frame_pages_capacity ? frame_pages_capacity * 2 : 256;
+            frame_pages = (uint32_t *)realloc(frame_pages, sizeof(uint32_t) * frame_pages_capacity);
+        }
+        frame_pages[num_frames++] = frame_header.page_num;
+        if(frame_header.commit != 0)
+        {
+            num_committed = num_frames;
+            committed_pages = frame_header.commit;
+        }
+    }
+    free(data);
+
+    // 第二遍：已提交的帧建立日志索引，之后的帧属于没有提交的语句，直接丢弃
+    for(uint32_t i = 0; i < num_committed; i++)
+    {
+        wal_index_put(pager, frame_pages[i], i);
+    }
+    free(frame_pages);
+    pager->wal_num_frames = num_committed;
+    if(committed_pages > pager->num_pages)
+    {
+        pager->num_pages = committed_pages;
+    }
+
+    pager_checkpoint(pager);
+}
+
+/**
+ * 清空预写日志
+ * 截断日志文件，换一个新的盐值写入日志头部
+ * @param pager 分页器
+ */
+void wal_reset(Pager *pager)
+{
+    pager->wal_salt = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16) ^ (pager->wal_salt + 1);
+    uint32_t header[4] = {WAL_MAGIC, WAL_VERSION, PAGE_SIZE, pager->wal_salt};
+    if(ftruncate(pager->wal_fd, 0) == -1 ||
+        pwrite(pager->wal_fd, header, WAL_HEADER_SIZE, 0) != (ssize_t)WAL_HEADER_SIZE ||
+        fdatasync(pager->wal_fd) == -1)
+    {
+        fatal_error("Error resetting write-ahead log: %d\n", errno);
+    }
+
+    pager->wal_num_frames = 0;
+    pager->wal_pending_syncs = 0;
+    pager->wal_index_count = 0;
+    for(uint32_t i = 0; i < pager->wal_index_capacity; i++)
+    {
+        pager->wal_index_pages[i] = INVALID_PAGE_NUM;
+    }
+}
+
+/**
+ * 计算帧的校验和
+ * 帧头前三个字段和页内容的CRC32C，用来发现崩溃时没有写完的帧
+ * @param header 帧头
+ * @param data 页内容
+ * @return 校验和
+ */
+uint32_t wal_checksum(WalFrameHeader *header, void *data)
+{
+    return crc32c(crc32c(0, header, 3 * sizeof(uint32_t)), data, PAGE_SIZE);
+}
+
+/**
+ * 计算CRC32C
+ * CPU支持SSE4.2时用crc32指令每次处理8字节，否则逐位计算
+ * @param crc 前面数据的CRC32C，从头开始时为0
+ * @param data 数据
+ * @param length 字节数
+ * @return 加上这段数据以后的CRC32C
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    crc = ~crc;
+#if defined(__x86_64__)
+    if(__builtin_cpu_supports("sse4.2"))
+    {
+        return ~crc32c_sse42(crc, bytes, length);
+    }
+#endif
+    for(size_t i = 0; i < length; i++)
+    {
+        crc ^= bytes[i];
+        for(uint32_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * 用SSE4.2的crc32指令计算CRC32C
+ * @param crc 取反后的CRC
+ * @param bytes 数据
+ * @param length 字节数
+ * @return 取反后的CRC
+ */
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t *bytes, size_t length)
+{
+    uint64_t value = crc;
+    while(length >= sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(uint64_t));
+        value = _mm_crc32_u64(value, word);
+        bytes += sizeof(uint64_t);
+        length -= sizeof(uint64_t);
+    }
+    crc = (uint32_t)value;
+    while(length > 0)
+    {
+        crc = _mm_crc32_u8(crc, *bytes++);
+        length--;
+    }
+    return crc;
+}
+#endif
+
+/**
+ * 计算页的校验和
+ * 除了校验和字段本身以外整个页的CRC32C
+ * @param page 页
+ * @return 校验和
+ */
+uint32_t page_checksum(void *page)
+{
+    uint32_t crc = crc32c(0, page, PAGE_CHECKSUM_OFFSET);
+    uint32_t rest = PAGE_CHECKSUM_OFFSET + PAGE_CHECKSUM_SIZE;
+    return crc32c(crc, (uint8_t *)page + rest, PAGE_SIZE - rest);
+}
+
+/**
+ * 验证页的校验和
+ * 全是0的页也是有效的：文件中页号有空洞时，空洞里从来没有写过的页读出来全是0
+ * @param page 页
+ * @return 是否有效
+ */
+bool page_checksum_valid(void *page)
+{
+    if(*node_checksum(page) == page_checksum(page))
+    {
+        return true;
+    }
+    for(uint32_t i = 0; i < PAGE_SIZE; i++)
+    {
+        if(((uint8_t *)page)[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * 用LZ4块格式压缩
+ * 贪心匹配：哈希表记下每个4字节序列最近出现的位置，能匹配时向后尽量延长。
+ * 每个序列是一个标记字节（高4位字面量长度、低4位匹配长度减4，等于15时后面接着255累加的长度字节）、
+ * 字面量、2字节小端序的匹配距离；最后一个序列只有字面量
+ * @param source 原始数据，不超过64KB
+ * @param length 原始数据的字节数
+ * @param destination 压缩后的数据
+ * @param capacity destination 的大小
+ * @return 压缩后的字节数，放不下时返回0
+ */
+uint32_t lz4_compress(const uint8_t *source, uint32_t length, uint8_t *destination, uint32_t capacity)
+{
+    uint16_t table[1 << LZ4_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    uint32_t position = 0;
+    uint32_t anchor = 0;    // 还没有输出的字面量的起点
+    uint32_t output = 0;
+    uint32_t match_limit = (length > LZ4_MATCH_LIMIT) ? length - LZ4_MATCH_LIMIT : 0;
+    while(true)
+    {
+        uint32_t match_length = 0;
+        uint32_t distance = 0;
+        while(position < match_limit)
+        {
+            uint32_t sequence;
+            memcpy(&sequence, source + position, sizeof(sequence));
+            uint32_t hash = (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+            uint32_t candidate = table[hash];
+            table[hash] = position;
+            if(candidate < position && memcmp(source + candidate, &sequence, sizeof(sequence)) == 0)
+            {
+                match_length = LZ4_MIN_MATCH;
+                while(position + match_length < length - LZ4_LAST_LITERALS && source[candidate + match_length] == source[position + match_length])
+                {
+                    match_length++;
+                }
+                distance = position - candidate;
+                break;
+            }
+            position++;
+        }
+        if(match_length == 0)
+        {
+            position = length;    // 剩下的都是字面量
+        }
+
+        // 标记字节、两段长度的扩展字节和距离最多需要的字节数
+        uint32_t literal_length = position - anchor;
+        if(output + 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1 > capacity)
+        {
+            return 0;
+        }
+        uint8_t *token = destination + output++;
+        *token = (uint8_t)((literal_length < 15 ? literal_length : 15) << 4);
+        if(literal_length >= 15)
+        {
+            uint32_t rest = literal_length - 15;
+            for(; rest >= 255; rest -= 255)
+            {
+                destination[output++] = 255;
+            }
+            destination[output++] = (uint8_t)rest;
+        }
+        memcpy(destination + output, source + anchor, literal_length);
+        output += literal_length;
+        if(match_length == 0)
+        {
+            return output;
+        }
+
+        destination[output++] = (uint8_t)(distance & 0xFF);
+        destination[output++] = (uint8_t)(distance >> 8);
+        uint32_t rest = match_length - LZ4_MIN_MATCH;
+        *token |= (uint8_t)(rest < 15 ? rest : 15);
+        if(rest >= 15)
+        {
+            for(rest -= 15; rest >= 255; rest -= 255)
+            {
+                destination[output++] = 255;
+            }
+            destination[output++] = (uint8_t)rest;
+        }
+        position += match_length;
+        anchor = position;
+    }
+}
+
+/**
+ * 解压LZ4块格式的数据
+ * 每一步都检查边界，损坏的数据不会读写越界
+ * @param source 压缩后的数据
+ * @param length 压缩后的字节数
+ * @param destination 解压后的数据
+ * @param capacity destination 的大小
+ * @return 解压后的字节数，数据损坏时返回-1
+ */
+int32_t lz4_decompress(const uint8_t *source, uint32_t length, uint8_t *destination, uint32_t capacity)
+{
+    uint32_t input = 0;
+    uint32_t output = 0;
+    while(input < length)
+    {
+        uint8_t token = source[input++];
+        uint32_t literal_length = token >> 4;
+        if(literal_length == 15)
+        {
+            uint8_t byte;
+            do
+            {
+                if(input >= length)
+                {
+                    return -1;
+                }
+                byte = source[input++];
+                literal_length += byte;
+            } while(byte == 255);
+        }
+        if(literal_length > length - input || literal_length > capacity - output)
+        {
+            return -1;
+        }
+        memcpy(destination + output, source + input, literal_length);
+        input += literal_length;
+        output += literal_length;
+        if(input == length)
+        {
+            break;    // 最后一个序列只有字面量
+        }
+
+        if(length - input < 2)
+        {
+            return -1;
+        }
+        uint32_t distance = source[input] | ((uint32_t)source[input + 1] << 8);
+        input += 2;
+        if(distance == 0 || distance > output)
+        {
+            return -1;
+        }
+        uint32_t match_length = token & 15;
+        if(match_length == 15)
+        {
+            uint8_t byte;
+            do
+            {
+                if(input >= length)
+                {
+                    return -1;
+                }
+                byte = source[input++];
+                match_length += byte;
+            } while(byte == 255);
+        }
+        match_length += LZ4_MIN_MATCH;
+        if(match_length > capacity - output)
+        {
+            return -1;
+        }
+        // 匹配可以和正在写的部分重叠，逐字节复制
+        for(uint32_t i = 0; i < match_length; i++)
+        {
+            destination[output + i] = destination[output - distance + i];
+        }
+        output += match_length;
+    }
+
+    return (int32_t)output;
+}
+
+/**
+ * 在日志索引中查找页的最新帧
+ * @param pager 分页器
+ * @param page_num 页号
+ * @return 帧号，页不在日志中时返回INVALID_PAGE_NUM
+ */
+uint32_t wal_index_find(Pager *pager, uint32_t page_num)
+{
+    uint32_t mask = pager->wal_index_capacity - 1;
+    for(uint32_t slot = (page_num * 2654435761u) & mask; ; slot = (slot + 1) & mask)
+    {
+        if(pager->wal_index_pages[slot] == page_num)
+        {
+            return pager->wal_index_frames[slot];
+        }
+        if(pager->wal_index_pages[slot] == INVALID_PAGE_NUM)
+        {
+            return INVALID_PAGE_NUM;
+        }
+    }
+}
+
+/**
+ * 更新日志索引
+ * 装载因子超过一半时把槽数翻倍
+ * @param pager 分页器
+ * @param page_num 页号
+ * @param frame_num 帧号
+ */
+void wal_index_put(Pager *pager, uint32_t page_num, uint32_t frame_num)
+{
+    if((pager->wal_index_count + 1) * 2 > pager->wal_index_capacity)
+    {
+        uint32_t old_capacity = pager->wal_index_capacity;
+        uint32_t *old_pages = pager->wal_index_pages;
+        uint32_t *old_frames = pager->wal_index_frames;
+        pager->wal_index_capacity = old_capacity * 2;
+        pager->wal_index_pages = (uint32_t *)malloc(sizeof(uint32_t) * pager->wal_index_capacity);
+        pager->wal_index_frames = (uint32_t *)malloc(sizeof(uint32_t) * pager->wal_index_capacity);
+        for(uint32_t i = 0; i < pager->wal_index_capacity; i++)
+        {
+            pager->wal_index_pages[i] = INVALID_PAGE_NUM;
+        }
+        pager->wal_index_count = 0;
+        for(uint32_t i = 0; i < old_capacity; i++)
+        {
+            if(old_pages[i] != INVALID_PAGE_NUM)
+            {
+                wal_index_put(pager, old_pages[i], old_frames[i]);
+            }
+        }
+        free(old_pages);
+        free(old_frames);
+    }
+
+    uint32_t mask = pager->wal_index_capacity - 1;
+    uint32_t slot = (page_num * 2654435761u) & mask;
+    while(pager->wal_index_pages[slot] != INVALID_PAGE_NUM && pager->wal_index_pages[slot] != page_num)
+    {
+        slot = (slot + 1) & mask;
+    }
+    if(pager->wal_index_pages[slot] == INVALID_PAGE_NUM)
+    {
+        pager->wal_index_pages[slot] = page_num;
+        pager->wal_index_count++;
+    }
+    pager->wal_index_frames[slot] = frame_num;
+}
+
+/**
+ * 计算页号在页表中的桶
+ * @param pager 分页器
+ * @param page_num 页号
+ * @return 桶下标
+ */
+uint32_t page_table_bucket(Pager *pager, uint32_t page_num)
+{
+    return (page_num * 2654435761u) & pager->page_table_mask;
+}
+
+/**
+ * 在页表中查找页所在的帧
+ * @param pager 分页器
+ * @param page_num 页号
+ * @return 帧，页不在缓冲池中时返回NULL
+ */
+Frame* pager_lookup(Pager *pager, uint32_t page_num)
+{
+    int32_t index = pager->page_table[page_table_bucket(pager, page_num)];
+    while(index != -1)
+    {
+        Frame *frame = &(pager->frames[index]);
+        if(frame->page_num == page_num)
+        {
+            return frame;
+        }
+        index = frame->hash_next;
+    }
+
+    return NULL;
+}
+
+/**
+ * 把帧从页表中移除
+ * @param pager 分页器
+ * @param frame 帧
+ */
+void page_table_remove(Pager *pager, Frame *frame)
+{
+    int32_t frame_index = frame - pager->frames;
+    int32_t *link = &(pager->page_table[page_table_bucket(pager, frame->page_num)]);
+    while(*link != -1)
+    {
+        if(*link == frame_index)
+        {
+            *link = frame->hash_next;
+            break;
+        }
+        link = &(pager->frames[*link].hash_next);
+    }
+    frame->hash_next = -1;
+    frame->page_num = INVALID_PAGE_NUM;
+}
+
+/**
+ * 追加帧到预写日志
+ * 每一帧由帧头和页内容两段组成，多帧合并成一次 pwritev 顺序追加到日志末尾
+ * @param pager 分页器
+ * @param page_nums 要写入的页号
+ * @param pages 要写入的页内容
+ * @param num_frames 帧数
+ * @param commit 不为0时最后一帧是提交帧，值为提交后数据库的页数
+ */
+void wal_append_frames(Pager *pager, uint32_t *page_nums, void **pages, uint32_t num_frames, uint32_t commit)
+{
+    struct iovec iov[2 * FLUSH_BATCH_PAGES];
+    WalFrameHeader headers[FLUSH_BATCH_PAGES];
+
+    uint32_t i = 0;
+    while(i < num_frames)
+    {
+        uint32_t batch = num_frames - i;
+        if(batch > FLUSH_BATCH_PAGES)
+        {
+            batch = FLUSH_BATCH_PAGES;
+        }
+
+        for(uint32_t j = 0; j < batch; j++)
+        {
+            WalFrameHeader *header = &(headers[j]);
+            header->page_num = page_nums[i + j];
+            header->commit = (i + j == num_frames - 1) ? commit : 0;
+            header->salt = pager->wal_salt;
+            *node_checksum(pages[i + j]) = page_checksum(pages[i + j]);    // 写到日志的页才会进入数据库文件，在这里算好页的校验和
+            header->checksum = wal_checksum(header, pages[i + j]);
+            iov[2 * j].iov_base = header;
+            iov[2 * j].iov_len = WAL_FRAME_HEADER_SIZE;
+            iov[2 * j + 1].iov_base = pages[i + j];
+            iov[2 * j + 1].iov_len = PAGE_SIZE;
+        }
+
+        off_t offset = WAL_HEADER_SIZE + (off_t)pager->wal_num_frames * (WAL_FRAME_HEADER_SIZE + PAGE_SIZE);
+        ssize_t expected = (ssize_t)batch * (WAL_FRAME_HEADER_SIZE + PAGE_SIZE);
+        if(pwritev(pager->wal_fd, iov, 2 * batch, offset) != expected)
+        {
+            fatal_error("Error writing: %d\n", errno);
+        }
+
+        for(uint32_t j = 0; j < batch; j++)
+        {
+            wal_index_put(pager, page_nums[i + j], pager->wal_num_frames + j);
+        }
+        pager->wal_num_frames += batch;
+        i += batch;
+    }
+}
+
+/**
+ * 刷新分页器, 将页中的数据刷新到预写日志中
+ * 淘汰脏页时调用，写入的是没有提交标记的帧，语句提交之前崩溃的话恢复时会被丢弃
+ * @param pager 分页器
+ * @param page_num 页号
+ */
+void pager_flush(Pager *pager, uint32_t page_num)
+{
+    Frame *frame = pager_lookup(pager, page_num);
+    if(frame == NULL)
+    {
+        fatal_error("Tried to flush null page\n");
+    }
+
+    wal_append_frames(pager, &page_num, &(frame->data), 1, 0);
+    frame->dirty = false;
+}
+
+/**
+ * 按页号比较两个帧，用于排序脏页
+ */
+int compare_frames_by_page_num(const void *a, const void *b)
+{
+    uint32_t page_a = (*(Frame **)a)->page_num;
+    uint32_t page_b = (*(Frame **)b)->page_num;
+    return (page_a > page_b) - (page_a < page_b);
+}
+
+/**
+ * 比较两个 uint32，用于排序页号
+ */
+int compare_uint32(const void *a, const void *b)
+{
+    uint32_t value_a = *(uint32_t *)a;
+    uint32_t value_b = *(uint32_t *)b;
+    return (value_a > value_b) - (value_a < value_b);
+}
+
+/**
+ * 按第一个元素比较两个 uint32 对，用于按页号排序日志索引
+ */
+int compare_uint32_pairs(const void *a, const void *b)
+{
+    uint32_t first_a = ((uint32_t *)a)[0];
+    uint32_t first_b = ((uint32_t *)b)[0];
+    return (first_a > first_b) - (first_a < first_b);
+}
+
+/**
+ * 提交所有脏页到预写日志
+ * 每条语句执行完后调用：只写被修改过的页，最后一帧带提交标记
+ * 不会每次都 fdatasync，攒够 group_commit 次提交（或者没有更多输入）时再一起同步
+ * 由持有写者互斥锁的线程调用，这时只有它会修改页；日志写完以后再释放分页器的锁做同步和检查点
+ * @param pager 分页器
+ */
+void pager_commit(Pager *pager)
+{
+    pthread_mutex_lock(&(pager->mutex));
+    if(pager->map_base != NULL)
+    {
+        // 内存映射模式：脏页号单独记录，页内容直接在映射中
+        uint32_t num_dirty = pager->map_num_dirty;
+        if(num_dirty > 0)
+        {
+            qsort(pager->map_dirty_pages, num_dirty, sizeof(uint32_t), compare_uint32);
+            void **pages = (void **)malloc(sizeof(void *) * num_dirty);
+            for(uint32_t i = 0; i < num_dirty; i++)
+            {
+                pages[i] = pager->map_base + (size_t)pager->map_dirty_pages[i] * PAGE_SIZE;
+                pager->map_dirty[pager->map_dirty_pages[i]] = 0;
+            }
+            wal_append_frames(pager, pager->map_dirty_pages, pages, num_dirty, pager->num_pages);
+            free(pages);
+            pager->map_num_dirty = 0;
+            pager->wal_pending_syncs++;
+        }
+    }
+    else
+    {
+        Frame **dirty_frames = (Frame **)malloc(sizeof(Frame *) * pager->capacity);
+        uint32_t num_dirty = 0;
+        for(uint32_t i = 0; i < pager->capacity; i++)
+        {
+            Frame *frame = &(pager->frames[i]);
+            if(frame->page_num != INVALID_PAGE_NUM && frame->dirty)
+            {
+                dirty_frames[num_dirty++] = frame;
+            }
+        }
+
+        if(num_dirty > 0)
+        {
+            qsort(dirty_frames, num_dirty, sizeof(Frame *), compare_frames_by_page_num);
+            uint32_t *page_nums = (uint32_t *)malloc(sizeof(uint32_t) * num_dirty);
+            void **pages = (void **)malloc(sizeof(void *) * num_dirty);
+            for(uint32_t i = 0; i < num_dirty; i++)
+            {
+                page_nums[i] = dirty_frames[i]->page_num;
+                pages[i] = dirty_frames[i]->data;
+                dirty_frames[i]->dirty = false;
+            }
+            wal_append_frames(pager, page_nums, pages, num_dirty, pager->num_pages);
+            free(page_nums);
+            free(pages);
+            pager->wal_pending_syncs++;
+        }
+        free(dirty_frames);
+    }
+    if(pager->in_transaction)
+    {
+        undo_clear(pager);    // 事务的修改都已经提交，撤销缓冲区没用了
+        pager->num_taken = 0;
+        pager->in_transaction = false;
+    }
+    bool sync = pager->wal_pending_syncs >= pager->group_commit;
+    bool checkpoint = pager->wal_num_frames >= WAL_AUTOCHECKPOINT_FRAMES;
+    pthread_mutex_unlock(&(pager->mutex));
+
+    if(sync)
+    {
+        pager_sync(pager);
+    }
+    if(checkpoint)
+    {
+        pager_checkpoint(pager);
+    }
+}
+
+/**
+ * 把已提交的日志同步到磁盘
+ * 多次提交共用一次 fdatasync（组提交）
+ * 同步时不持有分页器的锁，其他线程可以继续读页和提交；sync_mutex 保证另一个线程正在同步时，
+ * 这里等它做完再返回，返回时调用之前的提交都已经落盘
+ * @param pager 分页器
+ */
+void pager_sync(Pager *pager)
+{
+    pthread_mutex_lock(&(pager->sync_mutex));
+    pthread_mutex_lock(&(pager->mutex));
+    uint32_t pending_syncs = pager->wal_pending_syncs;
+    pager->wal_pending_syncs = 0;
+    pthread_mutex_unlock(&(pager->mutex));
+
+    if(pending_syncs > 0 && fdatasync(pager->wal_fd) == -1)
+    {
+        fatal_error("Error syncing write-ahead log: %d\n", errno);
+    }
+    pthread_mutex_unlock(&(pager->sync_mutex));
+}
+
+/**
+ * 检查点，把日志中的页写回数据库文件
+ * 日志先同步到磁盘，再把每个页的最新帧按页号顺序写回数据库文件（压缩文件先压缩再写进槽），
+ * 数据库文件同步以后清空日志。缓冲池中干净的页和日志中的最新帧相同，可以直接使用
+ * 只在提交之后调用，这时没有脏页，日志中的帧都已经提交；整个过程持有分页器的锁，
+ * 读者已经固定的页不受影响，没有固定的页要等检查点结束后才能读进来
+ * @param pager 分页器
+ */
+void pager_checkpoint(Pager *pager)
+{
+    pthread_mutex_lock(&(pager->mutex));
+    if(pager->wal_num_frames == 0)
+    {
+        pthread_mutex_unlock(&(pager->mutex));
+        return;
+    }
+    if(fdatasync(pager->wal_fd) == -1)
+    {
+        fatal_error("Error syncing write-ahead log: %d\n", errno);
+    }
+
+    // 按页号排序的（页号，帧号）
+    uint32_t num_entries = 0;
+    uint32_t *entries = (uint32_t *)malloc(sizeof(uint32_t) * 2 * (pager->wal_index_count + 1));
+    for(uint32_t i = 0; i < pager->wal_index_capacity; i++)
+    {
+        if(pager->wal_index_pages[i] != INVALID_PAGE_NUM)
+        {
+            entries[2 * num_entries] = pager->wal_index_pages[i];
+            entries[2 * num_entries + 1] = pager->wal_index_frames[i];
+            num_entries++;
+        }
+    }
+    qsort(entries, num_entries, 2 * sizeof(uint32_t), compare_uint32_pairs);
+    if(pager->compressed)
+    {
+        pager_write_slots(pager, entries, num_entries);
+    }
+    else
+    {
+        pager_write_pages(pager, entries, num_entries);
+    }
+
+    if(fsync(pager->file_descriptor) == -1)
+    {
+        fatal_error("Error syncing db file: %d\n", errno);
+    }
+
+    free(entries);
+
+    if(pager->map_base != NULL && pager->map_num_dirty == 0)
+    {
+        pager_map_file(pager);    // 所有页都已经写回文件，私有副本可以丢掉；替换映射是原子的，读者看到的内容不变
+    }
+
+    wal_reset(pager);
+    pthread_mutex_unlock(&(pager->mutex));
+}
+
+/**
+ * 把日志中的页写回数据库文件
+ * 检查点调用，持有 mutex。页号连续的页合并成一次 pwritev
+ * @param pager 分页器
+ * @param entries 按页号排序的（页号，帧号）
+ * @param num_entries 页数
+ */
+void pager_write_pages(Pager *pager, uint32_t *entries, uint32_t num_entries)
+{
+    struct iovec iov[FLUSH_BATCH_PAGES];
+    void *scratch = malloc((size_t)FLUSH_BATCH_PAGES * PAGE_SIZE);
+    uint32_t i = 0;
+    while(i < num_entries)
+    {
+        // 找出从 i 开始页号连续的一段
+        uint32_t first_page = entries[2 * i];
+        uint32_t run = 1;
+        while(i + run < num_entries && run < FLUSH_BATCH_PAGES && entries[2 * (i + run)] == first_page + run)
+        {
+            run++;
+        }
+
+        for(uint32_t j = 0; j < run; j++)
+        {
+            uint32_t page_num = entries[2 * (i + j)];
+            uint32_t frame_num = entries[2 * (i + j) + 1];
+            void *clean_page = pager_clean_page(pager, page_num);
+            iov[j].iov_len = PAGE_SIZE;
+            if(clean_page != NULL)
+            {
+                iov[j].iov_base = clean_page;
+                continue;
+            }
+
+            iov[j].iov_base = scratch + (size_t)j * PAGE_SIZE;
+            off_t offset = WAL_HEADER_SIZE + (off_t)frame_num * (WAL_FRAME_HEADER_SIZE + PAGE_SIZE) + WAL_FRAME_HEADER_SIZE;
+            if(pread(pager->wal_fd, iov[j].iov_base, PAGE_SIZE, offset) != (ssize_t)PAGE_SIZE)
+            {
+                fatal_error("Error reading write-ahead log: %d\n", errno);
+            }
+        }
+
+        off_t offset = (off_t)first_page * PAGE_SIZE;
+        ssize_t expected = (ssize_t)run * PAGE_SIZE;
+        if(pwritev(pager->file_descriptor, iov, run, offset) != expected)
+        {
+            fatal_error("Error writing: %d\n", errno);
+        }
+        if(offset + expected > pager->file_length)    // 更新文件长度
+        {
+            pager->file_length = offset + expected;
+        }
+        i += run;
+    }
+    free(scratch);
+}
+
+/**
+ * 打开压缩格式的数据库文件
+ * 空文件写入新的文件头；否则读入文件头和页映射的所有块，页数是最后一个写进文件的页加1，
+ * 文件中已经分配到的末尾是文件头、所有块和所有槽的最大结束位置，崩溃时写了一半的槽之后会被覆盖
+ * @param pager 分页器
+ */
+void pager_compress_open(Pager *pager)
+{
+    pager->compressed = true;
+    pager->compress_header = (uint32_t *)calloc(PAGE_SIZE, 1);
+    pager->compress_buffer = (uint8_t *)malloc(PAGE_SIZE);
+    uint32_t *header = pager->compress_header;
+    if(pager->file_length == 0)
+    {
+        header[0] = COMPRESS_MAGIC;
+        header[1] = COMPRESS_VERSION;
+        header[2] = PAGE_SIZE;
+        header[3] = 0;
+        compress_write(pager, header, PAGE_SIZE, 0);
+        pager->file_length = PAGE_SIZE;
+    }
+    else if(pread(pager->file_descriptor, header, PAGE_SIZE, 0) != (ssize_t)PAGE_SIZE ||
+        header[1] != COMPRESS_VERSION || header[2] != PAGE_SIZE || header[3] > COMPRESS_MAX_CHUNKS)
+    {
+        fatal_error("Compressed db file has an invalid header.\n");
+    }
+
+    uint32_t num_chunks = header[3];
+    size_t chunk_bytes = COMPRESS_CHUNK_ENTRIES * sizeof(PageSlot);
+    pager->slots = (PageSlot *)calloc((size_t)num_chunks * COMPRESS_CHUNK_ENTRIES, sizeof(PageSlot));
+    pager->compress_end = PAGE_SIZE / COMPRESS_SLOT_UNIT;
+    for(uint32_t chunk = 0; chunk < num_chunks; chunk++)
+    {
+        uint32_t offset = header[COMPRESS_HEADER_FIELDS + chunk];
+        if(pread(pager->file_descriptor, pager->slots + (size_t)chunk * COMPRESS_CHUNK_ENTRIES, chunk_bytes,
+            (off_t)offset * COMPRESS_SLOT_UNIT) != (ssize_t)chunk_bytes)
+        {
+            fatal_error("Compressed db file has a truncated page map.\n");
+        }
+        if(offset + chunk_bytes / COMPRESS_SLOT_UNIT > pager->compress_end)
+        {
+            pager->compress_end = offset + chunk_bytes / COMPRESS_SLOT_UNIT;
+        }
+    }
+
+    pager->num_pages = 0;
+    for(uint32_t page_num = 0; page_num < num_chunks * COMPRESS_CHUNK_ENTRIES; page_num++)
+    {
+        PageSlot *slot = &(pager->slots[page_num]);
+        if(slot->length == 0)
+        {
+            continue;
+        }
+        pager->num_pages = page_num + 1;
+        if(slot->offset + slot->capacity > pager->compress_end)
+        {
+            pager->compress_end = slot->offset + slot->capacity;
+        }
+    }
+}
+
+/**
+ * 查找页在压缩文件中的槽
+ * @param pager 分页器
+ * @param page_num 页号
+ * @return 槽，页还没有写进文件时返回NULL
+ */
+PageSlot *pager_slot(Pager *pager, uint32_t page_num)
+{
+    if(page_num >= pager->compress_header[3] * COMPRESS_CHUNK_ENTRIES || pager->slots[page_num].length == 0)
+    {
+        return NULL;
+    }
+    return &(pager->slots[page_num]);
+}
+
+/**
+ * 从压缩文件中读取页
+ * 没有压缩的页直接读进 data，压缩的页先读到 buffer 再解压
+ * @param pager 分页器
+ * @param page_num 页号
+ * @param data 页内容
+ * @param buffer 一页大小的缓冲区
+ * @return 是否读出了页；压缩的数据损坏时返回false
+ */
+bool pager_read_slot(Pager *pager, uint32_t page_num, void *data, uint8_t *buffer)
+{
+    PageSlot *slot = pager_slot(pager, page_num);
+    if(slot == NULL)
+    {
+        memset(data, 0, PAGE_SIZE);    // 文件中还没有的新页
+        return true;
+    }
+
+    off_t offset = (off_t)slot->offset * COMPRESS_SLOT_UNIT;
+    void *destination = (slot->length == PAGE_SIZE) ? data : buffer;
+    if(pread(pager->file_descriptor, destination, slot->length, offset) != (ssize_t)slot->length)
+    {
+        fatal_error("Error reading file: %d\n", errno);
+    }
+    return slot->length == PAGE_SIZE || lz4_decompress(buffer, slot->length, (uint8_t *)data, PAGE_SIZE) == (int32_t)PAGE_SIZE;
+}
+
+/**
+ * 写压缩文件
+ * @param pager 分页器
+ * @param data 数据
+ * @param length 字节数
+ * @param offset 文件偏移
+ */
+void compress_write(Pager *pager, const void *data, size_t length, off_t offset)
+{
+    if(pwrite(pager->file_descriptor, data, length, offset) != (ssize_t)length)
+    {
+        fatal_error("Error writing: %d\n", errno);
+    }
+    if(offset + (off_t)length > pager->file_length)    // 更新文件长度
+    {
+        pager->file_length = offset + (off_t)length;
+    }
+}
+
+/**
+ * 把日志中的页压缩后写回压缩文件
+ * 检查点调用，持有 mutex。压缩后没有至少省下一个对齐单位的页不压缩；页还放得下原来的槽时原地改写，
+ * 否则在文件末尾分配新槽，连续分配的槽合并成一次写。改写的页都还在日志里，写到一半崩溃时恢复会重新写一遍，
+ * 所以槽和页映射的块可以直接覆盖；只有新分配了块时才改写文件头，之前先同步文件，文件头不会指向还没写好的块
+ * @param pager 分页器
+ * @param entries 按页号排序的（页号，帧号）
+ * @param num_entries 页数
+ */
+void pager_write_slots(Pager *pager, uint32_t *entries, uint32_t num_entries)
+{
+    uint32_t *header = pager->compress_header;
+    uint32_t num_chunks = header[3];
+    uint32_t chunk_units = COMPRESS_CHUNK_ENTRIES * sizeof(PageSlot) / COMPRESS_SLOT_UNIT;
+    bool header_dirty = false;
+    bool *chunk_dirty = (bool *)calloc(COMPRESS_MAX_CHUNKS, sizeof(bool));
+    uint8_t *page = (uint8_t *)malloc(PAGE_SIZE);
+    size_t run_capacity = (size_t)FLUSH_BATCH_PAGES * PAGE_SIZE;
+    uint8_t *run = (uint8_t *)malloc(run_capacity);
+    off_t run_offset = 0;
+    size_t run_length = 0;
+    for(uint32_t i = 0; i < num_entries; i++)
+    {
+        uint32_t page_num = entries[2 * i];
+        uint8_t *image = (uint8_t *)pager_clean_page(pager, page_num);
+        if(image == NULL)
+        {
+            image = page;
+            off_t offset = WAL_HEADER_SIZE + (off_t)entries[2 * i + 1] * (WAL_FRAME_HEADER_SIZE + PAGE_SIZE) + WAL_FRAME_HEADER_SIZE;
+            if(pread(pager->wal_fd, image, PAGE_SIZE, offset) != (ssize_t)PAGE_SIZE)
+            {
+                fatal_error("Error reading write-ahead log: %d\n", errno);
+            }
+        }
+
+        // 页映射不够时在文件末尾分配新块
+        while(page_num >= num_chunks * COMPRESS_CHUNK_ENTRIES)
+        {
+            if(num_chunks == COMPRESS_MAX_CHUNKS)
+            {
+                fatal_error("Compressed db file is full.\n");
+            }
+            pager->slots = (PageSlot *)realloc(pager->slots, sizeof(PageSlot) * (num_chunks + 1) * COMPRESS_CHUNK_ENTRIES);
+            memset(pager->slots + (size_t)num_chunks * COMPRESS_CHUNK_ENTRIES, 0, sizeof(PageSlot) * COMPRESS_CHUNK_ENTRIES);
+            header[COMPRESS_HEADER_FIELDS + num_chunks] = pager->compress_end;
+            pager->compress_end += chunk_units;
+            chunk_dirty[num_chunks] = true;
+            num_chunks++;
+            header[3] = num_chunks;
+            header_dirty = true;
+        }
+
+        uint32_t length = lz4_compress(image, PAGE_SIZE, pager->compress_buffer, PAGE_SIZE - COMPRESS_SLOT_UNIT);
+        uint8_t *data = pager->compress_buffer;
+        if(length == 0)
+        {
+            length = PAGE_SIZE;
+            data = image;
+        }
+        uint32_t units = (length + COMPRESS_SLOT_UNIT - 1) / COMPRESS_SLOT_UNIT;
+        PageSlot *slot = &(pager->slots[page_num]);
+        if(slot->capacity < units)
+        {
+            slot->offset = pager->compress_end;
+            slot->capacity = units;
+            pager->compress_end += units;
+        }
+        slot->length = length;
+        chunk_dirty[page_num / COMPRESS_CHUNK_ENTRIES] = true;
+
+        off_t offset = (off_t)slot->offset * COMPRESS_SLOT_UNIT;
+        size_t padded = (size_t)units * COMPRESS_SLOT_UNIT;
+        if(run_length > 0 && (offset != run_offset + (off_t)run_length || run_length + padded > run_capacity))
+        {
+            compress_write(pager, run, run_length, run_offset);
+            run_length = 0;
+        }
+        if(run_length == 0)
+        {
+            run_offset = offset;
+        }
+        memcpy(run + run_length, data, length);
+        memset(run + run_length + length, 0, padded - length);
+        run_length += padded;
+    }
+    if(run_length > 0)
+    {
+        compress_write(pager, run, run_length, run_offset);
+    }
+    free(run);
+    free(page);
+
+    for(uint32_t chunk = 0; chunk < num_chunks; chunk++)
+    {
+        if(chunk_dirty[chunk])
+        {
+            compress_write(pager, pager->slots + (size_t)chunk * COMPRESS_CHUNK_ENTRIES, COMPRESS_CHUNK_ENTRIES * sizeof(PageSlot),
+                (off_t)header[COMPRESS_HEADER_FIELDS + chunk] * COMPRESS_SLOT_UNIT);
+        }
+    }
+    free(chunk_dirty);
+
+    if(header_dirty)
+    {
+        if(fsync(pager->file_descriptor) == -1)
+        {
+            fatal_error("Error syncing db file: %d\n", errno);
+        }
+        compress_write(pager, header, PAGE_SIZE, 0);
+    }
+}
+
+/**
+ * 重写压缩文件
+ * .vacuum 截断以后调用，持有 mutex，日志是空的。所有槽按页号顺序紧挨着写到临时文件，不重新压缩，
+ * 同步以后改名替换原来的文件：换槽留下的旧槽和截掉的页都在这时回收，中途崩溃时原来的文件不受影响
+ * @param pager 分页器
+ */
+void pager_compact(Pager *pager)
+{
+    char *temp_filename = (char *)malloc(strlen(pager->filename) + 8);
+    sprintf(temp_filename, "%s-vacuum", pager->filename);
+    int fd = open(temp_filename, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if(fd == -1 || flock(fd, LOCK_EX | LOCK_NB) == -1)    // 改名以后新文件就是数据库文件，要先加上锁
+    {
+        fatal_error("Unable to open file\n");
+    }
+
+    uint32_t num_chunks = (pager->num_pages + COMPRESS_CHUNK_ENTRIES - 1) / COMPRESS_CHUNK_ENTRIES;
+    uint32_t chunk_units = COMPRESS_CHUNK_ENTRIES * sizeof(PageSlot) / COMPRESS_SLOT_UNIT;
+    uint32_t *header = (uint32_t *)calloc(PAGE_SIZE, 1);
+    memcpy(header, pager->compress_header, COMPRESS_HEADER_FIELDS * sizeof(uint32_t));
+    header[3] = num_chunks;
+    uint32_t end = PAGE_SIZE / COMPRESS_SLOT_UNIT;
+    for(uint32_t chunk = 0; chunk < num_chunks; chunk++)
+    {
+        header[COMPRESS_HEADER_FIELDS + chunk] = end;
+        end += chunk_units;
+    }
+
+    int old_fd = pager->file_descriptor;
+    pager->file_descriptor = fd;
+    pager->file_length = 0;
+    PageSlot *slots = (PageSlot *)calloc((size_t)num_chunks * COMPRESS_CHUNK_ENTRIES, sizeof(PageSlot));
+    size_t run_capacity = (size_t)FLUSH_BATCH_PAGES * PAGE_SIZE;
+    uint8_t *run = (uint8_t *)malloc(run_capacity);
+    off_t run_offset = (off_t)end * COMPRESS_SLOT_UNIT;
+    size_t run_length = 0;
+    for(uint32_t page_num = 0; page_num < pager->num_pages; page_num++)
+    {
+        PageSlot *slot = pager_slot(pager, page_num);
+        if(slot == NULL)
+        {
+            continue;
+        }
+        uint32_t units = (slot->length + COMPRESS_SLOT_UNIT - 1) / COMPRESS_SLOT_UNIT;
+        if(run_length + (size_t)units * COMPRESS_SLOT_UNIT > run_capacity)
+        {
+            compress_write(pager, run, run_length, run_offset);
+            run_offset += run_length;
+            run_length = 0;
+        }
+        memset(run + run_length, 0, (size_t)units * COMPRESS_SLOT_UNIT);
+        if(pread(old_fd, run + run_length, slot->length, (off_t)slot->offset * COMPRESS_SLOT_UNIT) != (ssize_t)slot->length)
+        {
+            fatal_error("Error reading file: %d\n", errno);
+        }
+        slots[page_num].offset = end;
+        slots[page_num].length = slot->length;
+        slots[page_num].capacity = units;
+        end += units;
+        run_length += (size_t)units * COMPRESS_SLOT_UNIT;
+    }
+    if(run_length > 0)
+    {
+        compress_write(pager, run, run_length, run_offset);
+    }
+    free(run);
+
+    for(uint32_t chunk = 0; chunk < num_chunks; chunk++)
+    {
+        compress_write(pager, slots + (size_t)chunk * COMPRESS_CHUNK_ENTRIES, COMPRESS_CHUNK_ENTRIES * sizeof(PageSlot),
+            (off_t)header[COMPRESS_HEADER_FIELDS + chunk] * COMPRESS_SLOT_UNIT);
+    }
+    compress_write(pager, header, PAGE_SIZE, 0);
+    if(fsync(fd) == -1 || rename(temp_filename, pager->filename) == -1)
+    {
+        fatal_error("Error replacing db file: %d\n", errno);
+    }
+    close(old_fd);
+    free(temp_filename);
+
+    free(pager->slots);
+    free(pager->compress_header);
+    pager->slots = slots;
+    pager->compress_header = header;
+    pager->compress_end = end;
+}
+
+/**
+ * 截断数据库文件
+ * 在检查点之后调用，这时日志是空的，截掉的页也不会被固定。缓冲池中截掉的页直接丢掉；
+ * 内存映射模式下把截掉的部分重新变回不可访问的预留空间，之后再增长时和新页一样从全0开始
+ * @param pager 分页器
+ * @param num_pages 保留的页数
+ */
+void pager_truncate(Pager *pager, uint32_t num_pages)
+{
+    pthread_mutex_lock(&(pager->mutex));
+    for(uint32_t i = 0; i < pager->capacity; i++)
+    {
+        Frame *frame = &(pager->frames[i]);
+        if(frame->page_num != INVALID_PAGE_NUM && frame->page_num >= num_pages)
+        {
+            page_table_remove(pager, frame);
+            frame->dirty = false;
+        }
+    }
+
+    if(pager->map_base != NULL && pager->map_pages > num_pages)
+    {
+        size_t offset = (size_t)num_pages * PAGE_SIZE;
+        void *address = mmap(pager->map_base + offset, (size_t)pager->map_pages * PAGE_SIZE - offset, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        if(address == MAP_FAILED)
+        {
+            fatal_error("Error shrinking mmap: %d\n", errno);
+        }
+        pager->map_pages = num_pages;
+    }
+
+    pager->num_pages = num_pages;
+    if(pager->compressed)
+    {
+        // 压缩文件截掉的页清空它们的槽，和换槽留下的旧槽一起在重写文件时回收
+        for(uint32_t page_num = num_pages; page_num < pager->compress_header[3] * COMPRESS_CHUNK_ENTRIES; page_num++)
+        {
+            pager->slots[page_num].length = 0;
+        }
+        pager_compact(pager);
+        pthread_mutex_unlock(&(pager->mutex));
+        return;
+    }
+
+    pager->file_length = (off_t)num_pages * PAGE_SIZE;
+    if(ftruncate(pager->file_descriptor, pager->file_length) == -1 || fsync(pager->file_descriptor) == -1)
+    {
+        fatal_error("Error truncating db file: %d\n", errno);
+    }
+    pthread_mutex_unlock(&(pager->mutex));
+}
+
+/**
+ * 开始显式事务
+ * 事务开始时所有的修改都已经提交，之后第一次修改已有的页时保存的就是它提交后的内容
+ * @param pager 分页器
+ */
+void pager_begin(Pager *pager)
+{
+    pthread_mutex_lock(&(pager->mutex));
+    pager->in_transaction = true;
+    pager->transaction_num_pages = pager->num_pages;
+    pthread_mutex_unlock(&(pager->mutex));
+}
+
+/**
+ * 回滚显式事务
+ * 修改过的已有页在排它锁下原地恢复成事务开始前的内容，再提交一次，让它们在日志中覆盖事务被淘汰出去的帧；
+ * 事务新分配的页不再被树引用，但是在回滚前开始的扫描可能还会沿旧的叶子节点链表读到它们，所以保留内容，由调用者在这些扫描结束以后复用。
+ * 从空闲页链表取出的页也一样：不恢复内容，链表头保持取完以后的样子，taken_pages 留给调用者释放
+ * @param pager 分页器
+ */
+void pager_rollback(Pager *pager)
+{
+    pthread_mutex_lock(&(pager->mutex));
+    pager->in_transaction = false;
+    pthread_mutex_unlock(&(pager->mutex));
+
+    if(pager->num_taken > 0)
+    {
+        qsort(pager->taken_pages, pager->num_taken, sizeof(uint32_t), compare_uint32);
+    }
+    void *catalog = get_page(pager, CATALOG_PAGE_NUM);
+    uint32_t free_head = *node_parent(catalog);    // 事务中只会从链表头取页，不会加页
+    unpin_page(pager, CATALOG_PAGE_NUM);
+    for(uint32_t i = 0; i < pager->undo_capacity; i++)
+    {
+        uint32_t page_num = pager->undo_pages[i];
+        if(page_num == INVALID_PAGE_NUM ||
+           (pager->num_taken > 0 && bsearch(&page_num, pager->taken_pages, pager->num_taken, sizeof(uint32_t), compare_uint32) != NULL))
+        {
+            continue;
+        }
+        void *page = get_page(pager, page_num);
+        pager_mark_dirty(pager, page_num);
+        memcpy(page, pager->undo_images[i], PAGE_SIZE);
+        if(page_num == CATALOG_PAGE_NUM)
+        {
+            *node_parent(page) = free_head;
+        }
+        unpin_page(pager, page_num);
+    }
+
+    pthread_mutex_lock(&(pager->mutex));
+    undo_clear(pager);
+    pthread_mutex_unlock(&(pager->mutex));
+    pager_commit(pager);
+}
+
+/**
+ * 把页原来的内容保存到撤销缓冲区
+ * 同一个页只保存第一次修改之前的内容；调用者持有分页器的锁
+ * @param pager 分页器
+ * @param page_num 页号
+ * @param page 页的当前内容
+ */
+void undo_save(Pager *pager, uint32_t page_num, void *page)
+{
+    if((pager->undo_count + 1) * 2 > pager->undo_capacity)
+    {
+        uint32_t old_capacity = pager->undo_capacity;
+        uint32_t *old_pages = pager->undo_pages;
+        void **old_images = pager->undo_images;
+        pager->undo_capacity = old_capacity * 2;
+        pager->undo_pages = (uint32_t *)malloc(sizeof(uint32_t) * pager->undo_capacity);
+        pager->undo_images = (void **)malloc(sizeof(void *) * pager->undo_capacity);
+        for(uint32_t i = 0; i < pager->undo_capacity; i++)
+        {
+            pager->undo_pages[i] = INVALID_PAGE_NUM;
+        }
+        uint32_t mask = pager->undo_capacity - 1;
+        for(uint32_t i = 0; i < old_capacity; i++)
+        {
+            if(old_pages[i] != INVALID_PAGE_NUM)
+            {
+                uint32_t slot = (old_pages[i] * 2654435761u) & mask;
+                while(pager->undo_pages[slot] != INVALID_PAGE_NUM)
+                {
+                    slot = (slot + 1) & mask;
+                }
+                pager->undo_pages[slot] = old_pages[i];
+                pager->undo_images[slot] = old_images[i];
+            }
+        }
+        free(old_pages);
+        free(old_images);
+    }
+
+    uint32_t mask = pager->undo_capacity - 1;
+    uint32_t slot = (page_num * 2654435761u) & mask;
+    while(pager->undo_pages[slot] != INVALID_PAGE_NUM)
+    {
+        if(pager->undo_pages[slot] == page_num)
+        {
+            return;    // 已经保存过
+        }
+        slot = (slot + 1) & mask;
+    }
+    pager->undo_pages[slot] = page_num;
+    pager->undo_images[slot] = malloc(PAGE_SIZE);
+    memcpy(pager->undo_images[slot], page, PAGE_SIZE);
+    pager->undo_count++;
+}
+
+/**
+ * 清空撤销缓冲区
+ * 调用者持有分页器的锁
+ * @param pager 分页器
+ */
+void undo_clear(Pager *pager)
+{
+    for(uint32_t i = 0; i < pager->undo_capacity; i++)
+    {
+        if(pager->undo_pages[i] != INVALID_PAGE_NUM)
+        {
+            free(pager->undo_images[i]);
+            pager->undo_pages[i] = INVALID_PAGE_NUM;
+        }
+    }
+    pager->undo_count = 0;
+}
+
+/**
+ * 获取内存中和日志一致的页
+ * 检查点时，内存中没有被修改过的页和它在日志中的最新帧相同，可以省掉一次读日志
+ * @param pager 分页器
+ * @param page_num 页号
+ * @return 页，内存中没有或者已经被修改时返回NULL
+ */
+void* pager_clean_page(Pager *pager, uint32_t page_num)
+{
+    if(pager->map_base != NULL)
+    {
+        if(page_num < pager->map_pages && !pager->map_dirty[page_num])
+        {
+            return pager->map_base + (size_t)page_num * PAGE_SIZE;
+        }
+        return NULL;
+    }
+    if(pager->frames == NULL)
+    {
+        return NULL;    // 内存映射模式打开时重放日志，还没有建立映射
+    }
+
+    Frame *frame = pager_lookup(pager, page_num);
+    if(frame != NULL && !frame->dirty)
+    {
+        return frame->data;
+    }
+    return NULL;
+}
+
+/**
+ * 淘汰一个帧
+ * CLOCK算法：指针循环扫描所有帧，跳过被固定的帧，访问位为1的帧清零后给第二次机会，遇到访问位为0的帧就淘汰它
+ * @param pager 分页器
+ * @return 可以使用的空闲帧
+ */
+Frame* pager_evict(Pager *pager)
+{
+    // 扫描两圈：第一圈清掉访问位，第二圈一定能找到没有被固定的帧
+    for(uint32_t i = 0; i < 2 * pager->capacity; i++)
+    {
+        Frame *frame = &(pager->frames[pager->clock_hand]);
+        pager->clock_hand = (pager->clock_hand + 1) % pager->capacity;
+
+        if(frame->page_num == INVALID_PAGE_NUM)
+        {
+            return frame;
+        }
+        if(frame->pin_count > 0)
+        {
+            continue;
+        }
+        if(frame->referenced)
+        {
+            frame->referenced = false;
+            continue;
+        }
+
+        if(frame->dirty)
+        {
+            pager_flush(pager, frame->page_num);    // 脏页写到预写日志
+        }
+        page_table_remove(pager, frame);
+        return frame;
+    }
+
+    fatal_error("Buffer pool exhausted: all %d frames are pinned\n", pager->capacity);    // 打印错误信息
+}
+
+/**
+ * 从日志或数据库文件中读取页
+ * 页的最新版本还在日志中时读日志，否则读数据库文件（压缩文件通过页映射找到槽再解压），文件中还没有的新页全是0。
+ * 不验证校验和；调用者要保证日志索引和页映射在读的时候不会变化（持有 mutex，或者持有 writer_mutex 时没有人会提交）
+ * @param pager 分页器
+ * @param page_num 页号
+ * @param data 页内容
+ * @param buffer 一页大小的缓冲区，解压时使用
+ * @return 是否读出了页；压缩的数据损坏时返回false
+ */
+bool pager_read_page(Pager *pager, uint32_t page_num, void *data, uint8_t *buffer)
+{
+    uint32_t wal_frame = wal_index_find(pager, page_num);
+    if(wal_frame != INVALID_PAGE_NUM)
+    {
+        off_t wal_offset = WAL_HEADER_SIZE + (off_t)wal_frame * (WAL_FRAME_HEADER_SIZE + PAGE_SIZE) + WAL_FRAME_HEADER_SIZE;
+        if(pread(pager->wal_fd, data, PAGE_SIZE, wal_offset) != (ssize_t)PAGE_SIZE)
+        {
+            fatal_error("Error reading write-ahead log: %d\n", errno);    // 打印错误信息
+        }
+        return true;
+    }
+    if(pager->compressed)
+    {
+        return pager_read_slot(pager, page_num, data, buffer);
+    }
+
+    off_t offset = (off_t)page_num * PAGE_SIZE;
+    ssize_t bytes_read = 0;
+    if(offset < pager->file_length)
+    {
+        bytes_read = pread(pager->file_descriptor, data, PAGE_SIZE, offset);
+        if(bytes_read == -1)
+        {
+            fatal_error("Error reading file: %d\n", errno);    // 打印错误信息
+        }
+    }
+    memset(data + bytes_read, 0, PAGE_SIZE - bytes_read);    // 文件中还没有的新页
+    return true;
+}
+
+/**
+ * 获取页并固定
+ * 返回的页在调用 unpin_page 之前不会被淘汰
+ * 缓存未命中时持有分页器的锁读文件并验证校验和，读完之前其他线程不会在页表中看到这个帧；
+ * 内存映射模式不读文件，页的校验和只由 .check 验证
+ * @param pager 分页器
+ * @param page_num 页号
+ * @return 页
+ */
+void* get_page(Pager *pager, uint32_t page_num)
+{
+    if(page_num >= TABLE_MAX_PAGES)
+    {
+        fatal_error("Tried to fetch page number out of bounds. %u >= %u\n", page_num, TABLE_MAX_PAGES);    // 打印错误信息
+    }
+
+    pthread_mutex_lock(&(pager->mutex));
+    if(pager->map_base != NULL)
+    {
+        // 内存映射模式：直接返回映射中的地址，不需要读文件和复制
+        if(page_num >= pager->map_pages)
+        {
+            pager_map_grow(pager, page_num + 1);
+        }
+        if(page_num >= pager->num_pages)    // 更新页数
+        {
+            pager->num_pages = page_num + 1;
+        }
+
+        // 第一次访问这一块页时分配它们的页锁
+        PageLatch **chunk = &(pager->map_latches[page_num / MAP_LATCH_CHUNK_PAGES]);
+        if(*chunk == NULL)
+        {
+            *chunk = (PageLatch *)malloc(sizeof(PageLatch) * MAP_LATCH_CHUNK_PAGES);
+            for(uint32_t i = 0; i < MAP_LATCH_CHUNK_PAGES; i++)
+            {
+                page_latch_init(&((*chunk)[i]));
+            }
+        }
+        pthread_mutex_unlock(&(pager->mutex));
+        return pager->map_base + (size_t)page_num * PAGE_SIZE;
+    }
+
+    Frame *frame = pager_lookup(pager, page_num);
+    if(frame == NULL)
+    {
+        // 缓存未命中，从缓冲池中取一个帧
+        frame = pager_evict(pager);
+        if(!pager_read_page(pager, page_num, frame->data, pager->compress_buffer) || !page_checksum_valid(frame->data))
+        {
+            fatal_error("Page %u is corrupt.\n", page_num);    // 打印错误信息
+        }
+
+        frame->page_num = page_num;
+        frame->pin_count = 0;
+        frame->dirty = false;
+        uint32_t bucket = page_table_bucket(pager, page_num);
+        frame->hash_next = pager->page_table[bucket];
+        pager->page_table[bucket] = frame - pager->frames;
+    }
+    if(page_num >= pager->num_pages)    // 更新页数；收回的最后一页可能还在缓冲池里，再次分配时也要更新
+    {
+        pager->num_pages = page_num + 1;
+    }
+
+    frame->pin_count++;
+    frame->referenced = true;
+    pthread_mutex_unlock(&(pager->mutex));
+
+    return frame->data;
+}
+
+/**
+ * 取消固定页
+ * 每次 get_page 都要对应一次 unpin_page，固定计数归零后页才能被淘汰
+ * 写者修改页时加的排它锁在这里释放，所以修改页的代码要在取消固定之前完成所有修改；
+ * 读者用 page_unlatch_shared 取消固定
+ * @param pager 分页器
+ * @param page_num 页号
+ */
+void unpin_page(Pager *pager, uint32_t page_num)
+{
+    if(pager->map_base != NULL)
+    {
+        // 内存映射模式下页不会被淘汰，只需要释放排它锁
+        PageLatch *latch = pager_latch(pager, page_num, NULL);
+        if(latch->exclusive)
+        {
+            latch->exclusive = false;
+            pthread_rwlock_unlock(&(latch->lock));
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&(pager->mutex));
+    Frame *frame = pager_lookup(pager, page_num);
+    if(frame == NULL || frame->pin_count == 0)
+    {
+        fatal_error("Tried to unpin page %u that is not pinned\n", page_num);
+    }
+
+    frame->pin_count--;
+    if(frame->latch.exclusive)
+    {
+        frame->latch.exclusive = false;
+        pthread_rwlock_unlock(&(frame->latch.lock));
+    }
+    pthread_mutex_unlock(&(pager->mutex));
+}
+
+/**
+ * 标记页已被修改
+ * 修改页之前调用，只有被标记的页才会在淘汰或提交时写到预写日志；显式事务中还会先保存页原来的内容
+ * 同时对页加排它锁，等正在读这个页的读者离开；排它锁在下一次 unpin_page 时释放
+ * 等待页锁时不能持有分页器的锁，否则持有共享锁的读者固定下一个页时会死锁
+ * @param pager 分页器
+ * @param page_num 页号，必须已经被固定
+ */
+void pager_mark_dirty(Pager *pager, uint32_t page_num)
+{
+    pthread_mutex_lock(&(pager->mutex));
+    void *page = NULL;
+    bool save = pager->in_transaction && page_num < pager->transaction_num_pages;    // 事务之前就有的页要能恢复
+    if(pager->map_base != NULL)
+    {
+        if(save)
+        {
+            undo_save(pager, page_num, pager->map_base + (size_t)page_num * PAGE_SIZE);
+        }
+        if(!pager->map_dirty[page_num])
+        {
+            if(pager->map_num_dirty == pager->map_dirty_capacity)
+            {
+                pager->map_dirty_capacity = pager->map_dirty_capacity ? pager->map_dirty_capacity * 2 : 64;
+                pager->map_dirty_pages = (uint32_t *)realloc(pager->map_dirty_pages, sizeof(uint32_t) * pager->map_dirty_capacity);
+            }
+            pager->map_dirty[page_num] = 1;
+            pager->map_dirty_pages[pager->map_num_dirty++] = page_num;
+        }
+    }
+    else
+    {
+        Frame *frame = pager_lookup(pager, page_num);
+        if(frame == NULL || frame->pin_count == 0)
+        {
+            fatal_error("Tried to modify page %u that is not pinned\n", page_num);
+        }
+        if(save)
+        {
+            undo_save(pager, page_num, frame->data);
+        }
+        frame->dirty = true;
+        page = frame->data;
+    }
+    pthread_mutex_unlock(&(pager->mutex));
+
+    PageLatch *latch = pager_latch(pager, page_num, page);
+    if(!latch->exclusive)
+    {
+        pthread_rwlock_wrlock(&(latch->lock));
+        latch->exclusive = true;
+    }
+}
+
+/**
+ * 初始化页锁
+ * 使用写者优先的读写锁：读者只用 trylock 等待子节点，写者排队时新的读者让路，写者不会饿死
+ * @param latch 页锁
+ */
+void page_latch_init(PageLatch *latch)
+{
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&(latch->lock), &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+    latch->exclusive = false;
+}
+
+/**
+ * 获取页的页锁
+ * 缓冲池模式下页锁在帧里，由固定的页的地址算出帧；内存映射模式下在按块分配的页锁数组里
+ * @param pager 分页器
+ * @param page_num 页号，必须已经被固定
+ * @param page 缓冲池模式下页的地址，内存映射模式下不使用
+ * @return 页锁
+ */
+PageLatch* pager_latch(Pager *pager, uint32_t page_num, void *page)
+{
+    if(pager->map_base != NULL)
+    {
+        return &(pager->map_latches[page_num / MAP_LATCH_CHUNK_PAGES][page_num % MAP_LATCH_CHUNK_PAGES]);
+    }
+
+    return &(pager->frames[(page - pager->frame_data) / PAGE_SIZE].latch);
+}
+
+/**
+ * 固定页并加共享锁
+ * 调用者不能持有其他页锁：这里会一直等到写者释放排它锁
+ * @param pager 分页器
+ * @param page_num 页号
+ * @return 页
+ */
+void* page_latch_shared(Pager *pager, uint32_t page_num)
+{
+    void *page = get_page(pager, page_num);
+    pthread_rwlock_rdlock(&(pager_latch(pager, page_num, page)->lock));
+
+    return page;
+}
+
+/**
+ * 锁耦合：锁住下一个页再释放当前页
+ * 沿B+树下降到子节点、沿叶子节点链表前进都用它。下一个页正被写者修改时不能持有当前页的锁等待
+ * （写者可能接着要修改当前页），这时先释放当前页，等写者释放下一个页以后返回NULL，调用者从根节点重新查找
+ * @param pager 分页器
+ * @param page_num 当前页号，调用者持有它的共享锁
+ * @param next_page_num 下一个页号
+ * @return 加了共享锁的下一个页；需要重新查找时返回NULL，这时两个页都没有锁
+ */
+void* page_latch_next(Pager *pager, uint32_t page_num, uint32_t next_page_num)
+{
+    void *next_page = get_page(pager, next_page_num);
+    PageLatch *latch = pager_latch(pager, next_page_num, next_page);
+    if(pthread_rwlock_tryrdlock(&(latch->lock)) == 0)
+    {
+        page_unlatch_shared(pager, page_num);
+        return next_page;
+    }
+
+    page_unlatch_shared(pager, page_num);
+    pthread_rwlock_rdlock(&(latch->lock));    // 不持有其他页锁时才等待
+    page_unlatch_shared(pager, next_page_num);
+    return NULL;
+}
+
+/**
+ * 释放共享锁并取消固定
+ * @param pager 分页器
+ * @param page_num 页号
+ */
+void page_unlatch_shared(Pager *pager, uint32_t page_num)
+{
+    if(pager->map_base != NULL)
+    {
+        pthread_rwlock_unlock(&(pager_latch(pager, page_num, NULL)->lock));
+        return;
+    }
+
+    pthread_mutex_lock(&(pager->mutex));
+    Frame *frame = pager_lookup(pager, page_num);
+    if(frame == NULL || frame->pin_count == 0)
+    {
+        fatal_error("Tried to unpin page %u that is not pinned\n", page_num);
+    }
+    pthread_rwlock_unlock(&(frame->latch.lock));
+    frame->pin_count--;
+    pthread_mutex_unlock(&(pager->mutex));
+}
+
+/**
+ * 关闭数据库
+ * @param database 数据库
+ */
+void db_close(Database *database)
+{
+    Pager *pager = database->pager;
+
+    // 没有查询了，删掉所有待清除的行；提交剩下的脏页，再通过检查点把日志写回数据库文件，正常关闭后不再需要日志
+    database_purge_deleted(database);
+    database_fence_pages(database);
+    database_release_pages(database);
+    pager_commit(pager);
+    pager_checkpoint(pager);
+    close(pager->wal_fd);
+    unlink(pager->wal_filename);
+
+    if(pager->map_base != NULL)
+    {
+        munmap(pager->map_base, pager->map_reserved);
+        free(pager->map_dirty);
+        free(pager->map_dirty_pages);
+        for(size_t i = 0; i < MMAP_RESERVE_BYTES / PAGE_SIZE / MAP_LATCH_CHUNK_PAGES; i++)
+        {
+            free(pager->map_latches[i]);
+        }
+        free(pager->map_latches);
+    }
+
+    // 关闭文件描述符
+    int result = close(pager->file_descriptor);
+    if(result == -1)
+    {
+        fatal_error("Error closing db file.\n");
+    }
+
+    // 释放日志索引、缓冲池、分页器和表的内存空间
+    free(pager->wal_index_pages);
+    free(pager->wal_index_frames);
+    free(pager->wal_filename);
+    free(pager->filename);
+    free(pager->compress_header);
+    free(pager->slots);
+    free(pager->compress_buffer);
+    free(pager->undo_pages);
+    free(pager->undo_images);
+    free(pager->taken_pages);
+    free(pager->page_table);
+    free(pager->frame_data);
+    free(pager->frames);
+    free(pager);
+    for(uint32_t i = 0; i < database->num_tables; i++)
+    {
+        version_store_free(&(database->tables[i]->versions));
+        free(database->tables[i]->deleted_keys);
+        free(database->tables[i]);
+    }
+    free(database->tables);
+    for(uint32_t i = 0; i < database->num_free_batches; i++)
+    {
+        free(database->free_batches[i].page_nums);
+        free(database->free_batches[i].guards);
+    }
+    free(database->free_batches);
+    free(database->freed_pages);
+    free(database->purge_batches);
+    free(database->purge_pages);
+    close_worker_pool(database->scan_pool);
+    pthread_rwlock_destroy(&(database->vacuum_lock));
+    pthread_mutex_destroy(&(database->writer_mutex));
+    free(database);
+}
+
+/**
+ * 创建输入缓冲区
+ * @param fd 读取的文件描述符
+ * @param framed 语句是否用长度前缀分帧
+ * @return 输入缓冲区指针
+ */
+InputBuffer *new_input_buffer(int fd, bool framed)
+{
+    InputBuffer *input_buffer = (InputBuffer *)malloc(sizeof(InputBuffer));   // 分配输入缓冲区的内存空间
+    input_buffer->buffer = NULL;        // 初始化缓冲区指针为空
+    input_buffer->buffer_length = 0;    // 初始化缓冲区长度为0
+    input_buffer->input_length = 0;     // 初始化输入长度为0
+    input_buffer->read_buffer = (char *)malloc(INPUT_BUFFER_SIZE);    // 分配读缓冲区
+    input_buffer->read_capacity = INPUT_BUFFER_SIZE;
+    input_buffer->read_start = 0;
+    input_buffer->read_end = 0;
+    input_buffer->framed = framed;
+    input_buffer->fd = fd;
+    input_buffer->closed = false;
+    input_buffer->too_long = false;
+
+    return input_buffer;                // 返回输入缓冲区指针
+}
+
+/**
+ * 打印提示符
+ * @param output 输出缓冲区
+ */
+void print_prompt(OutputBuffer *output)
+{
+    output_write(output, "db > ", 5);
+}
+
+/**
+ * 读取一条语句
+ * 读缓冲区中没有完整的语句时才调用 read
+ * @param input_buffer 输入缓冲区
+ * @return 是否读到了语句，输入结束时返回false
+ */
+bool read_input(InputBuffer *input_buffer)
+{
+    while(!input_next_statement(input_buffer))
+    {
+        if(input_buffer->closed)
+        {
+            return false;
+        }
+        input_fill(input_buffer);
+    }
+
+    return true;
+}
+
+/**
+ * 从读缓冲区中取出一条完整的语句
+ * 切出一行（或者分帧模式下的一帧），复制到 buffer 中
+ * @param input_buffer 输入缓冲区
+ * @return 是否取出了语句，读缓冲区中没有完整的语句时返回false
+ */
+bool input_next_statement(InputBuffer *input_buffer)
+{
+    size_t offset;
+    size_t length;
+    size_t consumed;
+    if(!input_find_statement(input_buffer, &offset, &length, &consumed))
+    {
+        return false;
+    }
+    char *statement = input_buffer->read_buffer + input_buffer->read_start + offset;
+
+    if(input_buffer->buffer_length < length + 1)
+    {
+        input_buffer->buffer_length = length + 1;
+        input_buffer->buffer = realloc(input_buffer->buffer, input_buffer->buffer_length);
+        if(input_buffer->buffer == NULL)
+        {
+            fatal_error("Unable to allocate input buffer\n");
+        }
+    }
+    memcpy(input_buffer->buffer, statement, length);
+    input_buffer->buffer[length] = 0;    // 在输入缓冲区末尾添加字符串结束符
+    input_buffer->input_length = length;    // 计算输入长度
+    input_buffer->read_start += consumed;
+
+    return true;
+}
+
+/**
+ * 在读缓冲区中查找完整的语句
+ * 下一条语句超过 MAX_STATEMENT_LENGTH 时标记 too_long 并结束输入，不再读取这条语句剩下的部分
+ * @param input_buffer 输入缓冲区
+ * @param offset 返回语句文本相对于未处理数据开头的偏移（分帧模式下跳过帧头）
+ * @param length 返回语句文本的长度
+ * @param consumed 返回这条语句占用的字节数
+ * @return 是否有完整的语句
+ */
+bool input_find_statement(InputBuffer *input_buffer, size_t *offset, size_t *length, size_t *consumed)
+{
+    char *statement = input_buffer->read_buffer + input_buffer->read_start;
+    size_t available = input_buffer->read_end - input_buffer->read_start;
+    if(input_buffer->framed)
+    {
+        if(available < FRAME_HEADER_SIZE)
+        {
+            return false;
+        }
+        *length = frame_header_decode((uint8_t *)statement);
+        if(*length >= MAX_STATEMENT_LENGTH)
+        {
+            input_buffer->too_long = true;
+            input_buffer->closed = true;
+            return false;
+        }
+        if(available < FRAME_HEADER_SIZE + *length)
+        {
+            return false;
+        }
+        *offset = FRAME_HEADER_SIZE;
+        *consumed = FRAME_HEADER_SIZE + *length;
+        return true;
+    }
+
+    *offset = 0;
+    char *newline = memchr(statement, '\n', available);
+    if(newline != NULL)
+    {
+        *length = newline - statement;
+        *consumed = *length + 1;
+        return true;
+    }
+    if(available >= MAX_STATEMENT_LENGTH)
+    {
+        input_buffer->too_long = true;
+        input_buffer->closed = true;
+        return false;
+    }
+    if(input_buffer->closed && available > 0)
+    {
+        *length = available;    // 最后一行没有换行符
+        *consumed = *length;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * 读缓冲区中是否有完整的语句
+ * 服务器只把有完整语句的连接交给工作线程
+ * @param input_buffer 输入缓冲区
+ * @return 是否有完整的语句
+ */
+bool input_has_statement(InputBuffer *input_buffer)
+{
+    size_t offset;
+    size_t length;
+    size_t consumed;
+    return input_find_statement(input_buffer, &offset, &length, &consumed);
+}
+
+/**
+ * 读取更多数据到读缓冲区
+ * 先把还没有处理的数据移到读缓冲区开头，读缓冲区放满了还不够一条语句时加倍，语句长度有上限，所以读缓冲区的大小也有上限
+ * 非阻塞的套接字没有数据时直接返回，对端关闭、出错或者分配不到内存时标记输入结束
+ * @param input_buffer 输入缓冲区
+ * @return 是否读到了数据
+ */
+bool input_fill(InputBuffer *input_buffer)
+{
+    size_t available = input_buffer->read_end - input_buffer->read_start;
+    memmove(input_buffer->read_buffer, input_buffer->read_buffer + input_buffer->read_start, available);
+    input_buffer->read_start = 0;
+    input_buffer->read_end = available;
+    if(available == input_buffer->read_capacity)
+    {
+        char *read_buffer = realloc(input_buffer->read_buffer, input_buffer->read_capacity * 2);
+        if(read_buffer == NULL)
+        {
+            input_buffer->closed = true;    // 服务器只关闭这个连接
+            return false;
+        }
+        input_buffer->read_buffer = read_buffer;
+        input_buffer->read_capacity *= 2;
+    }
+
+    ssize_t bytes_read;
+    do
+    {
+        bytes_read = read(input_buffer->fd, input_buffer->read_buffer + available, input_buffer->read_capacity - available);
+    } while(bytes_read < 0 && errno == EINTR);
+
+    if(bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return false;
+    }
+    if(bytes_read <= 0)
+    {
+        input_buffer->closed = true;
+        return false;
+    }
+    input_buffer->read_end += bytes_read;
+
+    return true;
+}
+
+/**
+ * 写入帧头
+ * @param header 帧头
+ * @param length 帧的长度
+ */
+void frame_header_encode(uint8_t *header, uint32_t length)
+{
+    header[0] = length >> 24;
+    header[1] = length >> 16;
+    header[2] = length >> 8;
+    header[3] = length;
+}
+
+/**
+ * 读取帧头
+ * @param header 帧头
+ * @return 帧的长度
+ */
+uint32_t frame_header_decode(const uint8_t *header)
+{
+    return ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | header[3];
+}
+
+/**
+ * 是否还有待处理的输入
+ * 用于组提交和合并输出：后面还有语句等着执行时，先不做 fdatasync，也不写出结果
+ * @param input_buffer 输入缓冲区
+ * @return 读缓冲区或者标准输入中是否还有数据
+ */
+bool input_pending(InputBuffer *input_buffer)
+{
+    if(input_buffer->read_start < input_buffer->read_end)
+    {
+        return true;
+    }
+
+    struct pollfd fds;
+    fds.fd = input_buffer->fd;
+    fds.events = POLLIN;
+    fds.revents = 0;
+
+    return poll(&fds, 1, 0) > 0 && (fds.revents & POLLIN);
+}
+
+/**
+ * 关闭输入缓冲区
+ * @param input_buffer 输入缓冲区
+ */
+void close_input_buffer(InputBuffer *input_buffer)
+{
+    free(input_buffer->buffer);    // 释放输入缓冲区的内存空间
+    free(input_buffer->read_buffer);    // 释放读缓冲区的内存空间
+    free(input_buffer);    // 释放输入缓冲区结构体的内存空间
+}
+
+/**
+ * 创建输出缓冲区
+ * @param fd 写出的文件描述符
+ * @param framed 结果是否用长度前缀分帧
+ * @return 输出缓冲区指针
+ */
+OutputBuffer *new_output_buffer(int fd, bool framed)
+{
+    OutputBuffer *output = (OutputBuffer *)malloc(sizeof(OutputBuffer));    // 分配输出缓冲区的内存空间
+    output->buffer = (char *)malloc(OUTPUT_BUFFER_SIZE);    // 分配缓冲区
+    output->length = 0;    // 初始化已写入的长度为0
+    output->capacity = OUTPUT_BUFFER_SIZE;
+    output->fd = fd;
+    output->framed = framed;
+    output->in_response = false;
+    output->response_start = 0;
+    output->failed = false;
+
+    return output;
+}
+
+/**
+ * 写入输出缓冲区
+ * @param output 输出缓冲区
+ * @param data 数据
+ * @param length 数据长度
+ */
+void output_write(OutputBuffer *output, const char *data, size_t length)
+{
+    output_reserve(output, length);
+    memcpy(output->buffer + output->length, data, length);
+    output->length += length;
+}
+
+/**
+ * 格式化写入输出缓冲区
+ * @param output 输出缓冲区
+ * @param format 格式
+ */
+void output_printf(OutputBuffer *output, const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(NULL, 0, format, arguments);
+    va_end(arguments);
+
+    output_reserve(output, length + 1);    // vsnprintf 会多写一个结束符
+    va_start(arguments, format);
+    vsnprintf(output->buffer + output->length, length + 1, format, arguments);
+    va_end(arguments);
+    output->length += length;
+}
+
+/**
+ * 把整数写入输出缓冲区
+ * 从低位到高位转换成十进制字符，代替 printf 的格式解析
+ * @param output 输出缓冲区
+ * @param value 整数
+ */
+void output_uint32(OutputBuffer *output, uint32_t value)
+{
+    output_uint64(output, value);
+}
+
+/**
+ * 把64位整数写入输出缓冲区
+ * @param output 输出缓冲区
+ * @param value 整数
+ */
+void output_uint64(OutputBuffer *output, uint64_t value)
+{
+    char digits[20];    // uint64 最多20位十进制数
+    uint32_t start = sizeof(digits);
+    do
+    {
+        digits[--start] = '0' + value % 10;
+        value /= 10;
+    } while(value > 0);
+
+    output_write(output, digits + start, sizeof(digits) - start);
+}
+
+/**
+ * 保证输出缓冲区有足够的空间
+ * 放不下时先把已经完整的内容写出，还放不下就扩大缓冲区
+ * @param output 输出缓冲区
+ * @param length 需要的字节数
+ */
+void output_reserve(OutputBuffer *output, size_t length)
+{
+    if(output->length + length <= output->capacity)
+    {
+        return;
+    }
+
+    output_flush(output);
+    if(output->length + length <= output->capacity)
+    {
+        return;
+    }
+    while(output->length + length > output->capacity)
+    {
+        output->capacity *= 2;
+    }
+    output->buffer = realloc(output->buffer, output->capacity);
+    if(output->buffer == NULL)
+    {
+        if(output == fatal_output)
+        {
+            fatal_output = NULL;    // 缓冲区已经不能用了，错误信息直接打印
+        }
+        fatal_error("Unable to allocate output buffer\n");
+    }
+}
+
+/**
+ * 开始一条语句的结果
+ * 分帧模式下先留出帧头的位置，结果结束时再填入长度
+ * @param output 输出缓冲区
+ */
+void output_begin_response(OutputBuffer *output)
+{
+    if(!output->framed)
+    {
+        return;
+    }
+
+    output_reserve(output, FRAME_HEADER_SIZE);
+    output->response_start = output->length;
+    output->length += FRAME_HEADER_SIZE;
+    output->in_response = true;
+}
+
+/**
+ * 结束一条语句的结果
+ * @param output 输出缓冲区
+ */
+void output_end_response(OutputBuffer *output)
+{
+    if(!output->in_response)
+    {
+        return;
+    }
+
+    frame_header_encode((uint8_t *)(output->buffer + output->response_start), output->length - output->response_start - FRAME_HEADER_SIZE);
+    output->in_response = false;
+}
+
+/**
+ * 把输出缓冲区写出
+ * 分帧模式下正在写的结果还没有长度，留在缓冲区中；非阻塞的套接字写满时，剩下的留到可写时再写
+ * @param output 输出缓冲区
+ */
+void output_flush(OutputBuffer *output)
+{
+    if(output->fd < 0)
+    {
+        return;    // 只在内存中累积，缓冲区放不下时扩大
+    }
+
+    size_t flush_length = output->in_response ? output->response_start : output->length;
+    size_t written = 0;
+    while(written < flush_length)
+    {
+        ssize_t bytes_written = write(output->fd, output->buffer + written, flush_length - written);
+        if(bytes_written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(bytes_written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if(bytes_written <= 0)
+        {
+            // 对端已经关闭，丢弃所有的输出
+            output->failed = true;
+            written = flush_length;
+            break;
+        }
+        written += bytes_written;
+    }
+
+    memmove(output->buffer, output->buffer + written, output->length - written);
+    output->length -= written;
+    if(output->in_response)
+    {
+        output->response_start -= written;
+    }
+}
+
+/**
+ * 关闭输出缓冲区
+ * @param output 输出缓冲区
+ */
+void close_output_buffer(OutputBuffer *output)
+{
+    output_flush(output);
+    free(output->buffer);    // 释放缓冲区的内存空间
+    free(output);    // 释放输出缓冲区结构体的内存空间
+}
+
+/**
+ * 打印错误信息并退出程序
+ * 有 fatal_output 时先写出缓冲区中已经执行完的语句的结果，错误信息也写到缓冲区里，这样不会排在结果前面；
+ * 分帧模式下正在执行的语句还没有写完的结果被丢弃，错误信息作为这条语句的结果单独成一帧
+ * @param format 格式
+ */
+_Noreturn void fatal_error(const char *format, ...)
+{
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;    // 多个线程同时出错时只有第一个写出错误信息
+    pthread_mutex_lock(&mutex);
+
+    char message[256];
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(message, sizeof(message), format, arguments);
+    va_end(arguments);
+
+    OutputBuffer *output = fatal_output;
+    fatal_output = NULL;    // 写出时再出错就直接打印
+    if(output == NULL)
+    {
+        printf("%s", message);
+        exit(EXIT_FAILURE);
+    }
+
+    if(output->in_response)
+    {
+        output->length = output->response_start;
+        output->in_response = false;
+    }
+    output_begin_response(output);
+    output_write(output, message, strlen(message));
+    output_end_response(output);
+    output_flush(output);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * 查找键所在位置的游标
+ * 如果键存在，游标指向该键所在的单元格；否则指向键应该插入的位置
+ * 返回的游标持有叶子节点的固定和共享锁，用完后需要调用 cursor_close
+ * @param key 键
+ * @return 游标
+ */
+Cursor *table_find(Table *table, uint32_t key)
+{
+    uint32_t root_page_num = table->root_page_num;
+    while(true)
+    {
+        void *root_node = page_latch_shared(table->pager, root_page_num);    // 获取根节点
+        Cursor *cursor;
+        if(get_node_type(root_node) == NODE_LEAF)
+        {
+            cursor = leaf_node_find(table, root_page_num, root_node, key);
+        }
+        else
+        {
+            cursor = internal_node_find(table, root_page_num, root_node, key);
+        }
+
+        if(cursor != NULL)
+        {
+            return cursor;
+        }
+        // 下降途中遇到正被写者修改的页，从根节点重新开始
+    }
+}
+
+/**
+ * 二分查找键所在的单元格
+ * @param node 叶子节点
+ * @param key 键
+ * @return 单元格号，找不到时返回第一个比键大的单元格位置
+ */
+uint32_t leaf_node_search(void *node, uint32_t key)
+{
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t min_index = 0;
+    uint32_t one_past_max_index = num_cells;
+    while(one_past_max_index != min_index)
+    {
+        uint32_t index = (min_index + one_past_max_index) / 2;
+        uint32_t key_at_index = *leaf_node_key(node, index);
+        if(key == key_at_index)
+        {
+            min_index = index;
+            break;
+        }
+        if(key < key_at_index)
+        {
+            one_past_max_index = index;
+        }
+        else
+        {
+            min_index = index + 1;
+        }
+    }
+
+    return min_index;
+}
+
+/**
+ * 在叶子节点中查找键
+ * 二分查找键所在的单元格，找不到时返回第一个比键大的单元格位置
+ * 键比节点中所有的键都大、并且还有下一个叶子节点时向右移动：写者分裂节点以后、更新父节点之前，
+ * 键可能已经移到了新的右兄弟节点中
+ * @param page_num 页号，调用者持有它的共享锁
+ * @param node 叶子节点
+ * @param key 键
+ * @return 游标，需要从根节点重新查找时返回NULL
+ */
+Cursor *leaf_node_find(Table *table, uint32_t page_num, void *node, uint32_t key)
+{
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t min_index = leaf_node_search(node, key);
+
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if(min_index == num_cells && next_page_num != INVALID_PAGE_NUM)
+    {
+        void *next_node = page_latch_next(table->pager, page_num, next_page_num);
+        if(next_node == NULL)
+        {
+            return NULL;
+        }
+        return leaf_node_find(table, next_page_num, next_node, key);
+    }
+
+    Cursor *cursor = (Cursor *)malloc(sizeof(Cursor));    // 分配游标内存空间
+    cursor->table = table;    // 设置表
+    cursor->page_num = page_num;    // 设置页号
+    cursor->node = node;    // 设置叶子节点
+    cursor->cell_num = min_index;    // 设置单元格号
+    cursor->end_of_table = false;    // 设置是否到表尾
+    cursor->latched = true;    // 游标持有叶子节点的共享锁
+    cursor->copy = NULL;    // 不是快照游标
+
+    return cursor;
+}
+
+/**
+ * 在内部节点中查找键
+ * 二分查找键所在的子节点，锁住子节点后释放当前节点，递归下降直到叶子节点
+ * @param page_num 页号，调用者持有它的共享锁
+ * @param node 内部节点
+ * @param key 键
+ * @return 游标，需要从根节点重新查找时返回NULL
+ */
+Cursor *internal_node_find(Table *table, uint32_t page_num, void *node, uint32_t key)
+{
+    uint32_t child_index = internal_node_find_child(node, key);
+    uint32_t child_num = *internal_node_child(node, child_index);
+
+    void *child = page_latch_next(table->pager, page_num, child_num);
+    if(child == NULL)
+    {
+        return NULL;
+    }
+    switch(get_node_type(child))
+    {
+        case NODE_LEAF:
+            return leaf_node_find(table, child_num, child, key);
+        case NODE_INTERNAL:
+        default:
+            return internal_node_find(table, child_num, child, key);
+    }
+}
+
+/**
+ * 处理一条输入
+ * 元命令、预处理语句和普通语句都在这里处理，结果写到输出缓冲区；交互模式和服务器模式共用
+ * @param input_buffer 输入缓冲区，保存要处理的语句
+ * @param database 数据库
+ * @param cache 语句缓存
+ * @param statement 语句
+ * @param output 输出缓冲区
+ * @return 是否继续，收到 .exit 时返回false
+ */
+bool process_input(InputBuffer *input_buffer, Database *database, StatementCache *cache, Statement *statement, OutputBuffer *output)
+{
+    output_begin_response(output);
+
+    if(input_buffer->buffer[0] == '.')  // 判断是否为元命令
+    {
+        // 元命令会导入、检查点或者遍历整棵树，和写者互斥
+        pthread_mutex_lock(&(database->writer_mutex));
+        MetaCommandResult meta_result = do_meta_command(input_buffer, database, cache, output);
+        pthread_mutex_unlock(&(database->writer_mutex));
+        switch(meta_result)
+        {
+            case (META_COMMAND_SUCCESS):
+                break;
+            case (META_COMMAND_EXIT):
+                return false;
+            case (META_COMMAND_UNRECOGNIZED_COMMAND):
+                output_printf(output, "Unrecognized command '%s'.\n", input_buffer->buffer);    // 打印错误信息
+                break;
+        }
+        output_end_response(output);
+        return true;
+    }
+
+    switch(prepare_cached(cache, input_buffer, database, statement))   // 判断语句类型
+    {
+        case (PREPARE_SUCCESS):
+        {
+            ExecuteResult result = execute_statement(statement, database, cache, output);    // 执行语句
+            switch(result)
+            {
+                case (EXECUTE_SUCCESS):
+                    output_printf(output, "Executed.\n");    // 打印执行成功信息
+                    break;
+                case (EXECUTE_TABLE_FULL):
+                    output_printf(output, "Error: Table full.\n");    // 打印错误信息
+                    break;
+                case (EXECUTE_DUPLICATE_KEY):
+                    output_printf(output, "Error: Duplicate key.\n");    // 打印错误信息
+                    break;
+                case (EXECUTE_BUSY):
+                    output_printf(output, "Error: Database is busy.\n");    // 打印错误信息
+                    break;
+                case (EXECUTE_NO_TRANSACTION):
+                    output_printf(output, "Error: No transaction is active.\n");    // 打印错误信息
+                    break;
+                case (EXECUTE_IN_TRANSACTION):
+                    output_printf(output, "Error: Transaction already active.\n");    // 打印错误信息
+                    break;
+                case (EXECUTE_NOT_ALLOWED_IN_TRANSACTION):
+                    output_printf(output, "Error: Not allowed inside a transaction.\n");    // 打印错误信息
+                    break;
+                case (EXECUTE_INDEX_EXISTS):
+                    output_printf(output, "Error: Index already exists.\n");    // 打印错误信息
+                    break;
+                case (EXECUTE_TABLE_EXISTS):
+                    output_printf(output, "Error: Table already exists.\n");    // 打印错误信息
+                    break;
+                case (EXECUTE_CATALOG_FULL):
+                    output_printf(output, "Error: Too many tables, a database has at most %u.\n", CATALOG_MAX_TABLES);    // 打印错误信息
+                    break;
+                case (EXECUTE_DELETE_PENDING):
+                    output_printf(output, "Error: Key was deleted but earlier queries can still see it.\n");    // 打印错误信息
+                    break;
+            }
+            break;
+        }
+        case (PREPARE_NEGATIVE_ID):
+            output_printf(output, "ID must be positive.\n");    // 打印错误信息
+            break;
+        case (PREPARE_SYNTAX_TOO_LONG):
+            output_printf(output, "String is too long.\n");    // 打印错误信息
+            break;
+        case (PREPARE_SYNTAX_ERROR):
+            output_printf(output, "Syntax error. Could not parse statement.\n");    // 打印错误信息
+            break;
+        case (PREPARE_UNRECOGNIZED_STATEMENT):
+            output_printf(output, "Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);    // 打印错误信息
+            break;
+        case (PREPARE_UNKNOWN_PREPARED):
+            output_printf(output, "Unknown prepared statement.\n");    // 打印错误信息
+            break;
+        case (PREPARE_UNKNOWN_TABLE):
+            output_printf(output, "Error: No such table.\n");    // 打印错误信息
+            break;
+        case (PREPARE_ROW_TOO_LARGE):
+            output_printf(output, "Error: Row is too large.\n");    // 打印错误信息
+            break;
+        case (PREPARE_TOO_MANY_COLUMNS):
+            output_printf(output, "Error: Too many columns, a table has at most %u.\n", MAX_TABLE_COLUMNS);    // 打印错误信息
+            break;
+        case (PREPARE_STORED):
+            output_printf(output, "Prepared.\n");    // 预处理语句只保存，不执行
+            break;
+    }
+
+    output_end_response(output);
+    return true;
+}
+
+/**
+ * 以服务器模式运行
+ * 在 Unix 域套接字和（或）本机的 TCP 端口上监听，协议和 --framed 模式相同：
+ * 每条语句是4字节大端序长度加语句文本，每条语句的结果也用同样的方式分帧返回
+ * 收到 SIGINT 或 SIGTERM 时关闭所有连接，正常关闭数据库
+ * @param database 数据库
+ * @param socket_path Unix 域套接字的路径，为NULL时不监听
+ * @param port TCP 端口，为0时不监听
+ * @param num_workers 工作线程数，为0时在事件循环的线程里执行语句
+ */
+void run_server(Database *database, const char *socket_path, uint32_t port, uint32_t num_workers)
+{
+    Server server;
+    server.database = database;
+    server.socket_path = socket_path;
+    server.unix_fd = -1;
+    server.tcp_fd = -1;
+    server.connections = NULL;
+    server.connections_capacity = 0;
+    server.num_workers = num_workers;
+    server.queue_head = NULL;
+    server.queue_tail = NULL;
+    server.finished = NULL;
+    server.stopping = false;
+    pthread_mutex_init(&(server.queue_mutex), NULL);
+    pthread_cond_init(&(server.queue_cond), NULL);
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(server.epoll_fd < 0 || server.event_fd < 0)
+    {
+        fatal_error("Error creating epoll instance: %d\n", errno);
+    }
+
+    signal(SIGPIPE, SIG_IGN);    // 客户端断开后写出失败时返回错误，不终止进程
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    server.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if(socket_path != NULL)
+    {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if(strlen(socket_path) >= sizeof(address.sun_path))
+        {
+            fatal_error("Socket path is too long.\n");
+        }
+        strcpy(address.sun_path, socket_path);
+
+        // 只删除上次没有正常退出时留下的套接字文件：不是套接字的文件不动，还有服务器在监听的套接字也不能抢走
+        struct stat status;
+        if(lstat(socket_path, &status) == 0)
+        {
+            bool in_use = !S_ISSOCK(status.st_mode);
+            if(!in_use)
+            {
+                int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                in_use = probe >= 0 && connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+                if(probe >= 0)
+                {
+                    close(probe);
+                }
+            }
+            if(in_use)
+            {
+                fatal_error("Address in use.\n");
+            }
+            unlink(socket_path);
+        }
+        server.unix_fd = server_listen(&server, AF_UNIX, (struct sockaddr *)&address, sizeof(address));
+    }
+    if(port != 0)
+    {
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);    // 只接受本机的连接
+        server.tcp_fd = server_listen(&server, AF_INET, (struct sockaddr *)&address, sizeof(address));
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = server.signal_fd;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.signal_fd, &event);
+    event.data.fd = server.event_fd;
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.event_fd, &event);
+
+    // 工作线程继承上面屏蔽的信号，SIGINT 和 SIGTERM 都由事件循环通过 signal_fd 接收
+    server.workers = (pthread_t *)malloc(sizeof(pthread_t) * (num_workers > 0 ? num_workers : 1));
+    for(uint32_t i = 0; i < num_workers; i++)
+    {
+        if(pthread_create(&(server.workers[i]), NULL, server_worker, &server) != 0)
+        {
+            fatal_error("Error creating worker thread\n");
+        }
+    }
+
+    printf("Listening.\n");    // 告诉启动服务器的脚本可以连接了
+    fflush(stdout);
+
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    bool stopping = false;
+    bool has_work = false;
+    while(!stopping)
+    {
+        // 有连接因为输出积压暂停了，这一轮不等待新事件
+        int num_events = epoll_wait(server.epoll_fd, events, SERVER_MAX_EVENTS, has_work ? 0 : -1);
+        if(num_events < 0 && errno != EINTR)
+        {
+            fatal_error("Error waiting for events: %d\n", errno);
+        }
+
+        for(int i = 0; i < num_events; i++)
+        {
+            int fd = events[i].data.fd;
+            if(fd == server.unix_fd || fd == server.tcp_fd)
+            {
+                server_accept(&server, fd);
+                continue;
+            }
+            if(fd == server.signal_fd)
+            {
+                stopping = true;
+                continue;
+            }
+            if(fd == server.event_fd)
+            {
+                // 取回工作线程执行完的连接，下面和其他连接一起同步、写出结果
+                uint64_t count;
+                if(read(server.event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                {
+                    fatal_error("Error reading event fd: %d\n", errno);
+                }
+                pthread_mutex_lock(&(server.queue_mutex));
+                Connection *finished = server.finished;
+                server.finished = NULL;
+                pthread_mutex_unlock(&(server.queue_mutex));
+                while(finished != NULL)
+                {
+                    finished->busy = false;
+                    finished = finished->next;
+                }
+                continue;
+            }
+
+            Connection *connection = server.connections[fd];
+            if(connection == NULL || connection->busy)
+            {
+                continue;
+            }
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                input_fill(connection->input_buffer);
+            }
+            if(events[i].events & EPOLLOUT)
+            {
+                output_flush(connection->output);
+            }
+        }
+
+        // 先执行所有连接收到的语句，再一起同步，最后写出结果，客户端收到结果时修改已经落盘
+        // 有工作线程时只把有完整语句的连接交给工作线程，执行完以后在后面的某一轮同步和写出
+        for(uint32_t fd = 0; fd < server.connections_capacity; fd++)
+        {
+            Connection *connection = server.connections[fd];
+            if(connection == NULL || connection->busy)
+            {
+                continue;
+            }
+            if(num_workers == 0)
+            {
+                connection_process(database, connection);
+            }
+            else if(!connection->closing && connection->output->length < OUTPUT_BUFFER_SIZE &&
+                (input_has_statement(connection->input_buffer) || connection->input_buffer->too_long))
+            {
+                server_dispatch(&server, connection);
+            }
+        }
+        pager_sync(database->pager);
+
+        has_work = false;
+        for(uint32_t fd = 0; fd < server.connections_capacity; fd++)
+        {
+            Connection *connection = server.connections[fd];
+            if(connection == NULL || connection->busy)
+            {
+                continue;
+            }
+
+            output_flush(connection->output);
+            bool done = connection->closing || connection->input_buffer->closed;
+            if(connection->output->failed || (done && !connection->stalled && connection->output->length == 0))
+            {
+                server_close(&server, connection);
+                continue;
+            }
+
+            if(connection->output->length >= OUTPUT_BUFFER_SIZE)
+            {
+                server_watch(&server, connection, EPOLLOUT);    // 客户端读得太慢，先不读新的语句
+            }
+            else
+            {
+                server_watch(&server, connection, (done ? 0 : EPOLLIN) | (connection->output->length > 0 ? EPOLLOUT : 0));
+                has_work = has_work || connection->stalled;
+            }
+        }
+    }
+
+    // 工作线程执行完队列中的连接后退出
+    pthread_mutex_lock(&(server.queue_mutex));
+    server.stopping = true;
+    pthread_cond_broadcast(&(server.queue_cond));
+    pthread_mutex_unlock(&(server.queue_mutex));
+    for(uint32_t i = 0; i < num_workers; i++)
+    {
+        pthread_join(server.workers[i], NULL);
+    }
+    free(server.workers);
+
+    for(uint32_t fd = 0; fd < server.connections_capacity; fd++)
+    {
+        if(server.connections[fd] != NULL)
+        {
+            server_close(&server, server.connections[fd]);
+        }
     }
-
-    int id = atoi(id_string);
-    if(id < 0)
+    free(server.connections);
+    if(server.unix_fd >= 0)
     {
-        return PREPARE_NEGATIVE_ID;
+        close(server.unix_fd);
+        unlink(socket_path);
     }
-    if(strlen(username) > COLUMN_USERNAME_SIZE || strlen(email) > COLUMN_EMAIL_SIZE)
+    if(server.tcp_fd >= 0)
     {
-        return PREPARE_SYNTAX_TOO_LONG;
+        close(server.tcp_fd);
     }
-
-    statement->row_to_insert.id = id;
-    strcpy(statement->row_to_insert.username, username);
-    strcpy(statement->row_to_insert.email, email);
-
-    return PREPARE_SUCCESS;
+    close(server.signal_fd);
+    close(server.event_fd);
+    close(server.epoll_fd);
+    db_close(database);
+    exit(EXIT_SUCCESS);
 }
 
 /**
- * 准备语句
- * @param input_buffer 输入缓冲区
- * @param statement 语句
- * @return 语句识别结果
+ * 创建监听套接字
+ * @param server 服务器
+ * @param domain 地址族
+ * @param address 监听地址
+ * @param address_length 地址长度
+ * @return 监听套接字描述符
  */
-PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement)
+int server_listen(Server *server, int domain, struct sockaddr *address, socklen_t address_length)
 {
-    if(strncmp(input_buffer->buffer, "insert", 6) == 0) // 因为insert语句会包含其他字符，所以只需要比较前6个字符
+    int fd = socket(domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
     {
-        return prepare_insert(input_buffer, statement);
+        fatal_error("Error creating socket: %d\n", errno);
     }
-    if(strcmp(input_buffer->buffer, "select") == 0)
+
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if(bind(fd, address, address_length) < 0 || listen(fd, SOMAXCONN) < 0)
     {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+        fatal_error("Error listening on socket: %d\n", errno);
     }
 
-    return PREPARE_UNRECOGNIZED_STATEMENT;
-}
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
 
-/**
- * 打印行
- * @param row 行
- */
-void print_row(Row *row)
-{
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+    return fd;
 }
 
 /**
- * 执行插入语句
- * @param statement 语句
- * @param table 表
- * @return 执行结果
+ * 接受新连接
+ * 监听套接字是非阻塞的，一直接受到没有等待的连接为止
+ * @param server 服务器
+ * @param listen_fd 监听套接字描述符
  */
-ExecuteResult execute_insert(Statement *statement, Table *table)
+void server_accept(Server *server, int listen_fd)
 {
-    void *node = get_page(table->pager, table->root_page_num);
-    if((*leaf_node_num_cells(node)) >= LEAF_NODE_MAX_CELLS)
+    while(true)
     {
-        return EXECUTE_TABLE_FULL;
-    }
-
-    Row *row_to_insert = &(statement->row_to_insert);
-    Cursor *cursor = table_end(table);
-
-    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0)
+        {
+            return;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
 
-    free(cursor);
+        if((uint32_t)fd >= server->connections_capacity)
+        {
+            uint32_t capacity = (server->connections_capacity == 0) ? 64 : server->connections_capacity;
+            while(capacity <= (uint32_t)fd)
+            {
+                capacity *= 2;
+            }
+            server->connections = realloc(server->connections, capacity * sizeof(Connection *));
+            if(server->connections == NULL)
+            {
+                fatal_error("Unable to allocate connections\n");
+            }
+            memset(server->connections + server->connections_capacity, 0, (capacity - server->connections_capacity) * sizeof(Connection *));
+            server->connections_capacity = capacity;
+        }
 
-    return EXECUTE_SUCCESS;
+        Connection *connection = (Connection *)malloc(sizeof(Connection));
+        connection->fd = fd;
+        connection->input_buffer = new_input_buffer(fd, true);
+        connection->output = new_output_buffer(fd, true);
+        connection->statement.rows_to_insert = NULL;
+        connection->statement.rows_capacity = 0;
+        connection->cache = new_statement_cache();
+        connection->events = 0;
+        connection->stalled = false;
+        connection->closing = false;
+        connection->busy = false;
+        connection->next = NULL;
+        server->connections[fd] = connection;
+        server_watch(server, connection, EPOLLIN);
+    }
 }
 
 /**
- * 执行查询语句
- * @param statement 语句
- * @param table 表
- * @return 执行结果
+ * 更新连接在 epoll 中关注的事件
+ * @param server 服务器
+ * @param connection 连接
+ * @param events 要关注的事件
  */
-ExecuteResult execute_select(Statement *statement, Table *table)
+void server_watch(Server *server, Connection *connection, uint32_t events)
 {
-    Cursor *cursor = table_start(table);
-
-    Row row;
-    while(cursor->end_of_table != true)
+    if(connection->events == events)
     {
-        deserialize_row(cursor_value(cursor), &row);
-        print_row(&row);
-        cursor_advance(cursor);
+        return;
     }
 
-    return EXECUTE_SUCCESS;
+    // 不关注任何事件时从 epoll 中移除，否则挂断的连接仍然会不停地报告 EPOLLHUP
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = connection->fd;
+    int operation = (events == 0) ? EPOLL_CTL_DEL : (connection->events == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    epoll_ctl(server->epoll_fd, operation, connection->fd, &event);
+    connection->events = events;
 }
 
 /**
- * 执行语句
- * @param statement 语句
- * @param table 表
- * @return 执行结果
+ * 关闭连接
+ * @param server 服务器
+ * @param connection 连接
  */
-ExecuteResult execute_statement(Statement *statement, Table *table)
+void server_close(Server *server, Connection *connection)
 {
-    switch(statement->type)
+    if(connection->cache->in_transaction)
     {
-        case STATEMENT_INSERT:
-            return execute_insert(statement, table);
-        case STATEMENT_SELECT:
-            return execute_select(statement, table);
+        transaction_rollback(server->database, connection->cache);    // 断开连接时回滚没有提交的事务
     }
-}
-
-/**
- * 打开数据库
- * @param filename 文件名
- * @return 表
- */
-Table* db_open(const char *filename)
-{
-    Pager *pager = pager_open(filename);    // 打开分页器
-
-    Table *table = (Table *)malloc(sizeof(Table));    // 分配表内存空间
-    table->pager = pager;    // 设置分页器
-    table->root_page_num = 0;    // 设置根节点页号
-
-    if(pager->num_pages == 0)
+    close(connection->fd);    // 关闭描述符时 epoll 自动移除它
+    server->connections[connection->fd] = NULL;
+    close_input_buffer(connection->input_buffer);
+    free(connection->output->buffer);
+    free(connection->output);
+    free(connection->statement.rows_to_insert);
+    for(uint32_t i = 0; i < PLAN_CACHE_SIZE; i++)
     {
-        // 新建空表
-        void *root_node = get_page(pager, 0);
-        initialize_leaf_node(root_node);
+        free(connection->cache->plans[i].text);
     }
-
-    return table;
+    for(uint32_t i = 0; i < connection->cache->num_prepared; i++)
+    {
+        free(connection->cache->prepared[i].name);
+        free(connection->cache->prepared[i].statement.rows_to_insert);
+    }
+    free(connection->cache->prepared);
+    free(connection->cache);
+    free(connection);
 }
 
 /**
- * 打开分页器
- * @param filename 文件名
- * @return 分页器
+ * 执行连接收到的完整语句
+ * 输出积压超过输出缓冲区的大小时暂停，等结果写出以后再继续
+ * @param database 数据库
+ * @param connection 连接
  */
-Pager* pager_open(const char *filename)
+void connection_process(Database *database, Connection *connection)
 {
-    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);    // 打开文件
-    if(fd == -1)
-    {
-        printf("Unable to open file\n");    // 打印错误信息
-        exit(EXIT_FAILURE);    // 退出程序
-    }
-
-    off_t file_length = lseek(fd, 0, SEEK_END);    // 获取文件长度
-
-    Pager *pager = (Pager *)malloc(sizeof(Pager));    // 分配分页器内存空间
-    pager->file_descriptor = fd;    // 设置文件描述符
-    pager->file_length = file_length;    // 设置文件长度
-    pager->num_pages = (file_length / PAGE_SIZE);    // 设置页数
-    if(file_length % PAGE_SIZE != 0)
+    connection->stalled = false;
+    while(!connection->closing)
     {
-        printf("Db file is not a whole number of pages. Corrupt file.\n");    // 打印错误信息
-        exit(EXIT_FAILURE);    // 退出程序
-    }
-
-    for(uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
-    {
-        pager->pages[i] = NULL;
+        if(connection->output->length >= OUTPUT_BUFFER_SIZE)
+        {
+            connection->stalled = true;
+            return;
+        }
+        if(!input_next_statement(connection->input_buffer))
+        {
+            if(connection->input_buffer->too_long)
+            {
+                // 回复错误以后关闭这个连接，语句剩下的部分不再读取
+                output_begin_response(connection->output);
+                output_printf(connection->output, "Error: Statement too long.\n");
+                output_end_response(connection->output);
+                connection->closing = true;
+            }
+            return;
+        }
+        if(!process_input(connection->input_buffer, database, connection->cache, &(connection->statement), connection->output))
+        {
+            output_end_response(connection->output);    // .exit 的结果是空帧
+            connection->closing = true;
+        }
     }
-
-    return pager;
 }
 
 /**
- * 刷新分页器, 将页中的数据刷新到文件中
- * @param pager 分页器
- * @param page_num 页号
+ * 把连接交给工作线程执行
+ * 执行期间连接不在 epoll 中，事件循环不会读写它的缓冲区
+ * @param server 服务器
+ * @param connection 连接
  */
-void pager_flush(Pager *pager, uint32_t page_num)
+void server_dispatch(Server *server, Connection *connection)
 {
-    if(pager->pages[page_num] == NULL)
-    {
-        printf("Tried to flush null page\n");
-        exit(EXIT_FAILURE);
-    }
+    connection->busy = true;
+    server_watch(server, connection, 0);
 
-    off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-    if(offset == -1)
+    pthread_mutex_lock(&(server->queue_mutex));
+    connection->next = NULL;
+    if(server->queue_tail == NULL)
     {
-        printf("Error seeking: %d\n", errno);
-        exit(EXIT_FAILURE);
+        server->queue_head = connection;
     }
-
-    ssize_t bytes_written = write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-    if(bytes_written == -1)
+    else
     {
-        printf("Error writing: %d\n", errno);
-        exit(EXIT_FAILURE);
+        server->queue_tail->next = connection;
     }
+    server->queue_tail = connection;
+    pthread_cond_signal(&(server->queue_cond));
+    pthread_mutex_unlock(&(server->queue_mutex));
 }
 
 /**
- * 获取页
- * @param pager 分页器
- * @param page_num 页号
- * @return 页
+ * 工作线程
+ * 从任务队列中取出连接，执行它收到的完整语句，放进完成队列后通知事件循环
+ * @param argument 服务器
+ * @return NULL
  */
-void* get_page(Pager *pager, uint32_t page_num)
+void* server_worker(void *argument)
 {
-    if(page_num > TABLE_MAX_PAGES)
-    {
-        printf("Tried to fetch page number out of bounds. %d > %d\n", page_num, TABLE_MAX_PAGES);    // 打印错误信息
-        exit(EXIT_FAILURE);    // 退出程序
-    }
+    Server *server = (Server *)argument;
 
-    if(pager->pages[page_num] == NULL)
+    pthread_mutex_lock(&(server->queue_mutex));
+    while(true)
     {
-        // 缓存未命中，分配内存空间
-        void *page = malloc(PAGE_SIZE);    // 分配页内存空间
-        uint32_t num_pages = pager->file_length / PAGE_SIZE;    // 计算页数
-
-        // 为了保证文件长度是PAGE_SIZE的整数倍
-        if(pager->file_length % PAGE_SIZE)
+        while(server->queue_head == NULL && !server->stopping)
         {
-            num_pages += 1;
+            pthread_cond_wait(&(server->queue_cond), &(server->queue_mutex));
         }
-
-        if(page_num <= num_pages)
+        Connection *connection = server->queue_head;
+        if(connection == NULL)
         {
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);    // 设置文件偏移量
-            ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);    // 读取文件
-            if(bytes_read == -1)
-            {
-                printf("Error reading file: %d\n", errno);    // 打印错误信息
-                exit(EXIT_FAILURE);    // 退出程序
-            }
+            break;    // 服务器停止，队列已经空了
+        }
+        server->queue_head = connection->next;
+        if(server->queue_head == NULL)
+        {
+            server->queue_tail = NULL;
         }
+        pthread_mutex_unlock(&(server->queue_mutex));
 
-        pager->pages[page_num] = page;
+        connection_process(server->database, connection);
 
-        if(page_num >= pager->num_pages)    // 更新页数
+        pthread_mutex_lock(&(server->queue_mutex));
+        connection->next = server->finished;
+        server->finished = connection;
+        uint64_t one = 1;
+        if(write(server->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
         {
-            pager->num_pages = page_num + 1;
+            fatal_error("Error writing event fd: %d\n", errno);
         }
     }
+    pthread_mutex_unlock(&(server->queue_mutex));
 
-    return pager->pages[page_num];
+    return NULL;
 }
 
 /**
- * 关闭数据库
- * @param table 表
+ * 连接服务器
+ * @param socket_path Unix 域套接字的路径，为NULL时连接本机的TCP端口
+ * @param port TCP 端口
+ * @return 套接字描述符，连接失败时返回-1
  */
-void db_close(Table *table)
+int client_connect(const char *socket_path, uint32_t port)
 {
-    Pager *pager = table->pager;
-
-    // 刷新并释放所有完整的页
-    for(uint32_t i = 0; i < pager->num_pages; i++)
+    int fd;
+    int result;
+    if(socket_path != NULL)
     {
-        if(pager->pages[i] == NULL)
-        {
-            continue;
-        }
-
-        pager_flush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        result = connect(fd, (struct sockaddr *)&address, sizeof(address));
     }
-
-    // 关闭文件描述符
-    int result = close(pager->file_descriptor);
-    if(result == -1)
+    else
     {
-        printf("Error closing db file.\n");
-        exit(EXIT_FAILURE);
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        result = connect(fd, (struct sockaddr *)&address, sizeof(address));
     }
 
-    // 释放所有页的内存空间
-    for(uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
+    if(fd >= 0 && result < 0)
     {
-        void *page = pager->pages[i];
-        if(page)
-        {
-            free(page);
-            pager->pages[i] = NULL;
-        }
+        close(fd);
+        return -1;
     }
 
-    // 释放分页器和表的内存空间
-    free(pager);
-    free(table);
+    return fd;
 }
 
 /**
- * 创建输入缓冲区
- * @return 输入缓冲区指针
+ * 向服务器发送一条语句
+ * @param fd 套接字描述符
+ * @param statement 语句
+ * @param length 语句长度
+ * @return 是否发送成功
  */
-InputBuffer *new_input_buffer()
+bool client_send(int fd, const char *statement, uint32_t length)
 {
-    InputBuffer *input_buffer = (InputBuffer *)malloc(sizeof(InputBuffer));   // 分配输入缓冲区的内存空间
-    input_buffer->buffer = NULL;        // 初始化缓冲区指针为空
-    input_buffer->buffer_length = 0;    // 初始化缓冲区长度为0
-    input_buffer->input_length = 0;     // 初始化输入长度为0
+    uint8_t header[FRAME_HEADER_SIZE];
+    frame_header_encode(header, length);
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = FRAME_HEADER_SIZE;
+    iov[1].iov_base = (void *)statement;
+    iov[1].iov_len = length;
 
-    return input_buffer;                // 返回输入缓冲区指针
-}
+    ssize_t bytes_written = writev(fd, iov, 2);
+    if(bytes_written < 0)
+    {
+        return false;
+    }
+    if((size_t)bytes_written < FRAME_HEADER_SIZE)
+    {
+        return write_fully(fd, header + bytes_written, FRAME_HEADER_SIZE - bytes_written) && write_fully(fd, statement, length);
+    }
 
-/**
- * 打印提示符
- */
-void print_prompt()
-{
-    printf("db > ");
+    return write_fully(fd, statement + (bytes_written - FRAME_HEADER_SIZE), length - (bytes_written - FRAME_HEADER_SIZE));
 }
 
 /**
- * 读取输入
- * @param input_buffer 输入缓冲区
+ * 接收一条语句的结果
+ * @param fd 套接字描述符
+ * @param response 结果缓冲区，不够时扩大
+ * @param length 结果长度
+ * @param capacity 结果缓冲区的大小
+ * @return 是否接收成功，服务器关闭连接时返回false
  */
-void read_input(InputBuffer *input_buffer)
+bool client_receive(int fd, char **response, uint32_t *length, uint32_t *capacity)
 {
-    ssize_t bytes_read = getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);    // 从标准输入读取一行输入，并将结果存储在输入缓冲区中
+    uint8_t header[FRAME_HEADER_SIZE];
+    if(!read_fully(fd, header, FRAME_HEADER_SIZE))
+    {
+        return false;
+    }
 
-    if(bytes_read <= 0)
+    *length = frame_header_decode(header);
+    if(*capacity < *length)
     {
-        printf("Error reading input\n");    // 如果读取失败，则打印错误信息
-        exit(EXIT_FAILURE);    // 退出程序
+        *capacity = *length;
+        *response = realloc(*response, *capacity);
+        if(*response == NULL)
+        {
+            fatal_error("Unable to allocate response buffer\n");
+        }
     }
 
-    input_buffer->input_length = bytes_read - 1;    // 计算输入长度
-    input_buffer->buffer[bytes_read - 1] = 0;    // 在输入缓冲区末尾添加字符串结束符
+    return read_fully(fd, *response, *length);
 }
 
 /**
- * 关闭输入缓冲区
- * @param input_buffer 输入缓冲区
+ * 写出全部数据
+ * @param fd 文件描述符
+ * @param data 数据
+ * @param length 数据长度
+ * @return 是否写出成功
  */
-void close_input_buffer(InputBuffer *input_buffer)
+bool write_fully(int fd, const void *data, size_t length)
 {
-    free(input_buffer->buffer);    // 释放输入缓冲区的内存空间
-    free(input_buffer);    // 释放输入缓冲区结构体的内存空间
+    size_t written = 0;
+    while(written < length)
+    {
+        ssize_t bytes_written = write(fd, (const char *)data + written, length - written);
+        if(bytes_written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(bytes_written <= 0)
+        {
+            return false;
+        }
+        written += bytes_written;
+    }
+
+    return true;
 }
 
 /**
- * 获取表的起始游标
- * @param table 表
- * @return 游标
+ * 读取指定长度的数据
+ * @param fd 文件描述符
+ * @param data 数据缓冲区
+ * @param length 数据长度
+ * @return 是否读够了数据
  */
-Cursor *table_start(Table *table)
+bool read_fully(int fd, void *data, size_t length)
 {
-    Cursor *cursor = (Cursor *)malloc(sizeof(Cursor));    // 分配游标内存空间
-    cursor->table = table;    // 设置表
-    cursor->page_num = 0;    // 设置页号
-    cursor->cell_num = 0;    // 设置单元格号
-    
-    void *root_node = get_page(table->pager, table->root_page_num);    // 获取根节点
-    uint32_t num_cells = *leaf_node_num_cells(root_node);    // 获取叶子节点中单元格数量
-    cursor->end_of_table = (num_cells == 0);    // 设置是否到表尾
+    size_t bytes_read_total = 0;
+    while(bytes_read_total < length)
+    {
+        ssize_t bytes_read = read(fd, (char *)data + bytes_read_total, length - bytes_read_total);
+        if(bytes_read < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(bytes_read <= 0)
+        {
+            return false;
+        }
+        bytes_read_total += bytes_read;
+    }
 
-    return cursor;    // 返回游标
+    return true;
 }
 
 /**
- * 获取表的结束游标
- * @param table 表
- * @return 游标
+ * 以客户端模式运行
+ * 从标准输入逐行读取语句发给服务器，把结果原样打印出来；界面和本地的交互模式一样
+ * @param socket_path Unix 域套接字的路径，为NULL时连接本机的TCP端口
+ * @param port TCP 端口
+ * @param batch 是否为批处理模式（不打印提示符）
  */
-Cursor *table_end(Table *table)
+void run_client(const char *socket_path, uint32_t port, bool batch)
 {
-    Cursor *cursor = (Cursor *)malloc(sizeof(Cursor));    // 分配游标内存空间
-    cursor->table = table;    // 设置表
-    cursor->page_num = table->root_page_num;    // 设置页号
+    int fd = client_connect(socket_path, port);
+    if(fd < 0)
+    {
+        fatal_error("Unable to connect to server: %d\n", errno);
+    }
+    signal(SIGPIPE, SIG_IGN);
 
-    void *root_node = get_page(table->pager, table->root_page_num);    // 获取根节点
-    uint32_t num_cells = *leaf_node_num_cells(root_node);    // 获取叶子节点中单元格数量
-    cursor->cell_num = num_cells;    // 设置单元格号
-    cursor->end_of_table = true;    // 设置是否到表尾
+    InputBuffer *input_buffer = new_input_buffer(STDIN_FILENO, false);
+    OutputBuffer *output = new_output_buffer(STDOUT_FILENO, false);
+    char *response = NULL;
+    uint32_t response_length = 0;
+    uint32_t response_capacity = 0;
+    while(true)
+    {
+        if(!batch)
+        {
+            print_prompt(output);
+        }
+        output_flush(output);
+        if(!read_input(input_buffer))
+        {
+            if(input_buffer->too_long)
+            {
+                output_printf(output, "Error: Statement too long.\n");
+            }
+            break;
+        }
+        if(!client_send(fd, input_buffer->buffer, input_buffer->input_length) ||
+            !client_receive(fd, &response, &response_length, &response_capacity))
+        {
+            output_printf(output, "Connection closed by server.\n");
+            break;
+        }
+        output_write(output, response, response_length);
+        if(strcmp(input_buffer->buffer, ".exit") == 0)
+        {
+            break;
+        }
+    }
 
-    return cursor;    // 返回游标
+    close_output_buffer(output);
+    close_input_buffer(input_buffer);
+    free(response);
+    close(fd);
+    exit(EXIT_SUCCESS);
 }
 
 /**
@@ -813,61 +12632,174 @@ Cursor *table_end(Table *table)
  */
 int main(int argc, char *argv[])
 {
-    if(argc < 2)
+    char *filename = NULL;    // 数据库文件名
+    char *import_filename = NULL;    // 启动时批量导入的文件名
+    uint32_t fill_factor = DEFAULT_FILL_FACTOR;    // 批量导入的填充因子
+    bool batch = false;    // 批处理模式：不打印提示符，输入结束时正常关闭数据库
+    bool framed = false;    // 输入的语句和输出的结果都用长度前缀分帧
+    char *listen_path = NULL;    // 服务器模式监听的 Unix 域套接字路径
+    uint32_t listen_port = 0;    // 服务器模式监听的本机 TCP 端口
+    char *connect_path = NULL;    // 客户端模式连接的 Unix 域套接字路径
+    uint32_t connect_port = 0;    // 客户端模式连接的本机 TCP 端口
+    uint32_t num_workers = 0;    // 服务器模式的工作线程数，为0时在事件循环的线程里执行语句
+    DbOptions options;    // 数据库选项
+    options.pool_pages = DEFAULT_BUFFER_POOL_PAGES;
+    options.group_commit = DEFAULT_GROUP_COMMIT;
+    options.use_mmap = false;
+    options.compress = false;
+    long num_processors = sysconf(_SC_NPROCESSORS_ONLN);
+    options.scan_threads = (num_processors > 0) ? (uint32_t)num_processors : 1;    // 默认每个处理器一个扫描线程
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--pool-pages") == 0 && i + 1 < argc)
+        {
+            options.pool_pages = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--group-commit") == 0 && i + 1 < argc)
+        {
+            options.group_commit = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--mmap") == 0)
+        {
+            options.use_mmap = true;
+        }
+        else if(strcmp(argv[i], "--compress") == 0)
+        {
+            options.compress = true;
+        }
+        else if(strcmp(argv[i], "--import") == 0 && i + 1 < argc)
+        {
+            import_filename = argv[++i];
+        }
+        else if(strcmp(argv[i], "--fill-factor") == 0 && i + 1 < argc)
+        {
+            fill_factor = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--batch") == 0)
+        {
+            batch = true;
+        }
+        else if(strcmp(argv[i], "--framed") == 0)
+        {
+            batch = true;    // 分帧只在批处理模式下使用
+            framed = true;
+        }
+        else if(strcmp(argv[i], "--listen") == 0 && i + 1 < argc)
+        {
+            listen_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+        {
+            listen_port = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--scan-threads") == 0 && i + 1 < argc)
+        {
+            options.scan_threads = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            num_workers = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--connect") == 0 && i + 1 < argc)
+        {
+            connect_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "--connect-port") == 0 && i + 1 < argc)
+        {
+            connect_port = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else
+        {
+            filename = argv[i];
+        }
+    }
+
+    if(connect_path != NULL || connect_port != 0)
     {
-        printf("Must supply a database filename.\n");    // 打印错误信息
-        exit(EXIT_FAILURE);    // 退出程序
+        run_client(connect_path, connect_port, batch);    // 客户端模式不打开数据库文件
     }
 
-    char *filename = argv[1];    // 获取数据库文件名
-    Table *table = db_open(filename);    // 打开数据库
+    if(filename == NULL)
+    {
+        fatal_error("Must supply a database filename.\n");    // 打印错误信息
+    }
 
-    InputBuffer *input_buffer = new_input_buffer();    // 创建输入缓冲区
+    Database *database = db_open(filename, &options);    // 打开数据库
+    InputBuffer *input_buffer = new_input_buffer(STDIN_FILENO, framed);    // 创建输入缓冲区
+    OutputBuffer *output = new_output_buffer(STDOUT_FILENO, framed);    // 创建输出缓冲区
+    fatal_output = output;
+    if(import_filename != NULL)
+    {
+        do_import(database->tables[0], import_filename, fill_factor, output);    // 进入交互之前先批量导入
+        output_flush(output);
+    }
+    if(listen_path != NULL || listen_port != 0)
+    {
+        close_input_buffer(input_buffer);
+        fatal_output = NULL;
+        close_output_buffer(output);
+        run_server(database, listen_path, listen_port, num_workers);    // 服务器模式不读取标准输入
+    }
+    Statement statement;    // 语句，每次循环重复使用，插入的行数组不需要每次重新分配
+    statement.rows_to_insert = NULL;
+    statement.rows_capacity = 0;
+    StatementCache *cache = new_statement_cache();    // 创建语句缓存
 
     while(true)
     {
-        print_prompt();                 // 打印提示符
-        read_input(input_buffer);       // 读取输入
-
-        if(input_buffer->buffer[0] == '.')  // 判断是否为元命令
+        if(!batch)
         {
-            switch(do_meta_command(input_buffer, table))
+            print_prompt(output);       // 打印提示符
+        }
+        if(!input_pending(input_buffer))
+        {
+            pager_sync(database->pager);   // 等待输入之前，把攒下的提交一起同步到磁盘
+            output_flush(output);       // 同步之后再把攒下的结果一起写出
+            if(output->failed)
             {
-                case (META_COMMAND_SUCCESS):
-                    continue;   // 元命令执行成功，继续下一次循环，回到打印提示符
-                case (META_COMMAND_UNRECOGNIZED_COMMAND):
-                    printf("Unrecognized command '%s'.\n", input_buffer->buffer);    // 打印错误信息
-                    continue;   // 元命令未识别，继续下一次循环，回到打印提示符
+                exit(EXIT_FAILURE);     // 标准输出已经关闭
             }
         }
-
-        Statement statement;
-        switch(prepare_statement(input_buffer, &statement))   // 判断语句类型
+        if(!read_input(input_buffer))   // 读取输入
         {
-            case (PREPARE_SUCCESS):
-                break;  // 准备成功，继续下一步，退出switch
-            case (PREPARE_NEGATIVE_ID):
-                printf("ID must be positive.\n");    // 打印错误信息
-                continue;
-            case (PREPARE_SYNTAX_TOO_LONG):
-                printf("String is too long.\n");    // 打印错误信息
-                continue;
-            case (PREPARE_SYNTAX_ERROR):
-                printf("Syntax error. Could not parse statement.\n");    // 打印错误信息
-                continue;
-            case (PREPARE_UNRECOGNIZED_STATEMENT):
-                printf("Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);    // 打印错误信息
-                continue;
+            if(input_buffer->too_long)
+            {
+                output_begin_response(output);
+                output_printf(output, "Error: Statement too long.\n");
+                output_end_response(output);
+                close_output_buffer(output);
+                exit(EXIT_FAILURE);
+            }
+            if(batch)
+            {
+                // 批处理模式下输入结束就是脚本执行完了，没有提交的事务回滚，正常关闭数据库
+                if(cache->in_transaction)
+                {
+                    transaction_rollback(database, cache);
+                }
+                close_input_buffer(input_buffer);
+                db_close(database);
+                close_output_buffer(output);
+                exit(EXIT_SUCCESS);
+            }
+            output_printf(output, "Error reading input\n");    // 如果读取失败，则打印错误信息
+            close_output_buffer(output);
+            exit(EXIT_FAILURE);    // 退出程序
         }
 
-        switch(execute_statement(&statement, table))    // 执行语句
+        if(!process_input(input_buffer, database, cache, &statement, output))
         {
-            case (EXECUTE_SUCCESS):
-                printf("Executed.\n");    // 打印执行成功信息
-                break;
-            case (EXECUTE_TABLE_FULL):
-                printf("Error: Table full.\n");    // 打印错误信息
-                break;
+            // .exit：回滚没有提交的事务，关闭数据库，写出还没有写出的结果
+            if(cache->in_transaction)
+            {
+                transaction_rollback(database, cache);
+            }
+            close_input_buffer(input_buffer);
+            db_close(database);
+            output_end_response(output);
+            close_output_buffer(output);
+            exit(EXIT_SUCCESS);
         }
     }
-}
\ No newline at end of file
+}
@@ -1,10 +1,12 @@
+require 'socket'
+
 describe 'database' do
 	before do
-		'rm -rf test.db'
+		`rm -rf test.db test.db-wal`
 	end
-    def run_script(commands)
+    def run_script(commands, options = "")
       raw_output = nil
-      IO.popen("./db test.db", "r+") do |pipe|
+      IO.popen("./db #{options} test.db", "r+") do |pipe|
         commands.each do |command|
           pipe.puts command
         end
@@ -17,26 +19,26 @@ describe 'database' do
       raw_output.split("\n")
     end
 
-	# # 测试是否保留数据
-	# it 'keeps data after closing connection' do
-	# 	result1 = run_script([
-	# 	  "insert 1 user1 person1@example.com",
-	# 	  ".exit",
-	# 	])
-	# 	expect(result1).to match_array([
-	# 	  "db > Executed.",
-	# 	  "db > ",
-	# 	])
-	# 	result2 = run_script([
-	# 	  "select",
-	# 	  ".exit",
-	# 	])
-	# 	expect(result2).to match_array([
-	# 	  "db > (1, user1, person1@example.com)",
-	# 	  "Executed.",
-	# 	  "db > ",
-	# 	])
-	#   end
+	# 测试是否保留数据
+	it 'keeps data after closing connection' do
+		result1 = run_script([
+		  "insert 1 user1 person1@example.com",
+		  ".exit",
+		])
+		expect(result1).to match_array([
+		  "db > Executed.",
+		  "db > ",
+		])
+		result2 = run_script([
+		  "select",
+		  ".exit",
+		])
+		expect(result2).to match_array([
+		  "db > (1, user1, person1@example.com)",
+		  "Executed.",
+		  "db > ",
+		])
+	  end
 
 	it 'print constants' do
 		result = run_script([
@@ -45,12 +47,12 @@ describe 'database' do
 		])
 		expect(result).to match_array([
 			"db > Constants:",
-			"ROW_SIZE: 293",
-			"COMMON_NODE_HEADER_SIZE: 6",
-			"LEAF_NODE_HEADER_SIZE: 10",
-			"LEAF_NODE_CELL_SIZE: 297",
-			"LEAF_NODE_SPACE_FOR_CELLS: 4086",
-			"LEAF_NODE_MAX_CELLS: 13",
+			"ROW_MAX_SIZE: 293",
+			"COMMON_NODE_HEADER_SIZE: 10",
+			"LEAF_NODE_HEADER_SIZE: 20",
+			"LEAF_NODE_SLOT_SIZE: 8",
+			"LEAF_NODE_SPACE_FOR_CELLS: 4076",
+			"LEAF_NODE_MIN_CELLS: 13",
 			"db > ",
 		])
 	end
@@ -69,85 +71,1209 @@ describe 'database' do
 			"db > Executed.",
 			"db > Tree:",
 			"leaf (size 3)",
-			"  - 0 : 3",
-			"  - 1 : 1",
-			"  - 2 : 2",
+			"  - 0 : 1",
+			"  - 1 : 2",
+			"  - 2 : 3",
+			"db > ",
+		])
+	end
+
+    # 测试插入和检索一行
+    it 'inserts and retrieves a row' do
+      result = run_script([
+        "insert 1 user1 person1@example.com",
+        "select",
+        ".exit",
+      ])
+      expect(result).to match_array([
+        "db > Executed.",
+        "db > (1, user1, person1@example.com)",
+        "Executed.",
+        "db > ",
+      ])
+    end
+
+    # 测试插入和检索多行，数据超出缓冲池容量时会淘汰页
+    it 'keeps inserting when the table outgrows the buffer pool' do
+        script = (1..5000).map do |i|
+          "insert #{i} user#{i} person#{i}@example.com"
+        end
+        script << ".exit"
+        result = run_script(script, "--pool-pages 32")
+        expect(result[-2]).to eq('db > Executed.')
+
+        result = run_script([
+          "select where id = 1",
+          "select where id = 5000",
+          ".exit",
+        ], "--pool-pages 32")
+        expect(result).to eq([
+          "db > (1, user1, person1@example.com)",
+          "Executed.",
+          "db > (5000, user5000, person5000@example.com)",
+          "Executed.",
+          "db > ",
+        ])
+      end
+
+	# 测试第一个叶子节点分裂后的两叶子树结构，最长的行每页只能存13个
+	it 'allows printing out the structure of a 2-leaf-node btree' do
+		script = (1..14).map do |i|
+			"insert #{i} #{"u" * 32} #{"e" * 255}"
+		end
+		script << ".btree"
+		script << ".exit"
+		result = run_script(script)
+
+		expect(result[14...(result.length)]).to eq([
+			"db > Tree:",
+			"internal (size 1)",
+			"  leaf (size 7)",
+			"    - 0 : 1",
+			"    - 1 : 2",
+			"    - 2 : 3",
+			"    - 3 : 4",
+			"    - 4 : 5",
+			"    - 5 : 6",
+			"    - 6 : 7",
+			"  - key 7",
+			"  leaf (size 7)",
+			"    - 0 : 8",
+			"    - 1 : 9",
+			"    - 2 : 10",
+			"    - 3 : 11",
+			"    - 4 : 12",
+			"    - 5 : 13",
+			"    - 6 : 14",
+			"db > ",
+		])
+	end
+
+	# 测试根节点是内部节点时，叶子节点分裂会把新节点挂到已有的根节点下
+	it 'splits the rightmost leaf again under an existing internal root' do
+		script = (1..21).map do |i|
+			"insert #{i} #{"u" * 32} #{"e" * 255}"
+		end
+		script << ".btree"
+		script << ".exit"
+		result = run_script(script)
+
+		expect(result[21...(result.length)]).to eq([
+			"db > Tree:",
+			"internal (size 2)",
+			"  leaf (size 7)",
+			"    - 0 : 1",
+			"    - 1 : 2",
+			"    - 2 : 3",
+			"    - 3 : 4",
+			"    - 4 : 5",
+			"    - 5 : 6",
+			"    - 6 : 7",
+			"  - key 7",
+			"  leaf (size 7)",
+			"    - 0 : 8",
+			"    - 1 : 9",
+			"    - 2 : 10",
+			"    - 3 : 11",
+			"    - 4 : 12",
+			"    - 5 : 13",
+			"    - 6 : 14",
+			"  - key 14",
+			"  leaf (size 7)",
+			"    - 0 : 15",
+			"    - 1 : 16",
+			"    - 2 : 17",
+			"    - 3 : 18",
+			"    - 4 : 19",
+			"    - 5 : 20",
+			"    - 6 : 21",
+			"db > ",
+		])
+	end
+
+	# 测试插入最长字符串
+    it 'allows inserting strings that are the maximum length' do
+      long_username = "a"*32
+      long_email = "a"*255
+      script = [
+        "insert 1 #{long_username} #{long_email}",
+        "select",
+        ".exit",
+      ]
+      result = run_script(script)
+      expect(result).to match_array([
+        "db > Executed.",
+        "db > (1, #{long_username}, #{long_email})",
+        "Executed.",
+        "db > ",
+      ])
+    end
+
+	# 测试插入超长字符串
+	it 'prints error message if strings are too long' do
+		long_username = "a"*33
+		long_email = "a"*256
+		script = [
+		  "insert 1 #{long_username} #{long_email}",
+		  "select",
+		  ".exit",
+		]
+		result = run_script(script)
+		expect(result).to match_array([
+		  "db > String is too long.",
+		  "db > Executed.",
+		  "db > ",
+		])
+	end
+
+	# 测试插入负数id
+	it 'prints an error message if id is negative' do
+		script = [
+		  "insert -1 cstack foo@bar.com",
+		  "select",
+		  ".exit",
+		]
+		result = run_script(script)
+		expect(result).to match_array([
+		  "db > ID must be positive.",
+		  "db > Executed.",
+		  "db > ",
+		])
+	end
+
+	# 测试超出范围或者不是数字的id
+	it 'prints an error message if id is out of range or not a number' do
+		script = [
+		  "insert 1 user1 person1@example.com",
+		  "insert 4294967297 user2 person2@example.com",
+		  "insert 12abc user3 person3@example.com",
+		  "select where id = 4294967297",
+		  "select where id = abc",
+		  "select where id = 1x",
+		  "select where id between 0 and 2147483648",
+		  "select where id = 1",
+		  ".exit",
+		]
+		result = run_script(script)
+		expect(result).to eq([
+		  "db > Executed.",
+		  "db > Syntax error. Could not parse statement.",
+		  "db > Syntax error. Could not parse statement.",
+		  "db > Syntax error. Could not parse statement.",
+		  "db > Syntax error. Could not parse statement.",
+		  "db > Syntax error. Could not parse statement.",
+		  "db > Syntax error. Could not parse statement.",
+		  "db > (1, user1, person1@example.com)",
+		  "Executed.",
+		  "db > ",
+		])
+	end
+
+	# 测试重复id
+	it 'prints an error message if there is a duplicate id' do
+		script = [
+			"insert 1 user1 person1@example.com",
+			"insert 1 user1 person1@example.com",
+			"select",
+			".exit",
+		]
+		result = run_script(script)
+		expect(result).to match_array([
+			"db > Executed.",
+			"db > Error: Duplicate key.",
+			"db > (1, user1, person1@example.com)",
+			"Executed.",
+			"db > ",
+		])
+	end
+
+	# 测试全表扫描沿叶子节点链表读完所有叶子节点
+	it 'scans every leaf node in key order' do
+		script = (1..300).to_a.shuffle.map do |i|
+			"insert #{i} user#{i} person#{i}@example.com"
+		end
+		script << "select id"
+		script << ".exit"
+		result = run_script(script)
+		rows = result[300...(result.length)]
+		expected = (1..300).map { |i| "(#{i})" }
+		expected[0] = "db > (1)"
+		expect(rows).to eq(expected + ["Executed.", "db > "])
+	end
+
+	# 测试按id查询
+	it 'finds a row by id across multiple leaf nodes' do
+		script = (1..300).to_a.reverse.map do |i|
+			"insert #{i} user#{i} person#{i}@example.com"
+		end
+		script << "select where id = 17"
+		script << "select where id = 301"
+		script << ".exit"
+		result = run_script(script)
+		expect(result[300...(result.length)]).to eq([
+			"db > (17, user17, person17@example.com)",
+			"Executed.",
+			"db > Executed.",
+			"db > ",
+		])
+	end
+
+	# 测试变长行：短行每页能存的单元格远多于最长的行
+	it 'packs short rows densely into leaf pages' do
+		script = (1..100).map do |i|
+			"insert #{i} user#{i} person#{i}@example.com"
+		end
+		script << ".exit"
+		run_script(script)
+		expect(File.size("test.db")).to eq(8192)
+
+		result = run_script([
+			"select where id = 100",
+			".exit",
+		])
+		expect(result[0]).to eq("db > (100, user100, person100@example.com)")
+	end
+
+	# 测试按id区间查询，区间跨越多个叶子节点
+	it 'selects an id range across leaf nodes' do
+		script = (1..300).to_a.reverse.map do |i|
+			"insert #{i * 2} user#{i * 2} person#{i * 2}@example.com"
+		end
+		script << "select id where id between 95 and 105"
+		script << "select id where id between 599 and 1000"
+		script << "select id where id between 10 and 5"
+		script << ".exit"
+		result = run_script(script)
+		expect(result[300...(result.length)]).to eq([
+			"db > (96)",
+			"(98)",
+			"(100)",
+			"(102)",
+			"(104)",
+			"Executed.",
+			"db > (600)",
+			"Executed.",
+			"db > Executed.",
+			"db > ",
+		])
+	end
+
+	# 测试只查询部分列
+	it 'prints only the selected columns' do
+		result = run_script([
+			"insert 1 user1 person1@example.com",
+			"insert 2 user2 person2@example.com",
+			"select id, username",
+			"select email, id where id = 2",
+			"select name",
+			".exit",
+		])
+		expect(result).to eq([
+			"db > Executed.",
+			"db > Executed.",
+			"db > (1, user1)",
+			"(2, user2)",
+			"Executed.",
+			"db > (person2@example.com, 2)",
+			"Executed.",
+			"db > Syntax error. Could not parse statement.",
+			"db > ",
+		])
+	end
+
+	# 测试只读会话不会改写数据库文件
+	it 'does not write unmodified pages back on exit' do
+		script = (1..30).map do |i|
+			"insert #{i} user#{i} person#{i}@example.com"
+		end
+		script << ".exit"
+		run_script(script)
+		mtime = File.mtime("test.db")
+		sleep 0.05
+
+		result = run_script([
+			"select where id = 20",
+			".btree",
+			".exit",
+		])
+		expect(result[0]).to eq("db > (20, user20, person20@example.com)")
+		expect(File.mtime("test.db")).to eq(mtime)
+	end
+
+	# 测试进程没有正常退出时，从预写日志恢复已经执行的插入
+	it 'recovers executed inserts from the write-ahead log after a crash' do
+		script = (1..20).map do |i|
+			"insert #{i} user#{i} person#{i}@example.com"
+		end
+		result = run_script(script)
+		expect(result[-1]).to eq("db > Error reading input")
+		expect(File.exist?("test.db-wal")).to eq(true)
+
+		result = run_script([
+			"select where id = 20",
+			".exit",
+		])
+		expect(result).to eq([
+			"db > (20, user20, person20@example.com)",
+			"Executed.",
+			"db > ",
+		])
+		expect(File.exist?("test.db-wal")).to eq(false)
+	end
+
+	# 测试手动检查点
+	it 'folds the write-ahead log back into the database file on checkpoint' do
+		result = run_script([
+			"insert 1 user1 person1@example.com",
+			".checkpoint",
+		])
+		expect(result[0..1]).to eq([
+			"db > Executed.",
+			"db > Checkpoint complete.",
+		])
+		expect(File.size("test.db-wal")).to eq(16)
+		expect(File.size("test.db")).to eq(8192)
+	end
+
+	# 测试内存映射模式和缓冲池模式读写同一个数据库文件
+	it 'reads and writes the same file in mmap mode' do
+		script = (1..30).map do |i|
+			"insert #{i} user#{i} person#{i}@example.com"
+		end
+		script << ".exit"
+		run_script(script, "--mmap")
+		expect(File.size("test.db")).to eq(8192)
+
+		result = run_script([
+			"select where id = 25",
+			".exit",
+		])
+		expect(result[0]).to eq("db > (25, user25, person25@example.com)")
+
+		result = run_script([
+			"insert 31 user31 person31@example.com",
+			"select where id = 3",
+			".exit",
+		], "--mmap")
+		expect(result).to eq([
+			"db > Executed.",
+			"db > (3, user3, person3@example.com)",
+			"Executed.",
+			"db > ",
+		])
+	end
+
+	# 测试从CSV文件批量导入，自底向上构建B+树
+	it 'bulk loads unsorted rows from a csv file' do
+		File.open("test.csv", "w") do |file|
+			(1..300).to_a.shuffle.each do |i|
+				file.puts "#{i},user#{i},person#{i}@example.com"
+			end
+		end
+		result = run_script([
+			".import test.csv",
+			"select where id = 150",
+			"select id where id between 298 and 400",
+			"insert 150 user150 person150@example.com",
+			".import test.csv",
+			".exit",
+		])
+		File.delete("test.csv")
+		expect(result).to eq([
+			"db > Imported 300 rows.",
+			"db > (150, user150, person150@example.com)",
+			"Executed.",
+			"db > (298)",
+			"(299)",
+			"(300)",
+			"Executed.",
+			"db > Error: Duplicate key.",
+			"db > Error: Table must be empty to import.",
+			"db > ",
+		])
+	end
+
+	# 测试导入失败时截掉已经建好的页，文件大小和导入前一样，之后还能再导入
+	it 'truncates the pages of a failed import' do
+		run_script([".exit"])
+		empty_size = File.size("test.db")
+		File.open("test.csv", "w") do |file|
+			(1..20000).each do |i|
+				file.puts "#{i},user#{i},person#{i}@example.com"
+			end
+			file.puts "20000,user20000,person20000@example.com"
+		end
+		result = run_script([".import test.csv", ".exit"])
+		expect(result).to eq(["db > Error: Duplicate key.", "db > "])
+		expect(File.size("test.db")).to eq(empty_size)
+
+		File.open("test.csv", "w") do |file|
+			(1..20000).each do |i|
+				file.puts "#{i},user#{i},person#{i}@example.com"
+			end
+		end
+		result = run_script([".import test.csv", "select count(*)", ".check", ".exit"])
+		File.delete("test.csv")
+		expect(result).to eq([
+			"db > Imported 20000 rows.",
+			"db > (20000)",
+			"Executed.",
+			"db > Checked 249 pages: ok.",
+			"db > ",
+		])
+	end
+
+	# 测试一条语句插入多行，重复的键会让整批都不插入
+	it 'inserts a batch of rows in one statement' do
+		tuples = (1..100).to_a.reverse.map do |i|
+			"(#{i}, user#{i}, person#{i}@example.com)"
+		end
+		result = run_script([
+			"insert " + tuples.join(", "),
+			"insert (101, user101, a@b.com), (50, user50, c@d.com)",
+			"insert (102,user102,e@f.com),(102,user102,e@f.com)",
+			"select id where id between 99 and 200",
+			"select where id = 37",
+			".exit",
+		])
+		expect(result).to eq([
+			"db > Executed.",
+			"db > Error: Duplicate key.",
+			"db > Error: Duplicate key.",
+			"db > (99)",
+			"(100)",
+			"Executed.",
+			"db > (37, user37, person37@example.com)",
+			"Executed.",
+			"db > ",
+		])
+	end
+
+	# 测试预处理语句，占位符在执行时绑定
+	it 'executes prepared statements with bound parameters' do
+		result = run_script([
+			"prepare ins as insert ? ? ?",
+			"prepare find as select username where id = ?",
+			"execute ins 1 user1 person1@example.com",
+			"execute ins 2 user2",
+			"execute find 1",
+			"execute missing 1",
+			"insert ? user3 person3@example.com",
+			".exit",
+		])
+		expect(result).to eq([
+			"db > Prepared.",
+			"db > Prepared.",
+			"db > Executed.",
+			"db > Syntax error. Could not parse statement.",
+			"db > (user1)",
+			"Executed.",
+			"db > Unknown prepared statement.",
+			"db > Syntax error. Could not parse statement.",
+			"db > ",
+		])
+	end
+
+	# 测试批处理模式不打印提示符，输入结束时正常关闭数据库
+	it 'runs a script without prompts in batch mode' do
+		result = run_script([
+			"insert 1 user1 person1@example.com",
+			"select",
+			"insert 1 user1 person1@example.com",
+		], "--batch")
+		expect(result).to eq([
+			"Executed.",
+			"(1, user1, person1@example.com)",
+			"Executed.",
+			"Error: Duplicate key.",
+		])
+		expect(File.exist?("test.db-wal")).to eq(false)
+	end
+
+	# 测试服务器模式，多个客户端共享同一个表
+	it 'serves several clients over a unix socket' do
+		server = IO.popen("./db --listen test.sock test.db", "r")
+		expect(server.gets).to eq("Listening.\n")
+
+		result1 = run_script([
+			"insert 1 user1 person1@example.com",
+			".exit",
+		], "--connect test.sock")
+		result2 = run_script([
+			"insert 2 user2 person2@example.com",
+			"select id",
+		], "--connect test.sock --batch")
+		Process.kill("TERM", server.pid)
+		server.close
+
+		expect(result1).to eq([
+			"db > Executed.",
 			"db > ",
 		])
+		expect(result2).to eq([
+			"Executed.",
+			"(1)",
+			"(2)",
+			"Executed.",
+		])
+		expect(File.exist?("test.sock")).to eq(false)
+		expect(File.exist?("test.db-wal")).to eq(false)
+	end
+
+	# 测试有扫描线程池时服务器收到 TERM 也正常关闭：池中的线程不接收信号
+	it 'shuts down cleanly with scan threads' do
+		server = IO.popen("./db --listen test.sock --scan-threads 4 test.db", "r")
+		expect(server.gets).to eq("Listening.\n")
+		rows = (1..500).map { |i| "(#{i}, user#{i}, person#{i}@example.com)" }
+		result = run_script([
+			"insert #{rows.join(", ")}",
+			"select count(*)",
+		], "--connect test.sock --batch")
+		Process.kill("TERM", server.pid)
+		server.close
+
+		expect(result).to eq(["Executed.", "(500)", "Executed."])
+		expect($?.success?).to eq(true)
+		expect(File.exist?("test.sock")).to eq(false)
+		expect(File.exist?("test.db-wal")).to eq(false)
+	end
+
+	# 测试工作线程池，多个客户端并发读写
+	it 'serves concurrent clients with worker threads' do
+		server = IO.popen("./db --listen test.sock --threads 4 test.db", "r")
+		expect(server.gets).to eq("Listening.\n")
+
+		writers = (0...4).map do |w|
+			Thread.new do
+				commands = (1..50).map do |i|
+					id = w * 50 + i
+					"insert #{id} user#{id} person#{id}@example.com"
+				end
+				run_script(commands + ["select id where id between 1 and 1000"], "--connect test.sock --batch")
+			end
+		end
+		results = writers.map(&:value)
+		result = run_script(["select id"], "--connect test.sock --batch")
+		Process.kill("TERM", server.pid)
+		server.close
+
+		results.each do |r|
+			expect(r.take(50)).to eq(["Executed."] * 50)
+			ids = r.drop(50)[0...-1].map { |line| line[1...-1].to_i }
+			expect(ids).to eq(ids.sort.uniq)
+		end
+		expect(result).to eq((1..200).map { |id| "(#{id})" } + ["Executed."])
+	end
+
+	# 测试快照读：查询执行期间提交的插入，要么整批都看到，要么都看不到
+	it 'reads a consistent snapshot while rows are inserted' do
+		File.open("test.csv", "w") do |file|
+			(1..20000).each do |i|
+				file.puts "#{i * 2},user#{i},person#{i}@example.com"
+			end
+		end
+		run_script([".import test.csv"])
+		File.delete("test.csv")
+
+		server = IO.popen("./db --listen test.sock --threads 2 test.db", "r")
+		expect(server.gets).to eq("Listening.\n")
+		reader = Thread.new do
+			run_script(["select id"], "--connect test.sock --batch")
+		end
+		tuples = (0...100).map { |i| "(#{39801 + i * 2}, new, new@example.com)" }
+		writer = run_script(["insert #{tuples.join(", ")}"], "--connect test.sock --batch")
+		scan = reader.value
+		Process.kill("TERM", server.pid)
+		server.close
+
+		expect(writer).to eq(["Executed."])
+		expect(scan.last).to eq("Executed.")
+		new_rows = scan.count { |line| line[1...-1].to_i.odd? }
+		expect([0, 100]).to include(new_rows)
+		expect(scan.size - 1 - new_rows).to eq(20000)
+	end
+
+	# 测试删除不等旧的快照：查询还在读的时候删除就返回，行留在树中，这时再插入同一个键报告旧的查询还能看到它；
+	# 进程没有正常退出时，重新打开数据库先删掉这些行，提交了的删除不会丢失，之后可以再插入这个键
+	it 'finishes a delete while an older snapshot is still open' do
+		File.open("test.csv", "w") do |file|
+			(1..20000).each do |i|
+				file.puts "#{i * 2},user#{i},person#{i}@example.com"
+			end
+		end
+		run_script([".import test.csv"])
+		File.delete("test.csv")
+
+		server = IO.popen("./db --listen test.sock --threads 3 test.db", "r")
+		expect(server.gets).to eq("Listening.\n")
+		stop = false
+		readers = (1..2).map do
+			reader = IO.popen("./db --connect test.sock --batch test.db", "r+")
+			Thread.new do
+				reader.puts "select count(*) where username like 'user%'" until stop
+				reader.close_write
+			end
+			[reader, Thread.new { reader.read.split("\n") }]
+		end
+
+		# 两个会话不停地扫描，总有快照开着；删除以后马上插入，直到遇到还在等快照结束的删除
+		writer = IO.popen("./db --connect test.sock --batch test.db", "r+")
+		writer.sync = true
+		pending_id = nil
+		(1..1000).each do |i|
+			writer.puts "delete where id = #{i * 2}"
+			expect(writer.gets).to eq("Executed.\n")
+			writer.puts "insert #{i * 2} user#{i} person#{i}@example.com"
+			result = writer.gets
+			if result == "Error: Key was deleted but earlier queries can still see it.\n"
+				pending_id = i * 2
+				break
+			end
+			expect(result).to eq("Executed.\n")
+		end
+		writer.close
+		stop = true
+		scans = readers.flat_map do |reader, collector|
+			lines = collector.value
+			reader.close
+			lines
+		end
+		Process.kill("KILL", server.pid)
+		server.close
+		File.delete("test.sock")
+
+		expect(pending_id.nil?).to eq(false)
+		expect(scans.uniq - ["(19999)", "(20000)", "Executed."]).to eq([])
+		result = run_script([
+		  "select where id = #{pending_id}",
+		  "select count(*)",
+		  ".check",
+		  "insert #{pending_id} user#{pending_id / 2} person#{pending_id / 2}@example.com",
+		  "select count(*)",
+		], "--batch")
+		expect(result[0..2]).to eq(["Executed.", "(19999)", "Executed."])
+		expect(result[3].end_with?("pages: ok.")).to eq(true)
+		expect(result[4..6]).to eq(["Executed.", "(20000)", "Executed."])
+	end
+
+	# 测试显式事务：提交前其他会话看不到也不能写入，回滚撤销事务中的插入，建表、建索引和会改动文件的元命令不能放在事务里
+	it 'commits and rolls back explicit transactions' do
+		server = IO.popen("./db --listen test.sock --threads 2 test.db", "r")
+		expect(server.gets).to eq("Listening.\n")
+		session = IO.popen("./db --connect test.sock --batch test.db", "r+")
+		session.sync = true
+		session.puts "begin"
+		expect(session.gets).to eq("Executed.\n")
+		session.puts "insert 1 user1 person1@example.com"
+		expect(session.gets).to eq("Executed.\n")
+		["create index on username", "create table items (a int)", ".import test.csv", ".check", ".vacuum", ".checkpoint"].each do |command|
+			session.puts command
+			expect(session.gets).to eq("Error: Not allowed inside a transaction.\n")
+		end
+
+		other = run_script([
+		  "select",
+		  "insert 2 user2 person2@example.com",
+		  "create index on username",
+		  ".check",
+		], "--connect test.sock --batch")
+		expect(other).to eq([
+		  "Executed.",
+		  "Error: Database is busy.",
+		  "Error: Database is busy.",
+		  "Error: Database is busy.",
+		])
+
+		session.puts "commit"
+		expect(session.gets).to eq("Executed.\n")
+		session.puts "begin"
+		expect(session.gets).to eq("Executed.\n")
+		session.puts "insert 3 user3 person3@example.com"
+		expect(session.gets).to eq("Executed.\n")
+		session.puts "select id"
+		expect(session.gets).to eq("(1)\n")
+		expect(session.gets).to eq("(3)\n")
+		expect(session.gets).to eq("Executed.\n")
+		session.puts "rollback"
+		expect(session.gets).to eq("Executed.\n")
+		session.puts "rollback"
+		expect(session.gets).to eq("Error: No transaction is active.\n")
+		session.close
+
+		result = run_script(["select"], "--connect test.sock --batch")
+		Process.kill("TERM", server.pid)
+		server.close
+		expect(result).to eq([
+		  "(1, user1, person1@example.com)",
+		  "Executed.",
+		])
+	end
+
+	# 测试并行扫描：大表按区间分给多个线程扫描，结果仍然按id排序
+	it 'scans a large table in parallel in key order' do
+		File.open("test.csv", "w") do |file|
+			(1..50000).to_a.shuffle(random: Random.new(1)).each do |i|
+				file.puts "#{i},user#{i},person#{i}@example.com"
+			end
+		end
+		result = run_script([
+		  ".import test.csv",
+		  "select id",
+		  "select id where id between 20000 and 30000",
+		], "--batch --scan-threads 4")
+		File.delete("test.csv")
+
+		expect(result).to eq(["Imported 50000 rows."] +
+		  (1..50000).map { |id| "(#{id})" } + ["Executed."] +
+		  (20000..30000).map { |id| "(#{id})" } + ["Executed."])
+	end
+
+	# 测试聚合查询和字符串条件：只输出一行结果，不输出行
+	it 'computes aggregates and filters by username and email' do
+		script = (1..30).map do |i|
+			"insert #{i} user#{i} person#{i}@example.com"
+		end
+		script += [
+		  "select count(*), min(id), max(id), sum(id)",
+		  "select count(*) where username like user1%",
+		  "select max(id), sum(id) where id between 5 and 12",
+		  "select id where email = person7@example.com",
+		  "select min(id), max(id) where id between 100 and 200",
+		  "select count(*), id",
+		  ".exit",
+		]
+		result = run_script(script)
+		expect(result.last(12)).to eq([
+		  "db > (30, 1, 30, 465)",
+		  "Executed.",
+		  "db > (11)",
+		  "Executed.",
+		  "db > (12, 68)",
+		  "Executed.",
+		  "db > (7)",
+		  "Executed.",
+		  "db > (NULL, NULL)",
+		  "Executed.",
+		  "db > Syntax error. Could not parse statement.",
+		  "db > ",
+		])
+	end
+
+	# 测试二级索引：建立索引后按用户名和邮箱查找，之后插入的行也能通过索引找到
+	it 'looks up rows through secondary indexes' do
+		script = (1..500).map do |i|
+			"insert #{i} user#{i % 50} person#{i}@example.com"
+		end
+		script += [
+		  "create index on username",
+		  "create index on email",
+		  "create index on email",
+		  "insert 501 user7 late@example.com",
+		  "select id where username = user7",
+		  "select where email = person123@example.com",
+		  "select count(*) where email like person4%",
+		  ".exit",
+		]
+		result = run_script(script)
+		expect(result.last(21)).to eq([
+		  "db > Executed.",
+		  "db > Executed.",
+		  "db > Error: Index already exists.",
+		  "db > Executed.",
+		  "db > (7)",
+		] + [57, 107, 157, 207, 257, 307, 357, 407, 457, 501].map { |id| "(#{id})" } + [
+		  "Executed.",
+		  "db > (123, user23, person123@example.com)",
+		  "Executed.",
+		  "db > (111)",
+		  "Executed.",
+		  "db > ",
+		])
+	end
+
+	# 测试字符串条件的值用引号括起来，有没有索引都按去掉引号的值比较
+	it 'compares quoted string values without the quotes' do
+		script = (1..20).map do |i|
+			"insert #{i} user#{i} person#{i}@example.com"
+		end
+		script += [
+		  "select id where username = 'user7'",
+		  "select count(*) where username like 'user1%'",
+		  "create index on email",
+		  "select id where email = \"person12@example.com\"",
+		  "select count(*) where email like 'person2%'",
+		  "select where username = 'user7",
+		  ".exit",
+		]
+		result = run_script(script)
+		expect(result.last(11)).to eq([
+		  "db > (7)",
+		  "Executed.",
+		  "db > (11)",
+		  "Executed.",
+		  "db > Executed.",
+		  "db > (12)",
+		  "Executed.",
+		  "db > (2)",
+		  "Executed.",
+		  "db > Syntax error. Could not parse statement.",
+		  "db > ",
+		])
 	end
 
-    # # 测试插入和检索一行
-    # it 'inserts and retrieves a row' do
-    #   result = run_script([
-    #     "insert 1 user1 person1@example.com",
-    #     "select",
-    #     ".exit",
-    #   ])
-    #   expect(result).to match_array([
-    #     "db > Executed.",
-    #     "db > (1, user1, person1@example.com)",
-    #     "Executed.",
-    #     "db > ",
-    #   ])
-    # end
-
-    # # 测试插入和检索多行
-    # it 'prints error message when table is full' do
-    #     script = (1..1401).map do |i|
-    #       "insert #{i} user#{i} person#{i}@example.com"
-    #     end
-    #     script << ".exit"
-    #     result = run_script(script)
-    #     expect(result[-2]).to eq('db > Error: Table full.')
-    #   end
-
-	# # 测试插入最长字符串
-    # it 'allows inserting strings that are the maximum length' do
-    #   long_username = "a"*32
-    #   long_email = "a"*255
-    #   script = [
-    #     "insert 1 #{long_username} #{long_email}",
-    #     "select",
-    #     ".exit",
-    #   ]
-    #   result = run_script(script)
-    #   expect(result).to match_array([
-    #     "db > Executed.",
-    #     "db > (1, #{long_username}, #{long_email})",
-    #     "Executed.",
-    #     "db > ",
-    #   ])
-    # end
-
-	# # 测试插入超长字符串
-	# it 'prints error message if strings are too long' do
-	# 	long_username = "a"*33
-	# 	long_email = "a"*256
-	# 	script = [
-	# 	  "insert 1 #{long_username} #{long_email}",
-	# 	  "select",
-	# 	  ".exit",
-	# 	]
-	# 	result = run_script(script)
-	# 	expect(result).to match_array([
-	# 	  "db > String is too long.",
-	# 	  "db > Executed.",
-	# 	  "db > ",
-	# 	])
-	# end
-
-	# # 测试插入负数id
-	# it 'prints an error message if id is negative' do
-	# 	script = [
-	# 	  "insert -1 cstack foo@bar.com",
-	# 	  "select",
-	# 	  ".exit",
-	# 	]
-	# 	result = run_script(script)
-	# 	expect(result).to match_array([
-	# 	  "db > ID must be positive.",
-	# 	  "db > Executed.",
-	# 	  "db > ",
-	# 	])
-	# end
-end
\ No newline at end of file
+	# 测试建表：新表的行按表的列编码，重新打开数据库后表和列都还在
+	it 'creates tables with their own columns' do
+		run_script([
+		  "create table items (sku int, name varchar(10), qty int)",
+		  "insert into items (2,bolt,-5),(1,nut,7)",
+		  "create table items (a int)",
+		  "insert 1 user1 person1@example.com",
+		  ".exit",
+		])
+		result = run_script([
+		  "select from items",
+		  "select name from items where sku = 2",
+		  "select from missing",
+		  ".schema",
+		  ".exit",
+		])
+		expect(result).to eq([
+		  "db > (1, nut, 7)",
+		  "(2, bolt, -5)",
+		  "Executed.",
+		  "db > (bolt)",
+		  "Executed.",
+		  "db > Error: No such table.",
+		  "db > create table users (id int, username varchar(32), email varchar(255))",
+		  "create table items (sku int, name varchar(10), qty int)",
+		  "db > ",
+		])
+	end
+
+	# 测试目录页的上限：一个数据库最多11个表（包括默认表），每个表最多8列
+	it 'reports an error when the catalog has no room for a table or its columns' do
+		columns = (1..9).map { |i| "c#{i} int" }
+		script = (1..11).map do |i|
+			"create table t#{i} (id int)"
+		end
+		script += [
+		  "create table wide (#{columns.join(", ")})",
+		  "create table wide (#{columns.first(8).join(", ")})",
+		  ".exit",
+		]
+		result = run_script(script)
+		expect(result).to eq((["db > Executed."] * 10) + [
+		  "db > Error: Too many tables, a database has at most 11.",
+		  "db > Error: Too many columns, a table has at most 8.",
+		  "db > Error: Too many tables, a database has at most 11.",
+		  "db > ",
+		])
+	end
+
+	# 测试删除：按键和按区间删除的行查不到了，合并后空出来的页由 .vacuum 从文件末尾截掉
+	it 'deletes rows and shrinks the file with vacuum' do
+		script = (1..1000).map do |i|
+			"insert #{i} user#{i} person#{i}@example.com"
+		end
+		script += [
+		  "delete where id between 11 and 995",
+		  "delete where id = 3",
+		  "delete where id = 3",
+		  "select count(*), sum(id)",
+		  "select id where id between 8 and 996",
+		  ".exit",
+		]
+		result = run_script(script)
+		expect(result.last(10)).to eq([
+		  "db > Executed.",
+		  "db > Executed.",
+		  "db > (14, 5042)",
+		  "Executed.",
+		  "db > (8)",
+		  "(9)",
+		  "(10)",
+		  "(996)",
+		  "Executed.",
+		  "db > ",
+		])
+		expect(File.size("test.db")).to eq(90112)
+		result = run_script([
+		  ".vacuum",
+		  "insert 500 user500 person500@example.com",
+		  "select count(*)",
+		  ".exit",
+		])
+		expect(result).to eq([
+		  "db > Vacuum freed 20 pages.",
+		  "db > Executed.",
+		  "db > (15)",
+		  "Executed.",
+		  "db > ",
+		])
+		expect(File.size("test.db")).to eq(8192)
+	end
+
+	# 测试页压缩：压缩格式的文件比普通文件小，重新打开时不用再指定 --compress，内存映射模式不能打开它
+	it 'stores pages compressed' do
+		script = (1..2000).map do |i|
+			"insert #{i} user#{i} person#{i}@example.com"
+		end
+		script << ".exit"
+		run_script(script)
+		plain_size = File.size("test.db")
+		`rm -rf test.db test.db-wal`
+		run_script(script, "--compress")
+		expect(File.size("test.db") < plain_size).to eq(true)
+		result = run_script([
+		  "select count(*), sum(id)",
+		  "select where id = 1234",
+		  ".exit",
+		])
+		expect(result).to eq([
+		  "db > (2000, 2001000)",
+		  "Executed.",
+		  "db > (1234, user1234, person1234@example.com)",
+		  "Executed.",
+		  "db > ",
+		])
+		result = run_script([], "--mmap")    # 程序打开文件时就退出，不写命令，避免写到已经关闭的管道
+		expect(result).to eq([
+		  "Compressed db files cannot be opened with --mmap.",
+		])
+	end
+
+	# 测试完整性检查：正常的文件检查通过，改动页中的一个字节后校验和不匹配
+	it 'verifies page checksums with .check' do
+		script = (1..300).map do |i|
+			"insert #{i} user#{i} person#{i}@example.com"
+		end
+		script << ".check"
+		script << ".exit"
+		result = run_script(script)
+		expect(result.last(2)).to eq([
+		  "db > Checked 8 pages: ok.",
+		  "db > ",
+		])
+		File.open("test.db", "r+b") do |file|
+			file.seek(2 * 4096 + 100)
+			file.write("x")
+		end
+		result = run_script([
+		  ".check",
+		  ".exit",
+		])
+		expect(result).to eq([
+		  "db > Page 2: checksum mismatch.",
+		  "Checked 8 pages: 1 problem.",
+		  "db > ",
+		])
+	end
+
+	# 测试读到损坏的页退出时，之前执行完的语句的结果先写出；分帧模式下错误信息单独成一帧
+	it 'writes the results of earlier statements before exiting on a corrupt page' do
+		script = (1..300).map do |i|
+			"insert #{i} user#{i} person#{i}@example.com"
+		end
+		script << ".exit"
+		run_script(script)
+		File.open("test.db", "r+b") do |file|
+			file.seek(2 * 4096 + 100)
+			file.write("x")
+		end
+		result = run_script([
+		  "insert 301 user301 person301@example.com",
+		  "select where id = 300",
+		  ".check",
+		  "select where id = 60",
+		  "select where id = 1",
+		], "--batch")
+		expect(result).to eq([
+		  "Executed.",
+		  "(300, user300, person300@example.com)",
+		  "Executed.",
+		  "Page 2: checksum mismatch.",
+		  "Checked 8 pages: 1 problem.",
+		  "Page 2 is corrupt.",
+		])
+
+		frames = nil
+		IO.popen("./db --framed test.db", "r+") do |pipe|
+			["select where id = 301", "select where id = 60", "select where id = 1"].each do |command|
+				pipe.write([command.bytesize].pack("N") + command)
+			end
+			pipe.close_write
+			frames = pipe.read
+		end
+		responses = []
+		until frames.empty?
+			length = frames.unpack1("N")
+			responses << frames[4, length]
+			frames = frames[(4 + length)..]
+		end
+		expect(responses).to eq([
+		  "(301, user301, person301@example.com)\nExecuted.\n",
+		  "Page 2 is corrupt.\n",
+		])
+	end
+
+	# 测试旧格式的文件：页中没有校验和的目录页报告格式不支持，而不是页损坏
+	it 'rejects db files written in the old page format' do
+		page = [4, 0, 0, 1].pack("CCVV") + "users"
+		File.binwrite("test.db", page.ljust(4096, "\0"))
+		result = run_script([])    # 程序打开文件时就退出，不写命令
+		expect(result).to eq([
+		  "Unsupported db file format.",
+		])
+	end
+
+	# 测试随机删除：单行和区间删除使内部节点合并，树的结构仍然正确，剩下的行和模型一致
+	it 'keeps the tree consistent after random deletes' do
+		random = Random.new(1)
+		File.open("test.csv", "w") do |file|
+			(1..20000).to_a.shuffle(random: random).each do |i|
+				file.puts "#{i},user#{i},person#{i}@#{"e" * 200}.com"
+			end
+		end
+		script = [".import test.csv"]
+		remaining = (1..20000).to_a
+		1500.times do
+			if random.rand(2) == 0
+				id = random.rand(1..20000)
+				script << "delete where id = #{id}"
+				remaining.delete(id)
+			else
+				low = random.rand(1..20000)
+				high = low + random.rand(0..300)
+				script << "delete where id between #{low} and #{high}"
+				remaining.reject! { |id| id >= low && id <= high }
+			end
+		end
+		script << ".check"
+		script << "select count(*), sum(id)"
+		script << ".exit"
+		result = run_script(script)
+		File.delete("test.csv")
+		expect(result[-4].end_with?("pages: ok.")).to eq(true)
+		expect(result.last(3)).to eq([
+		  "db > (#{remaining.size}, #{remaining.sum})",
+		  "Executed.",
+		  "db > ",
+		])
+	end
+
+	# 测试事务中删除后重新插入同一个键：删除的行提交前还在树中，不能被当成重复的键
+	it 'reinserts a key deleted in the same transaction' do
+		result = run_script([
+		  "insert 5 a b",
+		  "begin",
+		  "delete where id = 5",
+		  "insert 5 c d",
+		  "insert (5, e, f), (6, g, h)",
+		  "commit",
+		  "select",
+		  "select where username = c",
+		  "begin",
+		  "delete where id = 5",
+		  "insert (5, e, f), (7, i, j)",
+		  "rollback",
+		  "select",
+		  ".exit",
+		], "--batch")
+		expect(result).to eq([
+		  "Executed.",
+		  "Executed.",
+		  "Executed.",
+		  "Executed.",
+		  "Error: Duplicate key.",
+		  "Executed.",
+		  "(5, c, d)",
+		  "Executed.",
+		  "(5, c, d)",
+		  "Executed.",
+		  "Executed.",
+		  "Executed.",
+		  "Executed.",
+		  "Executed.",
+		  "(5, c, d)",
+		  "Executed.",
+		])
+	end
+
+	# 测试事务中的页分配：事务从空闲页链表取页，提交或回滚以后页又回到链表中，反复插入和删除时文件不变大
+	it 'reuses free pages inside explicit transactions' do
+		rows = (1..2000).map do |i|
+			"(#{i}, user#{i}, person#{i}@example.com)"
+		end
+		sizes = [
+		  ["begin", "insert #{rows.join(", ")}", "commit"],
+		  ["begin", "insert #{rows.join(", ")}", "rollback"],
+		  ["begin", "insert #{rows.join(", ")}", "commit"],
+		].map do |transaction|
+			result = run_script(transaction + [
+			  "delete where id between 1 and 2000",
+			  ".check",
+			  ".exit",
+			], "--batch")
+			expect(result.last.end_with?("pages: ok.")).to eq(true)
+			File.size("test.db")
+		end
+		expect(sizes).to eq([98304, 98304, 98304])
+	end
+
+	# 测试监听路径：不是套接字的文件不会被删除，正在监听的套接字不会被抢走
+	it 'does not take over a path that is in use' do
+		File.write("test.sock", "keep")
+		result = `./db --listen test.sock test.db`
+		expect(result).to eq("Address in use.\n")
+		expect(File.read("test.sock")).to eq("keep")
+		File.delete("test.sock")
+
+		server = IO.popen("./db --listen test.sock test.db", "r")
+		expect(server.gets).to eq("Listening.\n")
+		result = `./db --listen test.sock other.db`
+		other = run_script(["select"], "--connect test.sock --batch")
+		Process.kill("TERM", server.pid)
+		server.close
+		`rm -f other.db other.db-wal`
+		expect(result).to eq("Address in use.\n")
+		expect(other).to eq([
+		  "Executed.",
+		])
+	end
+
+	# 测试语句长度的上限：帧头声明的长度太长时回复错误并关闭这个连接，其他连接不受影响
+	it 'closes a connection that sends a statement that is too long' do
+		server = IO.popen("./db --listen test.sock test.db", "r")
+		expect(server.gets).to eq("Listening.\n")
+		socket = UNIXSocket.new("test.sock")
+		socket.write([17 * 1024 * 1024].pack("N"))
+		length = socket.read(4).unpack1("N")
+		response = socket.read(length)
+		rest = socket.read
+		socket.close
+		result = run_script(["insert 1 user1 person1@example.com"], "--connect test.sock --batch")
+		Process.kill("TERM", server.pid)
+		server.close
+		expect(response).to eq("Error: Statement too long.\n")
+		expect(rest).to eq("")
+		expect(result).to eq([
+		  "Executed.",
+		])
+	end
+
+	# 测试文件锁：服务器打开数据库时，另一个进程不能再打开同一个文件
+	it 'refuses to open a db file that another process has open' do
+		server = IO.popen("./db --listen test.sock test.db", "r")
+		expect(server.gets).to eq("Listening.\n")
+		result = run_script([])    # 程序打开文件时就退出，不写命令
+		inserted = run_script(["insert 1 user1 person1@example.com"], "--connect test.sock --batch")
+		Process.kill("TERM", server.pid)
+		server.close
+		expect(result).to eq([
+		  "Database is locked by another process.",
+		])
+		expect(inserted).to eq([
+		  "Executed.",
+		])
+	end
+end